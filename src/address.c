@@ -0,0 +1,116 @@
+/*
+ *   address.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For the sockets under -std=c99
+#define _GNU_SOURCE
+
+#include "address.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+err_t
+address_parse (address_t * const a, const char * text)
+{
+    memset (a, 0, sizeof(*a));
+
+    if (!strncmp (text, "unix:", 5)) {
+        struct sockaddr_un * un = (struct sockaddr_un *) &a->addr;
+        if (!text[5] || strlen (text + 5) >= sizeof(un->sun_path))
+            return GSL_EINVAL;
+
+        un->sun_family = AF_UNIX;
+        strcpy (un->sun_path, text + 5);
+        a->length = sizeof(*un);
+        a->family = AF_UNIX;
+        return GSL_SUCCESS;
+    }
+
+    if (!strncmp (text, "tcp:", 4)) {
+        struct sockaddr_in * in = (struct sockaddr_in *) &a->addr;
+        char * end;
+        long port = strtol (text + 4, &end, 10);
+        if (end == text + 4 || *end || port <= 0 || port > 65535)
+            return GSL_EINVAL;
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons (port);
+        in->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        a->length = sizeof(*in);
+        a->family = AF_INET;
+        return GSL_SUCCESS;
+    }
+
+    return GSL_EINVAL;
+}
+
+/*
+ * A listening socket, replacing any stale unix socket, or -1
+ */
+int
+address_listen (const address_t * const a)
+{
+    int one = 1;
+    int fd = socket (a->family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+
+    if (a->family == AF_UNIX)
+        unlink (((const struct sockaddr_un *) &a->addr)->sun_path);
+    else
+        setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind (fd, (const struct sockaddr *) &a->addr, a->length)
+            || listen (fd, SOMAXCONN)) {
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * A blocking connected socket, without Nagle's delay over TCP, or -1
+ */
+int
+address_connect (const address_t * const a)
+{
+    int one = 1;
+    int fd = socket (a->family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+
+    if (connect (fd, (const struct sockaddr *) &a->addr, a->length)) {
+        close (fd);
+        return -1;
+    }
+
+    if (a->family == AF_INET)
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd;
+}
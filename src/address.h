@@ -0,0 +1,56 @@
+/*
+ *   address.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADDRESS_H_
+#define ADDRESS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+
+#include <sys/socket.h>
+
+/*
+ * unix:<path> or tcp:<port>, the latter always on localhost
+ */
+typedef struct
+{
+    struct sockaddr_storage addr;
+    socklen_t length;
+    int family;
+} address_t;
+
+err_t
+address_parse (address_t * const address, const char * text);
+
+int
+address_listen (const address_t * const address);
+
+int
+address_connect (const address_t * const address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ADDRESS_H_ */
@@ -0,0 +1,65 @@
+/*
+ *   backend.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backend.h"
+#include "kernels.h"
+
+#include <stdio.h>
+
+/*
+ * Entry points only the optimised libraries export. Being weak they are
+ * NULL unless the library providing them was linked.
+ */
+extern int openblas_get_num_threads (void) __attribute__((weak));
+extern int64_t bli_thread_get_num_threads (void) __attribute__((weak));
+
+void
+blas_backend_query (blas_backend_t * const backend)
+{
+    backend->cblas = "gslcblas";
+    backend->threads = 1;
+    backend->isa = kernel_isa ();
+
+    if (openblas_get_num_threads) {
+        backend->cblas = "openblas";
+        backend->threads = openblas_get_num_threads ();
+    } else if (bli_thread_get_num_threads) {
+        backend->cblas = "blis";
+        backend->threads = bli_thread_get_num_threads ();
+    }
+
+#ifdef NNET_NATIVE_KERNELS
+    backend->gemm = "native";
+#else
+    backend->gemm = backend->cblas;
+#endif
+}
+
+void
+blas_backend_print (void)
+{
+    blas_backend_t backend;
+    blas_backend_query (&backend);
+
+    printf ("BLAS backend: %s, native kernels %s, CBLAS %s with %i "
+            "thread%s\n", backend.gemm, backend.isa, backend.cblas,
+            backend.threads, backend.threads == 1 ? "" : "s");
+}
@@ -0,0 +1,55 @@
+/*
+ *   backend.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BACKEND_H_
+#define BACKEND_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * The BLAS in use. gemm names who runs the dense and conv products, which
+ * is either the native kernels or the CBLAS. The CBLAS is found at run time
+ * from what the executable was linked against, so it is correct even when
+ * a system libblas is an alternative for another implementation.
+ */
+typedef struct
+{
+    const char * gemm;
+    const char * cblas;
+    const char * isa; // Of the native kernels
+    int32_t threads; // Of the CBLAS, the native kernels use one
+} blas_backend_t;
+
+void
+blas_backend_query (blas_backend_t * const backend);
+
+void
+blas_backend_print (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BACKEND_H_ */
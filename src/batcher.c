@@ -0,0 +1,387 @@
+/*
+ *   batcher.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For clock_gettime, pthread_condattr_setclock and sched_yield
+#define _GNU_SOURCE
+
+#include "batcher.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Weight of the latest gap in its moving average
+#define BATCHER_GAP_WEIGHT 0.125
+
+uint64_t
+batcher_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+batcher_timespec (struct timespec * const ts, const uint64_t ns)
+{
+    ts->tv_sec = ns / 1000000000ull;
+    ts->tv_nsec = ns % 1000000000ull;
+}
+
+/*
+ * Wake the batcher if it is asleep. The fence pairs with the one in
+ * batcher_sleep, so either it sees the work or this sees it sleeping.
+ */
+static void
+batcher_wake (batcher_t * const b)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&b->sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock (&b->lock);
+        pthread_cond_signal (&b->ready);
+        pthread_mutex_unlock (&b->lock);
+    }
+}
+
+/*
+ * Sleep until woken, or until deadline unless it is 0, unless there is
+ * already more to take or the batcher is stopping
+ */
+static void
+batcher_sleep (batcher_t * const b, const uint64_t deadline)
+{
+    pthread_mutex_lock (&b->lock);
+    __atomic_store_n (&b->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    if (!mpsc_queue_size (&b->queue)
+            && __atomic_load_n (&b->running, __ATOMIC_RELAXED)) {
+        if (deadline) {
+            struct timespec ts;
+            batcher_timespec (&ts, deadline);
+            pthread_cond_timedwait (&b->ready, &b->lock, &ts);
+        } else {
+            pthread_cond_wait (&b->ready, &b->lock);
+        }
+    }
+
+    __atomic_store_n (&b->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&b->lock);
+}
+
+/*
+ * Whether to hold n pending requests for more
+ */
+static int
+batcher_should_wait (const batcher_t * const b, const uint32_t n,
+                     const uint64_t now)
+{
+    const uint64_t deadline = b->pending[0]->submitted + b->budget;
+    const uint32_t clients = __atomic_load_n (&b->clients, __ATOMIC_RELAXED);
+
+    if (!__atomic_load_n (&b->running, __ATOMIC_RELAXED)
+            || n >= b->max_batch || now >= deadline)
+        return 0;
+
+    // Nobody else to wait for
+    if (clients && n >= clients)
+        return 0;
+
+    return b->gap < deadline - now;
+}
+
+// The submit times order arrivals, producers may race by a little
+static void
+batcher_arrival (batcher_t * const b, const uint64_t submitted)
+{
+    // An idle spell counts as at most two budgets, so batching recovers
+    if (b->last_arrival) {
+        double gap = submitted > b->last_arrival
+                ? submitted - b->last_arrival : 0.0;
+        gap = gap > 2.0 * b->budget ? 2.0 * b->budget : gap;
+        b->gap += BATCHER_GAP_WEIGHT * (gap - b->gap);
+    }
+    b->last_arrival = submitted > b->last_arrival
+            ? submitted : b->last_arrival;
+}
+
+static void
+batcher_run (batcher_t * const b, const uint32_t n)
+{
+    epoch_enter (&b->reader);
+    network_t * network = __atomic_load_n (&b->network, __ATOMIC_ACQUIRE);
+    const uint32_t inputs = network->nodes.data[0];
+
+    for (uint32_t i = 0; i < n; ++i) {
+        double * row = b->inputs + (size_t) i * inputs;
+        const uint8_t * pixels = b->pending[i]->pixels;
+        for (uint32_t j = 0; j < inputs; ++j) {
+            row[j] = pixels[j] / 255.0;
+        }
+    }
+
+    err_t err = network_predict_batch (network, &b->batch, b->inputs, n,
+                                       b->classes, NULL);
+    epoch_exit (&b->reader);
+
+    const uint64_t now = batcher_now ();
+
+    pthread_mutex_lock (&b->stats_lock);
+    for (uint32_t i = 0; i < n; ++i) {
+        histogram_record (&b->stats.latency, now - b->pending[i]->submitted);
+        histogram_record (&b->stats.depth, b->pending[i]->depth);
+    }
+    histogram_record (&b->stats.batch, n);
+    pthread_mutex_unlock (&b->stats_lock);
+
+    __atomic_sub_fetch (&b->waiting, n, __ATOMIC_RELAXED);
+
+    // The requests belong to their submitters again after done
+    for (uint32_t i = 0; i < n; ++i) {
+        b->pending[i]->label = err ? BATCHER_FAILED : b->classes[i];
+        b->pending[i]->done (b->pending[i]);
+    }
+}
+
+static void *
+batcher_main (void * arg)
+{
+    batcher_t * b = arg;
+    uint32_t n = 0;
+
+    for (;;) {
+        batch_request_t * req;
+        while (n < b->max_batch && (req = mpsc_queue_pop (&b->queue))) {
+            batcher_arrival (b, req->submitted);
+            b->pending[n++] = req;
+        }
+
+        if (!n) {
+            if (!__atomic_load_n (&b->running, __ATOMIC_RELAXED)
+                    && !mpsc_queue_size (&b->queue))
+                break;
+            batcher_sleep (b, 0);
+            continue;
+        }
+
+        if (batcher_should_wait (b, n, batcher_now ())) {
+            batcher_sleep (b, b->pending[0]->submitted + b->budget);
+            continue;
+        }
+
+        batcher_run (b, n);
+        n = 0;
+    }
+
+    return NULL;
+}
+
+/*
+ * Serve network, which must stay allocated until batcher_stop or it is
+ * swapped out, from a thread of its own. budget is in ns.
+ */
+err_t
+batcher_start (batcher_t * const b, network_t * const network,
+               const uint32_t max_batch, const uint64_t budget)
+{
+    pthread_condattr_t attr;
+    err_t err;
+
+    memset (b, 0, sizeof(*b));
+    b->network = network;
+    epoch_reader_init (&b->reader);
+    b->max_batch = max_batch;
+    b->budget = budget;
+    b->gap = budget;
+    b->running = 1;
+
+    err = network_batch_allocate (&b->batch, network, max_batch);
+    RETURN_ON_ERR(err);
+    err = mpsc_queue_allocate (&b->queue, BATCHER_QUEUE);
+    RETURN_ON_ERR(err);
+
+    b->inputs = malloc (sizeof(double) * max_batch * network->nodes.data[0]);
+    b->classes = malloc (sizeof(uint32_t) * max_batch);
+    b->pending = malloc (sizeof(batch_request_t *) * max_batch);
+    RETURN_ERR_ON_BAD_ALLOC(b->inputs);
+    RETURN_ERR_ON_BAD_ALLOC(b->classes);
+    RETURN_ERR_ON_BAD_ALLOC(b->pending);
+
+    // Deadlines are on the monotonic clock, as the arrivals
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&b->ready, &attr);
+    pthread_condattr_destroy (&attr);
+    pthread_mutex_init (&b->lock, NULL);
+    pthread_mutex_init (&b->stats_lock, NULL);
+
+    if (pthread_create (&b->thread, NULL, &batcher_main, b))
+        return GSL_EFAILED;
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Finish the requests submitted, then stop and free the batcher. Nothing
+ * may be submitted once this is called.
+ */
+void
+batcher_stop (batcher_t * const b)
+{
+    pthread_mutex_lock (&b->lock);
+    __atomic_store_n (&b->running, 0, __ATOMIC_RELAXED);
+    pthread_cond_signal (&b->ready);
+    pthread_mutex_unlock (&b->lock);
+
+    pthread_join (b->thread, NULL);
+
+    pthread_cond_destroy (&b->ready);
+    pthread_mutex_destroy (&b->lock);
+    pthread_mutex_destroy (&b->stats_lock);
+    network_batch_free (&b->batch);
+    mpsc_queue_free (&b->queue);
+    free (b->inputs);
+    free (b->classes);
+    free (b->pending);
+}
+
+/*
+ * Serve network from the next pass, returning the one it replaces in old
+ * once no pass can be using it. The shapes must match, else GSL_EBADLEN
+ * and nothing changes. From one thread at a time.
+ */
+err_t
+batcher_swap (batcher_t * const b, network_t * const network,
+              network_t ** const old)
+{
+    const network_t * current = __atomic_load_n (&b->network,
+                                                 __ATOMIC_ACQUIRE);
+
+    if (network->nodes.size != current->nodes.size
+            || network->features.size || current->features.size
+            || memcmp (network->nodes.data, current->nodes.data,
+                       network->nodes.size * sizeof(uint32_t)))
+        return GSL_EBADLEN;
+
+    *old = __atomic_exchange_n (&b->network, network, __ATOMIC_SEQ_CST);
+    epoch_synchronize (&b->reader, 1);
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Count a client that submits one request at a time. Once all of them
+ * are waiting the batch runs without waiting out the budget.
+ */
+void
+batcher_attach (batcher_t * const b)
+{
+    __atomic_add_fetch (&b->clients, 1, __ATOMIC_RELAXED);
+}
+
+void
+batcher_detach (batcher_t * const b)
+{
+    __atomic_sub_fetch (&b->clients, 1, __ATOMIC_RELAXED);
+    batcher_wake (b);
+}
+
+/*
+ * Queue a request, yielding while the queue is full. Its depth counts
+ * those queued or in a batch still to run, so the stats can say how
+ * deep the queue gets without a lock here.
+ */
+void
+batcher_submit (batcher_t * const b, batch_request_t * const req)
+{
+    req->submitted = batcher_now ();
+    req->depth = __atomic_fetch_add (&b->waiting, 1, __ATOMIC_RELAXED);
+    while (mpsc_queue_push (&b->queue, req)) {
+        sched_yield ();
+    }
+
+    batcher_wake (b);
+}
+
+typedef struct
+{
+    batch_request_t request;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t done;
+} batcher_waiter_t;
+
+static void
+batcher_waiter_done (batch_request_t * const req)
+{
+    batcher_waiter_t * w = req->context;
+
+    pthread_mutex_lock (&w->lock);
+    w->done = 1;
+    pthread_cond_signal (&w->cond);
+    pthread_mutex_unlock (&w->lock);
+}
+
+/*
+ * Classify nodes[0] pixels, scaled from 0-255 as the loader does,
+ * blocking until the batch it joins has run
+ */
+uint32_t
+batcher_classify (batcher_t * const b, const uint8_t * const pixels)
+{
+    batcher_waiter_t w = {
+            .request = {
+                    .pixels = pixels,
+                    .done = &batcher_waiter_done,
+                    .context = &w
+            }
+    };
+    pthread_mutex_init (&w.lock, NULL);
+    pthread_cond_init (&w.cond, NULL);
+
+    batcher_submit (b, &w.request);
+
+    pthread_mutex_lock (&w.lock);
+    while (!w.done) {
+        pthread_cond_wait (&w.cond, &w.lock);
+    }
+    pthread_mutex_unlock (&w.lock);
+
+    pthread_cond_destroy (&w.cond);
+    pthread_mutex_destroy (&w.lock);
+
+    return w.request.label;
+}
+
+/*
+ * Copy out the statistics gathered since the last call, and reset them
+ */
+void
+batcher_take_stats (batcher_t * const b, batcher_stats_t * const stats)
+{
+    pthread_mutex_lock (&b->stats_lock);
+    *stats = b->stats;
+    histogram_reset (&b->stats.latency);
+    histogram_reset (&b->stats.batch);
+    histogram_reset (&b->stats.depth);
+    pthread_mutex_unlock (&b->stats_lock);
+}
@@ -0,0 +1,140 @@
+/*
+ *   batcher.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCHER_H_
+#define BATCHER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "epoch.h"
+#include "errors.h"
+#include "histogram.h"
+#include "nnet.h"
+#include "queue.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Requests queued ahead of the batcher before submitters have to wait
+#define BATCHER_QUEUE 4096
+
+// The label of a request whose pass failed
+#define BATCHER_FAILED UINT32_MAX
+
+typedef struct batch_request batch_request_t;
+
+// Called from the batcher's thread once label is set
+typedef void
+(*batch_done_f) (batch_request_t * const request);
+
+/*
+ * A classification, owned by the submitter until done is called. pixels
+ * must stay valid until then.
+ */
+struct batch_request
+{
+    const uint8_t * pixels;
+    uint32_t label;
+    uint64_t submitted; // ns
+    uint32_t depth; // Requests waiting ahead of it when submitted
+    batch_done_f done;
+    void * context; // For done
+};
+
+typedef struct
+{
+    histogram_t latency; // Submit to result, ns
+    histogram_t batch; // Samples per forward pass
+    histogram_t depth; // Requests waiting as each one arrives
+} batcher_stats_t;
+
+/*
+ * Coalesces concurrent classifications into batched forward passes on a
+ * thread of its own, fed through a lock-free queue. The first request
+ * waiting starts a budget; the pass runs when it is spent, the batch is
+ * full, every attached client is waiting, or the recent arrival rate
+ * says no other request will come in time. The lock is only taken to
+ * sleep when idle or waiting out the budget.
+ *
+ * batcher_swap replaces the network while serving. Each pass loads the
+ * network once, under an epoch, so a pass already running finishes on
+ * the old one and the next pass uses the new one.
+ */
+typedef struct
+{
+    network_t * network; // Swapped atomically
+    epoch_reader_t reader; // The thread's passes over network
+    network_batch_t batch;
+    double * inputs; // max_batch x nodes[0]
+    uint32_t * classes;
+    batch_request_t ** pending; // Taken off the queue for the next pass
+    uint32_t max_batch;
+    uint64_t budget; // ns
+    mpsc_queue_t queue;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    uint32_t sleeping;
+    uint32_t clients;
+    uint32_t running;
+    uint32_t waiting; // Submitted and not yet run
+    uint64_t last_arrival;
+    double gap; // Moving average of the time between arrivals, ns
+    pthread_t thread;
+    pthread_mutex_t stats_lock;
+    batcher_stats_t stats;
+} batcher_t;
+
+uint64_t
+batcher_now (void);
+
+err_t
+batcher_start (batcher_t * const batcher, network_t * const network,
+               const uint32_t max_batch, const uint64_t budget);
+
+void
+batcher_stop (batcher_t * const batcher);
+
+err_t
+batcher_swap (batcher_t * const batcher, network_t * const network,
+              network_t ** const old);
+
+void
+batcher_attach (batcher_t * const batcher);
+
+void
+batcher_detach (batcher_t * const batcher);
+
+void
+batcher_submit (batcher_t * const batcher, batch_request_t * const request);
+
+uint32_t
+batcher_classify (batcher_t * const batcher, const uint8_t * const pixels);
+
+void
+batcher_take_stats (batcher_t * const batcher, batcher_stats_t * const stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BATCHER_H_ */
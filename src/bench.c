@@ -0,0 +1,460 @@
+/*
+ *   bench.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "backend.h"
+#include "kernels.h"
+#include "nnet.h"
+#include "packed.h"
+#include "quant.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+
+// Run each case for at least this long
+#define BENCH_SECONDS 0.2
+
+typedef enum
+{
+    BENCH_GSL,
+    BENCH_NATIVE
+} bench_impl_t;
+
+typedef struct
+{
+    const char * name;
+    CBLAS_TRANSPOSE_t trans_a;
+    CBLAS_TRANSPOSE_t trans_b;
+    uint32_t m; // Rows of op(a)
+    uint32_t k;
+    uint32_t n; // 1 for a GEMV
+} bench_case_t;
+
+// The shapes used by the network: dense layers and the conv features
+static const bench_case_t cases[] = {
+        { "dense 30x784 gemv", CblasNoTrans, CblasNoTrans, 30, 784, 1 },
+        { "dense 30x784 gemv^T", CblasTrans, CblasNoTrans, 784, 30, 1 },
+        { "dense 10x30 gemv", CblasNoTrans, CblasNoTrans, 10, 30, 1 },
+        { "dense 10x30 gemv^T", CblasTrans, CblasNoTrans, 30, 10, 1 },
+        { "dense 784x30 copy gemv", CblasNoTrans, CblasNoTrans, 784, 30, 1 },
+        { "dense 30x10 copy gemv", CblasNoTrans, CblasNoTrans, 30, 10, 1 },
+        { "batch 30x784 * 784x64", CblasNoTrans, CblasNoTrans, 30, 784, 64 },
+        { "conv 8x25 * 25x576", CblasNoTrans, CblasNoTrans, 8, 25, 576 },
+        { "conv 8x576 * (25x576)^T", CblasNoTrans, CblasTrans, 8, 576, 25 },
+        { "square 256", CblasNoTrans, CblasNoTrans, 256, 256, 256 }
+};
+
+// Allocated once, as the network's batches and conv layers do
+static kernel_gemm_buffers_t gemm_buffers;
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static gsl_matrix *
+random_matrix (const gsl_rng * const rng, const size_t rows,
+               const size_t cols)
+{
+    gsl_matrix * m = gsl_matrix_alloc (rows, cols);
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < cols; ++j) {
+            gsl_matrix_set (m, i, j, gsl_ran_gaussian (rng, 1.0));
+        }
+    }
+    return m;
+}
+
+static void
+run_once (const bench_case_t * const bench, const bench_impl_t impl,
+          const gsl_matrix * const a, const gsl_matrix * const b,
+          gsl_matrix * const c)
+{
+    if (bench->n == 1) {
+        // Single column matrices are contiguous
+        gsl_vector_view x = gsl_vector_view_array (b->data, b->size1);
+        gsl_vector_view y = gsl_vector_view_array (c->data, c->size1);
+        if (impl == BENCH_NATIVE)
+            kernel_dgemv (bench->trans_a, 1.0, a, &x.vector, 0.0, &y.vector);
+        else
+            gsl_blas_dgemv (bench->trans_a, 1.0, a, &x.vector, 0.0,
+                            &y.vector);
+    } else {
+        if (impl == BENCH_NATIVE)
+            kernel_dgemm (bench->trans_a, bench->trans_b, 1.0, a, b, 0.0, c,
+                          &gemm_buffers);
+        else
+            gsl_blas_dgemm (bench->trans_a, bench->trans_b, 1.0, a, b, 0.0,
+                            c);
+    }
+}
+
+/*
+ * Seconds per call
+ */
+static double
+time_case (const bench_case_t * const bench, const bench_impl_t impl,
+           const gsl_matrix * const a, const gsl_matrix * const b,
+           gsl_matrix * const c)
+{
+    uint64_t calls = 0;
+    double start = now ();
+    double elapsed = 0.0;
+
+    // Warm the caches first
+    run_once (bench, impl, a, b, c);
+
+    do {
+        for (uint32_t i = 0; i < 16; ++i) {
+            run_once (bench, impl, a, b, c);
+        }
+        calls += 16;
+        elapsed = now () - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    return elapsed / calls;
+}
+
+/*
+ * The largest difference between the native and CBLAS results
+ */
+static double
+max_error (const bench_case_t * const bench, const gsl_matrix * const a,
+           const gsl_matrix * const b, gsl_matrix * const c)
+{
+    gsl_matrix * expected = gsl_matrix_alloc (c->size1, c->size2);
+
+    run_once (bench, BENCH_GSL, a, b, c);
+    gsl_matrix_memcpy (expected, c);
+    run_once (bench, BENCH_NATIVE, a, b, c);
+
+    double err = 0.0;
+    for (size_t i = 0; i < c->size1; ++i) {
+        for (size_t j = 0; j < c->size2; ++j) {
+            double d = fabs (gsl_matrix_get (c, i, j)
+                             - gsl_matrix_get (expected, i, j));
+            err = d > err ? d : err;
+        }
+    }
+
+    gsl_matrix_free (expected);
+    return err;
+}
+
+/*
+ * One dense layer forward in separate passes, as the network used to,
+ * against the fused kernel. Seconds per call of each.
+ */
+static void
+time_dense_forward (const gsl_matrix * const w, const gsl_vector * const x,
+                    const gsl_vector * const b, gsl_vector * const zs,
+                    gsl_vector * const a, double * const passes,
+                    double * const fused, double * const fused_fast,
+                    double * const bf16)
+{
+    uint64_t calls = 0;
+    double start = now ();
+
+    do {
+        for (uint32_t i = 0; i < 16; ++i) {
+            nnet_dgemv (CblasNoTrans, 1.0, w, x, 0.0, a);
+            gsl_blas_daxpy (1.0, b, a);
+            gsl_vector_memcpy (zs, a);
+            vector_vectorise (a, &sigmoid);
+        }
+        calls += 16;
+    } while (now () - start < BENCH_SECONDS);
+    *passes = (now () - start) / calls;
+
+    for (uint32_t mode = 0; mode < 2; ++mode) {
+        calls = 0;
+        start = now ();
+        do {
+            for (uint32_t i = 0; i < 16; ++i) {
+                kernel_dense_forward (w, x, b, zs, a, mode ?
+                        ACTIVATION_FAST : ACTIVATION_EXACT);
+            }
+            calls += 16;
+        } while (now () - start < BENCH_SECONDS);
+        *(mode ? fused_fast : fused) = (now () - start) / calls;
+    }
+
+    // The same from bf16 weights
+    matrix_array_t weights = { 1, (gsl_matrix **) &w };
+    uint32_t nodes[] = { w->size2, w->size1 };
+    uint32_array_t dimensions = { 2, nodes };
+    half_matrix_array_t half;
+    if (half_matrix_array_allocate (&half, &dimensions, PRECISION_BF16)
+            != GSL_SUCCESS)
+        return;
+    half_matrix_array_memcpy (&half, &weights);
+
+    calls = 0;
+    start = now ();
+    do {
+        for (uint32_t i = 0; i < 16; ++i) {
+            half_dense_forward (&half, 0, x, b, NULL, a, ACTIVATION_EXACT);
+        }
+        calls += 16;
+    } while (now () - start < BENCH_SECONDS);
+    *bf16 = (now () - start) / calls;
+
+    half_matrix_array_free (&half);
+}
+
+/*
+ * Images per second through the 784-30-10 network one sample at a time,
+ * and through network_predict_batch at each batch size
+ */
+static void
+bench_predict (const gsl_rng * const rng)
+{
+    const uint32_t samples = 4096;
+    const uint32_t batch_sizes[] = { 1, 8, 16, 64, 256, 1024 };
+    uint32_t nodes[] = { 784, 30, 10 };
+    network_t net = {};
+    net.nodes.data = nodes;
+    net.nodes.size = 3;
+    net.mode = NETWORK_INFER;
+
+    if (network_allocate (&net) != GSL_SUCCESS)
+        return;
+    network_random_init (&net, 1.0);
+
+    gsl_matrix * inputs = random_matrix (rng, samples, nodes[0]);
+    uint32_t * classes = malloc (sizeof(uint32_t) * samples);
+
+    printf ("\n%-27s %12s\n", "predict 784-30-10", "images/s");
+
+    uint64_t calls = 0;
+    double start = now ();
+    do {
+        for (uint32_t i = 0; i < samples; ++i) {
+            gsl_vector_view x = gsl_matrix_row (inputs, i);
+            network_set_input (&net, &x.vector);
+            network_feed_forward (&net, 0);
+        }
+        calls += samples;
+    } while (now () - start < BENCH_SECONDS);
+    printf ("%-27s %12.0f\n", "per sample", calls / (now () - start));
+
+    for (uint32_t i = 0; i < sizeof(batch_sizes) / sizeof(batch_sizes[0]);
+            ++i) {
+        network_batch_t batch;
+        if (network_batch_allocate (&batch, &net, batch_sizes[i])
+                != GSL_SUCCESS)
+            break;
+
+        calls = 0;
+        start = now ();
+        do {
+            network_predict_batch (&net, &batch, inputs->data, samples,
+                                   classes, NULL);
+            calls += samples;
+        } while (now () - start < BENCH_SECONDS);
+
+        char name[32];
+        snprintf (name, sizeof(name), "batch %u", batch_sizes[i]);
+        printf ("%-27s %12.0f\n", name, calls / (now () - start));
+
+        network_batch_free (&batch);
+    }
+
+    free (classes);
+    gsl_matrix_free (inputs);
+    network_free (&net);
+}
+
+static int
+compare_double (const void * a, const void * b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Latency percentiles of one sample at a time through the 784-30-10
+ * network, by the usual feed forward, the packed copy and the int8 copy
+ */
+static void
+bench_latency (const gsl_rng * const rng)
+{
+    const char * paths[] = { "feed forward", "packed", "int8" };
+    const uint32_t calls = 100000;
+    const uint32_t images = 64;
+    uint32_t nodes[] = { 784, 30, 10 };
+    network_t net = {};
+    net.nodes.data = nodes;
+    net.nodes.size = 3;
+    net.mode = NETWORK_INFER;
+
+    packed_network_t packed;
+    quant_network_t quant;
+    if (network_allocate (&net) != GSL_SUCCESS)
+        return;
+    network_random_init (&net, 1.0);
+    if (packed_network_allocate (&packed, &net) != GSL_SUCCESS
+            || quant_network_allocate (&quant, &net) != GSL_SUCCESS) {
+        network_free (&net);
+        return;
+    }
+
+    gsl_matrix * inputs = random_matrix (rng, images, nodes[0]);
+    uint8_t * pixels = malloc (images * nodes[0]);
+    double * latency = malloc (sizeof(double) * calls);
+    uint32_t sink = 0;
+
+    for (uint32_t i = 0; i < images * nodes[0]; ++i) {
+        pixels[i] = gsl_rng_uniform_int (rng, 256);
+    }
+
+    printf ("\n%-27s %12s %12s %12s %12s\n", "latency 784-30-10", "p50 ns",
+            "p99 ns", "p999 ns", "max ns");
+
+    for (uint32_t path = 0; path < 3; ++path) {
+        for (uint32_t i = 0; i < calls; ++i) {
+            gsl_vector_view x = gsl_matrix_row (inputs, i % images);
+            double start = now ();
+
+            if (path == 0) {
+                network_set_input (&net, &x.vector);
+                network_feed_forward (&net, 0);
+                sink += gsl_vector_max_index (net.outputs.data[1]);
+            } else if (path == 1) {
+                sink += packed_network_predict (&packed, x.vector.data, NULL);
+            } else {
+                sink += quant_network_predict (
+                        &quant, pixels + (i % images) * nodes[0], NULL);
+            }
+
+            latency[i] = (now () - start) * 1e9;
+        }
+
+        qsort (latency, calls, sizeof(double), &compare_double);
+        printf ("%-27s %12.0f %12.0f %12.0f %12.0f\n", paths[path],
+                latency[calls / 2], latency[calls * 99 / 100],
+                latency[calls * 999 / 1000], latency[calls - 1]);
+    }
+
+    // Keeps the predictions from being optimised out
+    if (sink == UINT32_MAX)
+        printf ("\n");
+
+    free (latency);
+    free (pixels);
+    gsl_matrix_free (inputs);
+    quant_network_free (&quant);
+    packed_network_free (&packed);
+    network_free (&net);
+}
+
+int
+main (int argc, char * argv[])
+{
+    gsl_rng * rng = gsl_rng_alloc (gsl_rng_mt19937);
+
+    // An optional CPU to pin to, for steadier latencies
+    if (argc > 1) {
+        uint32_t cpu = strtoul (argv[1], NULL, 10);
+        if (packed_network_pin (cpu) == GSL_SUCCESS)
+            printf ("Pinned to CPU %u\n", cpu);
+        else
+            printf ("Could not pin to CPU %u\n", cpu);
+    }
+
+    if (kernel_gemm_buffers_allocate (&gemm_buffers) != GSL_SUCCESS)
+        return EXIT_FAILURE;
+
+    blas_backend_print ();
+    printf ("%-27s %12s %12s %9s %9s %8s\n", "case", "cblas ns", "native ns",
+            "cblas GF", "native GF", "max err");
+
+    for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const bench_case_t * bench = &cases[i];
+        uint8_t ta = bench->trans_a != CblasNoTrans;
+        uint8_t tb = bench->trans_b != CblasNoTrans;
+
+        gsl_matrix * a = ta ? random_matrix (rng, bench->k, bench->m) :
+                random_matrix (rng, bench->m, bench->k);
+        gsl_matrix * b = tb ? random_matrix (rng, bench->n, bench->k) :
+                random_matrix (rng, bench->k, bench->n);
+        gsl_matrix * c = gsl_matrix_alloc (bench->m, bench->n);
+
+        double flops = 2.0 * bench->m * bench->k * bench->n;
+        double cblas = time_case (bench, BENCH_GSL, a, b, c);
+        double native = time_case (bench, BENCH_NATIVE, a, b, c);
+
+        printf ("%-27s %12.0f %12.0f %9.2f %9.2f %8.1e\n", bench->name,
+                cblas * 1e9, native * 1e9, flops / cblas * 1e-9,
+                flops / native * 1e-9, max_error (bench, a, b, c));
+
+        gsl_matrix_free (a);
+        gsl_matrix_free (b);
+        gsl_matrix_free (c);
+    }
+
+    printf ("\n%-27s %12s %12s %12s %12s\n", "dense forward", "passes ns",
+            "fused ns", "fast ns", "bf16 ns");
+
+    const uint32_t layers[][2] = { { 30, 784 }, { 10, 30 }, { 100, 784 } };
+    for (uint32_t i = 0; i < sizeof(layers) / sizeof(layers[0]); ++i) {
+        gsl_matrix * w = random_matrix (rng, layers[i][0], layers[i][1]);
+        gsl_matrix * x = random_matrix (rng, layers[i][1], 1);
+        gsl_matrix * b = random_matrix (rng, layers[i][0], 1);
+        gsl_vector * zs = gsl_vector_alloc (layers[i][0]);
+        gsl_vector * a = gsl_vector_alloc (layers[i][0]);
+        gsl_vector_view xv = gsl_vector_view_array (x->data, x->size1);
+        gsl_vector_view bv = gsl_vector_view_array (b->data, b->size1);
+
+        double passes = 0.0, fused = 0.0, fused_fast = 0.0, bf16 = 0.0;
+        time_dense_forward (w, &xv.vector, &bv.vector, zs, a, &passes,
+                            &fused, &fused_fast, &bf16);
+
+        char name[32];
+        snprintf (name, sizeof(name), "%ux%u", layers[i][0], layers[i][1]);
+        printf ("%-27s %12.0f %12.0f %12.0f %12.0f\n", name, passes * 1e9,
+                fused * 1e9, fused_fast * 1e9, bf16 * 1e9);
+
+        gsl_matrix_free (w);
+        gsl_matrix_free (x);
+        gsl_matrix_free (b);
+        gsl_vector_free (zs);
+        gsl_vector_free (a);
+    }
+
+    bench_predict (rng);
+    bench_latency (rng);
+
+    kernel_gemm_buffers_free (&gemm_buffers);
+    gsl_rng_free (rng);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+/*
+ *   bench_fixed.cpp
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Mean time to classify one sample through the GSL path, the packed
+ * network and the fixed template network, for a few topologies
+ */
+
+#include "fixed.hpp"
+#include "nnet.h"
+#include "packed.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include <gsl/gsl_matrix.h>
+
+static double
+now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template <std::size_t Inputs, std::size_t Hidden, std::size_t Outputs>
+static void
+bench_topology (nnet::fixed_network<Inputs, Hidden, Outputs> & fixed)
+{
+    const uint32_t images = 64;
+    const uint32_t calls = 200000 / Hidden;
+    uint32_t nodes[] = { Inputs, Hidden, Outputs };
+    network_t net = {};
+    net.nodes.data = nodes;
+    net.nodes.size = 3;
+    net.mode = NETWORK_INFER;
+
+    packed_network_t packed;
+    if (network_allocate (&net) != GSL_SUCCESS)
+        return;
+    network_random_init (&net, 1.0);
+    if (packed_network_allocate (&packed, &net) != GSL_SUCCESS
+            || fixed.load (net) != GSL_SUCCESS) {
+        network_free (&net);
+        return;
+    }
+
+    gsl_matrix * inputs = gsl_matrix_alloc (images, Inputs);
+    for (size_t i = 0; i < inputs->size1 * inputs->size2; ++i) {
+        inputs->data[i] = (rand () % 256) / 255.0;
+    }
+
+    double ns[3];
+    uint32_t sink = 0;
+    for (uint32_t path = 0; path < 3; ++path) {
+        double start = now ();
+
+        for (uint32_t i = 0; i < calls; ++i) {
+            gsl_vector_view x = gsl_matrix_row (inputs, i % images);
+
+            if (path == 0) {
+                network_set_input (&net, &x.vector);
+                network_feed_forward (&net, 0);
+                sink += gsl_vector_max_index (net.outputs.data[1]);
+            } else if (path == 1) {
+                sink += packed_network_predict (&packed, x.vector.data, NULL);
+            } else {
+                sink += fixed.predict (x.vector.data);
+            }
+        }
+
+        ns[path] = (now () - start) * 1e9 / calls;
+    }
+
+    printf ("%4zu-%zu-%-17zu %12.0f %12.0f %12.0f %9.1fx\n", Inputs, Hidden,
+            Outputs, ns[0], ns[1], ns[2], ns[0] / ns[2]);
+
+    // Keeps the predictions from being optimised out
+    if (sink == UINT32_MAX)
+        printf ("\n");
+
+    gsl_matrix_free (inputs);
+    packed_network_free (&packed);
+    network_free (&net);
+}
+
+// Static, the larger ones are too big for the stack
+static nnet::fixed_network<16, 8, 4> small;
+static nnet::fixed_network<64, 32, 10> medium;
+static nnet::fixed_network<784, 30, 10> mnist;
+
+int
+main ()
+{
+    printf ("%-27s %12s %12s %12s %10s\n", "predict", "gsl ns", "packed ns",
+            "fixed ns", "speedup");
+
+    bench_topology (small);
+    bench_topology (medium);
+    bench_topology (mnist);
+
+    return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ *   cache.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For mmap, fstat, mkstemp and fdopen under -std=c99
+#define _GNU_SOURCE
+
+#include "cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Read at a time for the checksum
+#define CACHE_CHECKSUM_BUFFER (1 << 20)
+
+static uint64_t
+cache_align (const uint64_t offset)
+{
+    return (offset + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+// Where each section goes for a dataset of this shape
+static void
+cache_layout (cache_header_t * const header, const uint32_t items,
+              const uint32_t rows, const uint32_t cols)
+{
+    const uint64_t pixels = (uint64_t) items * rows * cols;
+
+    memset (header, 0, sizeof(*header));
+    memcpy (header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->version = CACHE_VERSION;
+    header->byte_order = CACHE_BYTE_ORDER;
+    header->items = items;
+    header->rows = rows;
+    header->cols = cols;
+    header->images = cache_align (sizeof(*header));
+    header->pixels = cache_align (header->images + pixels * sizeof(double));
+    header->labels = cache_align (header->pixels + pixels);
+    header->bytes = header->labels + items;
+}
+
+static err_t
+cache_checksum_file (const char * file, uint8_t * const buf,
+                     uLong * const crc)
+{
+    int fd = open (file, O_RDONLY);
+    if (fd < 0)
+        return GSL_EFAILED;
+
+    ssize_t n;
+    while ((n = read (fd, buf, CACHE_CHECKSUM_BUFFER)) > 0) {
+        *crc = crc32 (*crc, buf, n);
+    }
+    close (fd);
+
+    return n < 0 ? GSL_EFAILED : GSL_SUCCESS;
+}
+
+/*
+ * The CRC-32 of every shard's files as they are stored, in order
+ */
+err_t
+cache_checksum (const dataset_t * const dataset, uint64_t * const checksum)
+{
+    uint8_t * buf = malloc (CACHE_CHECKSUM_BUFFER);
+    RETURN_ERR_ON_BAD_ALLOC(buf);
+
+    uLong crc = crc32 (0, NULL, 0);
+    err_t err = GSL_SUCCESS;
+    for (uint32_t i = 0; !err && i < dataset->size; ++i) {
+        err = cache_checksum_file (dataset->shards[i].images, buf, &crc);
+        if (!err)
+            err = cache_checksum_file (dataset->shards[i].labels, buf, &crc);
+    }
+
+    free (buf);
+    *checksum = crc;
+
+    return err;
+}
+
+static err_t
+cache_views (data_t * const data, uint8_t * const map,
+             const cache_header_t * const header)
+{
+    const uint32_t pixels = header->rows * header->cols;
+    images_t * images = &data->images;
+
+    images->views = malloc (header->items * sizeof(gsl_vector));
+    images->images = malloc (header->items * sizeof(gsl_vector *));
+    data->labels.labels = malloc (header->items);
+    RETURN_ERR_ON_BAD_ALLOC(images->views);
+    RETURN_ERR_ON_BAD_ALLOC(images->images);
+    RETURN_ERR_ON_BAD_ALLOC(data->labels.labels);
+
+    // As vector views, so images_free leaves the data to the unmap
+    double * scaled = (double *) (map + header->images);
+    for (uint32_t i = 0; i < header->items; ++i) {
+        gsl_vector * v = &images->views[i];
+        v->size = pixels;
+        v->stride = 1;
+        v->data = scaled + (size_t) i * pixels;
+        v->block = NULL;
+        v->owner = 0;
+        images->images[i] = v;
+    }
+
+    images->pixels = map + header->pixels;
+    memcpy (data->labels.labels, map + header->labels, header->items);
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Map a cache of dataset into data, if there is one built from the same
+ * source files. GSL_EINVAL if it is stale or not a cache. The mapping is
+ * private, so the data can be written without changing the file.
+ */
+err_t
+cache_map (data_t * const data, const char * cache_file,
+           const dataset_t * const dataset, const uint64_t checksum)
+{
+    cache_header_t expected;
+    struct stat st;
+
+    memset (data, 0, sizeof(*data));
+    cache_layout (&expected, dataset->items, dataset->rows, dataset->cols);
+    expected.checksum = checksum;
+
+    int fd = open (cache_file, O_RDONLY);
+    if (fd < 0)
+        return GSL_EFAILED;
+    if (fstat (fd, &st) || (uint64_t) st.st_size != expected.bytes) {
+        close (fd);
+        return GSL_EINVAL;
+    }
+
+    uint8_t * map = mmap (NULL, expected.bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+        return GSL_EFAILED;
+
+    if (memcmp (map, &expected, sizeof(expected))) {
+        munmap (map, expected.bytes);
+        return GSL_EINVAL;
+    }
+
+    data->items = expected.items;
+    data->images.magic_num = IMAGES_MAGIC;
+    data->images.num_images = expected.items;
+    data->images.rows = expected.rows;
+    data->images.cols = expected.cols;
+    data->images.map = map;
+    data->images.map_bytes = expected.bytes;
+    data->labels.magic_num = LABELS_MAGIC;
+    data->labels.num_labels = expected.items;
+
+    err_t err = cache_views (data, map, &expected);
+    if (err) {
+        images_free (&data->images);
+        labels_free (&data->labels);
+        memset (data, 0, sizeof(*data));
+    }
+
+    return err;
+}
+
+/*
+ * Create and open the file named by the template tmp, with the
+ * permissions fopen would have given it
+ */
+static FILE *
+cache_open_tmp (char * const tmp)
+{
+    int fd = mkstemp (tmp);
+    if (fd < 0)
+        return NULL;
+
+    mode_t mask = umask (0);
+    umask (mask);
+
+    FILE * fp = NULL;
+    if (!fchmod (fd, 0666 & ~mask))
+        fp = fdopen (fd, "wb");
+    if (!fp) {
+        close (fd);
+        remove (tmp);
+    }
+
+    return fp;
+}
+
+static err_t
+cache_write_at (FILE * const fp, const uint64_t offset, const void * const buf,
+                const size_t bytes)
+{
+    static const uint8_t zeros[CACHE_ALIGN];
+    long at = ftell (fp);
+
+    if (at < 0 || (uint64_t) at > offset
+            || fwrite (zeros, 1, offset - at, fp) != offset - at
+            || fwrite (buf, 1, bytes, fp) != bytes)
+        return GSL_EFAILED;
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+cache_write_data (const data_t * const data, FILE * const fp,
+                  const cache_header_t * const header)
+{
+    const images_t * images = &data->images;
+    const size_t pixels = (size_t) images->rows * images->cols;
+
+    err_t err = cache_write_at (fp, 0, header, sizeof(*header));
+    RETURN_ON_ERR(err);
+
+    for (uint32_t i = 0; i < header->items; ++i) {
+        const gsl_vector * v = images->images[i];
+        err = cache_write_at (fp, header->images + i * pixels * sizeof(double),
+                              v->data, pixels * sizeof(double));
+        RETURN_ON_ERR(err);
+    }
+
+    err = cache_write_at (fp, header->pixels, images->pixels,
+                          header->items * pixels);
+    RETURN_ON_ERR(err);
+
+    return cache_write_at (fp, header->labels, data->labels.labels,
+                           header->items);
+}
+
+/*
+ * Write data, as read from the sources with checksum, to cache_file. The
+ * vectors must be contiguous, as images_allocate makes them.
+ */
+err_t
+cache_write (const data_t * const data, const char * cache_file,
+             const uint64_t checksum)
+{
+    cache_header_t header;
+
+    cache_layout (&header, data->images.num_images, data->images.rows,
+                  data->images.cols);
+    header.checksum = checksum;
+
+    // A name of its own, so writers at the same time can't mix their files
+    char * tmp = malloc (strlen (cache_file) + 8);
+    RETURN_ERR_ON_BAD_ALLOC(tmp);
+    sprintf (tmp, "%s.XXXXXX", cache_file);
+
+    FILE * fp = cache_open_tmp (tmp);
+    if (!fp)
+        free (tmp);
+    RETURN_ERR_ON_NO_FILE(fp);
+
+    err_t err = cache_write_data (data, fp, &header);
+    if (fclose (fp) && !err)
+        err = GSL_EFAILED;
+
+    // Another run mapping it sees the old file or the new, never part
+    if (!err && rename (tmp, cache_file))
+        err = GSL_EFAILED;
+    if (err)
+        remove (tmp);
+    free (tmp);
+
+    return err;
+}
+
+/*
+ * Map dataset from cache_file if it is up to date. If not, read it as
+ * dataset_read does and write the cache for next time.
+ */
+err_t
+cache_read (data_t * const data, const dataset_t * const dataset,
+            const char * cache_file, const uint32_t threads)
+{
+    uint64_t checksum;
+
+    err_t err = cache_checksum (dataset, &checksum);
+    RETURN_ON_ERR(err);
+
+    if (cache_map (data, cache_file, dataset, checksum) == GSL_SUCCESS) {
+        printf ("Mapped %s\n", cache_file);
+        return GSL_SUCCESS;
+    }
+
+    err = dataset_read (dataset, data, threads);
+    RETURN_ON_ERR(err);
+
+    // Only slower next time if it can't be written
+    if (cache_write (data, cache_file, checksum))
+        printf ("Couldn't write %s\n", cache_file);
+    else
+        printf ("Wrote %s\n", cache_file);
+
+    return GSL_SUCCESS;
+}
@@ -0,0 +1,86 @@
+/*
+ *   cache.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dataset.h"
+#include "errors.h"
+#include "loader.h"
+
+#include <stdint.h>
+
+#define CACHE_MAGIC "NNETDATA"
+#define CACHE_VERSION 1
+#define CACHE_BYTE_ORDER 0x01020304
+#define CACHE_ALIGN 64
+
+/*
+ * A dataset as loaded, for mapping straight back in. After the header
+ * and each aligned to CACHE_ALIGN come
+ *
+ *   images  items x rows x cols doubles, scaled as the loader does
+ *   pixels  items x rows x cols bytes, as read for the quantised network
+ *   labels  items bytes
+ *
+ * in the byte order of the machine that wrote it. The checksum is the
+ * CRC-32 of the source files, so the cache is rebuilt when they change.
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t items;
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t reserved;
+    uint64_t checksum;
+    uint64_t images; // Offsets in the file
+    uint64_t pixels;
+    uint64_t labels;
+    uint64_t bytes; // Of the whole file
+} cache_header_t;
+
+err_t
+cache_checksum (const dataset_t * const dataset, uint64_t * const checksum);
+
+err_t
+cache_map (data_t * const data, const char * cache_file,
+           const dataset_t * const dataset, const uint64_t checksum);
+
+err_t
+cache_write (const data_t * const data, const char * cache_file,
+             const uint64_t checksum);
+
+err_t
+cache_read (data_t * const data, const dataset_t * const dataset,
+            const char * cache_file, const uint32_t threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CACHE_H_ */
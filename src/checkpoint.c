@@ -0,0 +1,220 @@
+/*
+ *   checkpoint.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For mkstemp, fchmod, fdopen and fileno under -std=c99
+#define _GNU_SOURCE
+
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static err_t
+checkpoint_write (const network_t * const net, FILE * const fp)
+{
+    const uint32_t version = CHECKPOINT_VERSION;
+    err_t err;
+
+    if (fwrite (CHECKPOINT_MAGIC, 1, 4, fp) != 4
+            || fwrite (&version, sizeof(version), 1, fp) != 1
+            || fwrite (&net->nodes.size, sizeof(uint32_t), 1, fp) != 1
+            || fwrite (net->nodes.data, sizeof(uint32_t), net->nodes.size,
+                       fp) != net->nodes.size)
+        return GSL_EFAILED;
+
+    for (uint32_t l = 0; l + 1 < net->nodes.size; ++l) {
+        err = gsl_matrix_fwrite (fp, net->weights.data[l]);
+        RETURN_ON_ERR(err);
+        err = gsl_vector_fwrite (fp, net->biases.data[l]);
+        RETURN_ON_ERR(err);
+    }
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Create and open the file named by the template tmp, with the
+ * permissions fopen would have given it
+ */
+static FILE *
+checkpoint_open_tmp (char * const tmp)
+{
+    int fd = mkstemp (tmp);
+    if (fd < 0)
+        return NULL;
+
+    mode_t mask = umask (0);
+    umask (mask);
+
+    FILE * fp = NULL;
+    if (!fchmod (fd, 0666 & ~mask))
+        fp = fdopen (fd, "wb");
+    if (!fp) {
+        close (fd);
+        remove (tmp);
+    }
+
+    return fp;
+}
+
+err_t
+checkpoint_save (const network_t * const net, const char * path)
+{
+    if (net->features.size)
+        return GSL_EINVAL;
+
+    // A name of its own, so writers at the same time can't mix their files
+    char * tmp = malloc (strlen (path) + 8);
+    RETURN_ERR_ON_BAD_ALLOC(tmp);
+    sprintf (tmp, "%s.XXXXXX", path);
+
+    FILE * fp = checkpoint_open_tmp (tmp);
+    if (!fp)
+        free (tmp);
+    RETURN_ERR_ON_NO_FILE(fp);
+
+    err_t err = checkpoint_write (net, fp);
+    if (fclose (fp) && !err)
+        err = GSL_EFAILED;
+
+    // A server reloading path sees the old file or the new, never part
+    if (!err && rename (tmp, path))
+        err = GSL_EFAILED;
+    if (err)
+        remove (tmp);
+    free (tmp);
+
+    return err;
+}
+
+/*
+ * Check the magic and version, and read the node counts into nodes
+ */
+static err_t
+checkpoint_read_header (uint32_array_t * const nodes, FILE * const fp)
+{
+    char magic[4];
+    uint32_t version;
+
+    nodes->data = NULL;
+    if (fread (magic, 1, 4, fp) != 4
+            || fread (&version, sizeof(version), 1, fp) != 1
+            || fread (&nodes->size, sizeof(uint32_t), 1, fp) != 1)
+        return GSL_EFAILED;
+
+    if (memcmp (magic, CHECKPOINT_MAGIC, 4) || version != CHECKPOINT_VERSION
+            || nodes->size < 2 || nodes->size > CHECKPOINT_MAX_LAYERS)
+        return GSL_EINVAL;
+
+    nodes->data = malloc (nodes->size * sizeof(uint32_t));
+    RETURN_ERR_ON_BAD_ALLOC(nodes->data);
+
+    if (fread (nodes->data, sizeof(uint32_t), nodes->size, fp) != nodes->size)
+        return GSL_EFAILED;
+
+    // The whole file, so a short one can't fail part way through a read
+    uint64_t bytes = 4 + 2 * sizeof(uint32_t)
+            + nodes->size * sizeof(uint32_t);
+    for (uint32_t l = 0; l < nodes->size; ++l) {
+        const uint64_t n = nodes->data[l];
+        if (!n || n > CHECKPOINT_MAX_NODES)
+            return GSL_EINVAL;
+        if (l)
+            bytes += (nodes->data[l - 1] + 1) * n * sizeof(double);
+    }
+
+    struct stat st;
+    if (fstat (fileno (fp), &st))
+        return GSL_EFAILED;
+    if ((uint64_t) st.st_size != bytes)
+        return GSL_EINVAL;
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * The node counts of a saved network, to allocate one to load it into.
+ * The caller frees nodes->data.
+ */
+err_t
+checkpoint_read_nodes (uint32_array_t * const nodes, const char * path)
+{
+    FILE * fp = fopen (path, "rb");
+    RETURN_ERR_ON_NO_FILE(fp);
+
+    err_t err = checkpoint_read_header (nodes, fp);
+    fclose (fp);
+
+    if (err) {
+        free (nodes->data);
+        nodes->data = NULL;
+    }
+
+    return err;
+}
+
+static err_t
+checkpoint_read (network_t * const net, FILE * const fp)
+{
+    uint32_array_t nodes;
+    err_t err = checkpoint_read_header (&nodes, fp);
+
+    if (!err && (nodes.size != net->nodes.size
+            || memcmp (nodes.data, net->nodes.data,
+                       nodes.size * sizeof(uint32_t))))
+        err = GSL_EBADLEN;
+    free (nodes.data);
+    RETURN_ON_ERR(err);
+
+    for (uint32_t l = 0; l + 1 < net->nodes.size; ++l) {
+        err = gsl_matrix_fread (fp, net->weights.data[l]);
+        RETURN_ON_ERR(err);
+        err = gsl_vector_fread (fp, net->biases.data[l]);
+        RETURN_ON_ERR(err);
+    }
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Into an allocated network of the same shape, returning GSL_EBADLEN if
+ * the shapes differ
+ */
+err_t
+checkpoint_load (network_t * const net, const char * path)
+{
+    if (net->features.size)
+        return GSL_EINVAL;
+
+    FILE * fp = fopen (path, "rb");
+    RETURN_ERR_ON_NO_FILE(fp);
+
+    err_t err = checkpoint_read (net, fp);
+    fclose (fp);
+    RETURN_ON_ERR(err);
+
+    network_refresh_weights_t (net);
+
+    return GSL_SUCCESS;
+}
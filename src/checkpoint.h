@@ -0,0 +1,65 @@
+/*
+ *   checkpoint.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "math_utils.h"
+#include "nnet.h"
+
+#include <stdint.h>
+
+#define CHECKPOINT_MAGIC "NNET"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_MAX_LAYERS 1024
+#define CHECKPOINT_MAX_NODES (1 << 24) // In a layer
+
+/*
+ * The dense weights and biases of a network, in host byte order:
+ *
+ *   "NNET", uint32 version, uint32 layers, uint32 nodes[layers]
+ *   then for each layer, its weights row by row and then its biases
+ *
+ * Feature layers are not saved, networks with them return GSL_EINVAL.
+ * Files with more layers or nodes than the limits below, a layer of no
+ * nodes, or a length that doesn't match the node counts are refused with
+ * GSL_EINVAL before anything is allocated for them.
+ */
+
+err_t
+checkpoint_save (const network_t * const network, const char * path);
+
+err_t
+checkpoint_read_nodes (uint32_array_t * const nodes, const char * path);
+
+err_t
+checkpoint_load (network_t * const network, const char * path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHECKPOINT_H_ */
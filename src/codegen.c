@@ -0,0 +1,223 @@
+/*
+ *   codegen.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "codegen.h"
+
+#include <ctype.h>
+#include <string.h>
+
+static uint32_t
+codegen_stride (const uint32_t outputs)
+{
+    return (outputs + CODEGEN_ALIGN - 1) / CODEGEN_ALIGN * CODEGEN_ALIGN;
+}
+
+static int
+codegen_is_identifier (const char * name)
+{
+    if (!isalpha ((unsigned char) name[0]) && name[0] != '_')
+        return 0;
+
+    for (const char * c = name; *c; ++c) {
+        if (!isalnum ((unsigned char) *c) && *c != '_')
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Layer l's weights transposed, inputs x padded outputs, and its padded
+ * biases. %.17g reads back as the same double.
+ */
+static void
+codegen_emit_layer (const network_t * const net, const uint32_t l,
+                    const char * prefix, const char * upper, FILE * const fp)
+{
+    const gsl_matrix * w = net->weights.data[l];
+    const uint32_t stride = codegen_stride (w->size1);
+
+    fprintf (fp, "static const double %s_w%u[%zu][%u] %s_ALIGNED = {\n",
+             prefix, l, w->size2, stride, upper);
+    for (size_t j = 0; j < w->size2; ++j) {
+        fprintf (fp, "    {");
+        for (uint32_t i = 0; i < stride; ++i) {
+            double v = i < w->size1 ? gsl_matrix_get (w, i, j) : 0.0;
+            fprintf (fp, "%s%.17g", i == 0 ? " " : i % 4 ? ", "
+                     : ",\n      ", v);
+        }
+        fprintf (fp, " },\n");
+    }
+    fprintf (fp, "};\n\n");
+
+    fprintf (fp, "static const double %s_b%u[%u] %s_ALIGNED = {", prefix, l,
+             stride, upper);
+    for (uint32_t i = 0; i < stride; ++i) {
+        double v = i < w->size1 ? gsl_vector_get (net->biases.data[l], i)
+                : 0.0;
+        fprintf (fp, "%s%s%.17g", i ? "," : "", i % 4 == 0 ? "\n    " : " ",
+                 v);
+    }
+    fprintf (fp, "\n};\n\n");
+}
+
+/*
+ * z = w * x + b into z, over all the padded outputs, then the sigmoid
+ * into a over the real ones
+ */
+static void
+codegen_emit_forward (const network_t * const net, const uint32_t l,
+                      const char * prefix, FILE * const fp)
+{
+    const uint32_t inputs = net->nodes.data[l];
+    const uint32_t outputs = net->nodes.data[l + 1];
+    const uint32_t stride = codegen_stride (outputs);
+    char x[16] = "input";
+
+    if (l)
+        snprintf (x, sizeof(x), "a%u", l - 1);
+
+    fprintf (fp, "    // Layer %u, %u x %u\n"
+             "#ifdef NNET_GENERATED_AVX2\n"
+             "    {\n", l, outputs, inputs);
+
+    // The accumulators are unrolled so they stay in registers
+    for (uint32_t k = 0; k < stride / 4; ++k) {
+        fprintf (fp, "        __m256d acc%u = _mm256_load_pd (%s_b%u + %u);\n",
+                 k, prefix, l, 4 * k);
+    }
+    fprintf (fp, "        for (uint32_t j = 0; j < %u; ++j) {\n"
+             "            const __m256d xj = _mm256_set1_pd (%s[j]);\n",
+             inputs, x);
+    for (uint32_t k = 0; k < stride / 4; ++k) {
+        fprintf (fp, "            acc%u = _mm256_fmadd_pd (_mm256_load_pd "
+                 "(%s_w%u[j] + %u), xj, acc%u);\n", k, prefix, l, 4 * k, k);
+    }
+    fprintf (fp, "        }\n");
+    for (uint32_t k = 0; k < stride / 4; ++k) {
+        fprintf (fp, "        _mm256_store_pd (z + %u, acc%u);\n", 4 * k, k);
+    }
+
+    fprintf (fp, "    }\n"
+             "#else\n"
+             "    for (uint32_t i = 0; i < %u; ++i) {\n"
+             "        z[i] = %s_b%u[i];\n"
+             "    }\n"
+             "    for (uint32_t j = 0; j < %u; ++j) {\n"
+             "        for (uint32_t i = 0; i < %u; ++i) {\n"
+             "            z[i] += %s_w%u[j][i] * %s[j];\n"
+             "        }\n"
+             "    }\n"
+             "#endif\n"
+             "    for (uint32_t i = 0; i < %u; ++i) {\n"
+             "        a%u[i] = 1.0 / (1.0 + exp (-z[i]));\n"
+             "    }\n\n",
+             stride, prefix, l, inputs, stride, prefix, l, x, outputs, l);
+}
+
+/*
+ * Write a self contained C file for the dense network, with its weights
+ * as static const arrays and a predict function specialised to its
+ * sizes. It needs only libm, and uses AVX2/FMA when built for them. The
+ * activation is always the exact sigmoid.
+ *
+ * Returns GSL_EINVAL for feature layers or a prefix that is not a C
+ * identifier.
+ */
+err_t
+codegen_emit (const network_t * const net, const char * prefix,
+              FILE * const fp)
+{
+    const uint32_t layers = net->nodes.size - 1;
+    const uint32_t inputs = net->nodes.data[0];
+    const uint32_t outputs = net->nodes.data[layers];
+    uint32_t widest = 0;
+    char upper[64];
+
+    if (net->features.size || !codegen_is_identifier (prefix)
+            || strlen (prefix) >= sizeof(upper))
+        return GSL_EINVAL;
+
+    for (size_t i = 0; i <= strlen (prefix); ++i) {
+        upper[i] = toupper ((unsigned char) prefix[i]);
+    }
+
+    fprintf (fp, "/*\n * Generated by NNet from a ");
+    for (uint32_t l = 0; l <= layers; ++l) {
+        fprintf (fp, "%u%s", net->nodes.data[l], l < layers ? "-" : "");
+    }
+    fprintf (fp, " network, do not edit.\n"
+             " *\n"
+             " *   uint32_t %s_predict (const double * input, "
+             "double * output);\n"
+             " *\n"
+             " * Classifies %s_INPUTS values, returning the index of the "
+             "largest\n"
+             " * output activation. The %s_OUTPUTS activations are copied "
+             "to output\n"
+             " * unless it is NULL. Link with -lm.\n"
+             " */\n\n", prefix, upper, upper);
+
+    fprintf (fp, "#include <math.h>\n"
+             "#include <stdint.h>\n"
+             "#include <string.h>\n\n"
+             "#if defined(__AVX2__) && defined(__FMA__)\n"
+             "#define NNET_GENERATED_AVX2\n"
+             "#include <immintrin.h>\n"
+             "#endif\n\n"
+             "#define %s_INPUTS %u\n"
+             "#define %s_OUTPUTS %u\n\n"
+             "#if defined(__GNUC__)\n"
+             "#define %s_ALIGNED __attribute__((aligned(64)))\n"
+             "#else\n"
+             "#define %s_ALIGNED\n"
+             "#endif\n\n", upper, inputs, upper, outputs, upper, upper);
+
+    for (uint32_t l = 0; l < layers; ++l) {
+        codegen_emit_layer (net, l, prefix, upper, fp);
+        widest = codegen_stride (net->nodes.data[l + 1]) > widest
+                ? codegen_stride (net->nodes.data[l + 1]) : widest;
+    }
+
+    fprintf (fp, "uint32_t\n"
+             "%s_predict (const double * const input, double * const output)\n"
+             "{\n"
+             "    double z[%u] %s_ALIGNED;\n", prefix, widest, upper);
+    for (uint32_t l = 0; l < layers; ++l) {
+        fprintf (fp, "    double a%u[%u];\n", l, net->nodes.data[l + 1]);
+    }
+    fprintf (fp, "\n");
+
+    for (uint32_t l = 0; l < layers; ++l) {
+        codegen_emit_forward (net, l, prefix, fp);
+    }
+
+    fprintf (fp, "    uint32_t best = 0;\n"
+             "    for (uint32_t i = 1; i < %u; ++i) {\n"
+             "        best = a%u[i] > a%u[best] ? i : best;\n"
+             "    }\n\n"
+             "    if (output)\n"
+             "        memcpy (output, a%u, sizeof(a%u));\n\n"
+             "    return best;\n"
+             "}\n", outputs, layers - 1, layers - 1, layers - 1, layers - 1);
+
+    return ferror (fp) ? GSL_EFAILED : GSL_SUCCESS;
+}
@@ -0,0 +1,45 @@
+/*
+ *   codegen.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CODEGEN_H_
+#define CODEGEN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "nnet.h"
+
+#include <stdio.h>
+
+// Outputs of each layer are padded to whole AVX2 registers of doubles
+#define CODEGEN_ALIGN 4
+
+err_t
+codegen_emit (const network_t * const network, const char * prefix,
+              FILE * const fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CODEGEN_H_ */
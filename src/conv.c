@@ -0,0 +1,442 @@
+/*
+ *   conv.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "conv.h"
+#include "kernels.h"
+#include "math_utils.h"
+#include "nnet.h"
+
+#include <gsl/gsl_blas.h>
+#include <assert.h>
+
+static uint32_t
+window_count (const uint32_t length,
+              const uint32_t size,
+              const uint32_t stride)
+{
+    return (length - size) / stride + 1;
+}
+
+static uint8_t
+conv_is_direct (const layer_t * const layer)
+{
+    return layer->size <= CONV_DIRECT_MAX_KERNEL;
+}
+
+static err_t
+window_set_output_shape (layer_t * const layer, const uint32_t channels)
+{
+    if (layer->size == 0 || layer->stride == 0)
+        return GSL_EINVAL;
+    if (layer->size > layer->in.rows || layer->size > layer->in.cols)
+        return GSL_EBADLEN;
+
+    layer->out.channels = channels;
+    layer->out.rows = window_count (layer->in.rows, layer->size,
+                                    layer->stride);
+    layer->out.cols = window_count (layer->in.cols, layer->size,
+                                    layer->stride);
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+conv_allocate (layer_t * const layer, const layer_stack_mode_t mode)
+{
+    err_t err = window_set_output_shape (layer, layer->filters);
+    RETURN_ON_ERR(err);
+
+    uint32_t patch = layer->in.channels * layer->size * layer->size;
+    uint32_t positions = layer->out.rows * layer->out.cols;
+
+    err = layer_allocate_params (layer, layer->filters, patch, mode);
+    RETURN_ON_ERR(err);
+
+    if (!conv_is_direct (layer)) {
+        layer->cols = gsl_matrix_alloc (patch, positions);
+        RETURN_ERR_ON_BAD_ALLOC(layer->cols);
+        err = kernel_gemm_buffers_allocate (&layer->gemm);
+        RETURN_ON_ERR(err);
+    }
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+max_pool_allocate (layer_t * const layer, const layer_stack_mode_t mode)
+{
+    err_t err = window_set_output_shape (layer, layer->in.channels);
+    RETURN_ON_ERR(err);
+
+    layer->argmax = malloc (shape_size (&layer->out)
+            * sizeof(*layer->argmax));
+    RETURN_ERR_ON_BAD_ALLOC(layer->argmax);
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+flatten_allocate (layer_t * const layer, const layer_stack_mode_t mode)
+{
+    layer->out.channels = 1;
+    layer->out.rows = 1;
+    layer->out.cols = shape_size (&layer->in);
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Flattening is free: the output is the input viewed as a vector
+ */
+static void
+flatten_feed_forward (layer_t * const layer,
+                      const gsl_vector * const input,
+                      const uint8_t train)
+{
+    assert(input->stride == 1);
+
+    layer->output_view = gsl_vector_view_array (input->data, input->size);
+    layer->output = &layer->output_view.vector;
+}
+
+static void
+flatten_backpropagate (layer_t * const layer,
+                       const gsl_vector * const input,
+                       gsl_vector * const input_delta)
+{
+    if (input_delta && input_delta->data != layer->output_delta->data)
+        gsl_vector_memcpy (input_delta, layer->output_delta);
+}
+
+const layer_ops_t conv2d_ops = {
+        .allocate = &conv_allocate,
+        .forward = &conv_feed_forward,
+        .backward = &conv_backpropagate,
+        .backward_uses_input = 1,
+        .backward_uses_output = 1
+};
+
+const layer_ops_t max_pool_ops = {
+        .allocate = &max_pool_allocate,
+        .forward = &max_pool_feed_forward,
+        .backward = &max_pool_backpropagate
+};
+
+const layer_ops_t flatten_ops = {
+        .allocate = &flatten_allocate,
+        .forward = &flatten_feed_forward,
+        .backward = &flatten_backpropagate,
+        .aliases_input = 1
+};
+
+/*
+ * Unroll each receptive field of the input into a column, so that the
+ * convolution becomes weights * cols. Row (c * k + ky) * k + kx of the
+ * result matches the weight layout of each filter.
+ */
+void
+im2col (const gsl_vector * const input,
+        const layer_t * const layer,
+        gsl_matrix * const cols)
+{
+    const uint32_t k = layer->size;
+    const uint32_t s = layer->stride;
+    const shape_t * in = &layer->in;
+    const shape_t * out = &layer->out;
+    const double * src = input->data;
+
+    assert(input->stride == 1);
+
+    for (uint32_t c = 0; c < in->channels; ++c) {
+        for (uint32_t ky = 0; ky < k; ++ky) {
+            for (uint32_t kx = 0; kx < k; ++kx) {
+                uint32_t row = (c * k + ky) * k + kx;
+                double * dst = cols->data + row * cols->tda;
+
+                for (uint32_t oy = 0; oy < out->rows; ++oy) {
+                    const double * src_row = src
+                            + (c * in->rows + oy * s + ky) * in->cols + kx;
+                    for (uint32_t ox = 0; ox < out->cols; ++ox) {
+                        *dst++ = src_row[ox * s];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * The adjoint of im2col: accumulate each column back onto the input
+ * positions it was gathered from.
+ */
+void
+col2im (const gsl_matrix * const cols,
+        const layer_t * const layer,
+        gsl_vector * const input)
+{
+    const uint32_t k = layer->size;
+    const uint32_t s = layer->stride;
+    const shape_t * in = &layer->in;
+    const shape_t * out = &layer->out;
+    double * dst = input->data;
+
+    assert(input->stride == 1);
+
+    gsl_vector_set_zero (input);
+
+    for (uint32_t c = 0; c < in->channels; ++c) {
+        for (uint32_t ky = 0; ky < k; ++ky) {
+            for (uint32_t kx = 0; kx < k; ++kx) {
+                uint32_t row = (c * k + ky) * k + kx;
+                const double * src = cols->data + row * cols->tda;
+
+                for (uint32_t oy = 0; oy < out->rows; ++oy) {
+                    double * dst_row = dst
+                            + (c * in->rows + oy * s + ky) * in->cols + kx;
+                    for (uint32_t ox = 0; ox < out->cols; ++ox) {
+                        dst_row[ox * s] += *src++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void
+conv_direct (const layer_t * const layer,
+             const gsl_vector * const input)
+{
+    const uint32_t k = layer->size;
+    const uint32_t s = layer->stride;
+    const shape_t * in = &layer->in;
+    const shape_t * out = &layer->out;
+    const double * src = input->data;
+    double * dst = layer->output->data;
+
+    for (uint32_t f = 0; f < out->channels; ++f) {
+        const double * w = layer->weights->data + f * layer->weights->tda;
+        double bias = gsl_vector_get (layer->biases, f);
+
+        for (uint32_t oy = 0; oy < out->rows; ++oy) {
+            for (uint32_t ox = 0; ox < out->cols; ++ox) {
+                double sum = bias;
+                const double * wp = w;
+
+                for (uint32_t c = 0; c < in->channels; ++c) {
+                    const double * patch = src
+                            + (c * in->rows + oy * s) * in->cols + ox * s;
+                    for (uint32_t ky = 0; ky < k; ++ky) {
+                        for (uint32_t kx = 0; kx < k; ++kx) {
+                            sum += *wp++ * patch[ky * in->cols + kx];
+                        }
+                    }
+                }
+
+                *dst++ = sum;
+            }
+        }
+    }
+}
+
+static void
+conv_im2col (layer_t * const layer,
+             const gsl_vector * const input)
+{
+    uint32_t positions = layer->out.rows * layer->out.cols;
+
+    im2col (input, layer, layer->cols);
+
+    // Z = W * cols, one row per filter
+    gsl_matrix_view z = gsl_matrix_view_array (layer->output->data,
+                                               layer->filters, positions);
+    err_t err = nnet_dgemm (CblasNoTrans, CblasNoTrans, 1.0, layer->weights,
+                            layer->cols, 0.0, &z.matrix, &layer->gemm);
+    assert(err == GSL_SUCCESS);
+
+    for (uint32_t f = 0; f < layer->filters; ++f) {
+        gsl_vector_view row = gsl_matrix_row (&z.matrix, f);
+        gsl_vector_add_constant (&row.vector,
+                                 gsl_vector_get (layer->biases, f));
+    }
+}
+
+void
+conv_feed_forward (layer_t * const layer,
+                   const gsl_vector * const input,
+                   const uint8_t train)
+{
+    assert(input->stride == 1);
+
+    if (conv_is_direct (layer))
+        conv_direct (layer, input);
+    else
+        conv_im2col (layer, input);
+
+    kernel_sigmoid (layer->output->data, layer->output->data,
+                    layer->output->size, layer->activation);
+}
+
+static void
+conv_direct_backpropagate (const layer_t * const layer,
+                           const gsl_vector * const input,
+                           gsl_vector * const input_delta)
+{
+    const uint32_t k = layer->size;
+    const uint32_t s = layer->stride;
+    const shape_t * in = &layer->in;
+    const shape_t * out = &layer->out;
+    const double * src = input->data;
+    const double * delta = layer->output_delta->data;
+
+    if (input_delta)
+        gsl_vector_set_zero (input_delta);
+
+    for (uint32_t f = 0; f < out->channels; ++f) {
+        const double * w = layer->weights->data + f * layer->weights->tda;
+        double * nw = layer->nabla_w->data + f * layer->nabla_w->tda;
+        double * nb = gsl_vector_ptr (layer->nabla_b, f);
+
+        for (uint32_t oy = 0; oy < out->rows; ++oy) {
+            for (uint32_t ox = 0; ox < out->cols; ++ox) {
+                double d = *delta++;
+                uint32_t j = 0;
+
+                *nb += d;
+
+                for (uint32_t c = 0; c < in->channels; ++c) {
+                    uint32_t base = (c * in->rows + oy * s) * in->cols + ox * s;
+                    for (uint32_t ky = 0; ky < k; ++ky) {
+                        for (uint32_t kx = 0; kx < k; ++kx, ++j) {
+                            uint32_t idx = base + ky * in->cols + kx;
+                            nw[j] += d * src[idx];
+                            if (input_delta)
+                                input_delta->data[idx] += d * w[j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void
+conv_im2col_backpropagate (layer_t * const layer,
+                           gsl_vector * const input_delta)
+{
+    uint32_t positions = layer->out.rows * layer->out.cols;
+
+    gsl_matrix_view delta = gsl_matrix_view_array (layer->output_delta->data,
+                                                   layer->filters, positions);
+
+    for (uint32_t f = 0; f < layer->filters; ++f) {
+        gsl_vector_view row = gsl_matrix_row (&delta.matrix, f);
+        double sum = 0.0;
+        for (uint32_t p = 0; p < positions; ++p) {
+            sum += gsl_vector_get (&row.vector, p);
+        }
+        *gsl_vector_ptr (layer->nabla_b, f) += sum;
+    }
+
+    // The columns still hold the input unrolled by the feed forward
+    err_t err = nnet_dgemm (CblasNoTrans, CblasTrans, 1.0, &delta.matrix,
+                            layer->cols, 1.0, layer->nabla_w, &layer->gemm);
+    assert(err == GSL_SUCCESS);
+
+    if (input_delta) {
+        // Reuse the columns for the gradient w.r.t. the unrolled input
+        err = nnet_dgemm (CblasTrans, CblasNoTrans, 1.0, layer->weights,
+                          &delta.matrix, 0.0, layer->cols, &layer->gemm);
+        assert(err == GSL_SUCCESS);
+        col2im (layer->cols, layer, input_delta);
+    }
+}
+
+/*
+ * Requires a feed forward with train set. The output_delta is scaled
+ * in place by sigmoid'(z).
+ */
+void
+conv_backpropagate (layer_t * const layer,
+                    const gsl_vector * const input,
+                    gsl_vector * const input_delta)
+{
+    vector_mul_sigmoid_prime (layer->output_delta, layer->output);
+
+    if (conv_is_direct (layer))
+        conv_direct_backpropagate (layer, input, input_delta);
+    else
+        conv_im2col_backpropagate (layer, input_delta);
+}
+
+void
+max_pool_feed_forward (layer_t * const layer,
+                       const gsl_vector * const input,
+                       const uint8_t train)
+{
+    const uint32_t k = layer->size;
+    const uint32_t s = layer->stride;
+    const shape_t * in = &layer->in;
+    const shape_t * out = &layer->out;
+    const double * src = input->data;
+    double * dst = layer->output->data;
+    uint32_t * argmax = layer->argmax;
+
+    assert(input->stride == 1);
+
+    for (uint32_t c = 0; c < out->channels; ++c) {
+        for (uint32_t oy = 0; oy < out->rows; ++oy) {
+            for (uint32_t ox = 0; ox < out->cols; ++ox) {
+                uint32_t best = (c * in->rows + oy * s) * in->cols + ox * s;
+
+                for (uint32_t ky = 0; ky < k; ++ky) {
+                    uint32_t idx = (c * in->rows + oy * s + ky) * in->cols
+                            + ox * s;
+                    for (uint32_t kx = 0; kx < k; ++kx, ++idx) {
+                        if (src[idx] > src[best])
+                            best = idx;
+                    }
+                }
+
+                *dst++ = src[best];
+                *argmax++ = best;
+            }
+        }
+    }
+}
+
+/*
+ * Route each output gradient back to the input which won the max
+ */
+void
+max_pool_backpropagate (layer_t * const layer,
+                        const gsl_vector * const input,
+                        gsl_vector * const input_delta)
+{
+    if (!input_delta)
+        return;
+
+    gsl_vector_set_zero (input_delta);
+
+    for (uint32_t i = 0; i < layer->output_delta->size; ++i) {
+        input_delta->data[layer->argmax[i]] +=
+                gsl_vector_get (layer->output_delta, i);
+    }
+}
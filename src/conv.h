@@ -0,0 +1,76 @@
+/*
+ *   conv.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONV_H_
+#define CONV_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "layer.h"
+
+#include <stdint.h>
+#include <gsl/gsl_matrix.h>
+
+// Kernels up to this size skip im2col and convolve directly
+#define CONV_DIRECT_MAX_KERNEL 3
+
+extern const layer_ops_t conv2d_ops;
+extern const layer_ops_t max_pool_ops;
+extern const layer_ops_t flatten_ops;
+
+void
+im2col (const gsl_vector * const input,
+        const layer_t * const layer,
+        gsl_matrix * const cols);
+
+void
+col2im (const gsl_matrix * const cols,
+        const layer_t * const layer,
+        gsl_vector * const input);
+
+void
+conv_feed_forward (layer_t * const layer,
+                   const gsl_vector * const input,
+                   const uint8_t train);
+
+void
+conv_backpropagate (layer_t * const layer,
+                    const gsl_vector * const input,
+                    gsl_vector * const input_delta);
+
+void
+max_pool_feed_forward (layer_t * const layer,
+                       const gsl_vector * const input,
+                       const uint8_t train);
+
+void
+max_pool_backpropagate (layer_t * const layer,
+                        const gsl_vector * const input,
+                        gsl_vector * const input_delta);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONV_H_ */
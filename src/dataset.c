@@ -0,0 +1,514 @@
+/*
+ *   dataset.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For strdup, getline, glob and posix_fadvise under -std=c99
+#define _GNU_SOURCE
+
+#include "dataset.h"
+
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct
+{
+    const dataset_t * dataset;
+    data_t * data;
+    uint32_t * next; // Shard, shared by the readers
+    err_t err;
+} dataset_reader_t;
+
+// Decompresses a shard's images into place ahead of the scaling
+typedef struct
+{
+    gzFile fp;
+    uint8_t * pixels;
+    uint32_t items;
+    uint32_t size; // Bytes an image
+    uint32_t done; // Images in place
+    err_t err;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} dataset_inflater_t;
+
+void
+dataset_init (dataset_t * const dataset)
+{
+    memset (dataset, 0, sizeof(*dataset));
+}
+
+void
+dataset_free (dataset_t * const dataset)
+{
+    for (uint32_t i = 0; i < dataset->size; ++i) {
+        free (dataset->shards[i].images);
+        free (dataset->shards[i].labels);
+    }
+
+    free (dataset->shards);
+    dataset_init (dataset);
+}
+
+/*
+ * Check file is an IDX file of bytes of dims dimensions, and its length if
+ * it isn't gzipped, and read their sizes
+ */
+static err_t
+dataset_read_header (const char * file, const uint32_t dims,
+                     uint32_t * const size)
+{
+    idx_t idx;
+
+    err_t err = idx_open (&idx, file);
+    if (!err)
+        err = idx_expect (&idx, IDX_U8, dims);
+    if (!err)
+        memcpy (size, idx.size, dims * sizeof(uint32_t));
+
+    idx_close (&idx);
+    idx_report (file, err);
+
+    return err;
+}
+
+/*
+ * Append a shard after checking its headers. Its images must be the shape
+ * of those already added.
+ */
+err_t
+dataset_add (dataset_t * const dataset,
+             const char * images_file,
+             const char * labels_file)
+{
+    uint32_t images[3];
+    uint32_t labels;
+
+    err_t err = dataset_read_header (images_file, 3, images);
+    RETURN_ON_ERR(err);
+    err = dataset_read_header (labels_file, 1, &labels);
+    RETURN_ON_ERR(err);
+
+    if (images[0] != labels || !images[1] || !images[2]
+            || images[0] > UINT32_MAX - dataset->items)
+        return GSL_EINVAL;
+
+    if (!dataset->size) {
+        dataset->rows = images[1];
+        dataset->cols = images[2];
+        dataset->pixels = images[1] * images[2];
+    } else if (images[1] != dataset->rows || images[2] != dataset->cols) {
+        return GSL_EBADLEN;
+    }
+
+    if (dataset->size == dataset->capacity) {
+        uint32_t capacity = dataset->capacity ? 2 * dataset->capacity : 16;
+        shard_t * shards = realloc (dataset->shards,
+                                    capacity * sizeof(shard_t));
+        RETURN_ERR_ON_BAD_ALLOC(shards);
+        dataset->shards = shards;
+        dataset->capacity = capacity;
+    }
+
+    shard_t * shard = &dataset->shards[dataset->size];
+    shard->images = strdup (images_file);
+    shard->labels = strdup (labels_file);
+    if (!shard->images || !shard->labels) {
+        free (shard->images);
+        free (shard->labels);
+        return GSL_ENOMEM;
+    }
+    shard->items = images[0];
+    shard->first = dataset->items;
+
+    dataset->size++;
+    dataset->items += images[0];
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * A relative path in a manifest is from the manifest's directory
+ */
+static char *
+dataset_manifest_path (const char * manifest, const char * path)
+{
+    const char * slash = strrchr (manifest, '/');
+    if (path[0] == '/' || !slash)
+        return strdup (path);
+
+    size_t dir = slash - manifest + 1;
+    char * full = malloc (dir + strlen (path) + 1);
+    if (full) {
+        memcpy (full, manifest, dir);
+        strcpy (full + dir, path);
+    }
+
+    return full;
+}
+
+static err_t
+dataset_add_line (dataset_t * const dataset, const char * manifest,
+                  char * const line)
+{
+    char * save;
+    char * images = strtok_r (line, " \t\r\n", &save);
+    char * labels = strtok_r (NULL, " \t\r\n", &save);
+
+    // Blank lines and comments
+    if (!images || images[0] == '#')
+        return GSL_SUCCESS;
+    if (!labels || strtok_r (NULL, " \t\r\n", &save))
+        return GSL_EINVAL;
+
+    char * images_path = dataset_manifest_path (manifest, images);
+    char * labels_path = dataset_manifest_path (manifest, labels);
+    err_t err = GSL_ENOMEM;
+    if (images_path && labels_path)
+        err = dataset_add (dataset, images_path, labels_path);
+
+    free (images_path);
+    free (labels_path);
+
+    return err;
+}
+
+/*
+ * Add the shards listed in a text file, a line of
+ *
+ *   <images file> <labels file>
+ *
+ * for each. Blank lines and those starting with # are skipped.
+ */
+err_t
+dataset_add_manifest (dataset_t * const dataset, const char * manifest)
+{
+    FILE * fp = fopen (manifest, "r");
+    RETURN_ERR_ON_NO_FILE(fp);
+
+    char * line = NULL;
+    size_t length = 0;
+    err_t err = GSL_SUCCESS;
+    while (!err && getline (&line, &length, fp) != -1) {
+        err = dataset_add_line (dataset, manifest, line);
+    }
+
+    free (line);
+    fclose (fp);
+
+    return err;
+}
+
+/*
+ * Add the shards matching a pair of patterns, eg. "dat/train-*-images"
+ * and "dat/train-*-labels". The matches are paired in sorted order, so
+ * the names must sort the same.
+ */
+err_t
+dataset_add_glob (dataset_t * const dataset,
+                  const char * images_pattern,
+                  const char * labels_pattern)
+{
+    glob_t images;
+    glob_t labels;
+    err_t err = GSL_EFAILED;
+
+    if (glob (images_pattern, 0, NULL, &images))
+        return GSL_EFAILED;
+
+    if (!glob (labels_pattern, 0, NULL, &labels)) {
+        err = images.gl_pathc == labels.gl_pathc ? GSL_SUCCESS : GSL_EINVAL;
+        for (size_t i = 0; !err && i < images.gl_pathc; ++i) {
+            err = dataset_add (dataset, images.gl_pathv[i],
+                               labels.gl_pathv[i]);
+        }
+        globfree (&labels);
+    }
+
+    globfree (&images);
+
+    return err;
+}
+
+/*
+ * The shard holding item, which must be less than the items
+ */
+uint32_t
+dataset_find_shard (const dataset_t * const dataset, const uint32_t item)
+{
+    uint32_t low = 0;
+    uint32_t high = dataset->size - 1;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low + 1) / 2;
+        if (dataset->shards[mid].first <= item)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
+static gzFile
+dataset_file_open (const char * file, const off_t at)
+{
+    int fd = open (file, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    // Each is read front to back, so let the kernel read ahead
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    gzFile fp = gzdopen (fd, "rb");
+    if (!fp) {
+        close (fd);
+        return NULL;
+    }
+
+    // A gzipped file is decompressed up to the offset
+    gzbuffer (fp, DATASET_GZ_BUFFER);
+    if (gzseek (fp, at, SEEK_SET) != at) {
+        gzclose (fp);
+        return NULL;
+    }
+
+    return fp;
+}
+
+/*
+ * Open the files of a shard at one of its items, to read on from there
+ */
+err_t
+dataset_shard_open (const dataset_t * const dataset,
+                    const uint32_t shard,
+                    const uint32_t item,
+                    gzFile * images,
+                    gzFile * labels)
+{
+    const shard_t * s = &dataset->shards[shard];
+
+    *images = dataset_file_open (s->images, IMAGES_HEADER_SIZE_BYTES
+                                 + (off_t) item * dataset->pixels);
+    *labels = dataset_file_open (s->labels, LABELS_HEADER_SIZE_BYTES
+                                 + (off_t) item);
+    if (!*images || !*labels) {
+        if (*images)
+            gzclose (*images);
+        if (*labels)
+            gzclose (*labels);
+        *images = NULL;
+        *labels = NULL;
+        return GSL_EFAILED;
+    }
+
+    return GSL_SUCCESS;
+}
+
+static void *
+dataset_inflate_main (void * arg)
+{
+    dataset_inflater_t * inflater = arg;
+    uint32_t done = 0;
+    err_t err = GSL_SUCCESS;
+
+    while (!err && done < inflater->items) {
+        uint32_t n = inflater->items - done;
+        n = n < DATASET_INFLATE_ITEMS ? n : DATASET_INFLATE_ITEMS;
+        err = idx_read_bytes (inflater->fp, inflater->pixels
+                              + (size_t) done * inflater->size,
+                              (size_t) n * inflater->size);
+        done += n;
+
+        pthread_mutex_lock (&inflater->lock);
+        inflater->done = done;
+        inflater->err = err;
+        pthread_cond_signal (&inflater->cond);
+        pthread_mutex_unlock (&inflater->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Read one shard into its place in data. The images are decompressed
+ * straight into the pixels on another thread, and scaled into the
+ * vectors on this one as they arrive.
+ */
+static err_t
+dataset_read_shard (const dataset_t * const dataset,
+                    data_t * const data,
+                    const uint32_t shard)
+{
+    const shard_t * s = &dataset->shards[shard];
+    dataset_inflater_t inflater = {
+            .pixels = data->images.pixels + (size_t) s->first
+                    * dataset->pixels,
+            .items = s->items,
+            .size = dataset->pixels
+    };
+    gzFile labels;
+    pthread_t thread;
+
+    err_t err = dataset_shard_open (dataset, shard, 0, &inflater.fp,
+                                    &labels);
+    RETURN_ON_ERR(err);
+
+    pthread_mutex_init (&inflater.lock, NULL);
+    pthread_cond_init (&inflater.cond, NULL);
+    const int background = !pthread_create (&thread, NULL,
+                                            &dataset_inflate_main,
+                                            &inflater);
+    if (!background)
+        dataset_inflate_main (&inflater);
+
+    err = idx_read_bytes (labels, data->labels.labels + s->first, s->items);
+
+    uint32_t scaled = 0;
+    while (!err && scaled < s->items) {
+        pthread_mutex_lock (&inflater.lock);
+        while (inflater.done == scaled && !inflater.err) {
+            pthread_cond_wait (&inflater.cond, &inflater.lock);
+        }
+        uint32_t done = inflater.done;
+        err = inflater.err;
+        pthread_mutex_unlock (&inflater.lock);
+
+        if (!err)
+            images_scale_pixels (&data->images, dataset->pixels,
+                                 s->first + scaled, done - scaled);
+        scaled = done;
+    }
+
+    if (background)
+        pthread_join (thread, NULL);
+    err = err ? err : inflater.err;
+
+    pthread_mutex_destroy (&inflater.lock);
+    pthread_cond_destroy (&inflater.cond);
+    gzclose (inflater.fp);
+    gzclose (labels);
+
+    return err;
+}
+
+static void *
+dataset_reader_main (void * arg)
+{
+    dataset_reader_t * r = arg;
+
+    for (;;) {
+        uint32_t shard = __atomic_fetch_add (r->next, 1, __ATOMIC_RELAXED);
+        if (shard >= r->dataset->size)
+            break;
+
+        r->err = dataset_read_shard (r->dataset, r->data, shard);
+        if (r->err)
+            break;
+    }
+
+    return NULL;
+}
+
+// Read the shards into data, allocated for them, threads at a time
+static err_t
+dataset_read_shards (const dataset_t * const dataset,
+                     data_t * const data,
+                     const uint32_t threads)
+{
+    err_t err = GSL_SUCCESS;
+    uint32_t count = threads ? threads : DATASET_DEFAULT_THREADS;
+    count = count < dataset->size ? count : dataset->size;
+
+    dataset_reader_t * readers = calloc (count, sizeof(dataset_reader_t));
+    pthread_t * thread = calloc (count, sizeof(pthread_t));
+    if (!readers || !thread) {
+        free (readers);
+        free (thread);
+        return GSL_ENOMEM;
+    }
+
+    // This thread is the first reader, the rest are started if they can be
+    uint32_t next = 0;
+    uint32_t started = 1;
+    for (uint32_t i = 0; i < count; ++i) {
+        readers[i].dataset = dataset;
+        readers[i].data = data;
+        readers[i].next = &next;
+    }
+    while (started < count && !pthread_create (&thread[started], NULL,
+                                               &dataset_reader_main,
+                                               &readers[started])) {
+        started++;
+    }
+
+    dataset_reader_main (&readers[0]);
+
+    for (uint32_t i = 0; i < started; ++i) {
+        if (i)
+            pthread_join (thread[i], NULL);
+        err = err ? err : readers[i].err;
+    }
+
+    free (readers);
+    free (thread);
+
+    return err;
+}
+
+/*
+ * Read every shard into one contiguous data, as read_all_data, with
+ * threads reading a shard at a time. threads of 0 is the default. On
+ * error nothing is left allocated.
+ */
+err_t
+dataset_read (const dataset_t * const dataset,
+              data_t * const data,
+              const uint32_t threads)
+{
+    memset (data, 0, sizeof(*data));
+    if (!dataset->items)
+        return GSL_EINVAL;
+
+    data->images.magic_num = IMAGES_MAGIC;
+    data->images.num_images = dataset->items;
+    data->images.rows = dataset->rows;
+    data->images.cols = dataset->cols;
+    data->labels.magic_num = LABELS_MAGIC;
+    data->labels.num_labels = dataset->items;
+    data->items = dataset->items;
+
+    err_t err = images_allocate (&data->images, dataset->pixels);
+    if (!err)
+        err = labels_allocate (&data->labels);
+    if (!err)
+        err = dataset_read_shards (dataset, data, threads);
+    if (err) {
+        images_free (&data->images);
+        labels_free (&data->labels);
+        memset (data, 0, sizeof(*data));
+    }
+
+    return err;
+}
@@ -0,0 +1,108 @@
+/*
+ *   dataset.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DATASET_H_
+#define DATASET_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "loader.h"
+
+#include <stdint.h>
+#include <zlib.h>
+
+// Loader threads when none are asked for, at most one per shard
+#define DATASET_DEFAULT_THREADS 4
+
+// Images decompressed at a time while the last are scaled
+#define DATASET_INFLATE_ITEMS 1024
+
+// zlib's buffer for each file
+#define DATASET_GZ_BUFFER (128 * 1024)
+
+// A pair of IDX image and label files
+typedef struct
+{
+    char * images;
+    char * labels;
+    uint32_t items;
+    uint32_t first; // Of the dataset
+} shard_t;
+
+/*
+ * Many pairs of IDX files read as one, each of them raw or gzipped, the
+ * items of each shard following those of the one before. The headers are
+ * checked as shards are added, so every shard has images of the same
+ * shape and a label for each.
+ */
+typedef struct
+{
+    uint32_t size;
+    uint32_t capacity;
+    shard_t * shards;
+    uint32_t items; // Of all the shards
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t pixels;
+} dataset_t;
+
+void
+dataset_init (dataset_t * const dataset);
+
+void
+dataset_free (dataset_t * const dataset);
+
+err_t
+dataset_add (dataset_t * const dataset,
+             const char * images_file,
+             const char * labels_file);
+
+err_t
+dataset_add_manifest (dataset_t * const dataset, const char * manifest);
+
+err_t
+dataset_add_glob (dataset_t * const dataset,
+                  const char * images_pattern,
+                  const char * labels_pattern);
+
+uint32_t
+dataset_find_shard (const dataset_t * const dataset, const uint32_t item);
+
+err_t
+dataset_shard_open (const dataset_t * const dataset,
+                    const uint32_t shard,
+                    const uint32_t item,
+                    gzFile * images,
+                    gzFile * labels);
+
+err_t
+dataset_read (const dataset_t * const dataset,
+              data_t * const data,
+              const uint32_t threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DATASET_H_ */
@@ -0,0 +1,69 @@
+/*
+ *   emit.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compile a saved network to C:
+ *
+ *   ./emit network.nnet digits digits.c
+ */
+
+#include "checkpoint.h"
+#include "codegen.h"
+#include "errors.h"
+#include "nnet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int
+main (int argc, const char * argv[])
+{
+    err_t err;
+
+    if (argc != 4) {
+        printf ("Usage: %s <checkpoint> <prefix> <output.c>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    network_t network = { 0 };
+    err = checkpoint_read_nodes (&network.nodes, argv[1]);
+    EXIT_MAIN_ON_ERR(err);
+
+    network.mode = NETWORK_INFER;
+    err = network_allocate (&network);
+    EXIT_MAIN_ON_ERR(err);
+
+    err = checkpoint_load (&network, argv[1]);
+    EXIT_MAIN_ON_ERR(err);
+
+    FILE * fp = fopen (argv[3], "w");
+    err = fp ? codegen_emit (&network, argv[2], fp) : GSL_EFAILED;
+    if (fp && fclose (fp) && !err)
+        err = GSL_EFAILED;
+    EXIT_MAIN_ON_ERR(err);
+
+    printf ("Wrote %s_predict to %s\n", argv[2], argv[3]);
+
+    network_free (&network);
+    free (network.nodes.data);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+/*
+ *   epoch.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "epoch.h"
+
+#include <sched.h>
+
+void
+epoch_reader_init (epoch_reader_t * const reader)
+{
+    reader->passes = 0;
+    reader->active = 0;
+}
+
+/*
+ * Before loading the shared pointer. The fence pairs with the one in
+ * epoch_synchronize: either the writer sees this reader active, or the
+ * reader loads the new pointer.
+ */
+void
+epoch_enter (epoch_reader_t * const reader)
+{
+    __atomic_store_n (&reader->active, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+// Once done with what the pointer pointed to
+void
+epoch_exit (epoch_reader_t * const reader)
+{
+    __atomic_store_n (&reader->passes, reader->passes + 1, __ATOMIC_RELEASE);
+    __atomic_store_n (&reader->active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * After swapping the pointer, wait out the readers that may have loaded
+ * the old one
+ */
+void
+epoch_synchronize (epoch_reader_t * const readers, const uint32_t count)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        epoch_reader_t * r = &readers[i];
+        const uint64_t passes = __atomic_load_n (&r->passes, __ATOMIC_ACQUIRE);
+
+        if (!__atomic_load_n (&r->active, __ATOMIC_ACQUIRE))
+            continue;
+
+        while (__atomic_load_n (&r->passes, __ATOMIC_ACQUIRE) == passes
+                && __atomic_load_n (&r->active, __ATOMIC_ACQUIRE))
+            sched_yield ();
+    }
+}
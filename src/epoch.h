@@ -0,0 +1,65 @@
+/*
+ *   epoch.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Lets a writer replace something readers use without them locking.
+ *
+ * A reader brackets each use of the shared pointer with epoch_enter and
+ * epoch_exit, and loads the pointer in between. A writer swaps in the new
+ * pointer, then epoch_synchronize waits until no reader can still hold the
+ * old one: each reader was either outside, or has since left the use it
+ * was in. The old one can then be freed.
+ *
+ * A reader only stores to its own counters, so the fast path is two
+ * stores and a fence.
+ */
+typedef struct
+{
+    uint64_t passes; // Uses finished
+    uint32_t active;
+} epoch_reader_t;
+
+void
+epoch_reader_init (epoch_reader_t * const reader);
+
+void
+epoch_enter (epoch_reader_t * const reader);
+
+void
+epoch_exit (epoch_reader_t * const reader);
+
+void
+epoch_synchronize (epoch_reader_t * const readers, const uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EPOCH_H_ */
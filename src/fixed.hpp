@@ -0,0 +1,378 @@
+/*
+ *   fixed.hpp
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FIXED_HPP_
+#define FIXED_HPP_
+
+/*
+ * A dense network whose layer sizes are template parameters, eg.
+ *
+ *   nnet::fixed_network<784, 30, 10> net;
+ *   net.load (network);
+ *   uint32_t digit = net.predict (image->data);
+ *
+ * Every array is sized at compile time and held in the object itself, so
+ * the loops have constant trip counts for the compiler to unroll and
+ * vectorise, and nothing is checked or looked up per sample. Sizes are
+ * only checked when weights are loaded from or stored to a network_t.
+ *
+ * The object holds the weights, activations and gradients, about twice
+ * the weights in size, so large topologies are better static or on the
+ * heap than on the stack.
+ */
+
+#include "errors.h"
+#include "loader.h"
+#include "math_utils.h"
+#include "nnet.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define FIXED_AVX2
+#include <immintrin.h>
+#endif
+
+namespace nnet
+{
+
+template <std::size_t... Sizes>
+struct fixed_layers;
+
+/*
+ * The terminal level: the output activations pass straight through, and
+ * the error coming back is the derivative of the quadratic cost.
+ */
+template <std::size_t Outputs>
+struct fixed_layers<Outputs>
+{
+    static const std::size_t outputs = Outputs;
+
+    const double *
+    forward (const double * const x)
+    {
+        return x;
+    }
+
+    void
+    backward (const double * const a, const std::size_t label,
+              double * const error)
+    {
+        for (std::size_t i = 0; i < Outputs; ++i) {
+            error[i] = a[i] - (i == label ? 1.0 : 0.0);
+        }
+    }
+
+    bool
+    fits (const network_t &, const std::size_t) const
+    {
+        return true;
+    }
+
+    void
+    load (const network_t &, const std::size_t)
+    {
+    }
+
+    void
+    store (network_t &, const std::size_t) const
+    {
+    }
+
+    void
+    zero_gradients ()
+    {
+    }
+
+    void
+    update (const double)
+    {
+    }
+};
+
+/*
+ * A dense layer from In to Out nodes, followed by the rest
+ */
+template <std::size_t In, std::size_t Out, std::size_t... Rest>
+struct fixed_layers<In, Out, Rest...>
+{
+    typedef fixed_layers<Out, Rest...> next_type;
+    static const std::size_t outputs = next_type::outputs;
+
+    // Outputs padded to whole AVX2 registers, the padding is zero
+    static const std::size_t Stride = (Out + 3) / 4 * 4;
+
+    /*
+     * Transposed, so each input scales a contiguous row into all of the
+     * outputs, held in registers
+     */
+    alignas(32) double wt[In][Stride];
+    alignas(32) double b[Stride];
+    double a[Out];
+    double delta[Out];
+    double nabla_wt[In][Out];
+    double nabla_b[Out];
+    next_type next;
+
+    // a = sigmoid(w * x + b), then on through the rest
+    const double *
+    forward (const double * const x)
+    {
+        alignas(32) double z[Stride];
+
+#ifdef FIXED_AVX2
+        __m256d acc[Stride / 4];
+
+#pragma GCC unroll 16
+        for (std::size_t k = 0; k < Stride / 4; ++k) {
+            acc[k] = _mm256_load_pd (b + 4 * k);
+        }
+        for (std::size_t j = 0; j < In; ++j) {
+            const __m256d xj = _mm256_set1_pd (x[j]);
+#pragma GCC unroll 16
+            for (std::size_t k = 0; k < Stride / 4; ++k) {
+                acc[k] = _mm256_fmadd_pd (_mm256_load_pd (wt[j] + 4 * k), xj,
+                                          acc[k]);
+            }
+        }
+#pragma GCC unroll 16
+        for (std::size_t k = 0; k < Stride / 4; ++k) {
+            _mm256_store_pd (z + 4 * k, acc[k]);
+        }
+#else
+        for (std::size_t i = 0; i < Out; ++i) {
+            z[i] = b[i];
+        }
+        for (std::size_t j = 0; j < In; ++j) {
+            for (std::size_t i = 0; i < Out; ++i) {
+                z[i] += wt[j][i] * x[j];
+            }
+        }
+#endif
+
+        for (std::size_t i = 0; i < Out; ++i) {
+            a[i] = 1.0 / (1.0 + std::exp (-z[i]));
+        }
+
+        return next.forward (a);
+    }
+
+    /*
+     * Take the error at the output of this layer from the rest, form the
+     * delta, accumulate the gradients, and pass w^T delta back unless
+     * error is NULL
+     */
+    void
+    backward (const double * const x, const std::size_t label,
+              double * const error)
+    {
+        next.backward (a, label, delta);
+
+        for (std::size_t i = 0; i < Out; ++i) {
+            delta[i] *= a[i] * (1.0 - a[i]);
+            nabla_b[i] += delta[i];
+        }
+        for (std::size_t j = 0; j < In; ++j) {
+            for (std::size_t i = 0; i < Out; ++i) {
+                nabla_wt[j][i] += delta[i] * x[j];
+            }
+        }
+
+        if (!error)
+            return;
+
+        for (std::size_t j = 0; j < In; ++j) {
+            double e = 0.0;
+            for (std::size_t i = 0; i < Out; ++i) {
+                e += wt[j][i] * delta[i];
+            }
+            error[j] = e;
+        }
+    }
+
+    // Whether the layers of net from l on have these sizes
+    bool
+    fits (const network_t & net, const std::size_t l) const
+    {
+        const gsl_matrix * wl = net.weights.data[l];
+        const gsl_vector * bl = net.biases.data[l];
+
+        return wl->size1 == Out && wl->size2 == In && bl->size == Out
+                && next.fits (net, l + 1);
+    }
+
+    void
+    load (const network_t & net, const std::size_t l)
+    {
+        const gsl_matrix * wl = net.weights.data[l];
+        const gsl_vector * bl = net.biases.data[l];
+
+        std::memset (wt, 0, sizeof(wt));
+        std::memset (b, 0, sizeof(b));
+
+        for (std::size_t i = 0; i < Out; ++i) {
+            for (std::size_t j = 0; j < In; ++j) {
+                wt[j][i] = wl->data[i * wl->tda + j];
+            }
+            b[i] = gsl_vector_get (bl, i);
+        }
+
+        next.load (net, l + 1);
+    }
+
+    void
+    store (network_t & net, const std::size_t l) const
+    {
+        gsl_matrix * wl = net.weights.data[l];
+
+        for (std::size_t i = 0; i < Out; ++i) {
+            for (std::size_t j = 0; j < In; ++j) {
+                wl->data[i * wl->tda + j] = wt[j][i];
+            }
+            gsl_vector_set (net.biases.data[l], i, b[i]);
+        }
+
+        next.store (net, l + 1);
+    }
+
+    void
+    zero_gradients ()
+    {
+        std::memset (nabla_wt, 0, sizeof(nabla_wt));
+        std::memset (nabla_b, 0, sizeof(nabla_b));
+        next.zero_gradients ();
+    }
+
+    void
+    update (const double scale)
+    {
+        for (std::size_t i = 0; i < Out; ++i) {
+            b[i] -= scale * nabla_b[i];
+        }
+        for (std::size_t j = 0; j < In; ++j) {
+            for (std::size_t i = 0; i < Out; ++i) {
+                wt[j][i] -= scale * nabla_wt[j][i];
+            }
+        }
+
+        next.update (scale);
+    }
+};
+
+template <std::size_t... Sizes>
+class fixed_network
+{
+    static_assert(sizeof...(Sizes) >= 2, "Need at least an input and output");
+
+    fixed_layers<Sizes...> layers;
+
+public:
+    static const std::size_t outputs = fixed_layers<Sizes...>::outputs;
+
+    // Whether net has this shape, without feature layers
+    bool
+    fits (const network_t & net) const
+    {
+        return net.nodes.size == sizeof...(Sizes) && !net.features.size
+                && layers.fits (net, 0);
+    }
+
+    /*
+     * Copy in the weights and biases of a network of the same shape,
+     * else GSL_EBADLEN
+     */
+    err_t
+    load (const network_t & net)
+    {
+        if (!fits (net))
+            return GSL_EBADLEN;
+
+        layers.load (net, 0);
+
+        return GSL_SUCCESS;
+    }
+
+    /*
+     * Copy the weights and biases back to a network of the same shape,
+     * else GSL_EBADLEN and it is left as it was
+     */
+    err_t
+    store (network_t & net) const
+    {
+        if (!fits (net))
+            return GSL_EBADLEN;
+
+        layers.store (net, 0);
+        network_refresh_weights_t (&net);
+
+        return GSL_SUCCESS;
+    }
+
+    // The output activations
+    const double *
+    forward (const double * const input)
+    {
+        return layers.forward (input);
+    }
+
+    // Returns the lowest index if more than 1, as network_get_output
+    uint32_t
+    predict (const double * const input)
+    {
+        const double * a = forward (input);
+        uint32_t best = 0;
+
+        for (uint32_t i = 1; i < outputs; ++i) {
+            best = a[i] > a[best] ? i : best;
+        }
+
+        return best;
+    }
+
+    void
+    backpropagate (const double * const input, const uint8_t label)
+    {
+        forward (input);
+        layers.backward (input, label, NULL);
+    }
+
+    // As network_update_mini_batch, images must be contiguous
+    void
+    update_mini_batch (const data_t & data, const uint32_array_t & slice,
+                       const double eta)
+    {
+        layers.zero_gradients ();
+
+        for (uint32_t i = 0; i < slice.size; ++i) {
+            uint32_t index = slice.data[i];
+            backpropagate (data.images.images[index]->data,
+                           data.labels.labels[index]);
+        }
+
+        layers.update (eta / slice.size);
+    }
+};
+
+} // namespace nnet
+
+#endif /* FIXED_HPP_ */
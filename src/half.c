@@ -0,0 +1,349 @@
+/*
+ *   half.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "half.h"
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+#define HALF_AVX2
+#include <immintrin.h>
+#endif
+
+static uint32_t
+float_bits (const float f)
+{
+    uint32_t u;
+    memcpy (&u, &f, sizeof(u));
+    return u;
+}
+
+static float
+bits_float (const uint32_t u)
+{
+    float f;
+    memcpy (&f, &u, sizeof(f));
+    return f;
+}
+
+/*
+ * The top half of the float, rounded to nearest even
+ */
+static uint16_t
+bf16_from_float (const float f)
+{
+    uint32_t u = float_bits (f);
+
+    if ((u & 0x7fffffff) > 0x7f800000)
+        return (u >> 16) | 0x40; // Keep NaNs quiet
+
+    return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+}
+
+/*
+ * IEEE half, rounded to nearest even
+ */
+static uint16_t
+fp16_from_float (const float f)
+{
+    uint32_t u = float_bits (f);
+    uint16_t sign = (u >> 16) & 0x8000;
+    u &= 0x7fffffff;
+
+    if (u >= 0x7f800000)
+        return sign | (u > 0x7f800000 ? 0x7e00 : 0x7c00);
+
+    // At least halfway from the largest half, 65504, to 2^16
+    if (u >= 0x477ff000)
+        return sign | 0x7c00;
+
+    // Subnormal below 2^-14, zero below half the smallest subnormal 2^-24
+    if (u < 0x38800000) {
+        if (u <= 0x33000000)
+            return sign;
+
+        uint32_t exp = u >> 23;
+        uint32_t mant = (u & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - exp;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+
+        if (rem > halfway || (rem == halfway && (h & 1)))
+            h++;
+        return sign | h;
+    }
+
+    u += 0xfff + ((u >> 13) & 1);
+    return sign | ((u - 0x38000000) >> 13);
+}
+
+static float
+fp16_to_float (const uint16_t h)
+{
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+
+    if (exp == 0) {
+        float f = mant * (1.0f / 16777216.0f);
+        return sign ? -f : f;
+    }
+
+    if (exp == 31)
+        return bits_float (sign | 0x7f800000 | (mant << 13));
+
+    return bits_float (sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+static float
+half_to_float (const uint16_t h, const precision_t precision)
+{
+    if (precision == PRECISION_BF16)
+        return bits_float ((uint32_t) h << 16);
+
+    return fp16_to_float (h);
+}
+
+uint16_t
+half_from_double (const double x, const precision_t precision)
+{
+    if (precision == PRECISION_BF16)
+        return bf16_from_float ((float) x);
+
+    return fp16_from_float ((float) x);
+}
+
+double
+half_to_double (const uint16_t h, const precision_t precision)
+{
+    return half_to_float (h, precision);
+}
+
+/*
+ * As matrix_array_allocate, the i'th matrix is dimensions.data[i + 1] x
+ * dimensions.data[i]
+ */
+err_t
+half_matrix_array_allocate (half_matrix_array_t * const array,
+                            const uint32_array_t * const dimensions,
+                            const precision_t precision)
+{
+    uint32_t widest = 0;
+
+    array->size = dimensions->size - 1;
+    array->precision = precision;
+    array->scratch = NULL;
+    array->data = calloc (array->size, sizeof(half_matrix_t));
+    RETURN_ERR_ON_BAD_ALLOC(array->data);
+
+    for (uint32_t i = 0; i < array->size; ++i) {
+        half_matrix_t * m = &array->data[i];
+        m->size1 = dimensions->data[i + 1];
+        m->size2 = dimensions->data[i];
+        m->data = malloc ((size_t) m->size1 * m->size2 * sizeof(uint16_t));
+        RETURN_ERR_ON_BAD_ALLOC(m->data);
+    }
+
+    for (uint32_t i = 0; i < dimensions->size; ++i) {
+        widest = dimensions->data[i] > widest ? dimensions->data[i] : widest;
+    }
+
+    array->scratch = malloc (widest * sizeof(float));
+    RETURN_ERR_ON_BAD_ALLOC(array->scratch);
+
+    return GSL_SUCCESS;
+}
+
+void
+half_matrix_array_free (half_matrix_array_t * const array)
+{
+    for (uint32_t i = 0; array->data && i < array->size; ++i) {
+        free (array->data[i].data);
+    }
+
+    free (array->data);
+    free (array->scratch);
+    array->data = NULL;
+    array->scratch = NULL;
+    array->size = 0;
+}
+
+/*
+ * Round each matrix of src into dest. Does nothing if dest is empty.
+ */
+void
+half_matrix_array_memcpy (half_matrix_array_t * const dest,
+                          const matrix_array_t * const src)
+{
+    for (uint32_t l = 0; l < dest->size; ++l) {
+        const gsl_matrix * m = src->data[l];
+        uint16_t * h = dest->data[l].data;
+
+        for (size_t i = 0; i < m->size1; ++i) {
+            for (size_t j = 0; j < m->size2; ++j) {
+                h[i * m->size2 + j] = half_from_double (
+                        m->data[i * m->tda + j], dest->precision);
+            }
+        }
+    }
+}
+
+#ifdef HALF_AVX2
+static __m256
+load8 (const uint16_t * const h, const precision_t precision)
+{
+    __m128i v = _mm_loadu_si128 ((const __m128i *) h);
+
+    if (precision == PRECISION_BF16)
+        return _mm256_castsi256_ps (
+                _mm256_slli_epi32 (_mm256_cvtepu16_epi32 (v), 16));
+
+    return _mm256_cvtph_ps (v);
+}
+
+static float
+hsum8 (const __m256 v)
+{
+    __m128 sum = _mm_add_ps (_mm256_castps256_ps128 (v),
+                             _mm256_extractf128_ps (v, 1));
+    sum = _mm_add_ps (sum, _mm_movehl_ps (sum, sum));
+    return _mm_cvtss_f32 (_mm_add_ss (sum, _mm_movehdup_ps (sum)));
+}
+#endif
+
+/*
+ * a = sigmoid(w * x + b) for a dense layer, the products in float from
+ * the 16 bit weights. zs is stored unless NULL.
+ */
+void
+half_dense_forward (half_matrix_array_t * const w,
+                    const uint32_t layer,
+                    const gsl_vector * const x,
+                    const gsl_vector * const b,
+                    gsl_vector * const zs,
+                    gsl_vector * const a,
+                    const activation_mode_t mode)
+{
+    const half_matrix_t * m = &w->data[layer];
+    const size_t n = m->size2;
+    float * xf = w->scratch;
+
+    for (size_t j = 0; j < n; ++j) {
+        xf[j] = x->data[j * x->stride];
+    }
+
+    for (size_t i = 0; i < m->size1; ++i) {
+        const uint16_t * row = m->data + i * n;
+        size_t j = 0;
+        float sum = 0.0f;
+
+#ifdef HALF_AVX2
+        __m256 s0 = _mm256_setzero_ps ();
+        __m256 s1 = _mm256_setzero_ps ();
+        for (; j + 16 <= n; j += 16) {
+            s0 = _mm256_fmadd_ps (load8 (row + j, w->precision),
+                                  _mm256_loadu_ps (xf + j), s0);
+            s1 = _mm256_fmadd_ps (load8 (row + j + 8, w->precision),
+                                  _mm256_loadu_ps (xf + j + 8), s1);
+        }
+        sum = hsum8 (_mm256_add_ps (s0, s1));
+#endif
+
+        for (; j < n; ++j) {
+            sum += half_to_float (row[j], w->precision) * xf[j];
+        }
+
+        a->data[i * a->stride] = sum + b->data[i * b->stride];
+    }
+
+    if (zs)
+        gsl_vector_memcpy (zs, a);
+
+    // Contiguous, as the network's outputs are
+    kernel_sigmoid (a->data, a->data, a->size, mode);
+}
+
+/*
+ * y = w^T x, accumulated in float a row of w at a time
+ */
+void
+half_gemv_t (half_matrix_array_t * const w,
+             const uint32_t layer,
+             const gsl_vector * const x,
+             gsl_vector * const y)
+{
+    const half_matrix_t * m = &w->data[layer];
+    const size_t n = m->size2;
+    float * yf = w->scratch;
+
+    memset (yf, 0, n * sizeof(float));
+
+    for (size_t i = 0; i < m->size1; ++i) {
+        const uint16_t * row = m->data + i * n;
+        const float xi = x->data[i * x->stride];
+        size_t j = 0;
+
+#ifdef HALF_AVX2
+        const __m256 xv = _mm256_set1_ps (xi);
+        for (; j + 8 <= n; j += 8) {
+            _mm256_storeu_ps (yf + j, _mm256_fmadd_ps (
+                    load8 (row + j, w->precision), xv,
+                    _mm256_loadu_ps (yf + j)));
+        }
+#endif
+
+        for (; j < n; ++j) {
+            yf[j] += half_to_float (row[j], w->precision) * xi;
+        }
+    }
+
+    for (size_t j = 0; j < n; ++j) {
+        y->data[j * y->stride] = yf[j];
+    }
+}
+
+/*
+ * mat -= scale * delta on the master weights, rounding the result into
+ * the working copy on the same pass
+ */
+void
+half_matrix_update (gsl_matrix * const mat,
+                    const gsl_matrix * const delta,
+                    const double scale,
+                    half_matrix_array_t * const w,
+                    const uint32_t layer)
+{
+    uint16_t * h = w->data[layer].data;
+
+    for (size_t i = 0; i < mat->size1; ++i) {
+        double * row = mat->data + i * mat->tda;
+        const double * d = delta->data + i * delta->tda;
+        uint16_t * hrow = h + i * mat->size2;
+
+        for (size_t j = 0; j < mat->size2; ++j) {
+            row[j] -= scale * d[j];
+            hrow[j] = half_from_double (row[j], w->precision);
+        }
+    }
+}
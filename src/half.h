@@ -0,0 +1,107 @@
+/*
+ *   half.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALF_H_
+#define HALF_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "math_utils.h"
+
+#include <stdint.h>
+#include <gsl/gsl_matrix.h>
+
+typedef enum
+{
+    PRECISION_DOUBLE,
+    PRECISION_BF16, // 8 bit exponent, 7 bit mantissa
+    PRECISION_FP16 // IEEE half, 5 bit exponent, 10 bit mantissa
+} precision_t;
+
+// Row major, size1 x size2
+typedef struct
+{
+    uint32_t size1;
+    uint32_t size2;
+    uint16_t * data;
+} half_matrix_t;
+
+/*
+ * 16 bit working copies of the dense weights. The products read these and
+ * accumulate in float, the doubles stay the master copy. They also write
+ * the scratch, so one thread at a time per array.
+ */
+typedef struct
+{
+    uint32_t size;
+    precision_t precision;
+    half_matrix_t * data;
+    float * scratch; // The widest layer, for the input or output in float
+} half_matrix_array_t;
+
+uint16_t
+half_from_double (const double x, const precision_t precision);
+
+double
+half_to_double (const uint16_t h, const precision_t precision);
+
+err_t
+half_matrix_array_allocate (half_matrix_array_t * const array,
+                            const uint32_array_t * const dimensions,
+                            const precision_t precision);
+
+void
+half_matrix_array_free (half_matrix_array_t * const array);
+
+void
+half_matrix_array_memcpy (half_matrix_array_t * const dest,
+                          const matrix_array_t * const src);
+
+void
+half_dense_forward (half_matrix_array_t * const w,
+                    const uint32_t layer,
+                    const gsl_vector * const x,
+                    const gsl_vector * const b,
+                    gsl_vector * const zs,
+                    gsl_vector * const a,
+                    const activation_mode_t mode);
+
+void
+half_gemv_t (half_matrix_array_t * const w,
+             const uint32_t layer,
+             const gsl_vector * const x,
+             gsl_vector * const y);
+
+void
+half_matrix_update (gsl_matrix * const mat,
+                    const gsl_matrix * const delta,
+                    const double scale,
+                    half_matrix_array_t * const w,
+                    const uint32_t layer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HALF_H_ */
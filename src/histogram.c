@@ -0,0 +1,119 @@
+/*
+ *   histogram.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram.h"
+
+#include <string.h>
+
+static uint32_t
+histogram_index (const uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    uint32_t msb = 63 - __builtin_clzll (value);
+    uint32_t shift = msb - HISTOGRAM_SUB_BITS;
+    uint32_t sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// The largest value that falls in bucket i
+static uint64_t
+histogram_bucket_max (const uint32_t i)
+{
+    if (i < HISTOGRAM_SUB_BUCKETS)
+        return i;
+
+    uint32_t shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = i % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void
+histogram_reset (histogram_t * const h)
+{
+    memset (h, 0, sizeof(*h));
+}
+
+void
+histogram_record (histogram_t * const h, const uint64_t value)
+{
+    h->buckets[histogram_index (value)]++;
+    h->count++;
+    h->sum += value;
+    h->max = value > h->max ? value : h->max;
+}
+
+void
+histogram_merge (histogram_t * const dest, const histogram_t * const src)
+{
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        dest->buckets[i] += src->buckets[i];
+    }
+
+    dest->count += src->count;
+    dest->sum += src->sum;
+    dest->max = src->max > dest->max ? src->max : dest->max;
+}
+
+/*
+ * The upper end of the bucket holding the p'th percentile, 0 <= p <= 100,
+ * never more than the largest value seen. 0 when empty.
+ */
+uint64_t
+histogram_percentile (const histogram_t * const h, const double p)
+{
+    uint64_t rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+    uint64_t seen = 0;
+
+    rank = rank < 1 ? 1 : rank;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS && h->count; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_max (i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+double
+histogram_mean (const histogram_t * const h)
+{
+    return h->count ? (double) h->sum / h->count : 0.0;
+}
+
+/*
+ * One line of count, mean and percentiles, each value divided by scale
+ */
+void
+histogram_print (const histogram_t * const h, const char * name,
+                 const double scale, FILE * const fp)
+{
+    fprintf (fp, "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+             (unsigned long long) h->count, histogram_mean (h) / scale,
+             histogram_percentile (h, 50.0) / scale,
+             histogram_percentile (h, 99.0) / scale,
+             histogram_percentile (h, 99.9) / scale, h->max / scale);
+}
@@ -0,0 +1,72 @@
+/*
+ *   histogram.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Counts of non-negative integers, eg. latencies in ns, exact below
+ * 2^HISTOGRAM_SUB_BITS and then in 2^HISTOGRAM_SUB_BITS buckets per power
+ * of two, so a percentile is within 1 / 2^HISTOGRAM_SUB_BITS of the truth.
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void
+histogram_reset (histogram_t * const histogram);
+
+void
+histogram_record (histogram_t * const histogram, const uint64_t value);
+
+void
+histogram_merge (histogram_t * const dest, const histogram_t * const src);
+
+uint64_t
+histogram_percentile (const histogram_t * const histogram, const double p);
+
+double
+histogram_mean (const histogram_t * const histogram);
+
+void
+histogram_print (const histogram_t * const histogram, const char * name,
+                 const double scale, FILE * const fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTOGRAM_H_ */
@@ -0,0 +1,279 @@
+/*
+ *   idx.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For fstat under -std=c99
+#define _GNU_SOURCE
+
+#include "idx.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint32_t
+idx_be32 (const uint8_t * const buf)
+{
+    return (uint32_t) buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+static uint32_t
+idx_element_size (const uint8_t type)
+{
+    switch (type) {
+        case IDX_U8:
+        case IDX_I8:
+            return 1;
+        case IDX_I16:
+            return 2;
+        case IDX_I32:
+        case IDX_F32:
+            return 4;
+        case IDX_F64:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Read all of bytes, gzread taking at most an unsigned int at a time
+ */
+err_t
+idx_read_bytes (gzFile fp, void * const buf, const size_t bytes)
+{
+    uint8_t * at = buf;
+    size_t left = bytes;
+
+    while (left) {
+        unsigned int n = left < (1u << 30) ? left : (1u << 30);
+        int got = gzread (fp, at, n);
+        if (got < 0)
+            return GSL_EFAILED;
+        if ((unsigned int) got != n)
+            return GSL_EOF;
+        at += n;
+        left -= n;
+    }
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+idx_read_header (idx_t * const idx)
+{
+    uint8_t buf[4 * IDX_MAX_DIMS];
+
+    // Too short for a header isn't an IDX file
+    err_t err = idx_read_bytes (idx->fp, buf, 4);
+    err = err == GSL_EOF ? GSL_EINVAL : err;
+    RETURN_ON_ERR(err);
+
+    idx->type = buf[2];
+    idx->dims = buf[3];
+    idx->element_size = idx_element_size (buf[2]);
+    if (buf[0] || buf[1] || !idx->element_size)
+        return GSL_EINVAL;
+
+    err = idx_read_bytes (idx->fp, buf, 4 * idx->dims);
+    err = err == GSL_EOF ? GSL_EINVAL : err;
+    RETURN_ON_ERR(err);
+
+    idx->header_bytes = 4 + 4 * idx->dims;
+    idx->elements = 1;
+    for (uint32_t d = 0; d < idx->dims; ++d) {
+        idx->size[d] = idx_be32 (&buf[4 * d]);
+        if (idx->size[d] && idx->elements > UINT64_MAX / idx->size[d])
+            return GSL_EOVRFLW;
+        idx->elements *= idx->size[d];
+    }
+
+    if (idx->elements > (SIZE_MAX - idx->header_bytes) / idx->element_size)
+        return GSL_EOVRFLW;
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Open file and check its header, and its length if it isn't gzipped
+ */
+err_t
+idx_open (idx_t * const idx, const char * file)
+{
+    struct stat st;
+
+    memset (idx, 0, sizeof(*idx));
+
+    int fd = open (file, O_RDONLY);
+    if (fd < 0)
+        return GSL_EFAILED;
+    if (fstat (fd, &st) || !(idx->fp = gzdopen (fd, "rb"))) {
+        close (fd);
+        return GSL_EFAILED;
+    }
+
+    err_t err = idx_read_header (idx);
+    if (!err && gzdirect (idx->fp)) {
+        uint64_t bytes = idx->header_bytes
+                + idx->elements * idx->element_size;
+        if ((uint64_t) st.st_size < bytes)
+            err = GSL_EOF;
+        else if ((uint64_t) st.st_size > bytes)
+            err = GSL_EBADLEN;
+    }
+
+    if (err)
+        idx_close (idx);
+
+    return err;
+}
+
+/*
+ * Check the file holds what the caller reads from it
+ */
+err_t
+idx_expect (const idx_t * const idx, const idx_type_t type,
+            const uint32_t dims)
+{
+    return idx->type == type && idx->dims == dims ? GSL_SUCCESS : GSL_EINVAL;
+}
+
+/*
+ * Read the next elements in one go, in the host's byte order
+ */
+err_t
+idx_read (idx_t * const idx, void * const buf, const uint64_t elements)
+{
+    if (elements > idx->elements - idx->read)
+        return GSL_EOF;
+
+    err_t err = idx_read_bytes (idx->fp, buf, elements * idx->element_size);
+    RETURN_ON_ERR(err);
+    idx->read += elements;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (idx->element_size == 2) {
+        uint16_t * e = buf;
+        for (uint64_t i = 0; i < elements; ++i) {
+            e[i] = __builtin_bswap16 (e[i]);
+        }
+    } else if (idx->element_size == 4) {
+        uint32_t * e = buf;
+        for (uint64_t i = 0; i < elements; ++i) {
+            e[i] = __builtin_bswap32 (e[i]);
+        }
+    } else if (idx->element_size == 8) {
+        uint64_t * e = buf;
+        for (uint64_t i = 0; i < elements; ++i) {
+            e[i] = __builtin_bswap64 (e[i]);
+        }
+    }
+#endif
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Once the elements are read, check nothing follows them
+ */
+err_t
+idx_read_end (idx_t * const idx)
+{
+    uint8_t extra;
+
+    int got = gzread (idx->fp, &extra, 1);
+    if (got < 0)
+        return GSL_EFAILED;
+
+    return got ? GSL_EBADLEN : GSL_SUCCESS;
+}
+
+void
+idx_close (idx_t * const idx)
+{
+    if (idx->fp)
+        gzclose (idx->fp);
+    idx->fp = NULL;
+}
+
+// What an error from these means for the file
+const char *
+idx_strerror (const err_t err)
+{
+    switch (err) {
+        case GSL_SUCCESS:
+            return "ok";
+        case GSL_EFAILED:
+            return "can't be opened or read";
+        case GSL_EINVAL:
+            return "not an IDX file of the type and shape expected";
+        case GSL_EOVRFLW:
+            return "sizes in the header overflow";
+        case GSL_EOF:
+            return "truncated, it ends before the elements in the header";
+        case GSL_EBADLEN:
+            return "longer than the elements in the header";
+        case GSL_ENOMEM:
+            return "out of memory";
+        default:
+            return gsl_strerror (err);
+    }
+}
+
+// Say what is wrong with file, if anything
+void
+idx_report (const char * file, const err_t err)
+{
+    if (err)
+        printf ("%s: %s\n", file, idx_strerror (err));
+}
+
+/*
+ * Widen elements as read by idx_read
+ */
+void
+idx_to_double (const idx_type_t type, const void * const src,
+               double * const dest, const size_t elements)
+{
+    for (size_t i = 0; i < elements; ++i) {
+        switch (type) {
+            case IDX_U8:
+                dest[i] = ((const uint8_t *) src)[i];
+                break;
+            case IDX_I8:
+                dest[i] = ((const int8_t *) src)[i];
+                break;
+            case IDX_I16:
+                dest[i] = ((const int16_t *) src)[i];
+                break;
+            case IDX_I32:
+                dest[i] = ((const int32_t *) src)[i];
+                break;
+            case IDX_F32:
+                dest[i] = ((const float *) src)[i];
+                break;
+            case IDX_F64:
+                dest[i] = ((const double *) src)[i];
+                break;
+        }
+    }
+}
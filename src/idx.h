@@ -0,0 +1,106 @@
+/*
+ *   idx.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IDX_H_
+#define IDX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+// The third byte of the magic number, big endian elements
+typedef enum
+{
+    IDX_U8 = 0x08,
+    IDX_I8 = 0x09,
+    IDX_I16 = 0x0b,
+    IDX_I32 = 0x0c,
+    IDX_F32 = 0x0d,
+    IDX_F64 = 0x0e
+} idx_type_t;
+
+// As many as the magic number's fourth byte can give
+#define IDX_MAX_DIMS 255
+
+/*
+ * An IDX file, raw or gzipped, open after its header.
+ *
+ * Errors are
+ *   GSL_EFAILED  it can't be opened or read
+ *   GSL_EINVAL   it isn't an IDX file, or not the type or shape expected
+ *   GSL_EOVRFLW  the sizes in the header overflow
+ *   GSL_EOF      it ends before the elements the header gives
+ *   GSL_EBADLEN  it goes on after them
+ * A raw file's length is checked when it is opened, a gzipped one's as
+ * it is read.
+ */
+typedef struct
+{
+    gzFile fp;
+    idx_type_t type;
+    uint32_t dims;
+    uint32_t size[IDX_MAX_DIMS];
+    uint32_t element_size; // Bytes
+    uint64_t elements; // All of them, the product of the sizes
+    uint64_t read; // So far
+    uint32_t header_bytes;
+} idx_t;
+
+err_t
+idx_open (idx_t * const idx, const char * file);
+
+err_t
+idx_expect (const idx_t * const idx, const idx_type_t type,
+            const uint32_t dims);
+
+err_t
+idx_read (idx_t * const idx, void * const buf, const uint64_t elements);
+
+err_t
+idx_read_end (idx_t * const idx);
+
+void
+idx_close (idx_t * const idx);
+
+const char *
+idx_strerror (const err_t err);
+
+void
+idx_report (const char * file, const err_t err);
+
+void
+idx_to_double (const idx_type_t type, const void * const src,
+               double * const dest, const size_t elements);
+
+err_t
+idx_read_bytes (gzFile fp, void * const buf, const size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IDX_H_ */
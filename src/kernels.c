@@ -0,0 +1,583 @@
+/*
+ *   kernels.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernels.h"
+#include "nnet.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define KERNEL_AVX2
+#include <immintrin.h>
+#endif
+
+const char *
+kernel_isa (void)
+{
+#ifdef KERNEL_AVX2
+    return "avx2+fma";
+#else
+    return "portable";
+#endif
+}
+
+static size_t
+min_size (const size_t a, const size_t b)
+{
+    return a < b ? a : b;
+}
+
+// y = beta * y, without reading y when beta is 0 as it may be garbage
+static void
+scale (double * const y, const size_t n, const size_t stride,
+       const double beta)
+{
+    if (beta == 1.0)
+        return;
+
+    for (size_t i = 0; i < n; ++i) {
+        y[i * stride] = beta == 0.0 ? 0.0 : beta * y[i * stride];
+    }
+}
+
+#ifdef KERNEL_AVX2
+static double
+hsum (const __m256d v)
+{
+    __m128d sum = _mm_add_pd (_mm256_castpd256_pd128 (v),
+                              _mm256_extractf128_pd (v, 1));
+    return _mm_cvtsd_f64 (_mm_add_sd (sum, _mm_unpackhi_pd (sum, sum)));
+}
+#endif
+
+/*
+ * Dot four consecutive rows of a with x. x is loaded once per four rows.
+ */
+static void
+dot4 (const double * const a, const size_t lda, const double * const x,
+      const size_t n, double * const dots)
+{
+    const double * a0 = a;
+    const double * a1 = a + lda;
+    const double * a2 = a + 2 * lda;
+    const double * a3 = a + 3 * lda;
+    size_t j = 0;
+
+#ifdef KERNEL_AVX2
+    __m256d s0 = _mm256_setzero_pd ();
+    __m256d s1 = _mm256_setzero_pd ();
+    __m256d s2 = _mm256_setzero_pd ();
+    __m256d s3 = _mm256_setzero_pd ();
+
+    for (; j + 4 <= n; j += 4) {
+        __m256d xv = _mm256_loadu_pd (x + j);
+        s0 = _mm256_fmadd_pd (_mm256_loadu_pd (a0 + j), xv, s0);
+        s1 = _mm256_fmadd_pd (_mm256_loadu_pd (a1 + j), xv, s1);
+        s2 = _mm256_fmadd_pd (_mm256_loadu_pd (a2 + j), xv, s2);
+        s3 = _mm256_fmadd_pd (_mm256_loadu_pd (a3 + j), xv, s3);
+    }
+
+    dots[0] = hsum (s0);
+    dots[1] = hsum (s1);
+    dots[2] = hsum (s2);
+    dots[3] = hsum (s3);
+#else
+    dots[0] = dots[1] = dots[2] = dots[3] = 0.0;
+#endif
+
+    for (; j < n; ++j) {
+        dots[0] += a0[j] * x[j];
+        dots[1] += a1[j] * x[j];
+        dots[2] += a2[j] * x[j];
+        dots[3] += a3[j] * x[j];
+    }
+}
+
+/*
+ * y += c[k] * a[k] over four consecutive rows of a, so y is loaded and
+ * stored once per four rows.
+ */
+static void
+axpy4 (const double * const a, const size_t lda, const double * const c,
+       const size_t n, double * const y)
+{
+    const double * a0 = a;
+    const double * a1 = a + lda;
+    const double * a2 = a + 2 * lda;
+    const double * a3 = a + 3 * lda;
+    size_t j = 0;
+
+#ifdef KERNEL_AVX2
+    __m256d c0 = _mm256_set1_pd (c[0]);
+    __m256d c1 = _mm256_set1_pd (c[1]);
+    __m256d c2 = _mm256_set1_pd (c[2]);
+    __m256d c3 = _mm256_set1_pd (c[3]);
+
+    for (; j + 4 <= n; j += 4) {
+        __m256d yv = _mm256_loadu_pd (y + j);
+        yv = _mm256_fmadd_pd (_mm256_loadu_pd (a0 + j), c0, yv);
+        yv = _mm256_fmadd_pd (_mm256_loadu_pd (a1 + j), c1, yv);
+        yv = _mm256_fmadd_pd (_mm256_loadu_pd (a2 + j), c2, yv);
+        yv = _mm256_fmadd_pd (_mm256_loadu_pd (a3 + j), c3, yv);
+        _mm256_storeu_pd (y + j, yv);
+    }
+#endif
+
+    for (; j < n; ++j) {
+        y[j] += a0[j] * c[0] + a1[j] * c[1] + a2[j] * c[2] + a3[j] * c[3];
+    }
+}
+
+/*
+ * y = alpha * op(a) * x + beta * y, as gsl_blas_dgemv. Vectors with a
+ * stride are passed on to the linked BLAS.
+ */
+err_t
+kernel_dgemv (const CBLAS_TRANSPOSE_t trans,
+              const double alpha,
+              const gsl_matrix * const a,
+              const gsl_vector * const x,
+              const double beta,
+              gsl_vector * const y)
+{
+    const size_t m = a->size1;
+    const size_t n = a->size2;
+    const size_t lda = a->tda;
+
+    if (x->stride != 1 || y->stride != 1)
+        return gsl_blas_dgemv (trans, alpha, a, x, beta, y);
+
+    if (trans == CblasNoTrans) {
+        if (x->size != n || y->size != m)
+            return GSL_EBADLEN;
+
+        double dots[4];
+        size_t i = 0;
+        for (; i + 4 <= m; i += 4) {
+            dot4 (a->data + i * lda, lda, x->data, n, dots);
+            for (size_t k = 0; k < 4; ++k) {
+                double old = beta == 0.0 ? 0.0 : beta * y->data[i + k];
+                y->data[i + k] = alpha * dots[k] + old;
+            }
+        }
+
+        for (; i < m; ++i) {
+            const double * row = a->data + i * lda;
+            double dot = 0.0;
+            for (size_t j = 0; j < n; ++j) {
+                dot += row[j] * x->data[j];
+            }
+            double old = beta == 0.0 ? 0.0 : beta * y->data[i];
+            y->data[i] = alpha * dot + old;
+        }
+
+        return GSL_SUCCESS;
+    }
+
+    if (x->size != m || y->size != n)
+        return GSL_EBADLEN;
+
+    scale (y->data, n, 1, beta);
+
+    double c[4];
+    size_t i = 0;
+    for (; i + 4 <= m; i += 4) {
+        for (size_t k = 0; k < 4; ++k) {
+            c[k] = alpha * x->data[i + k];
+        }
+        axpy4 (a->data + i * lda, lda, c, n, y->data);
+    }
+
+    for (; i < m; ++i) {
+        const double * row = a->data + i * lda;
+        double ci = alpha * x->data[i];
+        for (size_t j = 0; j < n; ++j) {
+            y->data[j] += row[j] * ci;
+        }
+    }
+
+    return GSL_SUCCESS;
+}
+
+#ifdef KERNEL_AVX2
+/*
+ * fast_exp on four lanes, with the same polynomial and so the same error.
+ * Adding 1.5 * 2^52 to n leaves it as an integer in the low mantissa bits,
+ * from where it is biased and shifted into the exponent to make 2^n.
+ */
+static __m256d
+fast_exp4 (__m256d x)
+{
+    const __m256d offset = _mm256_set1_pd (6755399441055744.0);
+
+    x = _mm256_min_pd (x, _mm256_set1_pd (FAST_EXP_MAX));
+    x = _mm256_max_pd (x, _mm256_set1_pd (-FAST_EXP_MAX));
+
+    __m256d n = _mm256_round_pd (_mm256_mul_pd (x,
+            _mm256_set1_pd (FAST_EXP_LOG2E)),
+            _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd (n, _mm256_set1_pd (FAST_EXP_LN2_HI), x);
+    r = _mm256_fnmadd_pd (n, _mm256_set1_pd (FAST_EXP_LN2_LO), r);
+
+    __m256d p = _mm256_set1_pd (1.0 / 720);
+    p = _mm256_fmadd_pd (p, r, _mm256_set1_pd (1.0 / 120));
+    p = _mm256_fmadd_pd (p, r, _mm256_set1_pd (1.0 / 24));
+    p = _mm256_fmadd_pd (p, r, _mm256_set1_pd (1.0 / 6));
+    p = _mm256_fmadd_pd (p, r, _mm256_set1_pd (1.0 / 2));
+    p = _mm256_fmadd_pd (p, r, _mm256_set1_pd (1.0));
+    p = _mm256_fmadd_pd (p, r, _mm256_set1_pd (1.0));
+
+    __m256i bits = _mm256_castpd_si256 (_mm256_add_pd (n, offset));
+    bits = _mm256_slli_epi64 (_mm256_add_epi64 (bits,
+            _mm256_set1_epi64x (1023)), 52);
+
+    return _mm256_mul_pd (p, _mm256_castsi256_pd (bits));
+}
+
+static __m256d
+sigmoid_fast4 (const __m256d z)
+{
+    const __m256d one = _mm256_set1_pd (1.0);
+    __m256d e = fast_exp4 (_mm256_sub_pd (_mm256_setzero_pd (), z));
+    return _mm256_div_pd (one, _mm256_add_pd (one, e));
+}
+#endif
+
+/*
+ * a = sigmoid(z) elementwise, a may be z. The fast mode runs four lanes at
+ * a time where AVX2 is available.
+ */
+void
+kernel_sigmoid (const double * const z,
+                double * const a,
+                const size_t n,
+                const activation_mode_t mode)
+{
+    size_t i = 0;
+
+    if (mode == ACTIVATION_EXACT) {
+        for (; i < n; ++i) {
+            a[i] = sigmoid (z[i]);
+        }
+        return;
+    }
+
+#ifdef KERNEL_AVX2
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd (a + i, sigmoid_fast4 (_mm256_loadu_pd (z + i)));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        a[i] = sigmoid_fast (z[i]);
+    }
+}
+
+/*
+ * z = w * x + b, a = sigmoid(z) for a whole dense layer in one sweep over
+ * the output. Each z goes straight from the GEMV accumulators through the
+ * bias and activation, and is stored in zs too unless zs is NULL.
+ *
+ * Without the native kernels the GEMV is left to the CBLAS and only the
+ * epilogue is fused.
+ */
+err_t
+kernel_dense_forward (const gsl_matrix * const w,
+                      const gsl_vector * const x,
+                      const gsl_vector * const b,
+                      gsl_vector * const zs,
+                      gsl_vector * const a,
+                      const activation_mode_t mode)
+{
+    const size_t m = w->size1;
+    const size_t n = w->size2;
+    const double * bias = b->data;
+    double * z_out = zs ? zs->data : NULL;
+    double * out = a->data;
+
+    if (x->size != n || b->size != m || a->size != m
+            || (zs && zs->size != m))
+        return GSL_EBADLEN;
+
+    if (x->stride != 1 || b->stride != 1 || a->stride != 1
+            || (zs && zs->stride != 1))
+        return GSL_EINVAL;
+
+#ifdef NNET_NATIVE_KERNELS
+    double z[4];
+    size_t i = 0;
+    for (; i + 4 <= m; i += 4) {
+        dot4 (w->data + i * w->tda, w->tda, x->data, n, z);
+        for (size_t k = 0; k < 4; ++k) {
+            z[k] += bias[i + k];
+            if (z_out)
+                z_out[i + k] = z[k];
+        }
+        kernel_sigmoid (z, out + i, 4, mode);
+    }
+
+    for (; i < m; ++i) {
+        const double * row = w->data + i * w->tda;
+        z[0] = bias[i];
+        for (size_t j = 0; j < n; ++j) {
+            z[0] += row[j] * x->data[j];
+        }
+        if (z_out)
+            z_out[i] = z[0];
+        kernel_sigmoid (z, out + i, 1, mode);
+    }
+#else
+    gsl_blas_dgemv (CblasNoTrans, 1.0, w, x, 0.0, a);
+
+    for (size_t i = 0; i < m; ++i) {
+        out[i] += bias[i];
+        if (z_out)
+            z_out[i] = out[i];
+    }
+    kernel_sigmoid (out, out, m, mode);
+#endif
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Copy an mc x kc block of op(a) into panels of KERNEL_MR rows, each
+ * stored column by column, scaled by alpha and padded with zeros.
+ */
+static void
+pack_a (const double * const a, const size_t lda, const uint8_t trans,
+        const size_t mc, const size_t kc, const double alpha,
+        double * const packed)
+{
+    double * dst = packed;
+
+    for (size_t i = 0; i < mc; i += KERNEL_MR) {
+        size_t rows = min_size (KERNEL_MR, mc - i);
+        for (size_t p = 0; p < kc; ++p) {
+            for (size_t r = 0; r < KERNEL_MR; ++r) {
+                double v = 0.0;
+                if (r < rows)
+                    v = trans ? a[p * lda + i + r] : a[(i + r) * lda + p];
+                *dst++ = alpha * v;
+            }
+        }
+    }
+}
+
+/*
+ * Copy a kc x nc block of op(b) into panels of KERNEL_NR columns, each
+ * stored row by row and padded with zeros.
+ */
+static void
+pack_b (const double * const b, const size_t ldb, const uint8_t trans,
+        const size_t kc, const size_t nc, double * const packed)
+{
+    double * dst = packed;
+
+    for (size_t j = 0; j < nc; j += KERNEL_NR) {
+        size_t cols = min_size (KERNEL_NR, nc - j);
+
+        // Rows of b are columns of op(b), read each once along its length
+        if (trans) {
+            for (size_t c = 0; c < KERNEL_NR; ++c) {
+                const double * src = b + (j + c) * ldb;
+                for (size_t p = 0; p < kc; ++p) {
+                    dst[p * KERNEL_NR + c] = c < cols ? src[p] : 0.0;
+                }
+            }
+            dst += kc * KERNEL_NR;
+            continue;
+        }
+
+        for (size_t p = 0; p < kc; ++p) {
+            for (size_t c = 0; c < KERNEL_NR; ++c) {
+                *dst++ = c < cols ? b[p * ldb + j + c] : 0.0;
+            }
+        }
+    }
+}
+
+/*
+ * Accumulate the product of an A panel and a B panel into a full
+ * KERNEL_MR x KERNEL_NR tile, held entirely in registers.
+ */
+static void
+micro_kernel (const size_t kc, const double * const ap,
+              const double * const bp, double * const c, const size_t ldc)
+{
+#ifdef KERNEL_AVX2
+    __m256d c00 = _mm256_setzero_pd (), c01 = _mm256_setzero_pd ();
+    __m256d c10 = _mm256_setzero_pd (), c11 = _mm256_setzero_pd ();
+    __m256d c20 = _mm256_setzero_pd (), c21 = _mm256_setzero_pd ();
+    __m256d c30 = _mm256_setzero_pd (), c31 = _mm256_setzero_pd ();
+
+    for (size_t p = 0; p < kc; ++p) {
+        const double * a = ap + p * KERNEL_MR;
+        __m256d b0 = _mm256_loadu_pd (bp + p * KERNEL_NR);
+        __m256d b1 = _mm256_loadu_pd (bp + p * KERNEL_NR + 4);
+        __m256d a0 = _mm256_broadcast_sd (a);
+        __m256d a1 = _mm256_broadcast_sd (a + 1);
+        __m256d a2 = _mm256_broadcast_sd (a + 2);
+        __m256d a3 = _mm256_broadcast_sd (a + 3);
+        c00 = _mm256_fmadd_pd (a0, b0, c00);
+        c01 = _mm256_fmadd_pd (a0, b1, c01);
+        c10 = _mm256_fmadd_pd (a1, b0, c10);
+        c11 = _mm256_fmadd_pd (a1, b1, c11);
+        c20 = _mm256_fmadd_pd (a2, b0, c20);
+        c21 = _mm256_fmadd_pd (a2, b1, c21);
+        c30 = _mm256_fmadd_pd (a3, b0, c30);
+        c31 = _mm256_fmadd_pd (a3, b1, c31);
+    }
+
+    __m256d acc[KERNEL_MR][2] = {
+            { c00, c01 }, { c10, c11 }, { c20, c21 }, { c30, c31 }
+    };
+    for (size_t r = 0; r < KERNEL_MR; ++r) {
+        double * row = c + r * ldc;
+        _mm256_storeu_pd (row, _mm256_add_pd (_mm256_loadu_pd (row),
+                                              acc[r][0]));
+        _mm256_storeu_pd (row + 4, _mm256_add_pd (_mm256_loadu_pd (row + 4),
+                                                  acc[r][1]));
+    }
+#else
+    double acc[KERNEL_MR][KERNEL_NR] = { { 0.0 } };
+
+    for (size_t p = 0; p < kc; ++p) {
+        for (size_t r = 0; r < KERNEL_MR; ++r) {
+            double a = ap[p * KERNEL_MR + r];
+            for (size_t j = 0; j < KERNEL_NR; ++j) {
+                acc[r][j] += a * bp[p * KERNEL_NR + j];
+            }
+        }
+    }
+
+    for (size_t r = 0; r < KERNEL_MR; ++r) {
+        for (size_t j = 0; j < KERNEL_NR; ++j) {
+            c[r * ldc + j] += acc[r][j];
+        }
+    }
+#endif
+}
+
+err_t
+kernel_gemm_buffers_allocate (kernel_gemm_buffers_t * const buffers)
+{
+    buffers->a = malloc (KERNEL_MC * KERNEL_KC * sizeof(double));
+    buffers->b = malloc (KERNEL_KC * KERNEL_NC * sizeof(double));
+    if (!buffers->a || !buffers->b) {
+        kernel_gemm_buffers_free (buffers);
+        return GSL_ENOMEM;
+    }
+
+    return GSL_SUCCESS;
+}
+
+void
+kernel_gemm_buffers_free (kernel_gemm_buffers_t * const buffers)
+{
+    free (buffers->a);
+    free (buffers->b);
+    buffers->a = NULL;
+    buffers->b = NULL;
+}
+
+/*
+ * C = alpha * op(a) * op(b) + beta * C, as gsl_blas_dgemm.
+ *
+ * Blocks of op(b) and op(a) are packed into the buffers so the
+ * microkernel streams through contiguous memory. Partial tiles at the
+ * edges go through a scratch tile.
+ */
+err_t
+kernel_dgemm (const CBLAS_TRANSPOSE_t trans_a,
+              const CBLAS_TRANSPOSE_t trans_b,
+              const double alpha,
+              const gsl_matrix * const a,
+              const gsl_matrix * const b,
+              const double beta,
+              gsl_matrix * const c,
+              kernel_gemm_buffers_t * const buffers)
+{
+    const uint8_t ta = trans_a != CblasNoTrans;
+    const uint8_t tb = trans_b != CblasNoTrans;
+    const size_t m = ta ? a->size2 : a->size1;
+    const size_t k = ta ? a->size1 : a->size2;
+    const size_t n = tb ? b->size1 : b->size2;
+
+    if ((tb ? b->size2 : b->size1) != k || c->size1 != m || c->size2 != n)
+        return GSL_EBADLEN;
+
+    for (size_t i = 0; i < m; ++i) {
+        scale (c->data + i * c->tda, n, 1, beta);
+    }
+
+    if (alpha == 0.0 || k == 0)
+        return GSL_SUCCESS;
+
+    double * a_packed = buffers->a;
+    double * b_packed = buffers->b;
+    double tile[KERNEL_MR * KERNEL_NR];
+
+    for (size_t jc = 0; jc < n; jc += KERNEL_NC) {
+        size_t nc = min_size (KERNEL_NC, n - jc);
+
+        for (size_t pc = 0; pc < k; pc += KERNEL_KC) {
+            size_t kc = min_size (KERNEL_KC, k - pc);
+            const double * b_block = tb ? b->data + jc * b->tda + pc :
+                    b->data + pc * b->tda + jc;
+            pack_b (b_block, b->tda, tb, kc, nc, b_packed);
+
+            for (size_t ic = 0; ic < m; ic += KERNEL_MC) {
+                size_t mc = min_size (KERNEL_MC, m - ic);
+                const double * a_block = ta ? a->data + pc * a->tda + ic :
+                        a->data + ic * a->tda + pc;
+                pack_a (a_block, a->tda, ta, mc, kc, alpha, a_packed);
+
+                for (size_t jr = 0; jr < nc; jr += KERNEL_NR) {
+                    size_t nr = min_size (KERNEL_NR, nc - jr);
+                    const double * bp = b_packed + jr * kc;
+
+                    for (size_t ir = 0; ir < mc; ir += KERNEL_MR) {
+                        size_t mr = min_size (KERNEL_MR, mc - ir);
+                        const double * ap = a_packed + ir * kc;
+                        double * cp = c->data + (ic + ir) * c->tda + jc + jr;
+
+                        if (mr == KERNEL_MR && nr == KERNEL_NR) {
+                            micro_kernel (kc, ap, bp, cp, c->tda);
+                            continue;
+                        }
+
+                        memset (tile, 0, sizeof(tile));
+                        micro_kernel (kc, ap, bp, tile, KERNEL_NR);
+                        for (size_t r = 0; r < mr; ++r) {
+                            for (size_t j = 0; j < nr; ++j) {
+                                cp[r * c->tda + j] += tile[r * KERNEL_NR + j];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return GSL_SUCCESS;
+}
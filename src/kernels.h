@@ -0,0 +1,116 @@
+/*
+ *   kernels.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "math_utils.h"
+
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_matrix.h>
+
+/*
+ * Register tile of the GEMM microkernel, and the cache blocks: a KC deep
+ * sliver of B stays in L1, an MC x KC block of A in L2. MC and NC are
+ * whole tiles, so the padded blocks fit the packing buffers.
+ */
+#define KERNEL_MR 4
+#define KERNEL_NR 8
+#define KERNEL_KC 256
+#define KERNEL_MC 64
+#define KERNEL_NC 1024
+
+/*
+ * The dense and convolution layers call BLAS through these, so they run
+ * on the built in kernels unless NNET_NATIVE_KERNELS is turned off, when
+ * they go to whichever CBLAS GSL was linked against. nnet_dgemm takes the
+ * packing buffers as well, which CBLAS has no use for.
+ */
+#ifdef NNET_NATIVE_KERNELS
+#define nnet_dgemv kernel_dgemv
+#define nnet_dgemm kernel_dgemm
+#else
+#define nnet_dgemv gsl_blas_dgemv
+#define nnet_dgemm(trans_a, trans_b, alpha, a, b, beta, c, buffers) \
+        gsl_blas_dgemm (trans_a, trans_b, alpha, a, b, beta, c)
+#endif
+
+/*
+ * Packing space for kernel_dgemm, enough for any shape. Allocated once
+ * by whatever runs GEMMs in a loop, and used by one thread at a time.
+ */
+typedef struct
+{
+    double * a; // KERNEL_MC x KERNEL_KC
+    double * b; // KERNEL_KC x KERNEL_NC
+} kernel_gemm_buffers_t;
+
+const char *
+kernel_isa (void);
+
+err_t
+kernel_dgemv (const CBLAS_TRANSPOSE_t trans,
+              const double alpha,
+              const gsl_matrix * const a,
+              const gsl_vector * const x,
+              const double beta,
+              gsl_vector * const y);
+
+err_t
+kernel_gemm_buffers_allocate (kernel_gemm_buffers_t * const buffers);
+
+void
+kernel_gemm_buffers_free (kernel_gemm_buffers_t * const buffers);
+
+err_t
+kernel_dgemm (const CBLAS_TRANSPOSE_t trans_a,
+              const CBLAS_TRANSPOSE_t trans_b,
+              const double alpha,
+              const gsl_matrix * const a,
+              const gsl_matrix * const b,
+              const double beta,
+              gsl_matrix * const c,
+              kernel_gemm_buffers_t * const buffers);
+
+err_t
+kernel_dense_forward (const gsl_matrix * const w,
+                      const gsl_vector * const x,
+                      const gsl_vector * const b,
+                      gsl_vector * const zs,
+                      gsl_vector * const a,
+                      const activation_mode_t mode);
+
+void
+kernel_sigmoid (const double * const z,
+                double * const a,
+                const size_t n,
+                const activation_mode_t mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KERNELS_H_ */
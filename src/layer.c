@@ -0,0 +1,628 @@
+/*
+ *   layer.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "layer.h"
+#include "conv.h"
+#include "kernels.h"
+#include "math_utils.h"
+#include "nnet.h"
+
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_randist.h>
+#include <string.h>
+#include <assert.h>
+
+uint32_t
+shape_size (const shape_t * const shape)
+{
+    return shape->channels * shape->rows * shape->cols;
+}
+
+/*
+ * Allocate a rows x cols weight matrix and a bias per row, with their
+ * gradients, and describe them to the stack.
+ */
+err_t
+layer_allocate_params (layer_t * const layer,
+                       const uint32_t rows,
+                       const uint32_t cols,
+                       const layer_stack_mode_t mode)
+{
+    layer->weights = gsl_matrix_alloc (rows, cols);
+    layer->biases = gsl_vector_alloc (rows);
+    RETURN_ERR_ON_BAD_ALLOC(layer->weights);
+    RETURN_ERR_ON_BAD_ALLOC(layer->biases);
+
+    layer->params[0].value = layer->weights->data;
+    layer->params[0].grad = NULL;
+    layer->params[0].size = rows * cols;
+    layer->params[1].value = layer->biases->data;
+    layer->params[1].grad = NULL;
+    layer->params[1].size = rows;
+    layer->num_params = 2;
+
+    if (mode == LAYER_STACK_INFER)
+        return GSL_SUCCESS;
+
+    layer->nabla_w = gsl_matrix_alloc (rows, cols);
+    layer->nabla_b = gsl_vector_alloc (rows);
+    RETURN_ERR_ON_BAD_ALLOC(layer->nabla_w);
+    RETURN_ERR_ON_BAD_ALLOC(layer->nabla_b);
+
+    layer->params[0].grad = layer->nabla_w->data;
+    layer->params[1].grad = layer->nabla_b->data;
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+dense_allocate (layer_t * const layer, const layer_stack_mode_t mode)
+{
+    const uint32_t inputs = shape_size (&layer->in);
+
+    if (layer->size == 0)
+        return GSL_EBADLEN;
+
+    layer->out.channels = 1;
+    layer->out.rows = 1;
+    layer->out.cols = layer->size;
+
+    err_t err = layer_allocate_params (layer, layer->size, inputs, mode);
+    RETURN_ON_ERR(err);
+
+    // The 16 bit weights serve both passes, weights_t only the backward
+    if (layer->precision != PRECISION_DOUBLE) {
+        uint32_t nodes[] = { inputs, layer->size };
+        uint32_array_t dimensions = { 2, nodes };
+        return half_matrix_array_allocate (&layer->half, &dimensions,
+                                           layer->precision);
+    }
+
+    if (mode == LAYER_STACK_TRAIN && layer->transpose_weights) {
+        layer->weights_t = gsl_matrix_alloc (inputs, layer->size);
+        RETURN_ERR_ON_BAD_ALLOC(layer->weights_t);
+    }
+
+    return GSL_SUCCESS;
+}
+
+static void
+dense_forward (layer_t * const layer,
+               const gsl_vector * const input,
+               const uint8_t train)
+{
+    // a = sigma(w * x + b)
+    if (layer->half.size) {
+        half_dense_forward (&layer->half, 0, input, layer->biases, NULL,
+                            layer->output, layer->activation);
+        return;
+    }
+
+    err_t err = kernel_dense_forward (layer->weights, input, layer->biases,
+                                      NULL, layer->output, layer->activation);
+    assert(err == GSL_SUCCESS);
+}
+
+/*
+ * The output_delta is scaled in place by sigmoid'(z), taken from the
+ * output, and w^T delta is read from the working copy when there is one.
+ */
+static void
+dense_backward (layer_t * const layer,
+                const gsl_vector * const input,
+                gsl_vector * const input_delta)
+{
+    gsl_vector * delta = layer->output_delta;
+
+    vector_mul_sigmoid_prime (delta, layer->output);
+
+    gsl_blas_daxpy (1.0, delta, layer->nabla_b);
+    gsl_blas_dger (1.0, delta, input, layer->nabla_w);
+
+    if (!input_delta)
+        return;
+
+    err_t err = GSL_SUCCESS;
+    if (layer->half.size)
+        half_gemv_t (&layer->half, 0, delta, input_delta);
+    else if (layer->weights_t)
+        err = nnet_dgemv (CblasNoTrans, 1.0, layer->weights_t, delta, 0.0,
+                          input_delta);
+    else
+        err = nnet_dgemv (CblasTrans, 1.0, layer->weights, delta, 0.0,
+                          input_delta);
+    assert(err == GSL_SUCCESS);
+}
+
+const layer_ops_t dense_ops = {
+        .allocate = &dense_allocate,
+        .forward = &dense_forward,
+        .backward = &dense_backward,
+        .backward_uses_input = 1,
+        .backward_uses_output = 1
+};
+
+static err_t
+sigmoid_allocate (layer_t * const layer, const layer_stack_mode_t mode)
+{
+    layer->out = layer->in;
+
+    return GSL_SUCCESS;
+}
+
+static void
+sigmoid_forward (layer_t * const layer,
+                 const gsl_vector * const input,
+                 const uint8_t train)
+{
+    kernel_sigmoid (input->data, layer->output->data, input->size,
+                    layer->activation);
+}
+
+/*
+ * The input has usually been overwritten, but sigma'(z) = a(1 - a)
+ */
+static void
+sigmoid_backward (layer_t * const layer,
+                  const gsl_vector * const input,
+                  gsl_vector * const input_delta)
+{
+    if (!input_delta)
+        return;
+
+    if (input_delta->data != layer->output_delta->data)
+        gsl_vector_memcpy (input_delta, layer->output_delta);
+
+    vector_mul_sigmoid_prime (input_delta, layer->output);
+}
+
+const layer_ops_t sigmoid_ops = {
+        .allocate = &sigmoid_allocate,
+        .forward = &sigmoid_forward,
+        .backward = &sigmoid_backward,
+        .in_place = 1,
+        .backward_uses_output = 1
+};
+
+static err_t
+dropout_allocate (layer_t * const layer, const layer_stack_mode_t mode)
+{
+    layer->out = layer->in;
+
+    if (mode == LAYER_STACK_INFER)
+        return GSL_SUCCESS;
+
+    layer->mask = gsl_vector_alloc (shape_size (&layer->in));
+    RETURN_ERR_ON_BAD_ALLOC(layer->mask);
+    gsl_vector_set_all (layer->mask, 1.0);
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Scale by the mask when training, which the owner draws afresh for each
+ * sample, else pass the input through
+ */
+static void
+dropout_forward (layer_t * const layer,
+                 const gsl_vector * const input,
+                 const uint8_t train)
+{
+    const double * in = input->data;
+    double * out = layer->output->data;
+
+    if (train) {
+        for (size_t i = 0; i < input->size; ++i) {
+            out[i] = in[i] * layer->mask->data[i];
+        }
+    } else if (out != in) {
+        memcpy (out, in, input->size * sizeof(double));
+    }
+}
+
+// Dropped nodes did not contribute
+static void
+dropout_backward (layer_t * const layer,
+                  const gsl_vector * const input,
+                  gsl_vector * const input_delta)
+{
+    const double * delta = layer->output_delta->data;
+
+    for (size_t i = 0; input_delta && i < input_delta->size; ++i) {
+        input_delta->data[i] = delta[i] * layer->mask->data[i];
+    }
+}
+
+const layer_ops_t dropout_ops = {
+        .allocate = &dropout_allocate,
+        .forward = &dropout_forward,
+        .backward = &dropout_backward,
+        .in_place = 1
+};
+
+static const layer_ops_t *
+layer_default_ops (const layer_type_t type)
+{
+    switch (type) {
+        case LAYER_DENSE:
+            return &dense_ops;
+        case LAYER_CONV2D:
+            return &conv2d_ops;
+        case LAYER_MAX_POOL:
+            return &max_pool_ops;
+        case LAYER_FLATTEN:
+            return &flatten_ops;
+        case LAYER_SIGMOID:
+            return &sigmoid_ops;
+        case LAYER_DROPOUT:
+            return &dropout_ops;
+        default:
+            return NULL;
+    }
+}
+
+static void
+layer_clear (layer_t * const layer)
+{
+    layer->num_params = 0;
+    layer->weights = layer->nabla_w = layer->cols = NULL;
+    layer->biases = layer->nabla_b = layer->mask = NULL;
+    layer->weights_t = NULL;
+    layer->half.size = 0;
+    layer->half.data = NULL;
+    layer->half.scratch = NULL;
+    layer->output = layer->output_delta = NULL;
+    layer->argmax = NULL;
+    layer->gemm.a = layer->gemm.b = NULL;
+}
+
+static void
+layer_free (layer_t * const layer)
+{
+    if (layer->ops && layer->ops->free)
+        layer->ops->free (layer);
+
+    if (layer->weights)
+        gsl_matrix_free (layer->weights);
+    if (layer->nabla_w)
+        gsl_matrix_free (layer->nabla_w);
+    if (layer->cols)
+        gsl_matrix_free (layer->cols);
+    if (layer->biases)
+        gsl_vector_free (layer->biases);
+    if (layer->nabla_b)
+        gsl_vector_free (layer->nabla_b);
+    if (layer->weights_t)
+        gsl_matrix_free (layer->weights_t);
+    if (layer->mask)
+        gsl_vector_free (layer->mask);
+    half_matrix_array_free (&layer->half);
+    free (layer->argmax);
+    kernel_gemm_buffers_free (&layer->gemm);
+
+    layer_clear (layer);
+}
+
+static uint32_t
+max_u32 (const uint32_t a, const uint32_t b)
+{
+    return a > b ? a : b;
+}
+
+/*
+ * Request a buffer for each layer output, and in training for each delta,
+ * with the lifetime it needs, then let the planner share storage between
+ * buffers which are never live together.
+ *
+ * Forward passes are steps 0 to n - 1 and backward passes n to 2n - 1, with
+ * the backward pass of layer i at step 2n - 1 - i. An output is live until
+ * the next layer has read it, unless a backward pass needs it later.
+ * A delta is written by the backward pass of the layer above and read by
+ * its own.
+ *
+ * Layers which alias their input share its buffer, and in place layers do
+ * too when nothing else needs the input after the forward pass. Their
+ * deltas are shared in the same way.
+ */
+static err_t
+layer_stack_plan (layer_stack_t * const stack)
+{
+    const uint32_t n = stack->size;
+    const uint32_t end = 2 * n;
+    const uint8_t train = stack->mode == LAYER_STACK_TRAIN;
+    memory_plan_t * plan = &stack->plan;
+    int32_t outputs[n];
+    int32_t deltas[n];
+
+    err_t err = memory_plan_allocate (plan, 2 * n);
+    RETURN_ON_ERR(err);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        const layer_t * layer = &stack->data[i];
+        const layer_ops_t * ops = layer->ops;
+        int32_t input = i ? outputs[i - 1] : PLAN_NO_ALIAS;
+
+        uint32_t last = i + 1 < n ? i + 1 : end;
+        if (train && ops->backward_uses_output)
+            last = max_u32 (last, end - 1 - i);
+        if (train && i + 1 < n && stack->data[i + 1].ops->backward_uses_input)
+            last = max_u32 (last, end - 2 - i);
+
+        // The stack input belongs to the caller
+        outputs[i] = PLAN_NO_ALIAS;
+        if (ops->aliases_input && input == PLAN_NO_ALIAS)
+            continue;
+
+        outputs[i] = memory_plan_add (plan, shape_size (&layer->out), i, last);
+
+        if (input == PLAN_NO_ALIAS)
+            continue;
+        if (ops->aliases_input
+                || (ops->in_place && memory_plan_last_use (plan, input) <= i))
+            memory_plan_alias (plan, outputs[i], input);
+    }
+
+    for (int32_t i = n - 1; train && i >= 0; --i) {
+        const layer_t * layer = &stack->data[i];
+        uint32_t first = i + 1 < n ? end - 2 - i : n - 1;
+
+        deltas[i] = memory_plan_add (plan, shape_size (&layer->out), first,
+                                     end - 1 - i);
+
+        if (i + 1 < n && (stack->data[i + 1].ops->aliases_input
+                || stack->data[i + 1].ops->in_place))
+            memory_plan_alias (plan, deltas[i], deltas[i + 1]);
+    }
+
+    err = memory_plan_build (plan);
+    RETURN_ON_ERR(err);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        layer_t * layer = &stack->data[i];
+        uint32_t size = shape_size (&layer->out);
+
+        if (outputs[i] != PLAN_NO_ALIAS) {
+            layer->output_view = gsl_vector_view_array (
+                    memory_plan_data (plan, outputs[i]), size);
+            layer->output = &layer->output_view.vector;
+        }
+
+        if (train) {
+            layer->output_delta_view = gsl_vector_view_array (
+                    memory_plan_data (plan, deltas[i]), size);
+            layer->output_delta = &layer->output_delta_view.vector;
+        }
+    }
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Work out the shape of each layer from the input shape, allocate each
+ * layer and plan the buffers between them.
+ */
+err_t
+layer_stack_allocate (layer_stack_t * const stack,
+                      const layer_stack_mode_t mode)
+{
+    shape_t shape = stack->input_shape;
+
+    stack->mode = mode;
+    stack->plan.size = 0;
+    stack->plan.num_slots = 0;
+    stack->plan.data = NULL;
+    stack->plan.slots = NULL;
+
+    for (uint32_t i = 0; i < stack->size; ++i) {
+        layer_t * layer = &stack->data[i];
+
+        layer_clear (layer);
+        layer->in = shape;
+        layer->activation = stack->activation;
+        layer->precision = stack->precision;
+        layer->transpose_weights = stack->transpose_weights;
+
+        if (!layer->ops)
+            layer->ops = layer_default_ops (layer->type);
+        if (!layer->ops)
+            return GSL_EINVAL;
+
+        err_t err = layer->ops->allocate (layer, mode);
+        RETURN_ON_ERR(err);
+
+        if (shape_size (&layer->out) == 0)
+            return GSL_EBADLEN;
+
+        shape = layer->out;
+    }
+
+    return layer_stack_plan (stack);
+}
+
+void
+layer_stack_free (layer_stack_t * const stack)
+{
+    for (uint32_t i = 0; i < stack->size; ++i) {
+        layer_free (&stack->data[i]);
+    }
+
+    memory_plan_free (&stack->plan);
+}
+
+/*
+ * Bytes held by the parameters, any working copies of the weights and,
+ * when training, their gradients
+ */
+size_t
+layer_stack_param_bytes (const layer_stack_t * const stack)
+{
+    size_t bytes = 0;
+
+    for (uint32_t i = 0; i < stack->size; ++i) {
+        const layer_t * layer = &stack->data[i];
+        for (uint32_t p = 0; p < layer->num_params; ++p) {
+            size_t copies = layer->params[p].grad ? 2 : 1;
+            bytes += copies * layer->params[p].size * sizeof(double);
+        }
+        if (layer->weights_t)
+            bytes += layer->params[0].size * sizeof(double);
+        if (layer->half.size)
+            bytes += layer->params[0].size * sizeof(uint16_t);
+    }
+
+    return bytes;
+}
+
+uint32_t
+layer_stack_output_size (const layer_stack_t * const stack)
+{
+    assert(stack->size != 0);
+    return shape_size (&stack->data[stack->size - 1].out);
+}
+
+gsl_vector *
+layer_stack_output (const layer_stack_t * const stack)
+{
+    assert(stack->size != 0);
+    return stack->data[stack->size - 1].output;
+}
+
+gsl_vector *
+layer_stack_output_delta (const layer_stack_t * const stack)
+{
+    assert(stack->size != 0);
+    return stack->data[stack->size - 1].output_delta;
+}
+
+void
+layer_stack_set_rand (layer_stack_t * const stack,
+                      const gsl_rng * const rng,
+                      double var)
+{
+    for (uint32_t i = 0; i < stack->size; ++i) {
+        layer_t * layer = &stack->data[i];
+        for (uint32_t p = 0; p < layer->num_params; ++p) {
+            for (size_t j = 0; j < layer->params[p].size; ++j) {
+                layer->params[p].value[j] = gsl_ran_gaussian (rng, var);
+            }
+        }
+    }
+}
+
+void
+layer_stack_zero_gradients (layer_stack_t * const stack)
+{
+    assert(stack->size == 0 || stack->mode == LAYER_STACK_TRAIN);
+
+    for (uint32_t i = 0; i < stack->size; ++i) {
+        layer_t * layer = &stack->data[i];
+        for (uint32_t p = 0; p < layer->num_params; ++p) {
+            memset (layer->params[p].grad, 0,
+                    layer->params[p].size * sizeof(double));
+        }
+    }
+}
+
+/*
+ * A step of SGD on every parameter. Layers with a working copy of their
+ * weights, params[0], write it on the same pass over them.
+ */
+void
+layer_stack_update (layer_stack_t * const stack, const double scale_fac)
+{
+    for (uint32_t i = 0; i < stack->size; ++i) {
+        layer_t * layer = &stack->data[i];
+        uint32_t first = 1;
+
+        if (layer->half.size)
+            half_matrix_update (layer->weights, layer->nabla_w, scale_fac,
+                                &layer->half, 0);
+        else if (layer->weights_t)
+            matrix_update_transposed (layer->weights, layer->nabla_w,
+                                      scale_fac, layer->weights_t);
+        else
+            first = 0;
+
+        for (uint32_t p = first; p < layer->num_params; ++p) {
+            double * value = layer->params[p].value;
+            const double * grad = layer->params[p].grad;
+            for (size_t j = 0; j < layer->params[p].size; ++j) {
+                value[j] -= scale_fac * grad[j];
+            }
+        }
+    }
+}
+
+/*
+ * Bring the working copies of the weights up to date after the weights
+ * are set other than by training. A no-op without any.
+ */
+void
+layer_stack_refresh_copies (layer_stack_t * const stack)
+{
+    for (uint32_t i = 0; i < stack->size; ++i) {
+        layer_t * layer = &stack->data[i];
+        matrix_array_t weights = { 1, &layer->weights };
+
+        if (layer->weights_t)
+            gsl_matrix_transpose_memcpy (layer->weights_t, layer->weights);
+        half_matrix_array_memcpy (&layer->half, &weights);
+    }
+}
+
+/*
+ * Run the input held by the stack through each layer in turn
+ */
+void
+layer_stack_feed_forward (const layer_stack_t * const stack,
+                          const uint8_t train)
+{
+    const gsl_vector * input = stack->input;
+
+    assert(!train || stack->mode == LAYER_STACK_TRAIN);
+
+    for (uint32_t i = 0; i < stack->size; ++i) {
+        layer_t * layer = &stack->data[i];
+        layer->ops->forward (layer, input, train);
+        input = layer->output;
+    }
+}
+
+/*
+ * Propagate the error held in the final output_delta back through the
+ * layers, accumulating the parameter gradients. Requires a feed forward
+ * with train set.
+ */
+void
+layer_stack_backpropagate (const layer_stack_t * const stack)
+{
+    assert(stack->mode == LAYER_STACK_TRAIN);
+
+    for (int32_t i = stack->size - 1; i >= 0; --i) {
+        layer_t * layer = &stack->data[i];
+        const gsl_vector * input = i ? stack->data[i - 1].output :
+                stack->input;
+        gsl_vector * input_delta = i ? stack->data[i - 1].output_delta :
+                stack->input_delta;
+
+        layer->ops->backward (layer, input, input_delta);
+    }
+}
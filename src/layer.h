@@ -0,0 +1,224 @@
+/*
+ *   layer.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LAYER_H_
+#define LAYER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "half.h"
+#include "kernels.h"
+#include "math_utils.h"
+#include "planner.h"
+
+#include <stdint.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_rng.h>
+
+#define LAYER_MAX_PARAMS 2
+
+typedef enum
+{
+    LAYER_DENSE,
+    LAYER_CONV2D,
+    LAYER_MAX_POOL,
+    LAYER_FLATTEN,
+    LAYER_SIGMOID,
+    LAYER_DROPOUT,
+    LAYER_CUSTOM
+} layer_type_t;
+
+typedef enum
+{
+    LAYER_STACK_TRAIN,
+    LAYER_STACK_INFER
+} layer_stack_mode_t;
+
+// Activations are stored channel major: [channel][row][col]
+typedef struct
+{
+    uint32_t channels;
+    uint32_t rows;
+    uint32_t cols;
+} shape_t;
+
+// A trainable buffer and its gradient, both contiguous
+typedef struct
+{
+    double * value;
+    double * grad;
+    size_t size;
+} param_t;
+
+typedef struct layer layer_t;
+
+/*
+ * Operations implementing a layer type.
+ *
+ * allocate sets layer->out from layer->in and allocates parameters and any
+ * private workspace, skipping anything only needed for training in
+ * inference mode. It must not allocate the output or output_delta, which
+ * belong to the stack planner.
+ *
+ * forward reads the input and writes layer->output. train is set when a
+ * backward pass will follow.
+ *
+ * backward reads layer->output_delta, accumulates parameter gradients and
+ * writes the error w.r.t. the input to input_delta, which for the first
+ * layer is the stack's and usually NULL. It may overwrite output_delta.
+ *
+ * The flags tell the planner how long buffers must live and which may be
+ * shared. Layers which alias their input only reinterpret it and forward
+ * must point the output at the input. In place layers may be given the
+ * same buffer for their input and output, and for their output_delta and
+ * input_delta, so must work element by element.
+ */
+typedef struct
+{
+    err_t (*allocate) (layer_t * const layer,
+                       const layer_stack_mode_t mode);
+    void (*free) (layer_t * const layer);
+    void (*forward) (layer_t * const layer,
+                     const gsl_vector * const input,
+                     const uint8_t train);
+    void (*backward) (layer_t * const layer,
+                      const gsl_vector * const input,
+                      gsl_vector * const input_delta);
+    uint8_t aliases_input;
+    uint8_t in_place;
+    uint8_t backward_uses_input;
+    uint8_t backward_uses_output;
+} layer_ops_t;
+
+/*
+ * The type, size, stride and filters are set by the user, or ops for a
+ * custom layer. Everything else is filled in by layer_stack_allocate.
+ */
+struct layer
+{
+    layer_type_t type;
+    uint32_t size; // Kernel or pooling window, or nodes for dense layers
+    uint32_t stride;
+    uint32_t filters; // Output channels, conv only
+    const layer_ops_t * ops;
+    void * state; // Private to custom layers
+    shape_t in;
+    shape_t out;
+    activation_mode_t activation; // From the stack
+    precision_t precision; // From the stack
+    uint8_t transpose_weights; // From the stack
+    uint32_t num_params;
+    param_t params[LAYER_MAX_PARAMS];
+    gsl_matrix * weights;
+    gsl_matrix * nabla_w;
+    gsl_vector * biases;
+    gsl_vector * nabla_b;
+    gsl_matrix * weights_t; // Dense, a transposed copy for the backward pass
+    half_matrix_array_t half; // Dense, 16 bit working weights, one matrix
+    gsl_vector * mask; // Dropout, 0 or 1 / keep per node, drawn by the owner
+    gsl_matrix * cols; // im2col workspace
+    kernel_gemm_buffers_t gemm; // For the im2col GEMMs
+    uint32_t * argmax; // Max pool input index per output
+    gsl_vector * output;
+    gsl_vector * output_delta; // Cost gradient w.r.t. the output
+    gsl_vector_view output_view;
+    gsl_vector_view output_delta_view;
+};
+
+/*
+ * The size, input_shape, input and data are set by the user, along with
+ * the options the layers take from the stack.
+ */
+typedef struct
+{
+    uint32_t size;
+    shape_t input_shape;
+    const gsl_vector * input;
+    layer_t * data;
+    layer_stack_mode_t mode;
+    activation_mode_t activation;
+    memory_plan_t plan; // Owns the outputs and deltas
+    precision_t precision; // Of the working copy of dense weights
+    uint8_t transpose_weights; // Dense layers keep weights_t when training
+    gsl_vector * input_delta; // Error w.r.t. the input, unless NULL
+} layer_stack_t;
+
+extern const layer_ops_t dense_ops;
+extern const layer_ops_t sigmoid_ops;
+extern const layer_ops_t dropout_ops;
+
+uint32_t
+shape_size (const shape_t * const shape);
+
+err_t
+layer_allocate_params (layer_t * const layer,
+                       const uint32_t rows,
+                       const uint32_t cols,
+                       const layer_stack_mode_t mode);
+
+err_t
+layer_stack_allocate (layer_stack_t * const stack,
+                      const layer_stack_mode_t mode);
+
+void
+layer_stack_free (layer_stack_t * const stack);
+
+size_t
+layer_stack_param_bytes (const layer_stack_t * const stack);
+
+uint32_t
+layer_stack_output_size (const layer_stack_t * const stack);
+
+gsl_vector *
+layer_stack_output (const layer_stack_t * const stack);
+
+gsl_vector *
+layer_stack_output_delta (const layer_stack_t * const stack);
+
+void
+layer_stack_set_rand (layer_stack_t * const stack,
+                      const gsl_rng * const rng,
+                      double var);
+
+void
+layer_stack_zero_gradients (layer_stack_t * const stack);
+
+void
+layer_stack_update (layer_stack_t * const stack, const double scale_fac);
+
+void
+layer_stack_refresh_copies (layer_stack_t * const stack);
+
+void
+layer_stack_feed_forward (const layer_stack_t * const stack,
+                          const uint8_t train);
+
+void
+layer_stack_backpropagate (const layer_stack_t * const stack);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LAYER_H_ */
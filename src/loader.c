@@ -23,7 +23,9 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 err_t
 extract_header_line (const uint8_t * const buf)
@@ -46,47 +48,86 @@ read_all_data (data_t * const data,
     RETURN_ON_ERR(err);
 
     err = labels_read_data (&data->labels, labels_file);
-    RETURN_ON_ERR(err);
-
-    labels_print_stats (&data->labels);
+    if (!err)
+        labels_print_stats (&data->labels);
+
+    // A label for each image
+    if (!err && data->images.num_images != data->labels.num_labels) {
+        printf ("%s: %i labels for %i images\n", labels_file,
+                data->labels.num_labels, data->images.num_images);
+        labels_free (&data->labels);
+        err = GSL_EINVAL;
+    }
+    if (err) {
+        images_free (&data->images);
+        return err;
+    }
 
-    // Keep the individual image and label count for now...
-    assert(data->images.num_images == data->labels.num_labels);
+    data->items = data->images.num_images;
 
     return GSL_SUCCESS;
 }
 
-err_t
-images_read_data (images_t * const image_data, const char * images_file)
+static err_t
+images_read_idx (images_t * const image_data, idx_t * const idx)
 {
-    FILE *fp = fopen (images_file, "rb");
-    RETURN_ERR_ON_NO_FILE(fp);
+    err_t err = idx_expect (idx, IDX_U8, 3);
+    RETURN_ON_ERR(err);
+    if (idx->size[0] > INT32_MAX || idx->size[1] > INT32_MAX
+            || idx->size[2] > INT32_MAX)
+        return GSL_EOVRFLW;
 
-    uint8_t buf[IMAGES_HEADER_SIZE_BYTES];
-    fread (&buf, 1, IMAGES_HEADER_SIZE_BYTES, fp);
+    // Each size fits in 32 bits, so their product fits in 64
+    const uint64_t image_size = (uint64_t) idx->size[1] * idx->size[2];
+    if (image_size > UINT32_MAX)
+        return GSL_EOVRFLW;
 
-    image_data->magic_num = extract_header_line (buf);
-    image_data->num_images = extract_header_line (&buf[4]);
-    image_data->rows = extract_header_line (&buf[8]);
-    image_data->cols = extract_header_line (&buf[12]);
+    image_data->magic_num = IMAGES_MAGIC;
+    image_data->num_images = idx->size[0];
+    image_data->rows = idx->size[1];
+    image_data->cols = idx->size[2];
 
-    uint32_t pixels = image_data->rows * image_data->cols;
-    printf ("Pixels per image: %d \n", pixels);
+    uint32_t pixels = image_size;
+    printf ("Pixels per image: %u \n", pixels);
 
-    err_t err;
     err = images_allocate (image_data, pixels);
-    RETURN_ON_ERR(err);
+    if (!err)
+        err = images_load_pixels (image_data, pixels, idx);
+    if (!err)
+        err = idx_read_end (idx);
+    if (err) {
+        images_free (image_data);
+        memset (image_data, 0, sizeof(*image_data));
+    }
 
-    images_load_pixels (image_data, pixels, fp);
+    return err;
+}
 
-    fclose (fp);
+/*
+ * Read an IDX file of unsigned bytes, images x rows x cols, raw or gzipped
+ */
+err_t
+images_read_data (images_t * const image_data, const char * images_file)
+{
+    idx_t idx;
 
-    return GSL_SUCCESS;
+    memset (image_data, 0, sizeof(*image_data));
+
+    err_t err = idx_open (&idx, images_file);
+    if (!err)
+        err = images_read_idx (image_data, &idx);
+
+    idx_close (&idx);
+    idx_report (images_file, err);
+
+    return err;
 }
 
 err_t
 images_allocate (images_t * const image_data, uint32_t pixels)
 {
+    image_data->map = NULL;
+    image_data->views = NULL;
     image_data->images =
             malloc (image_data->num_images * sizeof(gsl_vector *));
     RETURN_ERR_ON_BAD_ALLOC(image_data->images);
@@ -95,33 +136,60 @@ images_allocate (images_t * const image_data, uint32_t pixels)
         image_data->images[i] = gsl_vector_alloc (pixels);
     }
 
+    image_data->pixels = malloc ((size_t) image_data->num_images * pixels);
+    RETURN_ERR_ON_BAD_ALLOC(image_data->pixels);
+
     return GSL_SUCCESS;
 }
 
 void
 images_free (images_t * const image_data)
 {
-    for (int i = 0; i < image_data->num_images; ++i) {
+    if (image_data->map) {
+        free (image_data->images);
+        free (image_data->views);
+        munmap (image_data->map, image_data->map_bytes);
+        return;
+    }
+
+    for (int i = 0; image_data->images && i < image_data->num_images; ++i) {
         gsl_vector_free (image_data->images[i]);
     }
 
     free (image_data->images);
+    free (image_data->pixels);
 }
 
 /*
- * Write image pixels to each vector in the image array.
- *
- * TODO: Set using blocks?
+ * Read the raw pixels of every image in one go, keeping them for the
+ * quantised network, and set the vectors from them
  */
-void
+err_t
 images_load_pixels (images_t * const image_data,
                     const uint32_t pixels,
-                    FILE * const fp)
+                    idx_t * const idx)
 {
-    for (int i = 0; i < image_data->num_images; ++i) {
-        uint8_t buf[pixels];
-        fread (&buf, 1, pixels, fp);
-        for (int j = 0; j < pixels; ++j) {
+    err_t err = idx_read (idx, image_data->pixels,
+                          (uint64_t) image_data->num_images * pixels);
+    RETURN_ON_ERR(err);
+
+    images_scale_pixels (image_data, pixels, 0, image_data->num_images);
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Write count images' pixels from first to their vectors
+ */
+void
+images_scale_pixels (images_t * const image_data,
+                     const uint32_t pixels,
+                     const uint32_t first,
+                     const uint32_t count)
+{
+    for (uint32_t i = first; i < first + count; ++i) {
+        const uint8_t * buf = image_data->pixels + (size_t) i * pixels;
+        for (uint32_t j = 0; j < pixels; ++j) {
             // Normalise the greyscale value to prevent saturation
             // of the sigmoid function
             double tmp = buf[j] / 255.0;
@@ -140,31 +208,49 @@ images_print_stats (const images_t * const img_data)
     printf ("Columns  : %d \n\n", img_data->cols);
 }
 
-err_t
-labels_read_data (labels_t * const label_data, const char * labels_file)
+static err_t
+labels_read_idx (labels_t * const label_data, idx_t * const idx)
 {
-    FILE *fp = fopen (labels_file, "rb");
-    RETURN_ERR_ON_NO_FILE(fp);
-
-    uint8_t buf[LABELS_HEADER_SIZE_BYTES];
-    fread (&buf, 1, LABELS_HEADER_SIZE_BYTES, fp);
+    err_t err = idx_expect (idx, IDX_U8, 1);
+    RETURN_ON_ERR(err);
+    if (idx->size[0] > INT32_MAX)
+        return GSL_EOVRFLW;
 
-    label_data->magic_num = extract_header_line (buf);
-    label_data->num_labels = extract_header_line (&buf[4]);
+    label_data->magic_num = LABELS_MAGIC;
+    label_data->num_labels = idx->size[0];
 
-    err_t err;
     err = labels_allocate (label_data);
     RETURN_ON_ERR(err);
 
-    uint8_t digit;
-    for (uint32_t i = 0; i < label_data->num_labels; ++i) {
-        fread (&digit, 1, 1, fp);
-        label_data->labels[i] = digit;
+    err = idx_read (idx, label_data->labels, label_data->num_labels);
+    if (!err)
+        err = idx_read_end (idx);
+    if (err) {
+        labels_free (label_data);
+        memset (label_data, 0, sizeof(*label_data));
     }
 
-    fclose (fp);
+    return err;
+}
 
-    return GSL_SUCCESS;
+/*
+ * Read an IDX file of unsigned bytes, one per label, raw or gzipped
+ */
+err_t
+labels_read_data (labels_t * const label_data, const char * labels_file)
+{
+    idx_t idx;
+
+    memset (label_data, 0, sizeof(*label_data));
+
+    err_t err = idx_open (&idx, labels_file);
+    if (!err)
+        err = labels_read_idx (label_data, &idx);
+
+    idx_close (&idx);
+    idx_report (labels_file, err);
+
+    return err;
 }
 
 err_t
@@ -204,6 +290,10 @@ partition_data (data_t * const data,
     data->items = data->images.num_images - chunk_size;
 
     test_data->items = chunk_size;
+    test_data->images.rows = data->images.rows;
+    test_data->images.cols = data->images.cols;
     test_data->images.images = data->images.images + data->items;
+    test_data->images.pixels = data->images.pixels
+            + (size_t) data->items * data->images.rows * data->images.cols;
     test_data->labels.labels = data->labels.labels + data->items;
 }
@@ -27,11 +27,14 @@ extern "C" {
 #endif
 
 #include "errors.h"
+#include "idx.h"
 
 #include <gsl/gsl_matrix.h>
 
 #define IMAGES_HEADER_SIZE_BYTES 16
 #define LABELS_HEADER_SIZE_BYTES 8
+#define IMAGES_MAGIC 2051 // Unsigned bytes, 3 dimensions
+#define LABELS_MAGIC 2049 // Unsigned bytes, 1 dimension
 
 typedef struct
 {
@@ -40,6 +43,10 @@ typedef struct
     int32_t rows;
     int32_t cols;
     gsl_vector ** images;
+    uint8_t * pixels; // As read, rows * cols per image
+    void * map; // A cache file the pixels and vectors are in, or NULL
+    size_t map_bytes;
+    gsl_vector * views; // The vectors into the map
 } images_t;
 
 typedef struct
@@ -73,10 +80,16 @@ images_allocate (images_t * const image_data, uint32_t pixels);
 void
 images_free (images_t * const image_data);
 
-void
+err_t
 images_load_pixels (images_t * const image_data,
                     const uint32_t pixels,
-                    FILE * const fp);
+                    idx_t * const idx);
+
+void
+images_scale_pixels (images_t * const image_data,
+                     const uint32_t pixels,
+                     const uint32_t first,
+                     const uint32_t count);
 
 void
 images_print_stats (const images_t * const image_data);
@@ -0,0 +1,488 @@
+/*
+ *   loadgen.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drive ./serve from many connections at once:
+ *
+ *   ./loadgen [-c connections] [-p pipeline] [-n requests | -d seconds]
+ *             [-i inputs] [-m checkpoint]
+ *             unix:/tmp/nnet.sock | tcp:5000 | shm:nnet
+ *
+ * Each connection keeps up to the pipeline depth of random images in
+ * flight, all from one epoll loop. Prints the throughput and the latency
+ * from starting to send a request to reading its label. With -m the
+ * labels are checked against the network in the checkpoint.
+ *
+ * For shm: each connection is a thread making one request at a time.
+ */
+
+// For getopt, clock_gettime, epoll and threads
+#define _GNU_SOURCE
+
+#include "address.h"
+#include "checkpoint.h"
+#include "errors.h"
+#include "histogram.h"
+#include "nnet.h"
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOADGEN_CONNECTIONS 64
+#define LOADGEN_PIPELINE 4
+#define LOADGEN_REQUESTS 1000
+#define LOADGEN_INPUTS 784
+#define LOADGEN_IMAGES 256
+#define LOADGEN_EVENTS 256
+
+typedef struct
+{
+    int fd;
+    uint32_t index; // Which images it sends
+    uint64_t started; // Requests begun
+    uint32_t offset; // Bytes written of the last begun
+    uint64_t received;
+    uint64_t * sent_at; // ns, by request modulo the pipeline
+} client_t;
+
+typedef struct
+{
+    uint32_t inputs;
+    uint32_t pipeline;
+    uint64_t requests; // Per connection, unless running for a duration
+    uint64_t deadline; // ns
+    uint8_t * images;
+    uint32_t * expected; // NULL unless checking
+    uint64_t wrong;
+    histogram_t latency;
+} loadgen_t;
+
+static uint64_t
+loadgen_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t
+loadgen_image (const client_t * const client, const uint64_t request)
+{
+    return (client->index + request) % LOADGEN_IMAGES;
+}
+
+static int
+loadgen_more (const loadgen_t * const lg, const client_t * const client)
+{
+    if (lg->deadline)
+        return loadgen_now () < lg->deadline;
+
+    return client->started < lg->requests;
+}
+
+/*
+ * Write until the pipeline is full, or the socket is. Returns non-zero
+ * if the connection failed.
+ */
+static int
+loadgen_send (loadgen_t * const lg, client_t * const client)
+{
+    for (;;) {
+        if (client->offset == lg->inputs) {
+            if (client->started - client->received >= lg->pipeline
+                    || !loadgen_more (lg, client))
+                return 0;
+
+            client->sent_at[client->started % lg->pipeline] = loadgen_now ();
+            client->started++;
+            client->offset = 0;
+        }
+
+        const uint8_t * image = lg->images + (size_t) lg->inputs
+                * loadgen_image (client, client->started - 1);
+        ssize_t written = write (client->fd, image + client->offset,
+                                 lg->inputs - client->offset);
+
+        if (written < 0)
+            return errno != EAGAIN && errno != EINTR;
+        client->offset += written;
+    }
+}
+
+/*
+ * Take the labels waiting. Returns non-zero if the connection failed.
+ */
+static int
+loadgen_receive (loadgen_t * const lg, client_t * const client)
+{
+    uint8_t labels[LOADGEN_EVENTS];
+
+    for (;;) {
+        ssize_t got = read (client->fd, labels, sizeof(labels));
+
+        if (got == 0)
+            return 1;
+        if (got < 0)
+            return errno != EAGAIN && errno != EINTR;
+
+        const uint64_t now = loadgen_now ();
+        for (ssize_t i = 0; i < got; ++i) {
+            const uint64_t r = client->received++;
+            histogram_record (&lg->latency,
+                              now - client->sent_at[r % lg->pipeline]);
+            if (lg->expected
+                    && labels[i] != lg->expected[loadgen_image (client, r)])
+                lg->wrong++;
+        }
+    }
+}
+
+static double
+loadgen_close (client_t * const clients, const uint32_t opened,
+               const int epoll, const double elapsed)
+{
+    for (uint32_t c = 0; clients && c < opened; ++c) {
+        if (clients[c].fd >= 0)
+            close (clients[c].fd);
+        free (clients[c].sent_at);
+    }
+    free (clients);
+    if (epoll >= 0)
+        close (epoll);
+
+    return elapsed;
+}
+
+/*
+ * Run the connections from one epoll loop, returning the seconds taken,
+ * or 0 if a connection failed
+ */
+static double
+loadgen_sockets (loadgen_t * const lg, const uint32_t connections,
+                 const address_t * const address)
+{
+    client_t * clients = calloc (connections, sizeof(client_t));
+    int epoll = epoll_create1 (EPOLL_CLOEXEC);
+    uint32_t opened = 0;
+
+    if (!clients || epoll < 0)
+        return loadgen_close (clients, opened, epoll, 0.0);
+
+    for (; opened < connections; ++opened) {
+        client_t * client = &clients[opened];
+        client->index = opened;
+        client->offset = lg->inputs;
+        client->sent_at = malloc (lg->pipeline * sizeof(uint64_t));
+        client->fd = address_connect (address);
+        if (!client->sent_at || client->fd < 0) {
+            free (client->sent_at);
+            return loadgen_close (clients, opened, epoll, 0.0);
+        }
+        fcntl (client->fd, F_SETFL, fcntl (client->fd, F_GETFL) | O_NONBLOCK);
+
+        struct epoll_event ev = {
+                .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                .data.ptr = client
+        };
+        epoll_ctl (epoll, EPOLL_CTL_ADD, client->fd, &ev);
+    }
+
+    const uint64_t start = loadgen_now ();
+    if (lg->deadline)
+        lg->deadline += start;
+
+    for (uint32_t c = 0; c < connections; ++c) {
+        if (loadgen_send (lg, &clients[c]))
+            return loadgen_close (clients, opened, epoll, 0.0);
+    }
+
+    // A connection is done once it has nothing more to send or receive
+    uint32_t done = 0;
+    while (done < connections) {
+        struct epoll_event events[LOADGEN_EVENTS];
+        int n = epoll_wait (epoll, events, LOADGEN_EVENTS, 100);
+
+        for (int i = 0; i < n; ++i) {
+            client_t * client = events[i].data.ptr;
+
+            if (client->fd < 0)
+                continue;
+            if (loadgen_receive (lg, client) || loadgen_send (lg, client))
+                return loadgen_close (clients, opened, epoll, 0.0);
+
+            if (client->offset == lg->inputs
+                    && client->received == client->started
+                    && !loadgen_more (lg, client)) {
+                close (client->fd);
+                client->fd = -1;
+                done++;
+            }
+        }
+
+        // Writes stopped at the pipeline depth resume as labels come back
+        if (lg->deadline && loadgen_now () >= lg->deadline) {
+            for (uint32_t c = 0; c < connections; ++c) {
+                client_t * client = &clients[c];
+                if (client->fd >= 0 && client->offset == lg->inputs
+                        && client->received == client->started) {
+                    close (client->fd);
+                    client->fd = -1;
+                    done++;
+                }
+            }
+        }
+    }
+
+    return loadgen_close (clients, opened, epoll,
+                          (loadgen_now () - start) * 1e-9);
+}
+
+typedef struct
+{
+    loadgen_t * lg;
+    shm_ring_t * ring;
+    client_t client;
+    uint64_t wrong;
+    histogram_t latency;
+} shm_client_t;
+
+static void *
+loadgen_shm_client (void * arg)
+{
+    shm_client_t * sc = arg;
+    loadgen_t * lg = sc->lg;
+    client_t * client = &sc->client;
+
+    while (loadgen_more (lg, client)) {
+        const uint32_t image = loadgen_image (client, client->started++);
+        const uint64_t start = loadgen_now ();
+        uint32_t ticket;
+
+        uint8_t * slot = shm_ring_claim (sc->ring, &ticket);
+        memcpy (slot, lg->images + (size_t) image * lg->inputs, lg->inputs);
+        const uint32_t label = shm_ring_submit (sc->ring, ticket);
+
+        histogram_record (&sc->latency, loadgen_now () - start);
+        if (lg->expected && label != lg->expected[image])
+            sc->wrong++;
+    }
+
+    return NULL;
+}
+
+/*
+ * Run the clients on threads against the ring, returning the seconds
+ * taken
+ */
+static double
+loadgen_shm (loadgen_t * const lg, const uint32_t connections,
+             shm_ring_t * const ring)
+{
+    shm_client_t * clients = calloc (connections, sizeof(shm_client_t));
+    pthread_t * threads = calloc (connections, sizeof(pthread_t));
+    uint32_t started = 0;
+
+    if (!clients || !threads) {
+        free (clients);
+        free (threads);
+        return 0.0;
+    }
+
+    const uint64_t start = loadgen_now ();
+    if (lg->deadline)
+        lg->deadline += start;
+
+    for (; started < connections; ++started) {
+        clients[started].lg = lg;
+        clients[started].ring = ring;
+        clients[started].client.index = started;
+        if (pthread_create (&threads[started], NULL, &loadgen_shm_client,
+                            &clients[started]))
+            break;
+    }
+    for (uint32_t c = 0; c < started; ++c) {
+        pthread_join (threads[c], NULL);
+        histogram_merge (&lg->latency, &clients[c].latency);
+        lg->wrong += clients[c].wrong;
+    }
+
+    free (clients);
+    free (threads);
+
+    return (loadgen_now () - start) * 1e-9;
+}
+
+/*
+ * The labels the server should give, from the same network
+ */
+static err_t
+loadgen_expect (loadgen_t * const lg, const char * path)
+{
+    network_t network;
+    network_batch_t batch;
+    err_t err;
+
+    memset (&network, 0, sizeof(network));
+    err = checkpoint_read_nodes (&network.nodes, path);
+    RETURN_ON_ERR(err);
+    if (network.nodes.data[0] != lg->inputs)
+        return GSL_EBADLEN;
+
+    network.mode = NETWORK_INFER;
+    err = network_allocate (&network);
+    RETURN_ON_ERR(err);
+    err = checkpoint_load (&network, path);
+    RETURN_ON_ERR(err);
+    err = network_batch_allocate (&batch, &network, LOADGEN_IMAGES);
+    RETURN_ON_ERR(err);
+
+    const size_t pixels = (size_t) LOADGEN_IMAGES * lg->inputs;
+    double * inputs = malloc (pixels * sizeof(double));
+    lg->expected = malloc (LOADGEN_IMAGES * sizeof(uint32_t));
+    RETURN_ERR_ON_BAD_ALLOC(inputs);
+    RETURN_ERR_ON_BAD_ALLOC(lg->expected);
+
+    for (size_t i = 0; i < pixels; ++i) {
+        inputs[i] = lg->images[i] / 255.0;
+    }
+    err = network_predict_batch (&network, &batch, inputs, LOADGEN_IMAGES,
+                                 lg->expected, NULL);
+
+    free (inputs);
+    network_batch_free (&batch);
+    network_free (&network);
+    free (network.nodes.data);
+
+    return err;
+}
+
+int
+main (int argc, char * argv[])
+{
+    loadgen_t lg;
+    uint32_t connections = LOADGEN_CONNECTIONS;
+    double seconds = 0.0;
+    const char * checkpoint = NULL;
+    address_t address;
+    shm_ring_t ring;
+    err_t err;
+    int opt;
+
+    memset (&lg, 0, sizeof(lg));
+    lg.inputs = LOADGEN_INPUTS;
+    lg.pipeline = LOADGEN_PIPELINE;
+    lg.requests = LOADGEN_REQUESTS;
+
+    while ((opt = getopt (argc, argv, "c:p:n:d:i:m:")) != -1) {
+        switch (opt) {
+            case 'c':
+                connections = strtoul (optarg, NULL, 10);
+                break;
+            case 'p':
+                lg.pipeline = strtoul (optarg, NULL, 10);
+                break;
+            case 'n':
+                lg.requests = strtoull (optarg, NULL, 10);
+                break;
+            case 'd':
+                seconds = atof (optarg);
+                break;
+            case 'i':
+                lg.inputs = strtoul (optarg, NULL, 10);
+                break;
+            case 'm':
+                checkpoint = optarg;
+                break;
+            default:
+                optind = argc;
+        }
+    }
+
+    const int shm = !strncmp (argv[optind < argc ? optind : 0], "shm:", 4);
+    if (argc - optind != 1 || connections == 0 || lg.pipeline == 0
+            || lg.requests == 0 || lg.inputs == 0 || seconds < 0.0
+            || (!shm && address_parse (&address, argv[optind]))) {
+        printf ("Usage: %s [-c connections] [-p pipeline] [-n requests |"
+                " -d seconds] [-i inputs] [-m checkpoint]"
+                " unix:<path> | tcp:<port> | shm:<name>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (shm) {
+        err = shm_ring_open (&ring, argv[optind] + 4);
+        EXIT_MAIN_ON_ERR(err);
+        if (ring.header->inputs != lg.inputs) {
+            printf ("The server takes %u inputs\n", ring.header->inputs);
+            return EXIT_FAILURE;
+        }
+    }
+
+    lg.images = malloc ((size_t) LOADGEN_IMAGES * lg.inputs);
+    if (!lg.images)
+        return EXIT_FAILURE;
+
+    srand (1);
+    for (size_t i = 0; i < (size_t) LOADGEN_IMAGES * lg.inputs; ++i) {
+        lg.images[i] = rand () % 256;
+    }
+
+    if (checkpoint) {
+        err = loadgen_expect (&lg, checkpoint);
+        EXIT_MAIN_ON_ERR(err);
+    }
+
+    // From the start of the run
+    lg.deadline = (uint64_t) (seconds * 1e9);
+
+    double elapsed;
+    if (shm) {
+        elapsed = loadgen_shm (&lg, connections, &ring);
+        shm_ring_close (&ring);
+    } else {
+        elapsed = loadgen_sockets (&lg, connections, &address);
+    }
+    if (elapsed <= 0.0) {
+        printf ("Could not run against %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    printf ("%llu requests over %u connections in %.2f s, %.0f per second\n",
+            (unsigned long long) lg.latency.count, connections, elapsed,
+            lg.latency.count / elapsed);
+    printf ("%-12s %10s %10s %10s %10s %10s %10s\n", "", "count", "mean",
+            "p50", "p99", "p999", "max");
+    histogram_print (&lg.latency, "latency us", 1000.0, stdout);
+    if (checkpoint)
+        printf ("%llu wrong labels\n", (unsigned long long) lg.wrong);
+
+    free (lg.images);
+    free (lg.expected);
+
+    return lg.wrong ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -19,9 +19,15 @@
  *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "backend.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "dataset.h"
 #include "error.h"
 #include "loader.h"
 #include "nnet.h"
+#include "quant.h"
+#include "stream.h"
 
 #include <stdio.h>
 
@@ -30,55 +36,171 @@
 #define EPOCHS 10
 #define ETA 3.0
 #define RANDOM_VARIANCE 1.0
+#define DROPOUT 0.0
+#define USE_FEATURES 0
+#define TRANSPOSE_WEIGHTS 0
+#define ACTIVATION ACTIVATION_EXACT
+#define PRECISION PRECISION_DOUBLE
+#define QUANTISE 1
+#define CALIBRATION_ITEMS 1000
+#define STREAM_TRAINING 0 // Read the training data from disk each epoch
+#define SHUFFLE_BUFFER_ITEMS 16384
+#define SHUFFLE_BLOCK 0 // Items shuffled together, eg. 256 for locality
+#define LOADER_THREADS 0 // Reading shards in parallel, 0 for the default
 
 // Number of nodes in each layer of the network
 uint32_t nodes[] = { 784, 30, 10 };
 
+// Optional convolutional layers applied to the image ahead of nodes[0]
+layer_t features[] = {
+        { .type = LAYER_CONV2D, .size = 5, .stride = 1, .filters = 8 },
+        { .type = LAYER_MAX_POOL, .size = 2, .stride = 2 },
+        { .type = LAYER_FLATTEN }
+};
+
 const char * images_file = "./dat/train-images-idx3-ubyte";
 const char * labels_file = "./dat/train-labels-idx1-ubyte";
 
+// Or many shards, listed a pair of image and label files a line
+const char * manifest_file = NULL;
+
+// The scaled training data, mapped on later runs, or NULL not to cache it
+const char * cache_file = "./dat/train.cache";
+
+// The trained dense network, for ./emit
+const char * checkpoint_file = "./network.nnet";
+
 int
 main (int argc, const char* argv[])
 {
     err_t err;
 
-    printf ("Loading images and labels...\n");
     data_t data;
-    err = read_all_data (&data, images_file, labels_file);
+    data_t test_data;
+    stream_t stream;
+    dataset_t dataset;
+
+    dataset_init (&dataset);
+    if (manifest_file)
+        err = dataset_add_manifest (&dataset, manifest_file);
+    else
+        err = dataset_add (&dataset, images_file, labels_file);
     EXIT_MAIN_ON_ERR(err);
+    printf ("%i images of %i x %i in %i shards\n", dataset.items,
+            dataset.rows, dataset.cols, dataset.size);
+
+    if (STREAM_TRAINING) {
+        /*
+         * Hold the validation chunk and the calibration items in memory,
+         * and stream the rest for training
+         */
+        printf ("Streaming images and labels...\n");
+        err = stream_open_dataset (&stream, &dataset, SHUFFLE_BUFFER_ITEMS,
+                                   MINI_BATCH_SIZE);
+        EXIT_MAIN_ON_ERR(err);
+        err = stream.items > VALIDATION_DATA_CHUNK_SIZE ?
+                GSL_SUCCESS : GSL_EINVAL;
+        EXIT_MAIN_ON_ERR(err);
+
+        const uint32_t training = stream.items - VALIDATION_DATA_CHUNK_SIZE;
+        err = stream_range (&stream, training, VALIDATION_DATA_CHUNK_SIZE);
+        EXIT_MAIN_ON_ERR(err);
+        err = stream_read_data (&stream, &test_data);
+        EXIT_MAIN_ON_ERR(err);
+        err = stream_range (&stream, 0, training < CALIBRATION_ITEMS ?
+                                    training : CALIBRATION_ITEMS);
+        EXIT_MAIN_ON_ERR(err);
+        err = stream_read_data (&stream, &data);
+        EXIT_MAIN_ON_ERR(err);
+        err = stream_range (&stream, 0, training);
+        EXIT_MAIN_ON_ERR(err);
+    } else {
+        printf ("Loading images and labels...\n");
+        if (cache_file)
+            err = cache_read (&data, &dataset, cache_file, LOADER_THREADS);
+        else
+            err = dataset_read (&dataset, &data, LOADER_THREADS);
+        EXIT_MAIN_ON_ERR(err);
+
+        // Split off a chunk of data for testing
+        partition_data(&data, &test_data, VALIDATION_DATA_CHUNK_SIZE);
+    }
+
+    blas_backend_print ();
 
     printf ("Setting up network...\n");
     network_t network;
     uint32_t layers = sizeof(nodes) / sizeof(nodes[0]);
 
-    printf ("Node structure: ");
-    for (uint32_t i = 0; i < layers - 1; ++i) {
-        printf ("%i x ", nodes[i]);
-    }
-    printf ("%i.\n", nodes[layers - 1]);
-
     network.nodes.size = layers;
     network.nodes.data = nodes;
     network.epochs = EPOCHS;
     network.mini_batch_size = MINI_BATCH_SIZE;
+    network.shuffle_block = SHUFFLE_BLOCK;
     network.eta = ETA;
+    network.dropout = DROPOUT;
+    network.transpose_weights = TRANSPOSE_WEIGHTS;
+    network.activation = ACTIVATION;
+    network.precision = PRECISION;
+    network.mode = NETWORK_TRAIN;
+
+    network.features.size = 0;
+    if (USE_FEATURES) {
+        // The feature layers work on the image shape from the file header
+        network.features.size = sizeof(features) / sizeof(features[0]);
+        network.features.data = features;
+        network.features.input_shape.channels = 1;
+        network.features.input_shape.rows = data.images.rows;
+        network.features.input_shape.cols = data.images.cols;
+    }
 
     err = network_allocate (&network);
     EXIT_MAIN_ON_ERR(err);
 
+    printf ("Node structure: ");
+    for (uint32_t i = 0; i < layers - 1; ++i) {
+        printf ("%i x ", nodes[i]);
+    }
+    printf ("%i.\n", nodes[layers - 1]);
+    network_print_memory (&network);
+
     printf ("Initialising network...\n");
     network_random_init (&network, RANDOM_VARIANCE);
 
-    // Split off a chunk of data for testing
-    data_t test_data;
-    partition_data(&data, &test_data, VALIDATION_DATA_CHUNK_SIZE);
-
     printf ("Stochastic gradient descent...\n");
-    network_sgd (&network, &data, &test_data);
+    if (STREAM_TRAINING)
+        err = network_sgd_stream (&network, &stream, &test_data);
+    else
+        err = network_sgd (&network, &data, &test_data);
+    EXIT_MAIN_ON_ERR(err);
+
+    if (!network.features.size) {
+        err = checkpoint_save (&network, checkpoint_file);
+        EXIT_MAIN_ON_ERR(err);
+        printf ("Saved network to %s\n", checkpoint_file);
+    }
+
+    // Int8 copy for inference, calibrated on some of the training data
+    quant_network_t quant;
+    if (QUANTISE && quant_network_allocate (&quant, &network) == GSL_SUCCESS) {
+        uint32_t correct_answers;
+        quant_network_calibrate (&quant, &network, &data, CALIBRATION_ITEMS);
+        quant_network_evaluate (&quant, &test_data, &correct_answers);
+        printf ("Quantised (%s, %zu bytes): %i/%i correct.\n", quant_isa (),
+                quant_network_bytes (&quant), correct_answers,
+                test_data.items);
+        quant_network_free (&quant);
+    }
 
     network_free (&network);
     images_free (&data.images);
     labels_free (&data.labels);
+    if (STREAM_TRAINING) {
+        images_free (&test_data.images);
+        labels_free (&test_data.labels);
+        stream_close (&stream);
+    }
+    dataset_free (&dataset);
 
     return EXIT_SUCCESS;
 }
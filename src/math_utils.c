@@ -95,6 +95,68 @@ matrix_array_allocate (matrix_array_t * const array,
     return GSL_SUCCESS;
 }
 
+/*
+ * As matrix_array_allocate, but the i'th matrix is dimensions.data[i] x
+ * dimensions.data[i + 1], ie. the transpose.
+ */
+err_t
+matrix_array_allocate_transposed (matrix_array_t * const array,
+                                  const uint32_array_t * const dimensions)
+{
+    array->size = dimensions->size - 1;
+    array->data = malloc (sizeof(gsl_matrix *) * array->size);
+    RETURN_ERR_ON_BAD_ALLOC(array->data);
+
+    for (uint32_t i = 0; i < array->size; ++i) {
+        array->data[i] = gsl_matrix_alloc (dimensions->data[i],
+                                           dimensions->data[i + 1]);
+    }
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Copy each matrix of src, transposed, to dest. Does nothing if dest is
+ * empty.
+ */
+void
+matrix_array_transpose_memcpy (matrix_array_t * const dest,
+                               const matrix_array_t * const src)
+{
+    for (uint32_t i = 0; i < dest->size; ++i) {
+        gsl_matrix_transpose_memcpy (dest->data[i], src->data[i]);
+    }
+}
+
+/*
+ * mat -= scale * delta, writing the result to mat_t transposed on the same
+ * pass. Works in square tiles so the columns of mat_t being written stay
+ * in cache.
+ */
+void
+matrix_update_transposed (gsl_matrix * const mat,
+                          const gsl_matrix * const delta,
+                          const double scale,
+                          gsl_matrix * const mat_t)
+{
+    const size_t tile = 16;
+
+    for (size_t i0 = 0; i0 < mat->size1; i0 += tile) {
+        size_t i1 = i0 + tile < mat->size1 ? i0 + tile : mat->size1;
+        for (size_t j0 = 0; j0 < mat->size2; j0 += tile) {
+            size_t j1 = j0 + tile < mat->size2 ? j0 + tile : mat->size2;
+            for (size_t i = i0; i < i1; ++i) {
+                double * row = mat->data + i * mat->tda;
+                const double * d = delta->data + i * delta->tda;
+                for (size_t j = j0; j < j1; ++j) {
+                    row[j] -= scale * d[j];
+                    mat_t->data[j * mat_t->tda + i] = row[j];
+                }
+            }
+        }
+    }
+}
+
 void
 matrix_array_free (matrix_array_t * const matrix)
 {
@@ -151,3 +213,140 @@ vector_vectorise (gsl_vector * const vec, v_func_t func)
         gsl_vector_set (vec, i, tmp);
     }
 }
+
+/*
+ * e^x to a relative error below 2e-7 over the whole range, which puts
+ * sigmoid_fast within 5e-8 of sigmoid. Arguments are clamped to
+ * +/-FAST_EXP_MAX, so there is no overflow, infinity or NaN handling.
+ *
+ * e^x = 2^n * e^r with n = round(x / ln 2) and |r| <= ln 2 / 2, where e^r
+ * is its Taylor series to r^6. 2^n is built directly in the exponent bits.
+ */
+double
+fast_exp (double x)
+{
+    if (x > FAST_EXP_MAX)
+        x = FAST_EXP_MAX;
+    if (x < -FAST_EXP_MAX)
+        x = -FAST_EXP_MAX;
+
+    double t = x * FAST_EXP_LOG2E;
+    int64_t n = (int64_t) (t + (t >= 0.0 ? 0.5 : -0.5));
+    double r = x - n * FAST_EXP_LN2_HI - n * FAST_EXP_LN2_LO;
+
+    double p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24
+            + r * (1.0 / 120 + r * (1.0 / 720))))));
+
+    union
+    {
+        uint64_t u;
+        double d;
+    } scale = { .u = (uint64_t) (n + 1023) << 52 };
+
+    return p * scale.d;
+}
+
+/*
+ * delta *= sigmoid'(z), from the activation a = sigmoid(z) as a(1 - a)
+ */
+void
+vector_mul_sigmoid_prime (gsl_vector * const delta,
+                          const gsl_vector * const a)
+{
+    double * d = delta->data;
+    const double * act = a->data;
+
+    assert(delta->size == a->size);
+    assert(delta->stride == 1 && a->stride == 1);
+
+    for (size_t i = 0; i < delta->size; ++i) {
+        d[i] *= act[i] * (1.0 - act[i]);
+    }
+}
+
+/*
+ * Seed the generator state from a single value using splitmix64, as
+ * recommended by the xoshiro authors.
+ */
+void
+xoshiro256_seed (xoshiro256_t * const rng, uint64_t seed)
+{
+    for (uint32_t i = 0; i < 4; ++i) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+static inline uint64_t
+rotl (const uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * xoshiro256** by Blackman and Vigna, see http://prng.di.unimi.it/
+ */
+uint64_t
+xoshiro256_next (xoshiro256_t * const rng)
+{
+    uint64_t * s = rng->s;
+    const uint64_t result = rotl (s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl (s[3], 45);
+
+    return result;
+}
+
+/*
+ * Fill a vector with an inverted dropout mask. Each element is zero with
+ * probability rate, otherwise 1 / (1 - rate) so that the expected activation
+ * is unchanged and no rescaling is needed at inference time.
+ *
+ * Each 64 bit draw is split into four 16 bit uniforms, so the rate is
+ * resolved to 1/65536.
+ */
+void
+vector_set_dropout_mask (gsl_vector * const mask,
+                         xoshiro256_t * const rng,
+                         const double rate)
+{
+    assert(rate >= 0.0 && rate < 1.0);
+
+    const uint32_t threshold = (uint32_t) (rate * 65536.0);
+    const double keep = 1.0 / (1.0 - rate);
+    const size_t stride = mask->stride;
+    double * data = mask->data;
+
+    size_t i = 0;
+    while (i + 4 <= mask->size) {
+        uint64_t bits = xoshiro256_next (rng);
+        for (uint32_t lane = 0; lane < 4; ++lane, ++i) {
+            uint32_t u = (uint16_t) (bits >> (16 * lane));
+            data[i * stride] = (u >= threshold) * keep;
+        }
+    }
+
+    uint64_t bits = xoshiro256_next (rng);
+    for (; i < mask->size; ++i, bits >>= 16) {
+        uint32_t u = (uint16_t) bits;
+        data[i * stride] = (u >= threshold) * keep;
+    }
+}
+
+void
+vector_array_set_dropout_mask (vector_array_t * const array,
+                               xoshiro256_t * const rng,
+                               const double rate)
+{
+    for (uint32_t i = 0; i < array->size; ++i) {
+        vector_set_dropout_mask (array->data[i], rng, rate);
+    }
+}
@@ -52,9 +52,31 @@ typedef struct
     gsl_matrix ** data;
 } matrix_array_t;
 
+// State for the xoshiro256** generator
+typedef struct
+{
+    uint64_t s[4];
+} xoshiro256_t;
+
 // For vectorising array
 typedef double (*v_func_t) (double);
 
+// How activations are evaluated, see fast_exp for the error of the latter
+typedef enum
+{
+    ACTIVATION_EXACT,
+    ACTIVATION_FAST
+} activation_mode_t;
+
+/*
+ * Range reduction constants for exp: ln 2 split so that n * FAST_EXP_LN2_HI
+ * is exact, and the largest argument with a finite result.
+ */
+#define FAST_EXP_LOG2E 1.4426950408889634
+#define FAST_EXP_LN2_HI 6.93147180369123816490e-01
+#define FAST_EXP_LN2_LO 1.90821492927058770002e-10
+#define FAST_EXP_MAX 708.0
+
 err_t
 vector_array_allocate (vector_array_t * const array,
                        const uint32_array_t * const dimensions,
@@ -73,9 +95,23 @@ err_t
 matrix_array_allocate (matrix_array_t * const matrix_array,
                        const uint32_array_t * const structure);
 
+err_t
+matrix_array_allocate_transposed (matrix_array_t * const matrix_array,
+                                  const uint32_array_t * const structure);
+
 void
 matrix_array_free (matrix_array_t * const matrix_array);
 
+void
+matrix_array_transpose_memcpy (matrix_array_t * const dest,
+                               const matrix_array_t * const src);
+
+void
+matrix_update_transposed (gsl_matrix * const mat,
+                          const gsl_matrix * const delta,
+                          const double scale,
+                          gsl_matrix * const mat_t);
+
 void
 vector_set_rand (gsl_vector * const vec, const gsl_rng * const rng, double var);
 
@@ -95,6 +131,29 @@ matrix_array_set_rand (matrix_array_t * const matrix_array,
 void
 vector_vectorise (gsl_vector * const vec, v_func_t func);
 
+double
+fast_exp (double x);
+
+void
+vector_mul_sigmoid_prime (gsl_vector * const delta,
+                          const gsl_vector * const a);
+
+void
+xoshiro256_seed (xoshiro256_t * const rng, uint64_t seed);
+
+uint64_t
+xoshiro256_next (xoshiro256_t * const rng);
+
+void
+vector_set_dropout_mask (gsl_vector * const mask,
+                         xoshiro256_t * const rng,
+                         const double rate);
+
+void
+vector_array_set_dropout_mask (vector_array_t * const array,
+                               xoshiro256_t * const rng,
+                               const double rate);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,47 +20,215 @@
  */
 
 #include "nnet.h"
+#include "kernels.h"
 
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_rng.h>
 #include <assert.h>
+#include <string.h>
 
-err_t
-network_allocate (network_t * const net)
+// A pointer for each of size vectors held elsewhere
+static err_t
+vector_array_view (vector_array_t * const array, const uint32_t size)
 {
-    err_t err = GSL_SUCCESS;
+    array->offset = 0;
+    array->data = malloc (sizeof(gsl_vector *) * size);
+    RETURN_ERR_ON_BAD_ALLOC(array->data);
+    array->size = size;
+
+    return GSL_SUCCESS;
+}
 
-    err |= matrix_array_allocate (&net->nabla_w, &net->nodes);
-    err |= matrix_array_allocate (&net->weights, &net->nodes);
+static err_t
+matrix_array_view (matrix_array_t * const array, const uint32_t size)
+{
+    array->data = malloc (sizeof(gsl_matrix *) * size);
+    RETURN_ERR_ON_BAD_ALLOC(array->data);
+    array->size = size;
+
+    return GSL_SUCCESS;
+}
 
-    // These arrays are not required for the input layer
-    uint32_array_t dimensions = {
-            .size = net->nodes.size - 1,
-            .data = net->nodes.data + 1
+static void
+network_clear (network_t * const net)
+{
+    vector_array_t * vectors[] = {
+            &net->outputs, &net->nabla_b, &net->output_delta, &net->biases,
+            &net->dropout_mask
+    };
+    matrix_array_t * matrices[] = {
+            &net->weights, &net->weights_t, &net->nabla_w
     };
-    err |= vector_array_allocate (&net->zs, &dimensions, 0);
-    err |= vector_array_allocate (&net->nabla_b, &dimensions, 0);
-    err |= vector_array_allocate (&net->output_delta, &dimensions, 0);
-    err |= vector_array_allocate (&net->biases, &dimensions, 0);
 
-    // To simplify calculations store a pointer to input vector at -1
-    // in the outputs array.
-    err |= vector_array_allocate (&net->outputs, &dimensions, 1);
+    for (uint32_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+        vectors[i]->size = 0;
+        vectors[i]->offset = 0;
+        vectors[i]->data = NULL;
+    }
+    for (uint32_t i = 0; i < sizeof(matrices) / sizeof(matrices[0]); ++i) {
+        matrices[i]->size = 0;
+        matrices[i]->data = NULL;
+    }
+
+    memset (&net->layers, 0, sizeof(net->layers));
+}
+
+/*
+ * A dense layer for each of nodes[1] on, each hidden one followed by
+ * dropout when training with it
+ */
+static err_t
+network_layers_allocate (network_t * const net,
+                         const layer_stack_mode_t mode)
+{
+    const uint32_t dense = net->nodes.size - 1;
+    const uint8_t dropout = mode == LAYER_STACK_TRAIN && net->dropout > 0.0;
+    const uint32_t size = dropout ? 2 * dense - 1 : dense;
+    layer_stack_t * stack = &net->layers;
+
+    stack->input_shape.channels = 1;
+    stack->input_shape.rows = 1;
+    stack->input_shape.cols = net->nodes.data[0];
+    stack->activation = net->activation;
+    stack->precision = net->precision;
+    stack->transpose_weights = net->transpose_weights;
+    stack->data = calloc (size, sizeof(layer_t));
+    RETURN_ERR_ON_BAD_ALLOC(stack->data);
+    stack->size = size;
+
+    for (uint32_t l = 0, i = 0; l < dense; ++l) {
+        stack->data[i].type = LAYER_DENSE;
+        stack->data[i++].size = net->nodes.data[l + 1];
+        if (dropout && l + 1 < dense)
+            stack->data[i++].type = LAYER_DROPOUT;
+    }
+
+    return layer_stack_allocate (stack, mode);
+}
+
+// Point the network's arrays at the dense layers
+static err_t
+network_views (network_t * const net)
+{
+    const uint32_t dense = net->nodes.size - 1;
+    const uint8_t train = net->mode == NETWORK_TRAIN;
+    const uint8_t dropout = net->layers.size > dense;
+    const uint8_t transposed = net->layers.data[0].weights_t != NULL;
+    err_t err = GSL_SUCCESS;
+
+    err |= matrix_array_view (&net->weights, dense);
+    err |= vector_array_view (&net->biases, dense);
+    err |= vector_array_view (&net->outputs, dense);
+    if (transposed)
+        err |= matrix_array_view (&net->weights_t, dense);
+    if (train) {
+        err |= matrix_array_view (&net->nabla_w, dense);
+        err |= vector_array_view (&net->nabla_b, dense);
+        err |= vector_array_view (&net->output_delta, dense);
+    }
+    if (dropout)
+        err |= vector_array_view (&net->dropout_mask, dense - 1);
+    RETURN_ON_ERR(err);
+
+    for (uint32_t l = 0, i = 0; l < dense; ++l, ++i) {
+        const layer_t * layer = &net->layers.data[i];
+
+        net->weights.data[l] = layer->weights;
+        net->biases.data[l] = layer->biases;
+        if (transposed)
+            net->weights_t.data[l] = layer->weights_t;
+        if (train) {
+            net->nabla_w.data[l] = layer->nabla_w;
+            net->nabla_b.data[l] = layer->nabla_b;
+            net->output_delta.data[l] = layer->output_delta;
+        }
+
+        // The next layer reads the output after dropout
+        if (dropout && l + 1 < dense)
+            net->dropout_mask.data[l] = net->layers.data[++i].mask;
+        net->outputs.data[l] = net->layers.data[i].output;
+    }
 
-    return err;
+    return GSL_SUCCESS;
+}
+
+err_t
+network_allocate (network_t * const net)
+{
+    const layer_stack_mode_t mode = net->mode == NETWORK_TRAIN ?
+            LAYER_STACK_TRAIN : LAYER_STACK_INFER;
+    err_t err;
+
+    network_clear (net);
+    xoshiro256_seed (&net->dropout_rng, 0);
+
+    // The first dense layer takes the flattened feature output
+    if (net->features.size) {
+        net->features.activation = net->activation;
+        net->features.precision = net->precision;
+        net->features.transpose_weights = net->transpose_weights;
+        net->features.input_delta = NULL;
+        err = layer_stack_allocate (&net->features, mode);
+        RETURN_ON_ERR(err);
+        net->nodes.data[0] = layer_stack_output_size (&net->features);
+    }
+
+    err = network_layers_allocate (net, mode);
+    RETURN_ON_ERR(err);
+
+    // Where the dense layers leave the error for the feature layers
+    if (net->features.size && mode == LAYER_STACK_TRAIN)
+        net->layers.input_delta = layer_stack_output_delta (&net->features);
+
+    return network_views (net);
 }
 
 void
 network_free (network_t * const net)
 {
-    vector_array_free (&net->outputs);
-    vector_array_free (&net->zs);
-    vector_array_free (&net->nabla_b);
-    vector_array_free (&net->output_delta);
-    vector_array_free (&net->biases);
-
-    matrix_array_free (&net->nabla_w);
-    matrix_array_free (&net->weights);
+    // The arrays only point into the layers
+    free (net->outputs.data);
+    free (net->nabla_b.data);
+    free (net->output_delta.data);
+    free (net->biases.data);
+    free (net->dropout_mask.data);
+    free (net->nabla_w.data);
+    free (net->weights.data);
+    free (net->weights_t.data);
+
+    layer_stack_free (&net->layers);
+    free (net->layers.data);
+
+    if (net->features.size)
+        layer_stack_free (&net->features);
+}
+
+/*
+ * Report the memory held by the parameters, and by the activations and
+ * deltas as planned, as they would be with a buffer each, and the most
+ * live at once.
+ */
+void
+network_print_memory (const network_t * const net)
+{
+    const layer_stack_t * stacks[] = { &net->features, &net->layers };
+    size_t params = 0;
+    size_t planned = 0;
+    size_t unplanned = 0;
+    size_t peak = 0;
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        if (!stacks[i]->size)
+            continue;
+        params += layer_stack_param_bytes (stacks[i]);
+        planned += memory_plan_bytes (&stacks[i]->plan);
+        unplanned += memory_plan_unplanned_bytes (&stacks[i]->plan);
+        peak += memory_plan_peak_bytes (&stacks[i]->plan);
+    }
+
+    printf ("Parameters: %zu bytes\n", params);
+    printf ("Activations: %zu bytes planned, %zu unplanned, %zu peak live\n",
+            planned, unplanned, peak);
 }
 
 void
@@ -70,59 +238,307 @@ network_random_init (network_t * const net, const double var)
 
     vector_array_set_rand (&net->biases, rng, var);
     matrix_array_set_rand (&net->weights, rng, var);
+    layer_stack_set_rand (&net->features, rng, var);
+    network_refresh_weights_t (net);
 
     gsl_rng_free (rng);
 }
 
+/*
+ * Bring the transposed and 16 bit copies of the weights up to date after
+ * the weights are set other than by training. A no-op without either.
+ */
+void
+network_refresh_weights_t (network_t * const net)
+{
+    layer_stack_refresh_copies (&net->features);
+    layer_stack_refresh_copies (&net->layers);
+}
+
+/*
+ * Point the network at an input image. With feature layers the image
+ * goes to the first of them and the dense input is their output.
+ */
+void
+network_set_input (network_t * const net, const gsl_vector * const input)
+{
+    if (net->features.size)
+        net->features.input = input;
+    else
+        net->layers.input = input;
+}
+
 /*
  * Calculate the output vector from the input
  *
+ * When training (train set) and dropout is enabled the hidden layer
+ * outputs are multiplied by the current dropout masks.
+ */
+void
+network_feed_forward (network_t * const net, const uint8_t train)
+{
+    if (net->features.size) {
+        layer_stack_feed_forward (&net->features, train);
+        net->layers.input = layer_stack_output (&net->features);
+    }
+
+    layer_stack_feed_forward (&net->layers, train);
+}
+
+/*
+ * Plan the batch buffers as network_plan does for inference: the output of
+ * layer l is written at step l + 1 and read at step l + 2, and the
+ * flattened feature output, if any, is written at step 0.
  */
+err_t
+network_batch_allocate (network_batch_t * const batch,
+                        const network_t * const net,
+                        const uint32_t size)
+{
+    const uint32_t layers = net->weights.size;
+    int32_t buffers[layers + 1];
+
+    assert(size > 0);
+    batch->size = size;
+    batch->input = NULL;
+    batch->outputs.size = 0;
+    batch->outputs.data = NULL;
+
+    // Allocated here so a pass never has to
+    err_t err = kernel_gemm_buffers_allocate (&batch->gemm);
+    RETURN_ON_ERR(err);
+    err = memory_plan_allocate (&batch->plan, layers + 1);
+    RETURN_ON_ERR(err);
+
+    for (uint32_t l = 0; l < layers; ++l) {
+        buffers[l] = memory_plan_add (&batch->plan,
+                                      size * net->nodes.data[l + 1], l + 1,
+                                      l + 2);
+    }
+    if (net->features.size)
+        buffers[layers] = memory_plan_add (&batch->plan,
+                                           size * net->nodes.data[0], 0, 1);
+
+    err = memory_plan_build (&batch->plan);
+    RETURN_ON_ERR(err);
+
+    batch->outputs.data = malloc (sizeof(gsl_matrix *) * layers);
+    RETURN_ERR_ON_BAD_ALLOC(batch->outputs.data);
+
+    for (uint32_t l = 0; l < layers; ++l) {
+        gsl_block * slot = batch->plan.slots[batch->plan.data[buffers[l]].slot];
+        batch->outputs.data[l] = gsl_matrix_alloc_from_block (
+                slot, 0, size, net->nodes.data[l + 1],
+                net->nodes.data[l + 1]);
+        RETURN_ERR_ON_BAD_ALLOC(batch->outputs.data[l]);
+        batch->outputs.size++;
+    }
+
+    if (net->features.size) {
+        gsl_block * slot = batch->plan.slots[
+                batch->plan.data[buffers[layers]].slot];
+        batch->input = gsl_matrix_alloc_from_block (slot, 0, size,
+                                                    net->nodes.data[0],
+                                                    net->nodes.data[0]);
+        RETURN_ERR_ON_BAD_ALLOC(batch->input);
+    }
+
+    return GSL_SUCCESS;
+}
+
 void
-network_feed_forward (const network_t * const net, const uint8_t store_z)
+network_batch_free (network_batch_t * const batch)
 {
-    uint32_t whole_layers = net->nodes.size - 1;
+    // The matrices are views on the plan's slots
+    matrix_array_free (&batch->outputs);
+    if (batch->input)
+        gsl_matrix_free (batch->input);
 
-    for (int32_t i = 0; i < whole_layers; ++i)
-    {
-        // a^l = w^l * a^(l-1) + b^l
-        gsl_blas_dgemv (CblasNoTrans, 1.0, net->weights.data[i],
-                        net->outputs.data[i - 1], 0.0, net->outputs.data[i]);
+    memory_plan_free (&batch->plan);
+    kernel_gemm_buffers_free (&batch->gemm);
+}
+
+/*
+ * Run the feature layers over each sample in turn, collecting their
+ * flattened outputs as the rows of the dense input.
+ */
+static void
+network_batch_features (network_t * const net, network_batch_t * const batch,
+                        const double * const inputs, const uint32_t rows)
+{
+    const size_t width = shape_size (&net->features.input_shape);
+    const gsl_vector * saved = net->features.input;
+
+    for (uint32_t r = 0; r < rows; ++r) {
+        gsl_vector_const_view input = gsl_vector_const_view_array (
+                inputs + r * width, width);
+        net->features.input = &input.vector;
+        layer_stack_feed_forward (&net->features, 0);
+        gsl_matrix_set_row (batch->input, r,
+                            layer_stack_output (&net->features));
+    }
+
+    net->features.input = saved;
+}
+
+/*
+ * Classify samples rows of inputs, in passes of up to batch->size. Each
+ * row holds one image, or one input to the first dense layer when there
+ * are no feature layers. Either of classes, one per sample, and outputs,
+ * samples x nodes[L - 1] output activations, may be NULL.
+ *
+ * With the samples as rows, A^l = sigma(A^(l-1) * W^l^T + 1 * b^l^T).
+ */
+err_t
+network_predict_batch (network_t * const net,
+                       network_batch_t * const batch,
+                       const double * const inputs,
+                       const uint32_t samples,
+                       uint32_t * const classes,
+                       double * const outputs)
+{
+    const uint32_t layers = net->weights.size;
+    const uint32_t classes_size = net->nodes.data[layers];
+    const size_t width = net->features.size ?
+            shape_size (&net->features.input_shape) : net->nodes.data[0];
+
+    for (uint32_t start = 0; start < samples; start += batch->size) {
+        const uint32_t rows = samples - start < batch->size ?
+                samples - start : batch->size;
+        const double * chunk = inputs + (size_t) start * width;
+
+        gsl_matrix_const_view input = gsl_matrix_const_view_array (
+                chunk, rows, net->nodes.data[0]);
+        if (net->features.size) {
+            network_batch_features (net, batch, chunk, rows);
+            input = gsl_matrix_const_submatrix (batch->input, 0, 0, rows,
+                                                net->nodes.data[0]);
+        }
+        const gsl_matrix * a = &input.matrix;
+        gsl_matrix_view out[layers];
+
+        for (uint32_t l = 0; l < layers; ++l) {
+            const gsl_vector * b = net->biases.data[l];
+            out[l] = gsl_matrix_submatrix (batch->outputs.data[l], 0, 0, rows,
+                                           b->size);
+
+            if (rows < NETWORK_BATCH_MIN_GEMM) {
+                for (uint32_t r = 0; r < rows; ++r) {
+                    gsl_vector_const_view x = gsl_matrix_const_row (a, r);
+                    gsl_vector_view y = gsl_matrix_row (&out[l].matrix, r);
+                    err_t err = kernel_dense_forward (net->weights.data[l],
+                                                      &x.vector, b, NULL,
+                                                      &y.vector,
+                                                      net->activation);
+                    RETURN_ON_ERR(err);
+                }
+                a = &out[l].matrix;
+                continue;
+            }
+
+            for (uint32_t r = 0; r < rows; ++r) {
+                gsl_matrix_set_row (&out[l].matrix, r, b);
+            }
+
+            err_t err = nnet_dgemm (CblasNoTrans, CblasTrans, 1.0, a,
+                                    net->weights.data[l], 1.0, &out[l].matrix,
+                                    &batch->gemm);
+            RETURN_ON_ERR(err);
+
+            // The rows are contiguous, so the block is too
+            kernel_sigmoid (out[l].matrix.data, out[l].matrix.data,
+                            rows * b->size, net->activation);
+            a = &out[l].matrix;
+        }
+
+        for (uint32_t r = 0; classes && r < rows; ++r) {
+            gsl_vector_const_view row = gsl_matrix_const_row (a, r);
+            classes[start + r] = gsl_vector_max_index (&row.vector);
+        }
+
+        if (outputs)
+            memcpy (outputs + (size_t) start * classes_size, a->data,
+                    sizeof(double) * rows * classes_size);
+    }
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Shuffle index, a permutation of the items, for the next epoch.
+ *
+ * With a block size, the order of the blocks of consecutive items is
+ * shuffled and then the items within each block, so a mini-batch gathers
+ * from a few nearby regions of the data rather than all over it. blocks
+ * holds a permutation of the (items + block - 1) / block blocks, kept
+ * between calls. Without, index is shuffled as a whole.
+ */
+void
+network_shuffle_index (gsl_rng * const rng,
+                       uint32_t * const index,
+                       uint32_t * const blocks,
+                       const uint32_t items,
+                       const uint32_t block)
+{
+    if (!block || block >= items) {
+        gsl_ran_shuffle (rng, index, items, sizeof(uint32_t));
+        return;
+    }
 
-        gsl_blas_daxpy (1.0, net->biases.data[i], net->outputs.data[i]);
+    const uint32_t count = (items + block - 1) / block;
+    gsl_ran_shuffle (rng, blocks, count, sizeof(uint32_t));
 
-        if (store_z)
-            gsl_vector_memcpy (net->zs.data[i], net->outputs.data[i]);
+    uint32_t * out = index;
+    for (uint32_t b = 0; b < count; ++b) {
+        const uint32_t first = blocks[b] * block;
+        const uint32_t size = items - first < block ? items - first : block;
 
-        vector_vectorise (net->outputs.data[i], &sigmoid);
+        for (uint32_t i = 0; i < size; ++i) {
+            out[i] = first + i;
+        }
+        gsl_ran_shuffle (rng, out, size, sizeof(uint32_t));
+        out += size;
     }
 }
 
 /*
  * 	Stochastic Gradient Descent
  */
-void
+err_t
 network_sgd (network_t * const net,
              const data_t * const data,
              const data_t * const test_data)
 {
+    const uint32_t block = net->shuffle_block;
+    const uint32_t count = block ? (data->items + block - 1) / block : 0;
+
     // Use default random seed of 0
     gsl_rng * rng = gsl_rng_alloc (gsl_rng_mt19937);
-
-    // Index array used to address labels and images in random order
-    uint32_t rand_index[data->items];
+    RETURN_ERR_ON_BAD_ALLOC(rng);
+
+    // Index array used to address labels and images in random order, on
+    // the heap as it grows with the data
+    uint32_t * rand_index = malloc (data->items * sizeof(uint32_t));
+    uint32_t * blocks = malloc ((count ? count : 1) * sizeof(uint32_t));
+    if (!rand_index || !blocks) {
+        free (rand_index);
+        free (blocks);
+        gsl_rng_free (rng);
+        return GSL_ENOMEM;
+    }
     for (uint32_t i = 0; i < data->items; ++i) {
         rand_index[i] = i;
     }
+    for (uint32_t i = 0; i < count; ++i) {
+        blocks[i] = i;
+    }
 
     for (uint32_t i = 0; i < net->epochs; ++i)
     {
         // Randomise the index array
-        gsl_ran_shuffle (rng, rand_index,
-                         sizeof(rand_index) / sizeof(rand_index[0]),
-                         sizeof(rand_index[0]));
+        network_shuffle_index (rng, rand_index, blocks, data->items, block);
 
-        network_process_mini_batches (net, data, &rand_index[0],
+        network_process_mini_batches (net, data, rand_index,
                                       &network_update_mini_batch);
 
         uint32_t correct_answers = 0;
@@ -131,7 +547,50 @@ network_sgd (network_t * const net,
         printf ("Epoch %i complete, %i/%i correct.\n", i, correct_answers,
                 test_data->items);
     }
+
+    free (blocks);
+    free (rand_index);
     gsl_rng_free (rng);
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * As network_sgd, but each epoch reads the training data from the stream
+ * a mini-batch at a time, so it need not fit in memory
+ */
+err_t
+network_sgd_stream (network_t * const net,
+                    stream_t * const stream,
+                    const data_t * const test_data)
+{
+    uint32_array_t slice = { .data = stream->order };
+
+    for (uint32_t i = 0; i < net->epochs; ++i)
+    {
+        err_t err = stream_rewind (stream);
+        RETURN_ON_ERR(err);
+
+        uint32_t batches = 0;
+        for (;;) {
+            err = stream_next (stream);
+            RETURN_ON_ERR(err);
+            if (!stream->batch.items)
+                break;
+
+            slice.size = stream->batch.items;
+            network_update_mini_batch (net, &stream->batch, &slice);
+            batches++;
+        }
+
+        uint32_t correct_answers = 0;
+        network_evaluate_test_data (net, test_data, &correct_answers);
+
+        printf ("Epoch %i complete, %i batches streamed, %i/%i correct.\n",
+                i, batches, correct_answers, test_data->items);
+    }
+
+    return GSL_SUCCESS;
 }
 
 void
@@ -170,96 +629,52 @@ network_update_mini_batch (network_t * const net,
                            const uint32_array_t * const slice)
 {
     assert(slice->size != 0);
+    assert(net->mode == NETWORK_TRAIN);
 
     // Reset batch averages
-    vector_array_zero (&net->nabla_b);
-    matrix_array_set_zero (&net->nabla_w);
+    layer_stack_zero_gradients (&net->layers);
+    layer_stack_zero_gradients (&net->features);
 
     // Apply SGD to the mini-batch
     for (uint32_t i = 0; i < slice->size; ++i) {
         uint32_t random_index = slice->data[i];
-        net->outputs.data[INPUT_INDEX] = data->images.images[random_index];
+        network_set_input (net, data->images.images[random_index]);
         network_backpropagate_error (net, data->labels.labels[random_index]);
     }
 
     // Update weights and biases
     double scale_fac = net->eta / slice->size;
 
-    uint32_t whole_layers = net->nodes.size - 1;
-    for (uint32_t i = 0; i < whole_layers; ++i) {
-        gsl_matrix_scale (net->nabla_w.data[i], scale_fac);
-        gsl_matrix_sub (net->weights.data[i], net->nabla_w.data[i]);
-
-        gsl_vector_scale (net->nabla_b.data[i], scale_fac);
-        gsl_vector_sub (net->biases.data[i], net->nabla_b.data[i]);
-    }
-}
-
-void
-network_get_output_error (network_t * const net, const uint8_t label)
-{
-    uint32_t output_layer_index = net->outputs.size - 1;
-
-    gsl_vector * cost_deriv = gsl_vector_alloc (
-            net->outputs.data[output_layer_index]->size);
-
-    cost_derivative (net->outputs.data[output_layer_index], label, cost_deriv);
-
-    gsl_vector_memcpy (net->output_delta.data[output_layer_index],
-                       net->zs.data[output_layer_index]);
-
-    vector_vectorise (net->output_delta.data[output_layer_index],
-                      &sigmoid_prime);
-
-    gsl_vector_mul (net->output_delta.data[output_layer_index], cost_deriv);
-
-    gsl_vector_free (cost_deriv);
+    layer_stack_update (&net->layers, scale_fac);
+    layer_stack_update (&net->features, scale_fac);
 }
 
 /*
- * Accumulate cost function gradients
+ * The error w.r.t. the output activations, from which the output layer
+ * takes its delta
  */
 void
-network_accumulate_cfgs (network_t * const net, const int32_t layer)
+network_get_output_error (network_t * const net, const uint8_t label)
 {
-    // Y = alphaX + Y
-    gsl_blas_daxpy (1.0, net->output_delta.data[layer],
-                    net->nabla_b.data[layer]);
-
-    // A = [delta] * [activations]^T + A
-    gsl_blas_dger (1.0, net->output_delta.data[layer],
-                   net->outputs.data[layer - 1], net->nabla_w.data[layer]);
+    cost_derivative (layer_stack_output (&net->layers), label,
+                     layer_stack_output_delta (&net->layers));
 }
 
 void
 network_backpropagate_error (network_t * const net, const uint8_t label)
 {
+    // Draw a fresh set of hidden nodes to drop for this sample
+    if (net->dropout > 0.0)
+        vector_array_set_dropout_mask (&net->dropout_mask, &net->dropout_rng,
+                                       net->dropout);
+
     network_feed_forward (net, 1);
     network_get_output_error (net, label);
 
-    uint32_t output_layer_index = net->outputs.size - 1;
-    network_accumulate_cfgs (net, output_layer_index);
-
-    // Back propagate
-    for (int32_t l = output_layer_index - 1; l >= 0; --l)
-    {
-        gsl_vector_memcpy (net->output_delta.data[l], net->zs.data[l]);
-
-        vector_vectorise (net->output_delta.data[l], &sigmoid_prime);
-
-        gsl_vector * tmp = gsl_vector_alloc (net->output_delta.data[l]->size);
-
-        // Y = alpha(A^T) + beta(Y)
-        gsl_blas_dgemv (CblasTrans, 1.0, net->weights.data[l + 1],
-                        net->output_delta.data[l + 1], 0.0, tmp);
-
-        // Back-propagated delta
-        gsl_vector_mul (net->output_delta.data[l], tmp);
-
-        network_accumulate_cfgs (net, l);
-
-        gsl_vector_free (tmp);
-    }
+    // The dense layers leave the error w.r.t. their input to the features
+    layer_stack_backpropagate (&net->layers);
+    if (net->features.size)
+        layer_stack_backpropagate (&net->features);
 }
 
 void
@@ -281,7 +696,7 @@ network_evaluate_test_data (network_t * const net,
     uint32_t output;
 
     for (uint32_t i = 0; i < test_data->items; ++i) {
-        net->outputs.data[INPUT_INDEX] = test_data->images.images[i];
+        network_set_input (net, test_data->images.images[i]);
 
         network_get_output (net, &output);
         if (output == test_data->labels.labels[i])
@@ -295,6 +710,13 @@ sigmoid (double z)
     return 1.0 / (1.0 + exp (-z));
 }
 
+// As sigmoid, using fast_exp
+double
+sigmoid_fast (double z)
+{
+    return 1.0 / (1.0 + fast_exp (-z));
+}
+
 double
 sigmoid_prime (double z)
 {
@@ -27,31 +27,71 @@ extern "C" {
 #endif
 
 #include "errors.h"
+#include "half.h"
+#include "kernels.h"
+#include "layer.h"
 #include "loader.h"
 #include "math_utils.h"
+#include "stream.h"
 
 #include <math.h>
 #include <stdint.h>
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_matrix.h>
+#include <gsl/gsl_rng.h>
 
-#define INPUT_INDEX -1
+// Smaller batches run row by row, packing the weights for a GEMM costs more
+#define NETWORK_BATCH_MIN_GEMM 8
+
+typedef enum
+{
+    NETWORK_TRAIN,
+    NETWORK_INFER // Weights and biases only, activations share storage
+} network_mode_t;
 
 typedef struct
 {
+    network_mode_t mode;
     double eta;
     uint32_t epochs;
     uint32_t mini_batch_size;
+    uint32_t shuffle_block; // Items shuffled together each epoch, 0 for all
+    double dropout; // Probability of dropping a hidden node, 0 to disable
+    uint8_t transpose_weights; // Keep weights_t for the backward pass
+    activation_mode_t activation;
+    precision_t precision; // Of the working copy of the dense weights
     uint32_array_t nodes;
-    vector_array_t outputs; // Input is at [-1]
-    vector_array_t zs;
+    layer_stack_t features; // Optional layers ahead of nodes[0]
+    layer_stack_t layers; // A dense layer for each of nodes[1] on
+    /*
+     * Views on the dense layers, by nodes[l + 1]. Each output is the one
+     * the next layer reads, after dropout, and each delta holds dC/dz
+     * once the error is back propagated.
+     */
+    vector_array_t outputs;
     vector_array_t nabla_b;
     vector_array_t output_delta;
     vector_array_t biases;
     matrix_array_t weights;
+    matrix_array_t weights_t; // Transposed copy, when transpose_weights
     matrix_array_t nabla_w;
+    vector_array_t dropout_mask; // Hidden layers, when dropout is set
+    xoshiro256_t dropout_rng;
 } network_t;
 
+/*
+ * Buffers for classifying a batch of samples at once, as rows of
+ * size x nodes[l] matrices so each layer is one GEMM.
+ */
+typedef struct
+{
+    uint32_t size; // Samples per pass
+    gsl_matrix * input; // Flattened feature output, with feature layers
+    matrix_array_t outputs;
+    memory_plan_t plan;
+    kernel_gemm_buffers_t gemm;
+} network_batch_t;
+
 typedef void
 (*update_batch_f) (network_t * const,
                    const data_t * const,
@@ -63,14 +103,35 @@ network_free (network_t * const network);
 err_t
 network_allocate (network_t * const network);
 
+void
+network_print_memory (const network_t * const network);
+
+void
+network_refresh_weights_t (network_t * const network);
+
 void
 network_random_init (network_t * const network, const double var);
 
 void
+network_set_input (network_t * const network, const gsl_vector * const input);
+
+void
+network_shuffle_index (gsl_rng * const rng,
+                       uint32_t * const index,
+                       uint32_t * const blocks,
+                       const uint32_t items,
+                       const uint32_t block);
+
+err_t
 network_sgd (network_t * const network,
              const data_t * const data,
              const data_t * const test_data);
 
+err_t
+network_sgd_stream (network_t * const network,
+                    stream_t * const stream,
+                    const data_t * const test_data);
+
 void
 network_process_mini_batches (network_t * const network,
                               const data_t * const data,
@@ -85,9 +146,6 @@ network_update_mini_batch (network_t * const network,
 void
 network_get_output_error (network_t * const network, const uint8_t label);
 
-void
-network_accumulate_cfgs (network_t * const network, const int32_t layer);
-
 void
 network_backpropagate_error (network_t * const network, const uint8_t label);
 
@@ -100,11 +158,30 @@ void
 network_evaluate_output (network_t * const network, uint32_t * const output);
 
 void
-network_feed_forward (const network_t * const network, const uint8_t store_z);
+network_feed_forward (network_t * const network, const uint8_t train);
+
+err_t
+network_batch_allocate (network_batch_t * const batch,
+                        const network_t * const network,
+                        const uint32_t size);
+
+void
+network_batch_free (network_batch_t * const batch);
+
+err_t
+network_predict_batch (network_t * const network,
+                       network_batch_t * const batch,
+                       const double * const inputs,
+                       const uint32_t samples,
+                       uint32_t * const classes,
+                       double * const outputs);
 
 double
 sigmoid (double z);
 
+double
+sigmoid_fast (double z);
+
 double
 sigmoid_prime (double z);
 
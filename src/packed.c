@@ -0,0 +1,261 @@
+/*
+ *   packed.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For posix_memalign and sched_setaffinity
+#define _GNU_SOURCE
+
+#include "packed.h"
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define PACKED_AVX2
+#include <immintrin.h>
+#endif
+
+static uint32_t
+pad (const uint32_t n)
+{
+    return (n + PACKED_ALIGN - 1) / PACKED_ALIGN * PACKED_ALIGN;
+}
+
+/*
+ * Lay out the layers one after another: the weights, then the biases of
+ * each, then the two activation buffers and a padded copy of the input.
+ * Every part is a multiple of PACKED_ALIGN doubles so each starts on a
+ * cache line.
+ */
+err_t
+packed_network_allocate (packed_network_t * const packed,
+                         const network_t * const net)
+{
+    const uint32_t layers = net->nodes.size - 1;
+
+    packed->data = NULL;
+    if (net->features.size || layers > PACKED_MAX_LAYERS)
+        return GSL_EINVAL;
+
+    packed->layers = layers;
+    packed->activation = net->activation;
+
+    size_t doubles = 0;
+    uint32_t widest = 0;
+    for (uint32_t l = 0; l <= layers; ++l) {
+        packed->sizes[l] = net->nodes.data[l];
+        packed->padded[l] = pad (net->nodes.data[l]);
+        widest = packed->padded[l] > widest ? packed->padded[l] : widest;
+        if (l)
+            doubles += (size_t) packed->padded[l]
+                    * (packed->padded[l - 1] + 1);
+    }
+    doubles += 3 * widest;
+
+    packed->bytes = doubles * sizeof(double);
+    void * data = NULL;
+    if (posix_memalign (&data, PACKED_ALIGN * sizeof(double), packed->bytes))
+        return GSL_ENOMEM;
+
+    // The padding stays zero, so it adds nothing to the sums
+    packed->data = data;
+    memset (packed->data, 0, packed->bytes);
+
+    double * next = packed->data;
+    for (uint32_t l = 0; l < layers; ++l) {
+        packed->weights[l] = next;
+        next += (size_t) packed->padded[l + 1] * packed->padded[l];
+        packed->biases[l] = next;
+        next += packed->padded[l + 1];
+    }
+    packed->activations[0] = next;
+    packed->activations[1] = next + widest;
+    packed->input = next + 2 * widest;
+
+    packed_network_refresh (packed, net);
+
+    return GSL_SUCCESS;
+}
+
+void
+packed_network_free (packed_network_t * const packed)
+{
+    free (packed->data);
+    packed->data = NULL;
+}
+
+/*
+ * Copy the weights and biases in again, eg. after more training
+ */
+void
+packed_network_refresh (packed_network_t * const packed,
+                        const network_t * const net)
+{
+    for (uint32_t l = 0; l < packed->layers; ++l) {
+        const gsl_matrix * w = net->weights.data[l];
+        const gsl_vector * b = net->biases.data[l];
+
+        for (size_t i = 0; i < w->size1; ++i) {
+            memcpy (packed->weights[l] + i * packed->padded[l],
+                    w->data + i * w->tda, w->size2 * sizeof(double));
+            packed->biases[l][i] = gsl_vector_get (b, i);
+        }
+    }
+}
+
+/*
+ * Read every line of the weights and biases, to bring them back into
+ * cache after the thread has been idle. The sum is only returned so the
+ * reads are not optimised away.
+ */
+double
+packed_network_warm (const packed_network_t * const packed)
+{
+    double sum = 0.0;
+    const double * end = packed->activations[0];
+
+    for (const double * p = packed->data; p < end; p += PACKED_ALIGN) {
+        sum += *p;
+    }
+
+    return sum;
+}
+
+/*
+ * z = w * x + b for one layer. cols is a multiple of PACKED_ALIGN, as is
+ * rows so that whole groups of four rows can be taken, and w is aligned.
+ */
+static void
+packed_layer (const double * const w, const double * const b,
+              const double * const x, const size_t rows, const size_t cols,
+              double * const z)
+{
+#ifdef PACKED_AVX2
+    for (size_t i = 0; i < rows; i += 4) {
+        const double * w0 = w + i * cols;
+        const double * w1 = w0 + cols;
+        const double * w2 = w1 + cols;
+        const double * w3 = w2 + cols;
+
+        // Two sums per row to keep eight FMAs in flight
+        __m256d s0 = _mm256_setzero_pd (), t0 = _mm256_setzero_pd ();
+        __m256d s1 = _mm256_setzero_pd (), t1 = _mm256_setzero_pd ();
+        __m256d s2 = _mm256_setzero_pd (), t2 = _mm256_setzero_pd ();
+        __m256d s3 = _mm256_setzero_pd (), t3 = _mm256_setzero_pd ();
+
+        for (size_t j = 0; j < cols; j += 8) {
+            __m256d x0 = _mm256_loadu_pd (x + j);
+            __m256d x1 = _mm256_loadu_pd (x + j + 4);
+            s0 = _mm256_fmadd_pd (_mm256_load_pd (w0 + j), x0, s0);
+            t0 = _mm256_fmadd_pd (_mm256_load_pd (w0 + j + 4), x1, t0);
+            s1 = _mm256_fmadd_pd (_mm256_load_pd (w1 + j), x0, s1);
+            t1 = _mm256_fmadd_pd (_mm256_load_pd (w1 + j + 4), x1, t1);
+            s2 = _mm256_fmadd_pd (_mm256_load_pd (w2 + j), x0, s2);
+            t2 = _mm256_fmadd_pd (_mm256_load_pd (w2 + j + 4), x1, t2);
+            s3 = _mm256_fmadd_pd (_mm256_load_pd (w3 + j), x0, s3);
+            t3 = _mm256_fmadd_pd (_mm256_load_pd (w3 + j + 4), x1, t3);
+        }
+
+        // Reduce the four rows into one vector of their sums
+        __m256d h01 = _mm256_hadd_pd (_mm256_add_pd (s0, t0),
+                                      _mm256_add_pd (s1, t1));
+        __m256d h23 = _mm256_hadd_pd (_mm256_add_pd (s2, t2),
+                                      _mm256_add_pd (s3, t3));
+        __m256d sums = _mm256_add_pd (_mm256_permute2f128_pd (h01, h23, 0x20),
+                                      _mm256_permute2f128_pd (h01, h23, 0x31));
+        _mm256_store_pd (z + i, _mm256_add_pd (sums, _mm256_load_pd (b + i)));
+    }
+#else
+    for (size_t i = 0; i < rows; ++i) {
+        const double * row = w + i * cols;
+        double sum = b[i];
+        for (size_t j = 0; j < cols; ++j) {
+            sum += row[j] * x[j];
+        }
+        z[i] = sum;
+    }
+#endif
+}
+
+/*
+ * Classify one input of sizes[0] doubles, copying the output activations
+ * to output unless it is NULL.
+ */
+uint32_t
+packed_network_predict (packed_network_t * const packed,
+                        const double * const input,
+                        double * const output)
+{
+    const double * x = input;
+
+    // Inputs that don't fill their last line are read from a padded copy
+    if (packed->sizes[0] != packed->padded[0]) {
+        memcpy (packed->input, input, packed->sizes[0] * sizeof(double));
+        x = packed->input;
+    }
+
+    double * a = packed->activations[0];
+    for (uint32_t l = 0; l < packed->layers; ++l) {
+        a = packed->activations[l & 1];
+        packed_layer (packed->weights[l], packed->biases[l], x,
+                      packed->padded[l + 1], packed->padded[l], a);
+
+        // The padding rows are left at zero for the next layer
+        kernel_sigmoid (a, a, packed->sizes[l + 1], packed->activation);
+        x = a;
+    }
+
+    const uint32_t outputs = packed->sizes[packed->layers];
+    uint32_t best = 0;
+    for (uint32_t i = 1; i < outputs; ++i) {
+        best = a[i] > a[best] ? i : best;
+    }
+
+    if (output)
+        memcpy (output, a, outputs * sizeof(double));
+
+    return best;
+}
+
+/*
+ * Pin the calling thread to one CPU, so its caches stay warm and it isn't
+ * migrated in the middle of a request.
+ */
+err_t
+packed_network_pin (const uint32_t cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity (0, sizeof(set), &set))
+        return GSL_EFAILED;
+
+    return GSL_SUCCESS;
+#else
+    return GSL_EUNSUP;
+#endif
+}
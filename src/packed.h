@@ -0,0 +1,87 @@
+/*
+ *   packed.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKED_H_
+#define PACKED_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "math_utils.h"
+#include "nnet.h"
+
+#include <stdint.h>
+
+#define PACKED_MAX_LAYERS 8
+
+// Rows are padded to a whole cache line of doubles
+#define PACKED_ALIGN 8
+
+/*
+ * A copy of the dense layers of a network laid out for one sample at a
+ * time with the least latency. The weights, biases and activations are
+ * in a single cache line aligned block, each layer's rows padded with
+ * zeros to PACKED_ALIGN, so a prediction walks memory in order and does
+ * no allocation or dispatch.
+ */
+typedef struct
+{
+    uint32_t layers;
+    uint32_t sizes[PACKED_MAX_LAYERS + 1]; // Input at [0]
+    uint32_t padded[PACKED_MAX_LAYERS + 1];
+    double * weights[PACKED_MAX_LAYERS];
+    double * biases[PACKED_MAX_LAYERS];
+    double * activations[2]; // Alternate between the layers
+    double * input; // Padded copy, when the input doesn't fill its lines
+    activation_mode_t activation;
+    size_t bytes;
+    double * data;
+} packed_network_t;
+
+err_t
+packed_network_allocate (packed_network_t * const packed,
+                         const network_t * const network);
+
+void
+packed_network_free (packed_network_t * const packed);
+
+void
+packed_network_refresh (packed_network_t * const packed,
+                        const network_t * const network);
+
+double
+packed_network_warm (const packed_network_t * const packed);
+
+uint32_t
+packed_network_predict (packed_network_t * const packed,
+                        const double * const input,
+                        double * const output);
+
+err_t
+packed_network_pin (const uint32_t cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PACKED_H_ */
@@ -0,0 +1,257 @@
+/*
+ *   planner.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "planner.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+err_t
+memory_plan_allocate (memory_plan_t * const plan, const uint32_t capacity)
+{
+    plan->size = 0;
+    plan->requested = 0;
+    plan->capacity = capacity;
+    plan->num_slots = 0;
+    plan->slots = NULL;
+    plan->data = malloc ((capacity ? capacity : 1) * sizeof(*plan->data));
+    RETURN_ERR_ON_BAD_ALLOC(plan->data);
+
+    return GSL_SUCCESS;
+}
+
+void
+memory_plan_free (memory_plan_t * const plan)
+{
+    for (uint32_t i = 0; i < plan->num_slots; ++i) {
+        gsl_block_free (plan->slots[i]);
+    }
+
+    free (plan->slots);
+    free (plan->data);
+    plan->slots = NULL;
+    plan->data = NULL;
+    plan->num_slots = 0;
+    plan->size = 0;
+}
+
+/*
+ * Request a buffer, returning its index in the plan
+ */
+int32_t
+memory_plan_add (memory_plan_t * const plan,
+                 const uint32_t size,
+                 const uint32_t first,
+                 const uint32_t last)
+{
+    assert(plan->size < plan->capacity);
+    assert(first <= last);
+
+    buffer_lifetime_t * buffer = &plan->data[plan->size];
+    buffer->size = size;
+    buffer->first = first;
+    buffer->last = last;
+    buffer->alias = PLAN_NO_ALIAS;
+    buffer->slot = 0;
+    plan->requested += size;
+
+    return plan->size++;
+}
+
+/*
+ * Make a buffer share the storage of an earlier one, eg. so an activation
+ * can overwrite its input. The earlier buffer grows to cover the size and
+ * lifetime of both. The caller is responsible for the overwrite being safe.
+ */
+void
+memory_plan_alias (memory_plan_t * const plan,
+                   const int32_t buffer,
+                   const int32_t target)
+{
+    assert(target < buffer);
+
+    int32_t root_index = target;
+    while (plan->data[root_index].alias != PLAN_NO_ALIAS) {
+        root_index = plan->data[root_index].alias;
+    }
+
+    buffer_lifetime_t * root = &plan->data[root_index];
+    const buffer_lifetime_t * shared = &plan->data[buffer];
+    root->size = shared->size > root->size ? shared->size : root->size;
+    root->first = shared->first < root->first ? shared->first : root->first;
+    root->last = shared->last > root->last ? shared->last : root->last;
+
+    plan->data[buffer].alias = root_index;
+}
+
+/*
+ * The last step at which the storage behind a buffer is needed
+ */
+uint32_t
+memory_plan_last_use (const memory_plan_t * const plan, const int32_t buffer)
+{
+    int32_t root = plan->data[buffer].alias;
+    return plan->data[root == PLAN_NO_ALIAS ? buffer : root].last;
+}
+
+/*
+ * Assign each buffer a slot such that no two buffers in a slot are live
+ * at the same time, then allocate the slots.
+ *
+ * Buffers are placed in order of their first use. Each goes in the
+ * smallest free slot that fits, otherwise the largest free slot is grown,
+ * otherwise a new slot is opened.
+ */
+err_t
+memory_plan_build (memory_plan_t * const plan)
+{
+    uint32_t * order = malloc ((plan->size + 1) * sizeof(*order));
+    uint32_t * slot_size = malloc ((plan->size + 1) * sizeof(*slot_size));
+    int64_t * slot_free = malloc ((plan->size + 1) * sizeof(*slot_free));
+    plan->slots = malloc ((plan->size + 1) * sizeof(*plan->slots));
+
+    if (!order || !slot_size || !slot_free || !plan->slots) {
+        free (order);
+        free (slot_size);
+        free (slot_free);
+        return GSL_ENOMEM;
+    }
+
+    // Insertion sort of the roots by first use, it's a short list
+    uint32_t num_roots = 0;
+    for (uint32_t i = 0; i < plan->size; ++i) {
+        if (plan->data[i].alias != PLAN_NO_ALIAS)
+            continue;
+
+        uint32_t j = num_roots++;
+        while (j > 0
+                && plan->data[order[j - 1]].first > plan->data[i].first) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    plan->num_slots = 0;
+    for (uint32_t i = 0; i < num_roots; ++i) {
+        const buffer_lifetime_t * root = &plan->data[order[i]];
+        int32_t fit = -1;
+        int32_t largest = -1;
+
+        for (uint32_t s = 0; s < plan->num_slots; ++s) {
+            if (slot_free[s] >= (int64_t) root->first)
+                continue;
+            if (slot_size[s] >= root->size
+                    && (fit < 0 || slot_size[s] < slot_size[fit]))
+                fit = s;
+            if (largest < 0 || slot_size[s] > slot_size[largest])
+                largest = s;
+        }
+
+        int32_t slot = fit >= 0 ? fit : largest;
+        if (slot < 0) {
+            slot = plan->num_slots++;
+            slot_size[slot] = 0;
+        }
+
+        if (root->size > slot_size[slot])
+            slot_size[slot] = root->size;
+        slot_free[slot] = root->last;
+        plan->data[order[i]].slot = slot;
+    }
+
+    for (uint32_t i = 0; i < plan->size; ++i) {
+        if (plan->data[i].alias != PLAN_NO_ALIAS)
+            plan->data[i].slot = plan->data[plan->data[i].alias].slot;
+    }
+
+    err_t err = GSL_SUCCESS;
+    uint32_t allocated = 0;
+    for (; allocated < plan->num_slots; ++allocated) {
+        plan->slots[allocated] = gsl_block_alloc (slot_size[allocated]);
+        if (!plan->slots[allocated]) {
+            err = GSL_ENOMEM;
+            break;
+        }
+    }
+    plan->num_slots = allocated;
+
+    free (order);
+    free (slot_size);
+    free (slot_free);
+
+    return err;
+}
+
+double *
+memory_plan_data (const memory_plan_t * const plan, const int32_t buffer)
+{
+    assert(buffer >= 0 && buffer < plan->size);
+    return plan->slots[plan->data[buffer].slot]->data;
+}
+
+/*
+ * Bytes allocated by the plan
+ */
+size_t
+memory_plan_bytes (const memory_plan_t * const plan)
+{
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < plan->num_slots; ++i) {
+        bytes += plan->slots[i]->size * sizeof(double);
+    }
+
+    return bytes;
+}
+
+/*
+ * Bytes needed with a separate allocation for every buffer
+ */
+size_t
+memory_plan_unplanned_bytes (const memory_plan_t * const plan)
+{
+    return plan->requested * sizeof(double);
+}
+
+/*
+ * The most bytes live at any one step, a lower bound for any plan
+ */
+size_t
+memory_plan_peak_bytes (const memory_plan_t * const plan)
+{
+    size_t peak = 0;
+
+    for (uint32_t i = 0; i < plan->size; ++i) {
+        uint32_t step = plan->data[i].first;
+        size_t live = 0;
+
+        for (uint32_t j = 0; j < plan->size; ++j) {
+            const buffer_lifetime_t * buffer = &plan->data[j];
+            if (buffer->alias == PLAN_NO_ALIAS && buffer->first <= step
+                    && step <= buffer->last)
+                live += buffer->size;
+        }
+
+        peak = live > peak ? live : peak;
+    }
+
+    return peak * sizeof(double);
+}
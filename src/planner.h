@@ -0,0 +1,100 @@
+/*
+ *   planner.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLANNER_H_
+#define PLANNER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <gsl/gsl_block.h>
+
+#define PLAN_NO_ALIAS -1
+
+/*
+ * A buffer which must hold its contents from step first to step last,
+ * inclusive. Steps are whatever the caller sequences, eg. one per layer
+ * forward then one per layer backward.
+ */
+typedef struct
+{
+    uint32_t size; // Elements
+    uint32_t first;
+    uint32_t last;
+    int32_t alias; // Buffer to share storage with, for in-place operations
+    uint32_t slot; // Assigned by memory_plan_build
+} buffer_lifetime_t;
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t capacity;
+    size_t requested; // Elements over all buffers
+    buffer_lifetime_t * data;
+    uint32_t num_slots;
+    gsl_block ** slots;
+} memory_plan_t;
+
+err_t
+memory_plan_allocate (memory_plan_t * const plan, const uint32_t capacity);
+
+void
+memory_plan_free (memory_plan_t * const plan);
+
+int32_t
+memory_plan_add (memory_plan_t * const plan,
+                 const uint32_t size,
+                 const uint32_t first,
+                 const uint32_t last);
+
+void
+memory_plan_alias (memory_plan_t * const plan,
+                   const int32_t buffer,
+                   const int32_t target);
+
+uint32_t
+memory_plan_last_use (const memory_plan_t * const plan, const int32_t buffer);
+
+err_t
+memory_plan_build (memory_plan_t * const plan);
+
+double *
+memory_plan_data (const memory_plan_t * const plan, const int32_t buffer);
+
+size_t
+memory_plan_bytes (const memory_plan_t * const plan);
+
+size_t
+memory_plan_unplanned_bytes (const memory_plan_t * const plan);
+
+size_t
+memory_plan_peak_bytes (const memory_plan_t * const plan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PLANNER_H_ */
@@ -0,0 +1,331 @@
+/*
+ *   quant.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "quant.h"
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+#define QUANT_VNNI
+#include <immintrin.h>
+#elif defined(__AVX2__)
+#define QUANT_AVX2
+#include <immintrin.h>
+#endif
+
+// The loader scales pixels by this, so it is the step of the input codes
+#define QUANT_PIXEL_SCALE (1.0 / 255.0)
+
+const char *
+quant_isa (void)
+{
+#if defined(QUANT_VNNI)
+    return "avx512-vnni";
+#elif defined(QUANT_AVX2)
+    return "avx2";
+#else
+    return "portable";
+#endif
+}
+
+/*
+ * The sum of codes * weights over n, a multiple of QUANT_ALIGN.
+ *
+ * VNNI multiplies the unsigned codes by the signed weights and adds each
+ * four products straight into 32 bits. AVX2's vpmaddubsw would add pairs
+ * into 16 bits, which saturates at 255 * 127 * 2, so instead the bytes
+ * are widened and vpmaddwd adds pairs of 16 bit products into 32 bits.
+ */
+int32_t
+quant_dot (const uint8_t * const codes, const int8_t * const weights,
+           const size_t n)
+{
+#if defined(QUANT_VNNI)
+    __m256i sum = _mm256_setzero_si256 ();
+
+    for (size_t j = 0; j < n; j += QUANT_ALIGN) {
+        __m256i c = _mm256_loadu_si256 ((const __m256i *) (codes + j));
+        __m256i w = _mm256_loadu_si256 ((const __m256i *) (weights + j));
+        sum = _mm256_dpbusd_epi32 (sum, c, w);
+    }
+#elif defined(QUANT_AVX2)
+    __m256i sum = _mm256_setzero_si256 ();
+
+    for (size_t j = 0; j < n; j += 16) {
+        __m128i c = _mm_loadu_si128 ((const __m128i *) (codes + j));
+        __m128i w = _mm_loadu_si128 ((const __m128i *) (weights + j));
+        sum = _mm256_add_epi32 (sum, _mm256_madd_epi16 (
+                _mm256_cvtepu8_epi16 (c), _mm256_cvtepi8_epi16 (w)));
+    }
+#else
+    int32_t total = 0;
+
+    for (size_t j = 0; j < n; ++j) {
+        total += (int32_t) codes[j] * weights[j];
+    }
+
+    return total;
+#endif
+
+#if defined(QUANT_VNNI) || defined(QUANT_AVX2)
+    __m128i half = _mm_add_epi32 (_mm256_castsi256_si128 (sum),
+                                  _mm256_extracti128_si256 (sum, 1));
+    half = _mm_add_epi32 (half, _mm_shuffle_epi32 (half, 0x4e));
+    half = _mm_add_epi32 (half, _mm_shuffle_epi32 (half, 0xb1));
+    return _mm_cvtsi128_si32 (half);
+#endif
+}
+
+static void
+quant_layer_set_scales (quant_layer_t * const layer)
+{
+    for (uint32_t i = 0; i < layer->rows; ++i) {
+        layer->scales[i] = layer->weight_scales[i] * layer->input_scale;
+    }
+}
+
+/*
+ * Quantise each row of w symmetrically, so its largest magnitude maps
+ * to 127
+ */
+static err_t
+quant_layer_allocate (quant_layer_t * const layer, const gsl_matrix * const w,
+                      const gsl_vector * const b, const double input_scale)
+{
+    layer->rows = w->size1;
+    layer->cols = w->size2;
+    layer->stride = (w->size2 + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN;
+    layer->input_scale = input_scale;
+
+    layer->weights = calloc ((size_t) layer->rows * layer->stride, 1);
+    layer->weight_scales = malloc (layer->rows * sizeof(double));
+    layer->scales = malloc (layer->rows * sizeof(double));
+    layer->biases = malloc (layer->rows * sizeof(double));
+    RETURN_ERR_ON_BAD_ALLOC(layer->weights);
+    RETURN_ERR_ON_BAD_ALLOC(layer->weight_scales);
+    RETURN_ERR_ON_BAD_ALLOC(layer->scales);
+    RETURN_ERR_ON_BAD_ALLOC(layer->biases);
+
+    for (uint32_t i = 0; i < layer->rows; ++i) {
+        const double * row = w->data + i * w->tda;
+        double max = 0.0;
+        for (uint32_t j = 0; j < layer->cols; ++j) {
+            max = fabs (row[j]) > max ? fabs (row[j]) : max;
+        }
+
+        double scale = max > 0.0 ? max / 127.0 : 1.0;
+        int8_t * q = layer->weights + (size_t) i * layer->stride;
+        for (uint32_t j = 0; j < layer->cols; ++j) {
+            q[j] = (int8_t) lrint (row[j] / scale);
+        }
+
+        layer->weight_scales[i] = scale;
+        layer->biases[i] = gsl_vector_get (b, i);
+    }
+
+    quant_layer_set_scales (layer);
+
+    return GSL_SUCCESS;
+}
+
+static void
+quant_layer_free (quant_layer_t * const layer)
+{
+    free (layer->weights);
+    free (layer->weight_scales);
+    free (layer->scales);
+    free (layer->biases);
+}
+
+/*
+ * Until calibrated the hidden outputs are quantised over the whole range
+ * of the sigmoid
+ */
+err_t
+quant_network_allocate (quant_network_t * const quant,
+                        const network_t * const net)
+{
+    const uint32_t layers = net->nodes.size - 1;
+
+    memset (quant, 0, sizeof(*quant));
+    if (net->features.size || layers > QUANT_MAX_LAYERS)
+        return GSL_EINVAL;
+
+    quant->layers = layers;
+    quant->activation = net->activation;
+
+    uint32_t widest = 0;
+    for (uint32_t l = 0; l < layers; ++l) {
+        quant_layer_t * layer = &quant->layer[l];
+        err_t err = quant_layer_allocate (layer, net->weights.data[l],
+                                          net->biases.data[l],
+                                          QUANT_PIXEL_SCALE);
+        RETURN_ON_ERR(err);
+        widest = layer->stride > widest ? layer->stride : widest;
+        widest = layer->rows > widest ? layer->rows : widest;
+    }
+
+    quant->codes[0] = calloc (widest, 1);
+    quant->codes[1] = calloc (widest, 1);
+    quant->input = calloc (quant->layer[0].stride, 1);
+    quant->zs = malloc (widest * sizeof(double));
+    RETURN_ERR_ON_BAD_ALLOC(quant->codes[0]);
+    RETURN_ERR_ON_BAD_ALLOC(quant->codes[1]);
+    RETURN_ERR_ON_BAD_ALLOC(quant->input);
+    RETURN_ERR_ON_BAD_ALLOC(quant->zs);
+
+    return GSL_SUCCESS;
+}
+
+void
+quant_network_free (quant_network_t * const quant)
+{
+    for (uint32_t l = 0; l < quant->layers; ++l) {
+        quant_layer_free (&quant->layer[l]);
+    }
+
+    free (quant->codes[0]);
+    free (quant->codes[1]);
+    free (quant->input);
+    free (quant->zs);
+}
+
+/*
+ * Set the step of each hidden layer's output codes from the largest
+ * activation over the first items of data, run through the network in
+ * double.
+ */
+void
+quant_network_calibrate (quant_network_t * const quant,
+                         network_t * const net,
+                         const data_t * const data,
+                         const uint32_t items)
+{
+    double max[QUANT_MAX_LAYERS] = { 0.0 };
+
+    for (uint32_t i = 0; i < items && i < data->items; ++i) {
+        network_set_input (net, data->images.images[i]);
+        network_feed_forward (net, 0);
+
+        for (uint32_t l = 0; l + 1 < quant->layers; ++l) {
+            double m = gsl_vector_max (net->outputs.data[l]);
+            max[l] = m > max[l] ? m : max[l];
+        }
+    }
+
+    for (uint32_t l = 0; l + 1 < quant->layers; ++l) {
+        if (max[l] > 0.0) {
+            quant->layer[l + 1].input_scale = max[l] / 255.0;
+            quant_layer_set_scales (&quant->layer[l + 1]);
+        }
+    }
+}
+
+/*
+ * Bytes of weights, scales and biases
+ */
+size_t
+quant_network_bytes (const quant_network_t * const quant)
+{
+    size_t bytes = 0;
+
+    for (uint32_t l = 0; l < quant->layers; ++l) {
+        const quant_layer_t * layer = &quant->layer[l];
+        bytes += (size_t) layer->rows * layer->cols
+                + 2 * layer->rows * sizeof(double);
+    }
+
+    return bytes;
+}
+
+/*
+ * Classify one image of raw pixels, copying the output activations to
+ * output unless it is NULL
+ */
+uint32_t
+quant_network_predict (quant_network_t * const quant,
+                       const uint8_t * const pixels,
+                       double * const output)
+{
+    const uint8_t * codes = pixels;
+    double * zs = quant->zs;
+
+    if (quant->layer[0].cols != quant->layer[0].stride) {
+        memcpy (quant->input, pixels, quant->layer[0].cols);
+        codes = quant->input;
+    }
+
+    for (uint32_t l = 0; l < quant->layers; ++l) {
+        const quant_layer_t * layer = &quant->layer[l];
+
+        for (uint32_t i = 0; i < layer->rows; ++i) {
+            int32_t dot = quant_dot (codes, layer->weights
+                                     + (size_t) i * layer->stride,
+                                     layer->stride);
+            zs[i] = layer->scales[i] * dot + layer->biases[i];
+        }
+
+        kernel_sigmoid (zs, zs, layer->rows, quant->activation);
+
+        if (l + 1 == quant->layers)
+            break;
+
+        // Requantise for the next layer, its padding stays zero
+        uint8_t * next = quant->codes[l & 1];
+        const double step = quant->layer[l + 1].input_scale;
+        for (uint32_t i = 0; i < layer->rows; ++i) {
+            long code = lrint (zs[i] / step);
+            next[i] = code > 255 ? 255 : (uint8_t) code;
+        }
+        codes = next;
+    }
+
+    const uint32_t outputs = quant->layer[quant->layers - 1].rows;
+    uint32_t best = 0;
+    for (uint32_t i = 1; i < outputs; ++i) {
+        best = zs[i] > zs[best] ? i : best;
+    }
+
+    if (output)
+        memcpy (output, zs, outputs * sizeof(double));
+
+    return best;
+}
+
+void
+quant_network_evaluate (quant_network_t * const quant,
+                        const data_t * const test_data,
+                        uint32_t * const correct_answers)
+{
+    const size_t pixels = (size_t) test_data->images.rows
+            * test_data->images.cols;
+
+    *correct_answers = 0;
+    for (uint32_t i = 0; i < test_data->items; ++i) {
+        uint32_t output = quant_network_predict (
+                quant, test_data->images.pixels + i * pixels, NULL);
+        if (output == test_data->labels.labels[i])
+            (*correct_answers)++;
+    }
+}
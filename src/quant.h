@@ -0,0 +1,115 @@
+/*
+ *   quant.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUANT_H_
+#define QUANT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+#include "loader.h"
+#include "math_utils.h"
+#include "nnet.h"
+
+#include <stdint.h>
+
+#define QUANT_MAX_LAYERS 8
+
+// Rows of codes are padded with zeros to a whole AVX2 register
+#define QUANT_ALIGN 32
+
+/*
+ * A dense layer with int8 weights, scaled per row, taking uint8 codes of
+ * its input. Output i is
+ *
+ *   z_i = scales_i * sum_j weights_ij * code_j + biases_i
+ *
+ * where scales_i is the weight scale of the row times input_scale, the
+ * value of one step of the input codes.
+ */
+typedef struct
+{
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t stride; // cols padded to QUANT_ALIGN
+    int8_t * weights;
+    double * weight_scales;
+    double * scales;
+    double * biases;
+    double input_scale;
+} quant_layer_t;
+
+/*
+ * The dense layers of a network quantised after training. The input is
+ * the raw uint8 pixels, each hidden output is quantised to uint8 against
+ * the largest activation seen in calibration, and the output layer is
+ * left in double.
+ */
+typedef struct
+{
+    uint32_t layers;
+    quant_layer_t layer[QUANT_MAX_LAYERS];
+    uint8_t * codes[2]; // Alternate between the hidden layers
+    uint8_t * input; // Padded copy of the pixels
+    double * zs;
+    activation_mode_t activation;
+} quant_network_t;
+
+const char *
+quant_isa (void);
+
+int32_t
+quant_dot (const uint8_t * const codes, const int8_t * const weights,
+           const size_t n);
+
+err_t
+quant_network_allocate (quant_network_t * const quant,
+                        const network_t * const network);
+
+void
+quant_network_free (quant_network_t * const quant);
+
+void
+quant_network_calibrate (quant_network_t * const quant,
+                         network_t * const network,
+                         const data_t * const data,
+                         const uint32_t items);
+
+size_t
+quant_network_bytes (const quant_network_t * const quant);
+
+uint32_t
+quant_network_predict (quant_network_t * const quant,
+                       const uint8_t * const pixels,
+                       double * const output);
+
+void
+quant_network_evaluate (quant_network_t * const quant,
+                        const data_t * const test_data,
+                        uint32_t * const correct_answers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QUANT_H_ */
@@ -0,0 +1,188 @@
+/*
+ *   queue.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The indexes only grow, a slot is the index masked. The acquire and
+ * release pairs publish an item's contents along with its slot.
+ */
+
+static int
+queue_capacity_ok (const uint32_t capacity)
+{
+    return capacity && !(capacity & (capacity - 1));
+}
+
+err_t
+spsc_queue_allocate (spsc_queue_t * const q, const uint32_t capacity)
+{
+    memset (q, 0, sizeof(*q));
+    if (!queue_capacity_ok (capacity))
+        return GSL_EINVAL;
+
+    q->mask = capacity - 1;
+    q->slots = calloc (capacity, sizeof(void *));
+    RETURN_ERR_ON_BAD_ALLOC(q->slots);
+
+    return GSL_SUCCESS;
+}
+
+void
+spsc_queue_free (spsc_queue_t * const q)
+{
+    free (q->slots);
+    q->slots = NULL;
+}
+
+/*
+ * Producer only, returns non-zero if full
+ */
+int
+spsc_queue_push (spsc_queue_t * const q, void * const item)
+{
+    const uint64_t tail = q->tail;
+
+    if (tail - q->head_cache > q->mask) {
+        q->head_cache = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+        if (tail - q->head_cache > q->mask)
+            return -1;
+    }
+
+    q->slots[tail & q->mask] = item;
+    __atomic_store_n (&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * Consumer only, returns NULL if empty
+ */
+void *
+spsc_queue_pop (spsc_queue_t * const q)
+{
+    const uint64_t head = q->head;
+
+    if (head == q->tail_cache) {
+        q->tail_cache = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+        if (head == q->tail_cache)
+            return NULL;
+    }
+
+    void * item = q->slots[head & q->mask];
+    __atomic_store_n (&q->head, head + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
+
+err_t
+mpsc_queue_allocate (mpsc_queue_t * const q, const uint32_t capacity)
+{
+    memset (q, 0, sizeof(*q));
+    if (!queue_capacity_ok (capacity))
+        return GSL_EINVAL;
+
+    q->mask = capacity - 1;
+    q->cells = malloc (capacity * sizeof(mpsc_cell_t));
+    RETURN_ERR_ON_BAD_ALLOC(q->cells);
+
+    // Slot i is free for the producer of index i
+    for (uint32_t i = 0; i < capacity; ++i) {
+        q->cells[i].sequence = i;
+    }
+
+    return GSL_SUCCESS;
+}
+
+void
+mpsc_queue_free (mpsc_queue_t * const q)
+{
+    free (q->cells);
+    q->cells = NULL;
+}
+
+/*
+ * Any thread, returns non-zero if full
+ */
+int
+mpsc_queue_push (mpsc_queue_t * const q, void * const item)
+{
+    uint64_t tail = __atomic_load_n (&q->tail, __ATOMIC_RELAXED);
+    mpsc_cell_t * cell;
+
+    for (;;) {
+        cell = &q->cells[tail & q->mask];
+        uint64_t seq = __atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t) (seq - tail);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n (&q->tail, &tail, tail + 1, 1,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            tail = __atomic_load_n (&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->item = item;
+    __atomic_store_n (&cell->sequence, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * Consumer only, returns NULL if empty, or if the next producer has
+ * claimed its slot but not yet filled it
+ */
+void *
+mpsc_queue_pop (mpsc_queue_t * const q)
+{
+    const uint64_t head = q->head;
+    mpsc_cell_t * cell = &q->cells[head & q->mask];
+    uint64_t seq = __atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE);
+
+    if (seq != head + 1)
+        return NULL;
+
+    void * item = cell->item;
+    __atomic_store_n (&cell->sequence, head + q->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n (&q->head, head + 1, __ATOMIC_RELAXED);
+
+    return item;
+}
+
+/*
+ * Items claimed but not yet popped, a snapshot from any thread
+ */
+uint64_t
+mpsc_queue_size (const mpsc_queue_t * const q)
+{
+    uint64_t head = __atomic_load_n (&q->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n (&q->tail, __ATOMIC_RELAXED);
+
+    return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,109 @@
+/*
+ *   queue.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUEUE_H_
+#define QUEUE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+
+#include <stdint.h>
+
+// Keeps the producer and consumer ends of a queue off each other's lines
+#define QUEUE_CACHE_LINE 64
+
+/*
+ * Bounded lock-free queues of pointers, capacity a power of two.
+ *
+ * spsc_queue_t has one producer and one consumer thread. Each end caches
+ * the other's index, so only a full or empty queue touches the other's
+ * cache line.
+ */
+typedef struct
+{
+    void ** slots;
+    uint64_t mask;
+    uint8_t pad0[QUEUE_CACHE_LINE];
+    uint64_t head; // Consumer
+    uint64_t tail_cache;
+    uint8_t pad1[QUEUE_CACHE_LINE];
+    uint64_t tail; // Producer
+    uint64_t head_cache;
+    uint8_t pad2[QUEUE_CACHE_LINE];
+} spsc_queue_t;
+
+/*
+ * mpsc_queue_t has any number of producers and one consumer. Each slot
+ * carries a sequence number saying whose turn it is, so producers only
+ * contend on claiming the tail, as in Vyukov's bounded queue.
+ */
+typedef struct
+{
+    uint64_t sequence;
+    void * item;
+} mpsc_cell_t;
+
+typedef struct
+{
+    mpsc_cell_t * cells;
+    uint64_t mask;
+    uint8_t pad0[QUEUE_CACHE_LINE];
+    uint64_t head; // Consumer
+    uint8_t pad1[QUEUE_CACHE_LINE];
+    uint64_t tail; // Producers
+    uint8_t pad2[QUEUE_CACHE_LINE];
+} mpsc_queue_t;
+
+err_t
+spsc_queue_allocate (spsc_queue_t * const queue, const uint32_t capacity);
+
+void
+spsc_queue_free (spsc_queue_t * const queue);
+
+int
+spsc_queue_push (spsc_queue_t * const queue, void * const item);
+
+void *
+spsc_queue_pop (spsc_queue_t * const queue);
+
+err_t
+mpsc_queue_allocate (mpsc_queue_t * const queue, const uint32_t capacity);
+
+void
+mpsc_queue_free (mpsc_queue_t * const queue);
+
+int
+mpsc_queue_push (mpsc_queue_t * const queue, void * const item);
+
+void *
+mpsc_queue_pop (mpsc_queue_t * const queue);
+
+uint64_t
+mpsc_queue_size (const mpsc_queue_t * const queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QUEUE_H_ */
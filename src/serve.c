@@ -0,0 +1,884 @@
+/*
+ *   serve.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Classify images for other processes:
+ *
+ *   ./serve [-b max batch] [-l budget us] [-s stats seconds]
+ *           [-t io threads] [-w workers] [-p pipeline]
+ *           network.nnet unix:/tmp/nnet.sock | tcp:5000 | shm:nnet
+ *
+ * A request is the nodes[0] raw pixels of one image, 784 bytes for MNIST,
+ * and the reply is one byte, its class, in the order of the requests. A
+ * connection may have up to the pipeline depth of requests outstanding.
+ * If a request can't be classified its connection is closed instead.
+ * TCP listens on localhost only.
+ *
+ * Each I/O thread runs an epoll loop over non-blocking sockets. Whole
+ * requests go to the connection's compute worker, a batcher with its own
+ * copy of the network, through the batcher's MPSC queue. Results come
+ * back through an SPSC queue per worker and I/O thread, and an eventfd
+ * wakes the I/O thread for them.
+ *
+ * shm: serves processes on the same host from a shared memory ring
+ * instead, see shm.h. The clients write images straight into the ring,
+ * and one thread classifies whatever is ready in each pass, without
+ * waiting out a budget. Requests that can't be classified get SHM_FAILED.
+ *
+ * SIGHUP reloads the checkpoint without dropping connections or requests.
+ * Passes already running finish on the old network and later ones use the
+ * new, which must be the same shape. Save checkpoints with
+ * checkpoint_save, which renames the finished file into place.
+ */
+
+// For getopt, sigaction, accept4, eventfd and epoll
+#define _GNU_SOURCE
+
+#include "address.h"
+#include "batcher.h"
+#include "checkpoint.h"
+#include "errors.h"
+#include "histogram.h"
+#include "nnet.h"
+#include "queue.h"
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVE_MAX_BATCH 64
+#define SERVE_BUDGET_US 200
+#define SERVE_STATS_SECONDS 10
+#define SERVE_IO_THREADS 1
+#define SERVE_WORKERS 1
+#define SERVE_PIPELINE 8
+#define SERVE_MAX_WORKERS 64
+
+// Requests in flight per I/O thread, and so the size of its queues back
+#define SERVE_IO_INFLIGHT 2048
+#define SERVE_EVENTS 64
+
+typedef struct io_thread io_thread_t;
+
+/*
+ * Requests cycle through the slots in order: read into, submitted,
+ * completed, and their label sent
+ */
+typedef struct connection
+{
+    io_thread_t * io;
+    int fd;
+    uint32_t worker;
+    uint8_t readable; // Data may be waiting, edge triggered
+    uint8_t writing; // Waiting on EPOLLOUT
+    uint8_t closed;
+    uint8_t held; // On the backlog
+    uint32_t fill; // Bytes read of the request being read
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t sent;
+    batch_request_t * slots;
+    uint8_t * pixels;
+    uint8_t * labels;
+    struct connection * prev;
+    struct connection * next;
+    struct connection * backlog; // Readable, but held back by the limit
+    struct connection * dead; // Closed, to free once nothing is in flight
+} connection_t;
+
+struct io_thread
+{
+    pthread_t thread;
+    int epoll;
+    int event; // eventfd
+    uint32_t notified;
+    uint32_t inflight;
+    spsc_queue_t completions[SERVE_MAX_WORKERS];
+    connection_t * connections;
+    connection_t * backlog;
+    connection_t * dead;
+    uint32_t open;
+};
+
+typedef struct
+{
+    uint32_t inputs;
+    uint32_t pipeline;
+    uint32_t workers;
+    int listener;
+    batcher_t * batchers;
+    uint32_t next_worker;
+} server_t;
+
+static server_t server;
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t reloading = 0;
+
+static void
+serve_signal (int sig)
+{
+    if (sig == SIGHUP)
+        reloading = 1;
+    else
+        __atomic_store_n (&stopping, 1, __ATOMIC_RELAXED);
+}
+
+static void
+serve_handle_signals (void)
+{
+    struct sigaction sa = { .sa_handler = &serve_signal };
+
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+    sigaction (SIGHUP, &sa, NULL);
+    signal (SIGPIPE, SIG_IGN);
+}
+
+/*
+ * From the worker's thread. The first completion since the I/O thread
+ * last looked wakes it.
+ */
+static void
+serve_done (batch_request_t * const req)
+{
+    connection_t * conn = req->context;
+    io_thread_t * io = conn->io;
+
+    // Never full, it holds all the I/O thread may have in flight
+    spsc_queue_push (&io->completions[conn->worker], req);
+
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n (&io->notified, 1, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write (io->event, &one, sizeof(one)) < 0)
+            perror ("eventfd");
+    }
+}
+
+static void
+serve_watch (connection_t * const conn, const uint8_t writing)
+{
+    struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLRDHUP | EPOLLET
+                    | (writing ? EPOLLOUT : 0),
+            .data.ptr = conn
+    };
+
+    conn->writing = writing;
+    epoll_ctl (conn->io->epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void
+serve_free (connection_t * const conn)
+{
+    io_thread_t * io = conn->io;
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        io->connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    free (conn->slots);
+    free (conn->pixels);
+    free (conn->labels);
+    free (conn);
+}
+
+/*
+ * Stop serving a connection. It is freed between epoll waits, once
+ * nothing is in flight and it is off the backlog.
+ */
+static void
+serve_close (connection_t * const conn)
+{
+    io_thread_t * io = conn->io;
+
+    if (conn->closed)
+        return;
+
+    conn->closed = 1;
+    close (conn->fd);
+    batcher_detach (&server.batchers[conn->worker]);
+    __atomic_sub_fetch (&io->open, 1, __ATOMIC_RELAXED);
+
+    conn->dead = io->dead;
+    io->dead = conn;
+}
+
+static void
+serve_reap (io_thread_t * const io)
+{
+    connection_t ** link = &io->dead;
+
+    while (*link) {
+        connection_t * conn = *link;
+        if (conn->completed == conn->submitted && !conn->held) {
+            *link = conn->dead;
+            serve_free (conn);
+        } else {
+            link = &conn->dead;
+        }
+    }
+}
+
+/*
+ * Send the labels completed, in order
+ */
+static void
+serve_flush (connection_t * const conn)
+{
+    uint8_t out[SERVE_PIPELINE * 8];
+    uint32_t n = 0;
+
+    if (conn->closed)
+        return;
+
+    for (uint64_t i = conn->sent; i < conn->completed; ++i) {
+        out[n++] = conn->labels[i % server.pipeline];
+    }
+
+    if (n) {
+        ssize_t written = write (conn->fd, out, n);
+        if (written < 0 && errno != EAGAIN && errno != EINTR) {
+            serve_close (conn);
+            return;
+        }
+        conn->sent += written > 0 ? written : 0;
+    }
+
+    if ((conn->sent < conn->completed) != conn->writing)
+        serve_watch (conn, conn->sent < conn->completed);
+}
+
+/*
+ * Read and submit whole requests while there are free slots and the
+ * I/O thread is under its limit. Returns non-zero if held back by the
+ * limit with data still to read.
+ */
+static int
+serve_read (connection_t * const conn)
+{
+    io_thread_t * io = conn->io;
+    const uint32_t inputs = server.inputs;
+
+    while (conn->readable && !conn->closed) {
+        if (conn->submitted - conn->sent >= server.pipeline)
+            return 0; // Resumes as its labels are sent
+        if (io->inflight >= SERVE_IO_INFLIGHT)
+            return 1;
+
+        const uint32_t slot = conn->submitted % server.pipeline;
+        uint8_t * pixels = conn->pixels + (size_t) slot * inputs;
+        ssize_t got = read (conn->fd, pixels + conn->fill,
+                            inputs - conn->fill);
+
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+            serve_close (conn);
+            return 0;
+        }
+        if (got < 0) {
+            conn->readable = errno == EINTR;
+            continue;
+        }
+
+        conn->fill += got;
+        if (conn->fill < inputs)
+            continue;
+
+        batch_request_t * req = &conn->slots[slot];
+        req->pixels = pixels;
+        req->done = &serve_done;
+        req->context = conn;
+        conn->fill = 0;
+        conn->submitted++;
+        io->inflight++;
+        batcher_submit (&server.batchers[conn->worker], req);
+    }
+
+    return 0;
+}
+
+static void
+serve_backlog (io_thread_t * const io, connection_t * const conn)
+{
+    if (!conn->held) {
+        conn->held = 1;
+        conn->backlog = io->backlog;
+        io->backlog = conn;
+    }
+}
+
+static void
+serve_accept (io_thread_t * const io)
+{
+    for (;;) {
+        int fd = accept4 (server.listener, NULL, NULL,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+        int one = 1;
+
+        if (fd < 0)
+            return;
+
+        // Fails harmlessly on Unix sockets
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        connection_t * conn = calloc (1, sizeof(*conn));
+        if (conn) {
+            conn->slots = calloc (server.pipeline, sizeof(batch_request_t));
+            conn->pixels = malloc ((size_t) server.pipeline * server.inputs);
+            conn->labels = malloc (server.pipeline);
+        }
+        if (!conn || !conn->slots || !conn->pixels || !conn->labels) {
+            if (conn) {
+                free (conn->slots);
+                free (conn->pixels);
+                free (conn->labels);
+            }
+            free (conn);
+            close (fd);
+            continue;
+        }
+
+        conn->io = io;
+        conn->fd = fd;
+        conn->worker = __atomic_fetch_add (&server.next_worker, 1,
+                                          __ATOMIC_RELAXED) % server.workers;
+        conn->next = io->connections;
+        if (io->connections)
+            io->connections->prev = conn;
+        io->connections = conn;
+        __atomic_add_fetch (&io->open, 1, __ATOMIC_RELAXED);
+        batcher_attach (&server.batchers[conn->worker]);
+
+        struct epoll_event ev = {
+                .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+                .data.ptr = conn
+        };
+        epoll_ctl (io->epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+/*
+ * Take the completions from every worker, send the labels, then let
+ * held back connections read again
+ */
+static void
+serve_complete (io_thread_t * const io)
+{
+    uint64_t count;
+    if (read (io->event, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror ("eventfd");
+
+    __atomic_store_n (&io->notified, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    for (uint32_t w = 0; w < server.workers; ++w) {
+        batch_request_t * req;
+        while ((req = spsc_queue_pop (&io->completions[w]))) {
+            connection_t * conn = req->context;
+
+            // Send what came before, then drop the connection
+            if (req->label == BATCHER_FAILED) {
+                serve_flush (conn);
+                serve_close (conn);
+            }
+
+            conn->labels[conn->completed % server.pipeline] = req->label;
+            conn->completed++;
+            io->inflight--;
+
+            serve_flush (conn);
+            if (serve_read (conn))
+                serve_backlog (io, conn);
+        }
+    }
+
+    connection_t * backlog = io->backlog;
+    io->backlog = NULL;
+    while (backlog) {
+        connection_t * conn = backlog;
+        backlog = conn->backlog;
+        conn->backlog = NULL;
+        conn->held = 0;
+        if (serve_read (conn))
+            serve_backlog (io, conn);
+    }
+}
+
+static void *
+serve_io (void * arg)
+{
+    io_thread_t * io = arg;
+    struct epoll_event events[SERVE_EVENTS];
+
+    while (!__atomic_load_n (&stopping, __ATOMIC_RELAXED)) {
+        int n = epoll_wait (io->epoll, events, SERVE_EVENTS, 100);
+
+        for (int i = 0; i < n; ++i) {
+            void * ptr = events[i].data.ptr;
+
+            if (ptr == &server) {
+                serve_accept (io);
+            } else if (ptr == io) {
+                serve_complete (io);
+            } else {
+                connection_t * conn = ptr;
+                uint32_t ev = events[i].events;
+
+                // Sending labels may free slots to read more into
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                    conn->readable = 1;
+                if (ev & EPOLLOUT)
+                    serve_flush (conn);
+                if (serve_read (conn))
+                    serve_backlog (io, conn);
+            }
+        }
+
+        serve_reap (io);
+    }
+
+    return NULL;
+}
+
+static err_t
+serve_io_start (io_thread_t * const io)
+{
+    err_t err;
+
+    memset (io, 0, sizeof(*io));
+    io->epoll = epoll_create1 (EPOLL_CLOEXEC);
+    io->event = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->epoll < 0 || io->event < 0)
+        return GSL_EFAILED;
+
+    for (uint32_t w = 0; w < server.workers; ++w) {
+        err = spsc_queue_allocate (&io->completions[w], SERVE_IO_INFLIGHT);
+        RETURN_ON_ERR(err);
+    }
+
+    // Each accept wakes one of the I/O threads
+    struct epoll_event listen_ev = {
+            .events = EPOLLIN | EPOLLEXCLUSIVE,
+            .data.ptr = &server
+    };
+    struct epoll_event event_ev = { .events = EPOLLIN, .data.ptr = io };
+    if (epoll_ctl (io->epoll, EPOLL_CTL_ADD, server.listener, &listen_ev)
+            || epoll_ctl (io->epoll, EPOLL_CTL_ADD, io->event, &event_ev))
+        return GSL_EFAILED;
+
+    if (pthread_create (&io->thread, NULL, &serve_io, io))
+        return GSL_EFAILED;
+
+    return GSL_SUCCESS;
+}
+
+static void
+serve_io_free (io_thread_t * const io)
+{
+    while (io->connections) {
+        connection_t * conn = io->connections;
+        if (!conn->closed)
+            close (conn->fd);
+        serve_free (conn);
+    }
+
+    for (uint32_t w = 0; w < server.workers; ++w) {
+        spsc_queue_free (&io->completions[w]);
+    }
+
+    close (io->epoll);
+    close (io->event);
+}
+
+static void
+serve_print_stats (io_thread_t * const io, const uint32_t threads)
+{
+    batcher_stats_t total;
+    uint32_t open = 0;
+
+    memset (&total, 0, sizeof(total));
+    for (uint32_t w = 0; w < server.workers; ++w) {
+        batcher_stats_t stats;
+        batcher_take_stats (&server.batchers[w], &stats);
+        histogram_merge (&total.latency, &stats.latency);
+        histogram_merge (&total.batch, &stats.batch);
+        histogram_merge (&total.depth, &stats.depth);
+    }
+    for (uint32_t t = 0; t < threads; ++t) {
+        open += __atomic_load_n (&io[t].open, __ATOMIC_RELAXED);
+    }
+
+    printf ("%-12s %10s %10s %10s %10s %10s %10s   %u connections\n", "",
+            "count", "mean", "p50", "p99", "p999", "max", open);
+    histogram_print (&total.latency, "latency us", 1000.0, stdout);
+    histogram_print (&total.batch, "batch", 1.0, stdout);
+    histogram_print (&total.depth, "queue depth", 1.0, stdout);
+    fflush (stdout);
+}
+
+static int
+serve_same_shape (const uint32_array_t * const a,
+                  const uint32_array_t * const b)
+{
+    return a->size == b->size
+            && !memcmp (a->data, b->data, a->size * sizeof(uint32_t));
+}
+
+/*
+ * A network per worker, so their passes don't share buffers. Unless like
+ * is NULL the checkpoint must be its shape, which is checked before
+ * anything is allocated, else GSL_EBADLEN.
+ */
+static err_t
+serve_load (network_t * const network, const char * path,
+            const network_t * const like)
+{
+    err_t err;
+
+    memset (network, 0, sizeof(*network));
+    err = checkpoint_read_nodes (&network->nodes, path);
+    if (err == GSL_SUCCESS && like
+            && !serve_same_shape (&network->nodes, &like->nodes))
+        err = GSL_EBADLEN;
+    if (err == GSL_SUCCESS) {
+        network->mode = NETWORK_INFER;
+        err = network_allocate (network);
+        if (err == GSL_SUCCESS) {
+            err = checkpoint_load (network, path);
+            if (err != GSL_SUCCESS)
+                network_free (network);
+        }
+    }
+
+    // Reloads can fail any number of times without leaking
+    if (err != GSL_SUCCESS)
+        free (network->nodes.data);
+
+    return err;
+}
+
+static network_t *
+serve_open (const char * path, const network_t * const like)
+{
+    network_t * network = malloc (sizeof(network_t));
+
+    if (network && serve_load (network, path, like) != GSL_SUCCESS) {
+        free (network);
+        return NULL;
+    }
+
+    return network;
+}
+
+static void
+serve_close_network (network_t * const network)
+{
+    free (network->nodes.data);
+    network_free (network);
+    free (network);
+}
+
+/*
+ * Load the checkpoint again for every worker, and only once all of them
+ * have it swap it in, so they never serve different networks. A pass
+ * already running finishes on the old network, the next uses the new.
+ * If the checkpoint can't be read, or is another shape, the workers keep
+ * the old one.
+ */
+static void
+serve_reload (const char * path)
+{
+    network_t ** next = calloc (server.workers, sizeof(network_t *));
+    uint32_t loaded = 0;
+
+    while (next && loaded < server.workers) {
+        next[loaded] = serve_open (path, server.batchers[0].network);
+        if (!next[loaded])
+            break;
+        loaded++;
+    }
+
+    if (loaded == server.workers) {
+        // The shapes match, so none of these can fail
+        for (uint32_t w = 0; w < server.workers; ++w) {
+            network_t * old;
+            batcher_swap (&server.batchers[w], next[w], &old);
+            serve_close_network (old);
+        }
+        printf ("Reloaded %s\n", path);
+    } else {
+        for (uint32_t w = 0; w < loaded; ++w) {
+            serve_close_network (next[w]);
+        }
+        printf ("Could not reload %s, still serving the old network\n",
+                path);
+    }
+    fflush (stdout);
+
+    free (next);
+}
+
+/*
+ * Classify from the ring until stopped, on this thread
+ */
+static err_t
+serve_shm (const char * path, const char * name, const uint32_t max_batch,
+           const int stats_seconds)
+{
+    network_batch_t batch;
+    shm_ring_t ring;
+    batcher_stats_t stats;
+    err_t err;
+
+    network_t * network = serve_open (path, NULL);
+    if (!network)
+        return GSL_EFAILED;
+    err = network_batch_allocate (&batch, network, max_batch);
+    RETURN_ON_ERR(err);
+
+    const uint32_t inputs = network->nodes.data[0];
+    double * x = malloc ((size_t) max_batch * inputs * sizeof(double));
+    uint32_t * classes = malloc (max_batch * sizeof(uint32_t));
+    const uint8_t ** pixels = malloc (max_batch * sizeof(uint8_t *));
+    RETURN_ERR_ON_BAD_ALLOC(x);
+    RETURN_ERR_ON_BAD_ALLOC(classes);
+    RETURN_ERR_ON_BAD_ALLOC(pixels);
+
+    err = shm_ring_create (&ring, name, inputs, SHM_SLOTS);
+    RETURN_ON_ERR(err);
+
+    printf ("Serving %s on shm:%s, batches of up to %u\n", path, name,
+            max_batch);
+    fflush (stdout);
+
+    memset (&stats, 0, sizeof(stats));
+    uint64_t next_stats = batcher_now () + stats_seconds * 1000000000ull;
+    while (!stopping) {
+        const uint32_t n = shm_ring_wait (&ring, max_batch, pixels,
+                                          100000000);
+        const uint64_t start = batcher_now ();
+
+        for (uint32_t i = 0; i < n; ++i) {
+            double * row = x + (size_t) i * inputs;
+            for (uint32_t j = 0; j < inputs; ++j) {
+                row[j] = pixels[i][j] / 255.0;
+            }
+        }
+        if (n) {
+            err = network_predict_batch (network, &batch, x, n, classes,
+                                         NULL);
+            for (uint32_t i = 0; err && i < n; ++i) {
+                classes[i] = SHM_FAILED;
+            }
+            shm_ring_complete (&ring, n, classes);
+
+            histogram_record (&stats.latency, batcher_now () - start);
+            histogram_record (&stats.batch, n);
+        }
+
+        if (start >= next_stats) {
+            printf ("%-12s %10s %10s %10s %10s %10s %10s\n", "", "count",
+                    "mean", "p50", "p99", "p999", "max");
+            histogram_print (&stats.latency, "pass us", 1000.0, stdout);
+            histogram_print (&stats.batch, "batch", 1.0, stdout);
+            fflush (stdout);
+            memset (&stats, 0, sizeof(stats));
+            next_stats = start + stats_seconds * 1000000000ull;
+        }
+
+        // Between passes this thread holds no network, so swap in place
+        if (reloading) {
+            network_t * next = serve_open (path, network);
+            reloading = 0;
+
+            if (next) {
+                serve_close_network (network);
+                network = next;
+                printf ("Reloaded %s\n", path);
+            } else {
+                printf ("Could not reload %s\n", path);
+            }
+            fflush (stdout);
+        }
+    }
+
+    shm_ring_close (&ring);
+    free (x);
+    free (classes);
+    free (pixels);
+    network_batch_free (&batch);
+    serve_close_network (network);
+
+    return GSL_SUCCESS;
+}
+
+int
+main (int argc, char * argv[])
+{
+    uint32_t max_batch = SERVE_MAX_BATCH;
+    uint64_t budget_us = SERVE_BUDGET_US;
+    int stats_seconds = SERVE_STATS_SECONDS;
+    uint32_t threads = SERVE_IO_THREADS;
+    address_t address;
+    err_t err;
+    int opt;
+
+    server.workers = SERVE_WORKERS;
+    server.pipeline = SERVE_PIPELINE;
+
+    while ((opt = getopt (argc, argv, "b:l:s:t:w:p:")) != -1) {
+        switch (opt) {
+            case 'b':
+                max_batch = strtoul (optarg, NULL, 10);
+                break;
+            case 'l':
+                budget_us = strtoull (optarg, NULL, 10);
+                break;
+            case 's':
+                stats_seconds = atoi (optarg);
+                break;
+            case 't':
+                threads = strtoul (optarg, NULL, 10);
+                break;
+            case 'w':
+                server.workers = strtoul (optarg, NULL, 10);
+                break;
+            case 'p':
+                server.pipeline = strtoul (optarg, NULL, 10);
+                break;
+            default:
+                optind = argc;
+        }
+    }
+
+    if (argc - optind != 2 || max_batch == 0 || stats_seconds <= 0
+            || threads == 0 || server.workers == 0
+            || server.workers > SERVE_MAX_WORKERS || server.pipeline == 0
+            || server.pipeline > SERVE_PIPELINE * 8
+            || (strncmp (argv[optind + 1], "shm:", 4)
+                    && address_parse (&address, argv[optind + 1]))) {
+        printf ("Usage: %s [-b max batch] [-l budget us] [-s stats seconds]"
+                " [-t io threads] [-w workers] [-p pipeline <= %u]"
+                " <checkpoint> unix:<path> | tcp:<port> | shm:<name>\n",
+                argv[0], SERVE_PIPELINE * 8);
+        return EXIT_FAILURE;
+    }
+
+    serve_handle_signals ();
+
+    // A reload that fails is reported and the old network kept, not fatal
+    gsl_set_error_handler_off ();
+
+    if (!strncmp (argv[optind + 1], "shm:", 4)) {
+        err = serve_shm (argv[optind], argv[optind + 1] + 4, max_batch,
+                         stats_seconds);
+        EXIT_MAIN_ON_ERR(err);
+        return EXIT_SUCCESS;
+    }
+
+    server.batchers = calloc (server.workers, sizeof(batcher_t));
+    io_thread_t * io = calloc (threads, sizeof(io_thread_t));
+    if (!server.batchers || !io)
+        return EXIT_FAILURE;
+
+    for (uint32_t w = 0; w < server.workers; ++w) {
+        network_t * network = serve_open (argv[optind], NULL);
+        if (!network) {
+            printf ("Could not load %s\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+        err = batcher_start (&server.batchers[w], network, max_batch,
+                             budget_us * 1000);
+        EXIT_MAIN_ON_ERR(err);
+    }
+    server.inputs = server.batchers[0].network->nodes.data[0];
+
+    server.listener = address_listen (&address);
+    if (server.listener < 0) {
+        printf ("Could not listen on %s\n", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+    // Every I/O thread accepts until there are no more
+    fcntl (server.listener, F_SETFL,
+           fcntl (server.listener, F_GETFL) | O_NONBLOCK);
+
+    for (uint32_t t = 0; t < threads; ++t) {
+        err = serve_io_start (&io[t]);
+        EXIT_MAIN_ON_ERR(err);
+    }
+
+    printf ("Serving %s on %s, %u I/O threads, %u workers, batches of up to"
+            " %u within %llu us\n", argv[optind], argv[optind + 1], threads,
+            server.workers, max_batch, (unsigned long long) budget_us);
+    fflush (stdout);
+
+    while (!stopping) {
+        struct timespec ts = { .tv_sec = stats_seconds };
+        if (!nanosleep (&ts, NULL))
+            serve_print_stats (io, threads);
+
+        if (reloading) {
+            reloading = 0;
+            serve_reload (argv[optind]);
+        }
+    }
+
+    // No more submissions, then let the workers finish before freeing
+    for (uint32_t t = 0; t < threads; ++t) {
+        pthread_join (io[t].thread, NULL);
+    }
+    serve_print_stats (io, threads);
+    for (uint32_t w = 0; w < server.workers; ++w) {
+        batcher_stop (&server.batchers[w]);
+    }
+
+    for (uint32_t t = 0; t < threads; ++t) {
+        serve_io_free (&io[t]);
+    }
+    // The batchers hold the networks in use, after any reloads
+    for (uint32_t w = 0; w < server.workers; ++w) {
+        serve_close_network (server.batchers[w].network);
+    }
+
+    close (server.listener);
+    if (address.family == AF_UNIX)
+        unlink (argv[optind + 1] + 5);
+
+    free (io);
+    free (server.batchers);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,367 @@
+/*
+ *   shm.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For syscall, ftruncate and the futex under -std=c99
+#define _GNU_SOURCE
+
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Polls before sleeping, a few microseconds
+#define SHM_SPIN 4096
+
+static void
+shm_pause (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause ();
+#endif
+}
+
+// Shared, not private, as the waiters are in other processes
+static void
+shm_futex_wait (uint32_t * const word, const uint32_t value,
+                const struct timespec * const timeout)
+{
+    syscall (SYS_futex, word, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+static void
+shm_futex_wake (uint32_t * const word, const int waiters)
+{
+    syscall (SYS_futex, word, FUTEX_WAKE, waiters, NULL, NULL, 0);
+}
+
+static shm_slot_t *
+shm_slot (const shm_ring_t * const ring, const uint32_t ticket)
+{
+    const shm_header_t * h = ring->header;
+
+    return (shm_slot_t *) (ring->slots
+            + (size_t) (ticket & (h->slots - 1)) * h->slot_size);
+}
+
+static uint32_t
+shm_slot_size (const uint32_t inputs)
+{
+    size_t size = sizeof(shm_slot_t) + inputs;
+
+    return (size + SHM_CACHE_LINE - 1) / SHM_CACHE_LINE * SHM_CACHE_LINE;
+}
+
+// shm_open wants a leading slash
+static err_t
+shm_ring_name (shm_ring_t * const ring, const char * name)
+{
+    int n = snprintf (ring->name, sizeof(ring->name), "%s%s",
+                      name[0] == '/' ? "" : "/", name);
+
+    if (!name[0] || n < 0 || (size_t) n >= sizeof(ring->name)
+            || strchr (ring->name + 1, '/'))
+        return GSL_EINVAL;
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+shm_ring_map (shm_ring_t * const ring, const int fd)
+{
+    void * base = mmap (NULL, ring->bytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    close (fd);
+    if (base == MAP_FAILED)
+        return GSL_EFAILED;
+
+    ring->header = base;
+    ring->slots = (uint8_t *) base + sizeof(shm_header_t);
+    ring->spin = sysconf (_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Create the ring for a server, replacing any left by one that died.
+ * slots must be a power of two, at least 4.
+ */
+err_t
+shm_ring_create (shm_ring_t * const ring, const char * name,
+                 const uint32_t inputs, const uint32_t slots)
+{
+    err_t err;
+
+    memset (ring, 0, sizeof(*ring));
+    if (slots < 4 || (slots & (slots - 1)) || inputs == 0)
+        return GSL_EINVAL;
+
+    err = shm_ring_name (ring, name);
+    RETURN_ON_ERR(err);
+
+    const uint32_t slot_size = shm_slot_size (inputs);
+    ring->bytes = sizeof(shm_header_t) + (size_t) slots * slot_size;
+
+    shm_unlink (ring->name);
+    int fd = shm_open (ring->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return GSL_EFAILED;
+    if (ftruncate (fd, ring->bytes)) {
+        close (fd);
+        shm_unlink (ring->name);
+        return GSL_EFAILED;
+    }
+
+    err = shm_ring_map (ring, fd);
+    if (err != GSL_SUCCESS) {
+        shm_unlink (ring->name);
+        return err;
+    }
+    ring->owner = 1;
+
+    shm_header_t * h = ring->header;
+    h->version = SHM_VERSION;
+    h->inputs = inputs;
+    h->slots = slots;
+    h->slot_size = slot_size;
+    for (uint32_t i = 0; i < slots; ++i) {
+        shm_slot (ring, i)->sequence = i;
+    }
+
+    // Last, so a client never sees a half made ring
+    __atomic_store_n (&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Map a server's ring for a client. GSL_EINVAL if it isn't one, or is
+ * from another version.
+ */
+err_t
+shm_ring_open (shm_ring_t * const ring, const char * name)
+{
+    struct stat st;
+    err_t err;
+
+    memset (ring, 0, sizeof(*ring));
+    err = shm_ring_name (ring, name);
+    RETURN_ON_ERR(err);
+
+    int fd = shm_open (ring->name, O_RDWR, 0);
+    if (fd < 0)
+        return GSL_EFAILED;
+    if (fstat (fd, &st) || (size_t) st.st_size < sizeof(shm_header_t)) {
+        close (fd);
+        return GSL_EINVAL;
+    }
+
+    ring->bytes = st.st_size;
+    err = shm_ring_map (ring, fd);
+    RETURN_ON_ERR(err);
+
+    const shm_header_t * h = ring->header;
+    if (__atomic_load_n (&h->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+            || h->version != SHM_VERSION || h->slots < 4
+            || (h->slots & (h->slots - 1))
+            || h->slot_size != shm_slot_size (h->inputs)
+            || ring->bytes != sizeof(shm_header_t)
+                    + (size_t) h->slots * h->slot_size) {
+        shm_ring_close (ring);
+        return GSL_EINVAL;
+    }
+
+    return GSL_SUCCESS;
+}
+
+void
+shm_ring_close (shm_ring_t * const ring)
+{
+    if (ring->header)
+        munmap (ring->header, ring->bytes);
+    if (ring->owner)
+        shm_unlink (ring->name);
+
+    ring->header = NULL;
+    ring->slots = NULL;
+}
+
+/*
+ * Take a ticket and return its slot's pixels to write the image into,
+ * waiting while the ring is full
+ */
+uint8_t *
+shm_ring_claim (shm_ring_t * const ring, uint32_t * const ticket)
+{
+    const uint32_t t = __atomic_fetch_add (&ring->header->head, 1,
+                                           __ATOMIC_RELAXED);
+    shm_slot_t * slot = shm_slot (ring, t);
+
+    for (uint32_t spin = 0;
+            __atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE) != t;
+            ++spin) {
+        if (spin < ring->spin)
+            shm_pause ();
+        else
+            sched_yield ();
+    }
+
+    // Any wake owed to the last lap's client is spent
+    __atomic_store_n (&slot->waiting, 0, __ATOMIC_RELAXED);
+    *ticket = t;
+
+    return slot->pixels;
+}
+
+/*
+ * Hand the claimed slot to the server and wait for its label, SHM_FAILED
+ * if it couldn't be classified
+ */
+uint32_t
+shm_ring_submit (shm_ring_t * const ring, const uint32_t ticket)
+{
+    shm_header_t * h = ring->header;
+    shm_slot_t * slot = shm_slot (ring, ticket);
+
+    __atomic_store_n (&slot->sequence, ticket + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in shm_ring_wait, so one sees the other
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&h->sleeping, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add (&h->doorbell, 1, __ATOMIC_RELAXED);
+        shm_futex_wake (&h->doorbell, 1);
+    }
+
+    for (uint32_t spin = 0; spin < ring->spin; ++spin) {
+        if (__atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE) == ticket + 2)
+            break;
+        shm_pause ();
+    }
+
+    while (__atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE) != ticket + 2) {
+        __atomic_store_n (&slot->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        shm_futex_wait (&slot->sequence, ticket + 1, NULL);
+    }
+
+    const uint32_t label = slot->label;
+    __atomic_store_n (&slot->sequence, ticket + h->slots, __ATOMIC_RELEASE);
+
+    return label;
+}
+
+uint32_t
+shm_ring_classify (shm_ring_t * const ring, const uint8_t * const pixels)
+{
+    uint32_t ticket;
+    uint8_t * slot = shm_ring_claim (ring, &ticket);
+
+    memcpy (slot, pixels, ring->header->inputs);
+
+    return shm_ring_submit (ring, ticket);
+}
+
+/*
+ * For the server: wait up to timeout ns for requests, then point pixels
+ * at the ready slots in ticket order, up to max of them, in place.
+ * Returns how many, 0 if none came in time.
+ */
+uint32_t
+shm_ring_wait (shm_ring_t * const ring, const uint32_t max,
+               const uint8_t ** const pixels, const uint64_t timeout)
+{
+    shm_header_t * h = ring->header;
+    struct timespec ts = {
+            .tv_sec = timeout / 1000000000ull,
+            .tv_nsec = timeout % 1000000000ull
+    };
+    uint32_t spin = 0;
+
+    for (;;) {
+        uint32_t n = 0;
+        while (n < max && n < h->slots) {
+            const uint32_t t = ring->tail + n;
+            shm_slot_t * slot = shm_slot (ring, t);
+            if (__atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE) != t + 1)
+                break;
+            pixels[n++] = slot->pixels;
+        }
+
+        if (n)
+            return n;
+        if (spin++ < ring->spin) {
+            shm_pause ();
+            continue;
+        }
+        if (!timeout)
+            return 0;
+
+        const uint32_t bell = __atomic_load_n (&h->doorbell, __ATOMIC_RELAXED);
+        __atomic_store_n (&h->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+        const shm_slot_t * next = shm_slot (ring, ring->tail);
+        if (__atomic_load_n (&next->sequence, __ATOMIC_ACQUIRE)
+                != ring->tail + 1)
+            shm_futex_wait (&h->doorbell, bell, &ts);
+
+        __atomic_store_n (&h->sleeping, 0, __ATOMIC_RELAXED);
+        if (__atomic_load_n (&next->sequence, __ATOMIC_ACQUIRE)
+                != ring->tail + 1
+                && __atomic_load_n (&h->doorbell, __ATOMIC_RELAXED) == bell)
+            return 0;
+        spin = ring->spin;
+    }
+}
+
+/*
+ * Post the labels for the n slots from the last shm_ring_wait
+ */
+void
+shm_ring_complete (shm_ring_t * const ring, const uint32_t n,
+                   const uint32_t * const labels)
+{
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint32_t t = ring->tail + i;
+        shm_slot_t * slot = shm_slot (ring, t);
+
+        slot->label = labels[i];
+        __atomic_store_n (&slot->sequence, t + 2, __ATOMIC_RELEASE);
+
+        // Pairs with the fence in shm_ring_submit
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&slot->waiting, __ATOMIC_RELAXED)) {
+            __atomic_store_n (&slot->waiting, 0, __ATOMIC_RELAXED);
+            shm_futex_wake (&slot->sequence, INT_MAX);
+        }
+    }
+
+    ring->tail += n;
+}
@@ -0,0 +1,133 @@
+/*
+ *   shm.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHM_H_
+#define SHM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "errors.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_MAGIC 0x4e4e4553 // "SENN", little endian
+#define SHM_VERSION 1
+#define SHM_CACHE_LINE 64
+
+// Requests in the ring unless asked otherwise, a power of two
+#define SHM_SLOTS 256
+
+// The label of a request the server couldn't classify
+#define SHM_FAILED UINT32_MAX
+
+/*
+ * A ring of request slots in a POSIX shared memory object, for processes
+ * on one host to classify images without copying them through a socket.
+ *
+ * A client takes a ticket, which names slot ticket % slots, writes the
+ * image's pixels straight into the slot and marks it ready. The server
+ * takes the ready slots in ticket order, as many as have arrived, runs
+ * them through one batched pass, writes the labels back and marks them
+ * done. The client reads its label and frees the slot for the ticket a
+ * lap later.
+ *
+ * Each slot's sequence says which of those it is in for ticket t:
+ *
+ *   t             free, for the client holding ticket t
+ *   t + 1         ready, for the server
+ *   t + 2         done, for the client
+ *   t + slots     free for the next lap
+ *
+ * Both sides spin briefly and then sleep on a futex, so a busy ring
+ * makes no system calls. On a single CPU spinning only delays the other
+ * side, so they sleep straight away. A client that dies holding a ticket
+ * stalls the ring; the server is meant for cooperating processes.
+ */
+typedef struct
+{
+    uint32_t sequence;
+    uint32_t waiting; // The client sleeps on sequence
+    uint32_t label;
+    uint8_t pad[SHM_CACHE_LINE - 3 * sizeof(uint32_t)];
+    uint8_t pixels[]; // inputs bytes, then padding to a cache line
+} shm_slot_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t inputs;
+    uint32_t slots;
+    uint32_t slot_size; // Bytes, a multiple of the cache line
+    uint8_t pad0[SHM_CACHE_LINE - 5 * sizeof(uint32_t)];
+    uint32_t head; // Next ticket, taken by clients
+    uint8_t pad1[SHM_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t sleeping; // The server sleeps on doorbell
+    uint32_t doorbell;
+    uint8_t pad2[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+} shm_header_t;
+
+typedef struct
+{
+    shm_header_t * header;
+    uint8_t * slots;
+    size_t bytes;
+    uint32_t tail; // Server only, the next ticket to classify
+    uint32_t spin; // Polls before sleeping, none on one CPU
+    int owner; // Created it, so unlinks it
+    char name[256];
+} shm_ring_t;
+
+err_t
+shm_ring_create (shm_ring_t * const ring, const char * name,
+                 const uint32_t inputs, const uint32_t slots);
+
+err_t
+shm_ring_open (shm_ring_t * const ring, const char * name);
+
+void
+shm_ring_close (shm_ring_t * const ring);
+
+uint8_t *
+shm_ring_claim (shm_ring_t * const ring, uint32_t * const ticket);
+
+uint32_t
+shm_ring_submit (shm_ring_t * const ring, const uint32_t ticket);
+
+uint32_t
+shm_ring_classify (shm_ring_t * const ring, const uint8_t * const pixels);
+
+uint32_t
+shm_ring_wait (shm_ring_t * const ring, const uint32_t max,
+               const uint8_t ** const pixels, const uint64_t timeout);
+
+void
+shm_ring_complete (shm_ring_t * const ring, const uint32_t n,
+                   const uint32_t * const labels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHM_H_ */
@@ -0,0 +1,347 @@
+/*
+ *   stream.c
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stream.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static err_t
+stream_batch_allocate (stream_t * const s)
+{
+    data_t * batch = &s->batch;
+
+    memset (batch, 0, sizeof(*batch));
+    batch->images.num_images = s->batch_size;
+    batch->images.rows = s->rows;
+    batch->images.cols = s->cols;
+    batch->labels.num_labels = s->batch_size;
+
+    err_t err = images_allocate (&batch->images, s->pixels);
+    RETURN_ON_ERR(err);
+    err = labels_allocate (&batch->labels);
+    RETURN_ON_ERR(err);
+
+    s->order = malloc (s->batch_size * sizeof(uint32_t));
+    RETURN_ERR_ON_BAD_ALLOC(s->order);
+    for (uint32_t i = 0; i < s->batch_size; ++i) {
+        s->order[i] = i;
+    }
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Stream a single pair of files
+ */
+err_t
+stream_open (stream_t * const s,
+             const char * images_file,
+             const char * labels_file,
+             const uint32_t shuffle_items,
+             const uint32_t batch_size)
+{
+    dataset_t files;
+
+    dataset_init (&files);
+    err_t err = dataset_add (&files, images_file, labels_file);
+    if (err) {
+        memset (s, 0, sizeof(*s));
+        dataset_free (&files);
+        return err;
+    }
+
+    err = stream_open_dataset (s, &files, shuffle_items, batch_size);
+    s->files = files;
+    s->dataset = &s->files;
+
+    return err;
+}
+
+/*
+ * Stream a dataset, which must outlive the stream. The range is all of
+ * the items until stream_range.
+ */
+err_t
+stream_open_dataset (stream_t * const s,
+                     const dataset_t * const dataset,
+                     const uint32_t shuffle_items,
+                     const uint32_t batch_size)
+{
+    memset (s, 0, sizeof(*s));
+    if (!shuffle_items || !batch_size || !dataset->items)
+        return GSL_EINVAL;
+
+    s->dataset = dataset;
+    s->items = dataset->items;
+    s->rows = dataset->rows;
+    s->cols = dataset->cols;
+    s->pixels = dataset->pixels;
+    s->count = s->items;
+    s->capacity = shuffle_items;
+    s->batch_size = batch_size;
+    s->chunk_pixels = malloc ((size_t) STREAM_CHUNK_ITEMS * s->pixels);
+    s->chunk_labels = malloc (STREAM_CHUNK_ITEMS);
+    s->buffer_pixels = malloc ((size_t) shuffle_items * s->pixels);
+    s->buffer_labels = malloc (shuffle_items);
+    RETURN_ERR_ON_BAD_ALLOC(s->chunk_pixels);
+    RETURN_ERR_ON_BAD_ALLOC(s->chunk_labels);
+    RETURN_ERR_ON_BAD_ALLOC(s->buffer_pixels);
+    RETURN_ERR_ON_BAD_ALLOC(s->buffer_labels);
+
+    // The default seed, as network_sgd
+    s->rng = gsl_rng_alloc (gsl_rng_mt19937);
+    RETURN_ERR_ON_BAD_ALLOC(s->rng);
+
+    return stream_batch_allocate (s);
+}
+
+static void
+stream_close_files (stream_t * const s)
+{
+    if (s->images)
+        gzclose (s->images);
+    if (s->labels)
+        gzclose (s->labels);
+    s->images = NULL;
+    s->labels = NULL;
+}
+
+void
+stream_close (stream_t * const s)
+{
+    stream_close_files (s);
+    dataset_free (&s->files);
+    if (s->rng)
+        gsl_rng_free (s->rng);
+    if (s->batch.images.images)
+        images_free (&s->batch.images);
+    labels_free (&s->batch.labels);
+
+    free (s->chunk_pixels);
+    free (s->chunk_labels);
+    free (s->buffer_pixels);
+    free (s->buffer_labels);
+    free (s->order);
+    memset (s, 0, sizeof(*s));
+}
+
+/*
+ * Hand out only count items from first, from the next stream_rewind
+ */
+err_t
+stream_range (stream_t * const s, const uint32_t first, const uint32_t count)
+{
+    if (first > s->items || count > s->items - first)
+        return GSL_EINVAL;
+
+    s->first = first;
+    s->count = count;
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+stream_seek (stream_t * const s)
+{
+    stream_close_files (s);
+    s->read = 0;
+    s->chunk_fill = 0;
+    s->chunk_next = 0;
+    s->shard_left = 0;
+    if (!s->count)
+        return GSL_SUCCESS;
+
+    s->shard = dataset_find_shard (s->dataset, s->first);
+    const shard_t * shard = &s->dataset->shards[s->shard];
+    const uint32_t item = s->first - shard->first;
+    s->shard_left = shard->items - item;
+
+    return dataset_shard_open (s->dataset, s->shard, item, &s->images,
+                               &s->labels);
+}
+
+/*
+ * Read the next n items of the range, moving on through the shards
+ */
+static err_t
+stream_read_items (stream_t * const s, uint8_t * pixels, uint8_t * labels,
+                   const uint32_t n)
+{
+    uint32_t left = n;
+
+    while (left) {
+        if (!s->shard_left) {
+            stream_close_files (s);
+            s->shard++;
+            s->shard_left = s->dataset->shards[s->shard].items;
+            err_t err = dataset_shard_open (s->dataset, s->shard, 0,
+                                            &s->images, &s->labels);
+            RETURN_ON_ERR(err);
+        }
+
+        uint32_t m = left < s->shard_left ? left : s->shard_left;
+        err_t err = idx_read_bytes (s->images, pixels,
+                                    (size_t) m * s->pixels);
+        RETURN_ON_ERR(err);
+        err = idx_read_bytes (s->labels, labels, m);
+        RETURN_ON_ERR(err);
+
+        pixels += (size_t) m * s->pixels;
+        labels += m;
+        left -= m;
+        s->shard_left -= m;
+    }
+
+    s->read += n;
+
+    return GSL_SUCCESS;
+}
+
+static err_t
+stream_read_chunk (stream_t * const s)
+{
+    uint32_t n = s->count - s->read;
+    n = n < STREAM_CHUNK_ITEMS ? n : STREAM_CHUNK_ITEMS;
+
+    s->chunk_fill = n;
+    s->chunk_next = 0;
+
+    return stream_read_items (s, s->chunk_pixels, s->chunk_labels, n);
+}
+
+/*
+ * Copy the next item of the range to pixels and label. took is 0 once the
+ * range is used up.
+ */
+static err_t
+stream_take (stream_t * const s, uint8_t * const pixels,
+             uint8_t * const label, uint8_t * const took)
+{
+    *took = 0;
+
+    if (s->chunk_next == s->chunk_fill) {
+        err_t err = stream_read_chunk (s);
+        RETURN_ON_ERR(err);
+        if (!s->chunk_fill)
+            return GSL_SUCCESS;
+    }
+
+    memcpy (pixels, s->chunk_pixels + (size_t) s->chunk_next * s->pixels,
+            s->pixels);
+    *label = s->chunk_labels[s->chunk_next++];
+    *took = 1;
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Start a pass over the range, filling the shuffle buffer
+ */
+err_t
+stream_rewind (stream_t * const s)
+{
+    uint8_t took = 1;
+
+    err_t err = stream_seek (s);
+    RETURN_ON_ERR(err);
+
+    s->fill = 0;
+    while (s->fill < s->capacity && took) {
+        err = stream_take (s, s->buffer_pixels + (size_t) s->fill * s->pixels,
+                           &s->buffer_labels[s->fill], &took);
+        RETURN_ON_ERR(err);
+        s->fill += took;
+    }
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Draw the next mini-batch into stream->batch, up to batch_size items.
+ * batch.items is 0 once the pass is done.
+ */
+err_t
+stream_next (stream_t * const s)
+{
+    data_t * batch = &s->batch;
+
+    batch->items = 0;
+    while (batch->items < s->batch_size && s->fill) {
+        const uint32_t r = gsl_rng_uniform_int (s->rng, s->fill);
+        uint8_t * slot = s->buffer_pixels + (size_t) r * s->pixels;
+        uint8_t * pixels = batch->images.pixels
+                + (size_t) batch->items * s->pixels;
+        gsl_vector * image = batch->images.images[batch->items];
+        uint8_t took;
+
+        memcpy (pixels, slot, s->pixels);
+        for (uint32_t j = 0; j < s->pixels; ++j) {
+            gsl_vector_set (image, j, pixels[j] / 255.0);
+        }
+        batch->labels.labels[batch->items++] = s->buffer_labels[r];
+
+        // Refill the place from the file, or close the gap with the last,
+        // unless it was the last
+        err_t err = stream_take (s, slot, &s->buffer_labels[r], &took);
+        RETURN_ON_ERR(err);
+        if (!took)
+            s->fill--;
+        if (!took && r != s->fill) {
+            memcpy (slot, s->buffer_pixels + (size_t) s->fill * s->pixels,
+                    s->pixels);
+            s->buffer_labels[r] = s->buffer_labels[s->fill];
+        }
+    }
+
+    return GSL_SUCCESS;
+}
+
+/*
+ * Load the whole range into data in file order, as read_all_data, eg.
+ * to hold a validation set in memory while training streams the rest
+ */
+err_t
+stream_read_data (stream_t * const s, data_t * const data)
+{
+    memset (data, 0, sizeof(*data));
+    data->images.magic_num = IMAGES_MAGIC;
+    data->images.num_images = s->count;
+    data->images.rows = s->rows;
+    data->images.cols = s->cols;
+    data->labels.magic_num = LABELS_MAGIC;
+    data->labels.num_labels = s->count;
+    data->items = s->count;
+
+    err_t err = stream_seek (s);
+    RETURN_ON_ERR(err);
+    err = images_allocate (&data->images, s->pixels);
+    RETURN_ON_ERR(err);
+    err = labels_allocate (&data->labels);
+    RETURN_ON_ERR(err);
+    err = stream_read_items (s, data->images.pixels, data->labels.labels,
+                             s->count);
+    RETURN_ON_ERR(err);
+
+    images_scale_pixels (&data->images, s->pixels, 0, s->count);
+
+    return GSL_SUCCESS;
+}
@@ -0,0 +1,112 @@
+/*
+ *   stream.h
+ *
+ *   Copyright 2015 Doug Szumski <d.s.szumski@gmail.com>
+ *
+ *   This file is part of NNet.
+ *
+ *   NNet is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   NNet is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with NNet.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dataset.h"
+#include "errors.h"
+#include "loader.h"
+
+#include <stdint.h>
+#include <gsl/gsl_rng.h>
+
+// Images read from the files at a time
+#define STREAM_CHUNK_ITEMS 4096
+
+/*
+ * Reads a range of the images and labels of a dataset, in large
+ * sequential chunks across its shards, and hands them out a mini-batch at
+ * a time in an order shuffled within a buffer of shuffle_items.
+ *
+ * The buffer starts full. Each item handed out is picked at random from
+ * the buffer and its place refilled by the next from the files, so an
+ * item can move about shuffle_items places from where it was. Memory is
+ * bounded by the buffer, a chunk and a batch, however many items the
+ * files hold.
+ */
+typedef struct
+{
+    dataset_t files; // Of stream_open
+    const dataset_t * dataset;
+    gzFile images; // Of the shard being read
+    gzFile labels;
+    uint32_t shard;
+    uint32_t shard_left; // Items still to read from it
+    uint32_t items; // In the dataset
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t pixels;
+    uint32_t first; // The range handed out
+    uint32_t count;
+    uint32_t read; // Of the range this pass
+    uint8_t * chunk_pixels;
+    uint8_t * chunk_labels;
+    uint32_t chunk_fill;
+    uint32_t chunk_next;
+    uint8_t * buffer_pixels;
+    uint8_t * buffer_labels;
+    uint32_t capacity;
+    uint32_t fill;
+    gsl_rng * rng;
+    data_t batch; // The last mini-batch, batch.items of them
+    uint32_t * order; // 0, 1, 2... to slice the batch
+    uint32_t batch_size;
+} stream_t;
+
+err_t
+stream_open (stream_t * const stream,
+             const char * images_file,
+             const char * labels_file,
+             const uint32_t shuffle_items,
+             const uint32_t batch_size);
+
+err_t
+stream_open_dataset (stream_t * const stream,
+                     const dataset_t * const dataset,
+                     const uint32_t shuffle_items,
+                     const uint32_t batch_size);
+
+void
+stream_close (stream_t * const stream);
+
+err_t
+stream_range (stream_t * const stream, const uint32_t first,
+              const uint32_t count);
+
+err_t
+stream_rewind (stream_t * const stream);
+
+err_t
+stream_next (stream_t * const stream);
+
+err_t
+stream_read_data (stream_t * const stream, data_t * const data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STREAM_H_ */
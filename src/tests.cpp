@@ -21,18 +21,46 @@
 
 #define CATCH_CONFIG_MAIN
 
+#include <algorithm>
+#include <climits>
 #include <cstdlib>
+#include <string>
+#include <vector>
+#include <glob.h>
+#include <sched.h>
+#include <unistd.h>
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_matrix.h>
 
+#include "backend.h"
+#include "batcher.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "codegen.h"
+#include "conv.h"
+#include "dataset.h"
 #include "errors.h"
+#include "kernels.h"
+#include "layer.h"
 #include "math_utils.h"
 #include "catch.hpp"
 #include "nnet.h"
 #include "loader.h"
+#include "fixed.hpp"
+#include "histogram.h"
+#include "idx.h"
+#include "packed.h"
+#include "quant.h"
+#include "queue.h"
+#include "shm.h"
+#include "address.h"
+#include "stream.h"
 
 #define BIG_NUM 9999.0
 
+static void
+require_matrices_equal (const gsl_matrix * const a, const gsl_matrix * const b);
+
 TEST_CASE( "Extract header line", "[loader]" )
 {
     uint8_t int32_field[4] = { 0x00, 0x00, 0x08, 0x03 };
@@ -111,6 +139,603 @@ TEST_CASE( "Labels read data", "[loader]" )
     REQUIRE(lbl_data.labels[lbl_data.num_labels - 1] == 0x08);
 }
 
+// Compress file to file.gz, or the first bytes of it to file.cut.gz
+static std::string
+gzip_file (const char * const file, const long bytes = -1)
+{
+    std::string gz = std::string (file) + (bytes < 0 ? ".gz" : ".cut.gz");
+    std::vector<char> buf (1 << 16);
+    FILE * in = fopen (file, "rb");
+    gzFile out = gzopen (gz.c_str (), "wb");
+    long left = bytes < 0 ? LONG_MAX : bytes;
+    size_t n;
+
+    while (left > 0 && (n = fread (buf.data (), 1, buf.size (), in)) > 0) {
+        n = (long) n < left ? n : left;
+        gzwrite (out, buf.data (), n);
+        left -= n;
+    }
+
+    gzclose (out);
+    fclose (in);
+
+    return gz;
+}
+
+// An IDX file of values as type, with the sizes given, then extra bytes
+template <typename T>
+static void
+write_typed_idx (const char * const file, const uint8_t type,
+                 const std::vector<uint32_t> & sizes,
+                 const std::vector<double> & values, const uint32_t extra = 0)
+{
+    FILE * fp = fopen (file, "wb");
+    uint8_t magic[4] = { 0, 0, type, (uint8_t) sizes.size () };
+    fwrite (magic, 1, 4, fp);
+
+    for (uint32_t size : sizes) {
+        uint8_t be[4] = { (uint8_t) (size >> 24), (uint8_t) (size >> 16),
+                          (uint8_t) (size >> 8), (uint8_t) size };
+        fwrite (be, 1, 4, fp);
+    }
+
+    for (double value : values) {
+        T element = (T) value;
+        uint8_t bytes[sizeof(T)];
+        memcpy (bytes, &element, sizeof(T));
+        std::reverse (bytes, bytes + sizeof(T));
+        fwrite (bytes, 1, sizeof(T), fp);
+    }
+
+    for (uint32_t i = 0; i < extra; ++i) {
+        fputc (0, fp);
+    }
+
+    fclose (fp);
+}
+
+template <typename T>
+static void
+check_typed_idx (const uint8_t type, const std::vector<double> & values)
+{
+    const char * file = "idx_test_typed";
+    write_typed_idx<T> (file, type, { 2, 1, 3 }, values);
+
+    idx_t idx;
+    REQUIRE(idx_open (&idx, file) == 0);
+    REQUIRE(idx.type == type);
+    REQUIRE(idx.dims == 3);
+    REQUIRE(idx.size[0] == 2);
+    REQUIRE(idx.size[2] == 3);
+    REQUIRE(idx.elements == 6);
+    REQUIRE(idx.element_size == sizeof(T));
+    REQUIRE(idx_expect (&idx, IDX_U8, 3) == (type == IDX_U8 ? 0 : GSL_EINVAL));
+
+    T elements[6];
+    double widened[6];
+    REQUIRE(idx_read (&idx, elements, 4) == 0);
+    REQUIRE(idx_read (&idx, elements + 4, 3) == GSL_EOF);
+    REQUIRE(idx_read (&idx, elements + 4, 2) == 0);
+    REQUIRE(idx_read_end (&idx) == 0);
+    idx_to_double (idx.type, elements, widened, 6);
+    for (uint32_t i = 0; i < 6; ++i) {
+        REQUIRE(elements[i] == (T) values[i]);
+        REQUIRE(widened[i] == values[i]);
+    }
+
+    idx_close (&idx);
+    remove (file);
+}
+
+TEST_CASE( "IDX element types", "[idx]" )
+{
+    const std::vector<double> values = { -3, -1, 0, 1, 2, 100 };
+
+    check_typed_idx<uint8_t> (IDX_U8, { 0, 1, 2, 3, 255, 100 });
+    check_typed_idx<int8_t> (IDX_I8, values);
+    check_typed_idx<int16_t> (IDX_I16, { -300, -1, 0, 1, 2, 30000 });
+    check_typed_idx<int32_t> (IDX_I32, { -70000, -1, 0, 1, 2, 1e9 });
+    check_typed_idx<float> (IDX_F32, { -0.5, -1, 0, 1, 0.25, 1099511627776.0 });
+    check_typed_idx<double> (IDX_F64, { -0.1, -1, 0, 1, 1e-300, 1e300 });
+}
+
+TEST_CASE( "IDX errors", "[idx]" )
+{
+    const char * file = "idx_test_errors";
+    const std::vector<double> six = { 1, 2, 3, 4, 5, 6 };
+    idx_t idx;
+
+    // Any number of dimensions, none is a single element
+    write_typed_idx<uint8_t> (file, IDX_U8, { 1, 2, 1, 3, 1 }, six);
+    REQUIRE(idx_open (&idx, file) == 0);
+    REQUIRE(idx.dims == 5);
+    REQUIRE(idx.header_bytes == 24);
+    idx_close (&idx);
+    write_typed_idx<uint8_t> (file, IDX_U8, {}, { 7 });
+    REQUIRE(idx_open (&idx, file) == 0);
+    REQUIRE(idx.elements == 1);
+    idx_close (&idx);
+
+    // Raw files the wrong length are caught opening them
+    write_typed_idx<int16_t> (file, IDX_I16, { 7 }, six);
+    REQUIRE(idx_open (&idx, file) == GSL_EOF);
+    write_typed_idx<int16_t> (file, IDX_I16, { 6 }, six, 1);
+    REQUIRE(idx_open (&idx, file) == GSL_EBADLEN);
+
+    // Gzipped ones reading them
+    write_typed_idx<int16_t> (file, IDX_I16, { 6 }, six, 1);
+    std::string gz = gzip_file (file);
+    int16_t elements[7];
+    REQUIRE(idx_open (&idx, gz.c_str ()) == 0);
+    REQUIRE(idx_read (&idx, elements, 6) == 0);
+    REQUIRE(idx_read_end (&idx) == GSL_EBADLEN);
+    idx_close (&idx);
+    write_typed_idx<int16_t> (file, IDX_I16, { 7 }, six);
+    gz = gzip_file (file);
+    REQUIRE(idx_open (&idx, gz.c_str ()) == 0);
+    REQUIRE(idx_read (&idx, elements, 7) == GSL_EOF);
+    idx_close (&idx);
+    remove (gz.c_str ());
+
+    // Not IDX at all
+    write_typed_idx<uint8_t> (file, 0x0a, { 6 }, six);
+    REQUIRE(idx_open (&idx, file) == GSL_EINVAL);
+    FILE * fp = fopen (file, "wb");
+    fputs ("IDX", fp);
+    fclose (fp);
+    REQUIRE(idx_open (&idx, file) == GSL_EINVAL);
+    fp = fopen (file, "wb");
+    fputs ("\x01\x02\x08\x01", fp);
+    fclose (fp);
+    REQUIRE(idx_open (&idx, file) == GSL_EINVAL);
+    REQUIRE(idx_open (&idx, "no_such_file") == GSL_EFAILED);
+
+    // Sizes whose product doesn't fit
+    write_typed_idx<uint8_t> (file, IDX_U8, { 0xffffffff, 0xffffffff, 2 },
+                              {});
+    REQUIRE(idx_open (&idx, file) == GSL_EOVRFLW);
+
+    // And through the loader, which leaves nothing allocated
+    images_t images;
+    labels_t labels;
+    write_typed_idx<uint8_t> (file, IDX_U8, { 2, 2, 2 }, six);
+    REQUIRE(images_read_data (&images, file) == GSL_EOF);
+    REQUIRE(images.images == NULL);
+    write_typed_idx<uint8_t> (file, IDX_U8, { 0, 65536, 65536 }, {});
+    REQUIRE(images_read_data (&images, file) == GSL_EOVRFLW);
+    REQUIRE(images.images == NULL);
+    write_typed_idx<uint8_t> (file, IDX_U8, { 2, 1, 3 }, six);
+    REQUIRE(labels_read_data (&labels, file) == GSL_EINVAL);
+    REQUIRE(labels.labels == NULL);
+
+    const char * labels_file = "idx_test_labels";
+    data_t data;
+    write_typed_idx<uint8_t> (labels_file, IDX_U8, { 3 }, { 1, 2, 3 });
+    REQUIRE(read_all_data (&data, file, labels_file) == GSL_EINVAL);
+    write_typed_idx<uint8_t> (labels_file, IDX_U8, { 2 }, { 1, 2 });
+    REQUIRE(read_all_data (&data, file, labels_file) == 0);
+    REQUIRE(data.items == 2);
+    REQUIRE(gsl_vector_get (data.images.images[1], 2) == Approx (6 / 255.0));
+    images_free (&data.images);
+    labels_free (&data.labels);
+
+    REQUIRE(std::string (idx_strerror (GSL_EOF)).find ("truncated") == 0);
+    remove (file);
+    remove (labels_file);
+}
+
+/*
+ * IDX files of items 2x2 images, each holding its index from first in the
+ * first two pixels, labelled with the index mod 10
+ */
+static void
+write_idx (const char * const images, const char * const labels,
+           const uint32_t items, const uint32_t magic,
+           const uint32_t first = 0)
+{
+    uint8_t header[IMAGES_HEADER_SIZE_BYTES] = { 0 };
+    const uint32_t fields[] = { magic, items, 2, 2 };
+
+    for (uint32_t f = 0; f < 4; ++f) {
+        for (uint32_t b = 0; b < 4; ++b) {
+            header[4 * f + b] = fields[f] >> (24 - 8 * b);
+        }
+    }
+
+    FILE * fp = fopen (images, "wb");
+    fwrite (header, 1, IMAGES_HEADER_SIZE_BYTES, fp);
+    for (uint32_t i = first; i < first + items; ++i) {
+        uint8_t pixels[4] = { (uint8_t) i, (uint8_t) (i >> 8), 0, 255 };
+        fwrite (pixels, 1, 4, fp);
+    }
+    fclose (fp);
+
+    header[3] = LABELS_MAGIC & 0xff;
+    fp = fopen (labels, "wb");
+    fwrite (header, 1, LABELS_HEADER_SIZE_BYTES, fp);
+    for (uint32_t i = first; i < first + items; ++i) {
+        fputc (i % 10, fp);
+    }
+    fclose (fp);
+}
+
+TEST_CASE( "Stream shuffles each item once a pass", "[stream]" )
+{
+    const char * images = "stream_test_images";
+    const char * labels = "stream_test_labels";
+    const uint32_t items = 5000; // More than a chunk
+    write_idx (images, labels, items, IMAGES_MAGIC);
+
+    stream_t stream;
+    REQUIRE(stream_open (&stream, images, labels, 100, 7) == 0);
+    REQUIRE(stream.items == items);
+    REQUIRE(stream.pixels == 4);
+    REQUIRE(stream_range (&stream, 1000, items) == GSL_EINVAL);
+    REQUIRE(stream_range (&stream, 1000, 3000) == 0);
+
+    std::vector<uint32_t> seen (items);
+    for (uint32_t pass = 0; pass < 2; ++pass) {
+        uint32_t handed = 0;
+        uint32_t in_order = 0;
+        std::fill (seen.begin (), seen.end (), 0);
+
+        REQUIRE(stream_rewind (&stream) == 0);
+        for (;;) {
+            REQUIRE(stream_next (&stream) == 0);
+            const data_t & batch = stream.batch;
+            if (!batch.items)
+                break;
+            REQUIRE(batch.items <= 7);
+
+            for (uint32_t i = 0; i < batch.items; ++i) {
+                const uint8_t * p = batch.images.pixels + 4 * i;
+                uint32_t index = p[0] | p[1] << 8;
+                REQUIRE(index >= 1000);
+                REQUIRE(index < 4000);
+                REQUIRE(batch.labels.labels[i] == index % 10);
+                REQUIRE(gsl_vector_get (batch.images.images[i], 3) == 1.0);
+                in_order += index == 1000 + handed;
+                seen[index]++;
+                handed++;
+            }
+        }
+
+        REQUIRE(handed == 3000);
+        REQUIRE(std::count (seen.begin (), seen.end (), 1) == 3000);
+        REQUIRE(in_order < 100);
+    }
+
+    // The held out range, in file order
+    data_t data;
+    REQUIRE(stream_range (&stream, 4990, 10) == 0);
+    REQUIRE(stream_read_data (&stream, &data) == 0);
+    REQUIRE(data.items == 10);
+    REQUIRE(data.images.rows == 2);
+    for (uint32_t i = 0; i < data.items; ++i) {
+        REQUIRE(data.labels.labels[i] == (4990 + i) % 10);
+        REQUIRE(gsl_vector_get (data.images.images[i], 0)
+                == Approx (((4990 + i) & 0xff) / 255.0));
+    }
+
+    images_free (&data.images);
+    labels_free (&data.labels);
+    stream_close (&stream);
+
+    // Files that are not images, or not the length of their headers
+    REQUIRE(stream_open (&stream, labels, labels, 100, 7) == GSL_EINVAL);
+    stream_close (&stream);
+    write_idx (images, labels, 10, LABELS_MAGIC);
+    REQUIRE(stream_open (&stream, images, labels, 100, 7) == GSL_EBADLEN);
+    stream_close (&stream);
+    REQUIRE(stream_open (&stream, "no_such_file", labels, 100, 7)
+            == GSL_EFAILED);
+    stream_close (&stream);
+
+    remove (images);
+    remove (labels);
+}
+
+// Items 0 to 1000 in three shards, one of a single item
+static const char * shard_files[] = {
+        "dataset_test_a_images", "dataset_test_a_labels",
+        "dataset_test_b_images", "dataset_test_b_labels",
+        "dataset_test_c_images", "dataset_test_c_labels"
+};
+
+static void
+write_shards ()
+{
+    write_idx (shard_files[0], shard_files[1], 300, IMAGES_MAGIC, 0);
+    write_idx (shard_files[2], shard_files[3], 1, IMAGES_MAGIC, 300);
+    write_idx (shard_files[4], shard_files[5], 700, IMAGES_MAGIC, 301);
+}
+
+static void
+check_items (const data_t & data, const uint32_t first)
+{
+    for (uint32_t i = 0; i < data.items; ++i) {
+        const uint32_t index = first + i;
+        REQUIRE(data.images.pixels[4 * i] == (index & 0xff));
+        REQUIRE(data.images.pixels[4 * i + 1] == (index >> 8));
+        REQUIRE(data.labels.labels[i] == index % 10);
+        REQUIRE(gsl_vector_get (data.images.images[i], 0)
+                == Approx ((index & 0xff) / 255.0));
+    }
+}
+
+TEST_CASE( "Dataset of shards", "[dataset]" )
+{
+    write_shards ();
+
+    FILE * fp = fopen ("dataset_test_manifest", "w");
+    fprintf (fp, "# Shards\n%s %s\n\n%s\t%s\n%s %s\n", shard_files[0],
+             shard_files[1], shard_files[2], shard_files[3], shard_files[4],
+             shard_files[5]);
+    fclose (fp);
+
+    dataset_t dataset;
+    dataset_init (&dataset);
+    REQUIRE(dataset_add_manifest (&dataset, "dataset_test_manifest") == 0);
+    REQUIRE(dataset.size == 3);
+    REQUIRE(dataset.items == 1001);
+    REQUIRE(dataset.pixels == 4);
+    REQUIRE(dataset_find_shard (&dataset, 0) == 0);
+    REQUIRE(dataset_find_shard (&dataset, 299) == 0);
+    REQUIRE(dataset_find_shard (&dataset, 300) == 1);
+    REQUIRE(dataset_find_shard (&dataset, 301) == 2);
+    REQUIRE(dataset_find_shard (&dataset, 1000) == 2);
+
+    // However many readers, into one data in order
+    for (uint32_t threads = 1; threads <= 4; ++threads) {
+        data_t data;
+        REQUIRE(dataset_read (&dataset, &data, threads) == 0);
+        REQUIRE(data.items == 1001);
+        check_items (data, 0);
+        images_free (&data.images);
+        labels_free (&data.labels);
+    }
+
+    // Or streamed, a range across the shards in order and shuffled
+    stream_t stream;
+    data_t data;
+    REQUIRE(stream_open_dataset (&stream, &dataset, 16, 5) == 0);
+    REQUIRE(stream_range (&stream, 250, 600) == 0);
+    REQUIRE(stream_read_data (&stream, &data) == 0);
+    check_items (data, 250);
+    images_free (&data.images);
+    labels_free (&data.labels);
+
+    std::vector<uint32_t> seen (dataset.items);
+    REQUIRE(stream_rewind (&stream) == 0);
+    for (;;) {
+        REQUIRE(stream_next (&stream) == 0);
+        if (!stream.batch.items)
+            break;
+        for (uint32_t i = 0; i < stream.batch.items; ++i) {
+            const uint8_t * p = stream.batch.images.pixels + 4 * i;
+            seen[p[0] | p[1] << 8]++;
+        }
+    }
+    REQUIRE(std::count (seen.begin () + 250, seen.begin () + 850, 1) == 600);
+    REQUIRE(std::count (seen.begin (), seen.end (), 0) == 401);
+    stream_close (&stream);
+
+    // The same shards by pattern
+    dataset_t globbed;
+    dataset_init (&globbed);
+    REQUIRE(dataset_add_glob (&globbed, "dataset_test_*_images",
+                              "dataset_test_*_labels") == 0);
+    REQUIRE(globbed.size == 3);
+    REQUIRE(globbed.items == 1001);
+    REQUIRE(dataset_read (&globbed, &data, 0) == 0);
+    check_items (data, 0);
+    images_free (&data.images);
+    labels_free (&data.labels);
+    REQUIRE(dataset_add_glob (&globbed, "dataset_test_*_images",
+                              "no_such_*_labels") == GSL_EFAILED);
+    dataset_free (&globbed);
+
+    // Labels that don't match the images, and lines that aren't pairs
+    REQUIRE(dataset_add (&dataset, shard_files[0], shard_files[3])
+            == GSL_EINVAL);
+    REQUIRE(dataset_add (&dataset, shard_files[1], shard_files[1])
+            == GSL_EINVAL);
+    fp = fopen ("dataset_test_manifest", "w");
+    fprintf (fp, "%s\n", shard_files[0]);
+    fclose (fp);
+    REQUIRE(dataset_add_manifest (&dataset, "dataset_test_manifest")
+            == GSL_EINVAL);
+    REQUIRE(dataset.size == 3);
+
+    dataset_free (&dataset);
+    remove ("dataset_test_manifest");
+    for (uint32_t i = 0; i < 6; ++i) {
+        remove (shard_files[i]);
+    }
+}
+
+TEST_CASE( "Gzipped shards", "[dataset]" )
+{
+    write_shards ();
+    std::string a_images = gzip_file (shard_files[0]);
+    std::string a_labels = gzip_file (shard_files[1]);
+    std::string c_images = gzip_file (shard_files[4]);
+    std::string c_labels = gzip_file (shard_files[5]);
+    std::string cut = gzip_file (shard_files[4], 1000);
+
+    // Whole files, as the loader reads them
+    images_t images;
+    labels_t labels;
+    REQUIRE(images_read_data (&images, a_images.c_str ()) == 0);
+    REQUIRE(labels_read_data (&labels, a_labels.c_str ()) == 0);
+    REQUIRE(images.num_images == 300);
+    REQUIRE(labels.num_labels == 300);
+    REQUIRE(images.pixels[4 * 299] == 299 - 256);
+    REQUIRE(gsl_vector_get (images.images[299], 3) == 1.0);
+    REQUIRE(labels.labels[299] == 9);
+    images_free (&images);
+    labels_free (&labels);
+
+    // Mixed with raw shards
+    dataset_t dataset;
+    dataset_init (&dataset);
+    REQUIRE(dataset_add (&dataset, a_images.c_str (), a_labels.c_str ())
+            == 0);
+    REQUIRE(dataset_add (&dataset, shard_files[2], shard_files[3]) == 0);
+    REQUIRE(dataset_add (&dataset, c_images.c_str (), c_labels.c_str ())
+            == 0);
+    REQUIRE(dataset.items == 1001);
+
+    data_t data;
+    REQUIRE(dataset_read (&dataset, &data, 2) == 0);
+    check_items (data, 0);
+    images_free (&data.images);
+    labels_free (&data.labels);
+
+    // Streamed from part way into a gzipped shard
+    stream_t stream;
+    REQUIRE(stream_open_dataset (&stream, &dataset, 16, 5) == 0);
+    REQUIRE(stream_range (&stream, 100, 800) == 0);
+    REQUIRE(stream_read_data (&stream, &data) == 0);
+    check_items (data, 100);
+    images_free (&data.images);
+    labels_free (&data.labels);
+    stream_close (&stream);
+
+    // A shard cut short is caught reading it
+    dataset_t short_shard;
+    dataset_init (&short_shard);
+    REQUIRE(dataset_add (&short_shard, cut.c_str (), c_labels.c_str ())
+            == 0);
+    REQUIRE(dataset_read (&short_shard, &data, 1) == GSL_EOF);
+    REQUIRE(data.images.images == NULL);
+    REQUIRE(data.labels.labels == NULL);
+    dataset_free (&short_shard);
+
+    dataset_free (&dataset);
+    for (const std::string & gz : { a_images, a_labels, c_images, c_labels,
+                                    cut }) {
+        remove (gz.c_str ());
+    }
+    for (uint32_t i = 0; i < 6; ++i) {
+        remove (shard_files[i]);
+    }
+}
+
+TEST_CASE( "Dataset cache", "[cache]" )
+{
+    const char * cache_file = "dataset_test_cache";
+    write_shards ();
+    remove (cache_file);
+
+    dataset_t dataset;
+    dataset_init (&dataset);
+    for (uint32_t i = 0; i < 6; i += 2) {
+        REQUIRE(dataset_add (&dataset, shard_files[i], shard_files[i + 1])
+                == 0);
+    }
+
+    // Read from the shards and written, then mapped
+    data_t data;
+    REQUIRE(cache_read (&data, &dataset, cache_file, 2) == 0);
+    REQUIRE(data.images.map == NULL);
+    images_free (&data.images);
+    labels_free (&data.labels);
+
+    // Its temporary file is renamed, none is left behind
+    glob_t found;
+    REQUIRE(glob ("dataset_test_cache.*", 0, NULL, &found) == GLOB_NOMATCH);
+    globfree (&found);
+
+    REQUIRE(cache_read (&data, &dataset, cache_file, 2) == 0);
+    REQUIRE(data.images.map != NULL);
+    REQUIRE(data.items == 1001);
+    check_items (data, 0);
+    const uintptr_t offset = (uintptr_t) data.images.images[0]->data
+            % CACHE_ALIGN;
+    REQUIRE(offset == 0);
+    images_free (&data.images);
+    labels_free (&data.labels);
+
+    // A changed shard is read again
+    uint64_t checksum;
+    REQUIRE(cache_checksum (&dataset, &checksum) == 0);
+    write_idx (shard_files[2], shard_files[3], 1, IMAGES_MAGIC, 301);
+    uint64_t changed;
+    REQUIRE(cache_checksum (&dataset, &changed) == 0);
+    REQUIRE(changed != checksum);
+    REQUIRE(cache_map (&data, cache_file, &dataset, changed) == GSL_EINVAL);
+    REQUIRE(cache_read (&data, &dataset, cache_file, 2) == 0);
+    REQUIRE(data.images.map == NULL);
+    REQUIRE(data.images.pixels[4 * 300] == (301 & 0xff));
+    images_free (&data.images);
+    labels_free (&data.labels);
+    REQUIRE(cache_map (&data, cache_file, &dataset, changed) == 0);
+    REQUIRE(data.images.pixels[4 * 300] == (301 & 0xff));
+    images_free (&data.images);
+    labels_free (&data.labels);
+
+    // So is a cache that is cut short or isn't one
+    REQUIRE(truncate (cache_file, 100) == 0);
+    REQUIRE(cache_map (&data, cache_file, &dataset, changed) == GSL_EINVAL);
+    FILE * fp = fopen (cache_file, "wb");
+    fprintf (fp, "not a cache");
+    fclose (fp);
+    REQUIRE(cache_map (&data, cache_file, &dataset, changed) == GSL_EINVAL);
+    REQUIRE(cache_map (&data, "no_such_file", &dataset, changed)
+            == GSL_EFAILED);
+    REQUIRE(cache_read (&data, &dataset, cache_file, 2) == 0);
+    images_free (&data.images);
+    labels_free (&data.labels);
+    REQUIRE(cache_map (&data, cache_file, &dataset, changed) == 0);
+    images_free (&data.images);
+    labels_free (&data.labels);
+
+    dataset_free (&dataset);
+    remove (cache_file);
+    for (uint32_t i = 0; i < 6; ++i) {
+        remove (shard_files[i]);
+    }
+}
+
+TEST_CASE( "Stream training", "[stream]" )
+{
+    const char * images = "stream_train_images";
+    const char * labels = "stream_train_labels";
+    write_idx (images, labels, 500, IMAGES_MAGIC);
+
+    uint32_t nodes[] = { 4, 6, 10 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 3;
+    network.epochs = 2;
+    network.mini_batch_size = 10;
+    network.eta = 3.0;
+    network.mode = NETWORK_TRAIN;
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    stream_t stream;
+    data_t test_data;
+    REQUIRE(stream_open (&stream, images, labels, 64, 10) == 0);
+    REQUIRE(stream_range (&stream, 400, 100) == 0);
+    REQUIRE(stream_read_data (&stream, &test_data) == 0);
+    REQUIRE(stream_range (&stream, 0, 400) == 0);
+
+    gsl_matrix * before = gsl_matrix_alloc (6, 4);
+    gsl_matrix_memcpy (before, network.weights.data[0]);
+    REQUIRE(network_sgd_stream (&network, &stream, &test_data) == 0);
+    REQUIRE(!gsl_matrix_equal (before, network.weights.data[0]));
+
+    gsl_matrix_free (before);
+    images_free (&test_data.images);
+    labels_free (&test_data.labels);
+    stream_close (&stream);
+    network_free (&network);
+    remove (images);
+    remove (labels);
+}
+
 TEST_CASE( "Sigmoid function", "[nnet]" )
 {
     REQUIRE(sigmoid (0.0) == Approx (0.5f));
@@ -125,6 +750,99 @@ TEST_CASE( "Sigmoid prime function", "[nnet]" )
     REQUIRE(sigmoid_prime(-BIG_NUM) == Approx(0.0));
 }
 
+TEST_CASE( "Fast exp and sigmoid", "[nnet]" )
+{
+    double max_exp_err = 0.0;
+    double max_sigmoid_err = 0.0;
+
+    for (double z = -40.0; z <= 40.0; z += 1e-3) {
+        max_exp_err = fmax (max_exp_err, fabs (fast_exp (z) / exp (z) - 1.0));
+        max_sigmoid_err = fmax (max_sigmoid_err,
+                                fabs (sigmoid_fast (z) - sigmoid (z)));
+    }
+
+    // As documented for fast_exp
+    REQUIRE(max_exp_err < 2e-7);
+    REQUIRE(max_sigmoid_err < 5e-8);
+
+    // Clamped rather than overflowing
+    REQUIRE(fast_exp (1000.0) == Approx (exp (FAST_EXP_MAX)));
+    REQUIRE(fast_exp (-1000.0) >= 0.0);
+    REQUIRE(sigmoid_fast (-1000.0) == Approx (0.0));
+    REQUIRE(sigmoid_fast (1000.0) == Approx (1.0));
+
+    // The vector kernel agrees with the scalar one, tails included
+    double z[11];
+    double a[11];
+    for (int i = 0; i < 11; ++i) {
+        z[i] = -12.5 + 2.5 * i;
+    }
+    kernel_sigmoid (z, a, 11, ACTIVATION_FAST);
+    for (int i = 0; i < 11; ++i) {
+        REQUIRE(fabs (a[i] - sigmoid (z[i])) < 5e-8);
+    }
+    kernel_sigmoid (z, z, 11, ACTIVATION_EXACT);
+    for (int i = 0; i < 11; ++i) {
+        REQUIRE(z[i] == sigmoid (-12.5 + 2.5 * i));
+    }
+}
+
+TEST_CASE( "Sigmoid prime from activation", "[nnet]" )
+{
+    gsl_vector * delta = gsl_vector_alloc (3);
+    gsl_vector * a = gsl_vector_alloc (3);
+    for (size_t i = 0; i < 3; ++i) {
+        gsl_vector_set (a, i, sigmoid (i - 1.0));
+        gsl_vector_set (delta, i, 2.0);
+    }
+
+    vector_mul_sigmoid_prime (delta, a);
+
+    for (size_t i = 0; i < 3; ++i) {
+        REQUIRE(gsl_vector_get (delta, i)
+                == Approx (2.0 * sigmoid_prime (i - 1.0)));
+    }
+
+    gsl_vector_free (delta);
+    gsl_vector_free (a);
+}
+
+TEST_CASE( "Backpropagate with dropout", "[nnet]" )
+{
+    uint32_t nodes[] = { 4, 16, 3 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 3;
+    network.dropout = 0.25;
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    gsl_vector * input = gsl_vector_alloc (4);
+    gsl_vector_set_all (input, 0.5);
+    network_set_input (&network, input);
+
+    matrix_array_set_zero (&network.nabla_w);
+    vector_array_zero (&network.nabla_b);
+    network_backpropagate_error (&network, 1);
+
+    // delta^0 = (W^1)^T delta^1 * sigma'(z^0) * mask, where the kept
+    // outputs are a^0 / keep
+    gsl_vector * expected = gsl_vector_alloc (16);
+    gsl_blas_dgemv (CblasTrans, 1.0, network.weights.data[1],
+                    network.output_delta.data[1], 0.0, expected);
+    for (size_t i = 0; i < 16; ++i) {
+        double mask = gsl_vector_get (network.dropout_mask.data[0], i);
+        double a = gsl_vector_get (network.outputs.data[0], i)
+                * (1.0 - network.dropout);
+        REQUIRE(gsl_vector_get (network.output_delta.data[0], i) == Approx (
+                gsl_vector_get (expected, i) * a * (1.0 - a) * mask));
+    }
+
+    gsl_vector_free (expected);
+    gsl_vector_free (input);
+    network_free (&network);
+}
+
 TEST_CASE( "Vectorise function", "[nnet]" )
 {
     gsl_vector * vec = gsl_vector_alloc (3);
@@ -142,6 +860,39 @@ TEST_CASE( "Vectorise function", "[nnet]" )
     gsl_vector_free (vec);
 }
 
+TEST_CASE( "Dropout mask", "[nnet]" )
+{
+    const uint32_t size = 10000;
+    const double rate = 0.25;
+
+    xoshiro256_t rng;
+    xoshiro256_seed (&rng, 0);
+
+    // Odd length to exercise the tail of the mask
+    gsl_vector * mask = gsl_vector_alloc (size + 3);
+    vector_set_dropout_mask (mask, &rng, rate);
+
+    uint32_t dropped = 0;
+    for (uint32_t i = 0; i < mask->size; ++i) {
+        double m = gsl_vector_get (mask, i);
+        if (m == 0.0)
+            dropped++;
+        else
+            REQUIRE(m == Approx (1.0 / (1.0 - rate)));
+    }
+
+    REQUIRE(dropped > 0.23 * size);
+    REQUIRE(dropped < 0.27 * size);
+
+    // Nothing is dropped with a zero rate
+    vector_set_dropout_mask (mask, &rng, 0.0);
+    for (uint32_t i = 0; i < mask->size; ++i) {
+        REQUIRE(gsl_vector_get (mask, i) == Approx (1.0));
+    }
+
+    gsl_vector_free (mask);
+}
+
 void
 mini_batch_test (network_t * const network,
                  const data_t * const data,
@@ -156,7 +907,7 @@ TEST_CASE( "Iterate over mini batches", "[nnet]" )
 {
     // TODO: Assert num images = num labels and store number only once.
     data_t data;
-    network_t network;
+    network_t network = {};
 
     // Perfectly divisible
     data.items = 4;
@@ -180,6 +931,53 @@ TEST_CASE( "Iterate over mini batches", "[nnet]" )
     network_process_mini_batches (&network, &data, &ndwr[0], &mini_batch_test);
 }
 
+TEST_CASE( "Block shuffle index", "[nnet]" )
+{
+    const uint32_t items = 1000;
+    const uint32_t block = 50;
+    gsl_rng * rng = gsl_rng_alloc (gsl_rng_mt19937);
+    std::vector<uint32_t> index (items);
+    std::vector<uint32_t> blocks (items / block);
+
+    for (uint32_t i = 0; i < blocks.size (); ++i) {
+        blocks[i] = i;
+    }
+
+    for (uint32_t epoch = 0; epoch < 3; ++epoch) {
+        network_shuffle_index (rng, index.data (), blocks.data (), items,
+                               block);
+
+        // Each run of block items is one block, shuffled, in a new place
+        uint32_t in_place = 0;
+        uint32_t moved = 0;
+        for (uint32_t i = 0; i < items; ++i) {
+            const uint32_t b = index[i] / block;
+            REQUIRE(b == index[i - i % block] / block);
+            in_place += index[i] == i;
+            moved += index[i] / block != i / block;
+        }
+        REQUIRE(in_place < items / 10);
+        REQUIRE(moved > items / 2);
+
+        std::vector<uint32_t> sorted (index);
+        std::sort (sorted.begin (), sorted.end ());
+        for (uint32_t i = 0; i < items; ++i) {
+            REQUIRE(sorted[i] == i);
+        }
+    }
+
+    // The same number of blocks, the last one short
+    network_shuffle_index (rng, index.data (), blocks.data (), items - 30,
+                           block);
+    std::vector<uint32_t> seen (index.begin (), index.end () - 30);
+    std::sort (seen.begin (), seen.end ());
+    for (uint32_t i = 0; i < seen.size (); ++i) {
+        REQUIRE(seen[i] == i);
+    }
+
+    gsl_rng_free (rng);
+}
+
 TEST_CASE ("Cost derivative", "[nnet]")
 {
     const uint32_t output_size = 4;
@@ -204,7 +1002,7 @@ TEST_CASE ("Cost derivative", "[nnet]")
 
 TEST_CASE ("Get output error", "[nnet]")
 {
-    network_t network;
+    network_t network = {};
 
     uint32_t nodes[] = { 2, 3, 2 };
     uint32_t layers = sizeof(nodes) / sizeof(nodes[0]);
@@ -218,22 +1016,20 @@ TEST_CASE ("Get output error", "[nnet]")
     gsl_vector_set (network.outputs.data[output_index], 0, 0.2f);
     gsl_vector_set (network.outputs.data[output_index], 1, 0.9f);
 
-    gsl_vector_set (network.zs.data[output_index], 0, 0.5f);
-    gsl_vector_set (network.zs.data[output_index], 1, 0.1f);
-
     network_get_output_error (&network, label);
 
+    // a - y, the output layer applies sigma'(z) itself
     REQUIRE(gsl_vector_get (network.output_delta.data[output_index], 0)
-            == Approx (0.047f));
+            == Approx (0.2));
     REQUIRE(gsl_vector_get (network.output_delta.data[output_index], 1)
-            == Approx (-0.02494));
+            == Approx (-0.1));
 
     network_free (&network);
 }
 
 TEST_CASE ("Accumulate cost function gradients", "[nnet]")
 {
-	network_t network;
+	network_t network = {};
 	uint32_t nodes[] = { 2, 3, 2 };
     uint32_t layers = sizeof(nodes) / sizeof(nodes[0]);
     network.nodes.data = nodes;
@@ -241,9 +1037,12 @@ TEST_CASE ("Accumulate cost function gradients", "[nnet]")
 	network_allocate(&network);
 
 	uint32_t output_index = layers - 2;
+    layer_t * layer = &network.layers.data[output_index];
 
-    gsl_vector_set (network.output_delta.data[output_index], 0, 0.5f);
-    gsl_vector_set (network.output_delta.data[output_index], 1, 0.1f);
+    // sigma'(z) = 0.25, so the deltas w.r.t. z are 0.5 and 0.1
+    gsl_vector_set_all (network.outputs.data[output_index], 0.5);
+    gsl_vector_set (network.output_delta.data[output_index], 0, 2.0);
+    gsl_vector_set (network.output_delta.data[output_index], 1, 0.4);
 
     // Use non-zero values to check accumulation for the average
     gsl_vector_set (network.nabla_b.data[output_index], 0, 1.0);
@@ -260,7 +1059,7 @@ TEST_CASE ("Accumulate cost function gradients", "[nnet]")
     gsl_vector_set (network.outputs.data[output_index - 1], 1, 2.0);
     gsl_vector_set (network.outputs.data[output_index - 1], 2, 3.0);
 
-    network_accumulate_cfgs (&network, output_index);
+    layer->ops->backward (layer, network.outputs.data[output_index - 1], NULL);
 
     REQUIRE(gsl_matrix_get (network.nabla_w.data[output_index], 0, 0)
             == Approx (1.5f));
@@ -287,7 +1086,7 @@ TEST_CASE( "Feed forward", "[nnet]" )
 	 * TODO: Extend to test non-trivial weights?
 	 */
 
-    network_t network;
+    network_t network = {};
     uint32_t nodes[] = { 2, 3, 2 };
     uint32_t layers = sizeof(nodes) / sizeof(nodes[0]);
     network.nodes.data = nodes;
@@ -297,10 +1096,9 @@ TEST_CASE( "Feed forward", "[nnet]" )
     uint32_t output_index = layers - 2;
 
     // Normally this points at an input image
-    network.outputs.data[INPUT_INDEX] = gsl_vector_alloc (
-            network.nodes.data[0]);
-
-    gsl_vector_set_all (network.outputs.data[INPUT_INDEX], 1.0);
+    gsl_vector * input = gsl_vector_alloc (network.nodes.data[0]);
+    gsl_vector_set_all (input, 1.0);
+    network_set_input (&network, input);
 
     gsl_matrix_set_all (network.weights.data[output_index - 1], 1.0);
     gsl_matrix_set_all (network.weights.data[output_index], 1.0);
@@ -314,18 +1112,10 @@ TEST_CASE( "Feed forward", "[nnet]" )
     network_feed_forward (&network, 1);
 
     // Inputs
-    REQUIRE(gsl_vector_get (network.outputs.data[INPUT_INDEX], 0)
-            == Approx (1.0));
-    REQUIRE(gsl_vector_get (network.outputs.data[INPUT_INDEX], 1)
-            == Approx (1.0));
-
-    // Middle layer
-    REQUIRE(gsl_vector_get (network.zs.data[output_index - 1], 0)
-            == Approx (0.0));
-    REQUIRE(gsl_vector_get (network.zs.data[output_index - 1], 1)
-            == Approx (0.0));
-    REQUIRE(gsl_vector_get (network.zs.data[output_index - 1], 2)
-            == Approx (0.0));
+    REQUIRE(gsl_vector_get (input, 0) == Approx (1.0));
+    REQUIRE(gsl_vector_get (input, 1) == Approx (1.0));
+
+    // Middle layer, z = 0
     REQUIRE(gsl_vector_get (network.outputs.data[output_index - 1], 0)
             == Approx (0.5f));
     REQUIRE(gsl_vector_get (network.outputs.data[output_index - 1], 1)
@@ -333,19 +1123,1859 @@ TEST_CASE( "Feed forward", "[nnet]" )
     REQUIRE(gsl_vector_get (network.outputs.data[output_index - 1], 2)
             == Approx (0.5f));
 
-    // Output
-    REQUIRE(gsl_vector_get (network.zs.data[output_index], 0)
-            == Approx (0.0));
-    REQUIRE(gsl_vector_get (network.zs.data[output_index], 1)
-            == Approx (0.0));
+    // Output, z = 0
     REQUIRE(gsl_vector_get (network.outputs.data[output_index], 0)
             == Approx (0.5f));
     REQUIRE(gsl_vector_get (network.outputs.data[output_index], 1)
             == Approx (0.5f));
 
+    gsl_vector_free (input);
+    network_free (&network);
+}
+
+TEST_CASE( "Feed forward with dropout", "[nnet]" )
+{
+    network_t network = {};
+    uint32_t nodes[] = { 2, 64, 2 };
+    uint32_t layers = sizeof(nodes) / sizeof(nodes[0]);
+    network.nodes.data = nodes;
+    network.nodes.size = layers;
+    network.dropout = 0.5;
+    network_allocate (&network);
+
+    gsl_vector * input = gsl_vector_alloc (network.nodes.data[0]);
+    gsl_vector_set_all (input, 1.0);
+    network_set_input (&network, input);
+
+    gsl_matrix_set_all (network.weights.data[0], 1.0);
+    gsl_matrix_set_all (network.weights.data[1], 1.0);
+    gsl_vector_set_all (network.biases.data[0], -2.0);
+    gsl_vector_set_all (network.biases.data[1], 0.0);
+
+    // Inference is unaffected by dropout
+    network_feed_forward (&network, 0);
+    for (uint32_t i = 0; i < nodes[1]; ++i) {
+        REQUIRE(gsl_vector_get (network.outputs.data[0], i) == Approx (0.5));
+    }
+
+    // Training drops hidden nodes and rescales the rest
+    vector_array_set_dropout_mask (&network.dropout_mask,
+                                   &network.dropout_rng, network.dropout);
+    network_feed_forward (&network, 1);
+
+    uint32_t dropped = 0;
+    for (uint32_t i = 0; i < nodes[1]; ++i) {
+        double out = gsl_vector_get (network.outputs.data[0], i);
+        if (out == 0.0)
+            dropped++;
+        else
+            REQUIRE(out == Approx (1.0));
+    }
+    REQUIRE(dropped > 0);
+    REQUIRE(dropped < nodes[1]);
+
+    gsl_vector_free (input);
+    network_free (&network);
+}
+
+TEST_CASE( "Inference mode", "[nnet]" )
+{
+    uint32_t nodes[] = { 2, 4, 3, 2 };
+    network_t train = {};
+    network_t infer = {};
+    train.nodes.data = infer.nodes.data = nodes;
+    train.nodes.size = infer.nodes.size = 4;
+    infer.mode = NETWORK_INFER;
+
+    REQUIRE(network_allocate (&train) == 0);
+    REQUIRE(network_allocate (&infer) == 0);
+
+    // No training buffers, and the outputs alternate between two slots
+    REQUIRE(infer.nabla_w.size == 0);
+    REQUIRE(infer.layers.plan.num_slots == 2);
+    REQUIRE(infer.outputs.data[0]->data == infer.outputs.data[2]->data);
+
+    network_random_init (&train, 1.0);
+    network_random_init (&infer, 1.0);
+
+    gsl_vector * input = gsl_vector_alloc (2);
+    gsl_vector_set (input, 0, 0.3);
+    gsl_vector_set (input, 1, -0.7);
+    network_set_input (&train, input);
+    network_set_input (&infer, input);
+
+    network_feed_forward (&train, 0);
+    network_feed_forward (&infer, 0);
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        REQUIRE(gsl_vector_get (infer.outputs.data[2], i)
+                == gsl_vector_get (train.outputs.data[2], i));
+    }
+
+    gsl_vector_free (input);
+    network_free (&train);
+    network_free (&infer);
+}
+
+/*
+ * Predict samples inputs of the given width a batch at a time, and check
+ * against feeding each one forward on its own.
+ */
+static void
+check_predict_batch (network_t * const network, const uint32_t width,
+                     const uint32_t samples, const uint32_t batch_size)
+{
+    const uint32_t outputs_size = network->nodes.data[network->nodes.size - 1];
+    double * inputs = new double[samples * width];
+    double * outputs = new double[samples * outputs_size];
+    uint32_t * classes = new uint32_t[samples];
+
+    for (uint32_t i = 0; i < samples * width; ++i) {
+        inputs[i] = ((i * 37) % 23) / 23.0 - 0.5;
+    }
+
+    network_batch_t batch;
+    REQUIRE(network_batch_allocate (&batch, network, batch_size) == 0);
+    REQUIRE(network_predict_batch (network, &batch, inputs, samples, classes,
+                                   outputs) == 0);
+
+    for (uint32_t s = 0; s < samples; ++s) {
+        gsl_vector_view input = gsl_vector_view_array (inputs + s * width,
+                                                       width);
+        network_set_input (network, &input.vector);
+        network_feed_forward (network, 0);
+
+        const gsl_vector * expected =
+                network->outputs.data[network->outputs.size - 1];
+        REQUIRE(classes[s] == gsl_vector_max_index (expected));
+        for (uint32_t i = 0; i < outputs_size; ++i) {
+            REQUIRE(outputs[s * outputs_size + i]
+                    == Approx (gsl_vector_get (expected, i)));
+        }
+    }
+
+    // Classes alone
+    uint32_t * only_classes = new uint32_t[samples];
+    REQUIRE(network_predict_batch (network, &batch, inputs, samples,
+                                   only_classes, NULL) == 0);
+    for (uint32_t s = 0; s < samples; ++s) {
+        REQUIRE(only_classes[s] == classes[s]);
+    }
+
+    network_batch_free (&batch);
+    delete[] inputs;
+    delete[] outputs;
+    delete[] classes;
+    delete[] only_classes;
+}
+
+TEST_CASE( "Batched prediction", "[nnet]" )
+{
+    uint32_t nodes[] = { 6, 5, 7, 4 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 4;
+    network.mode = NETWORK_INFER;
+
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    // The output of each layer shares a slot with the one two below
+    network_batch_t batch;
+    REQUIRE(network_batch_allocate (&batch, &network, 4) == 0);
+    REQUIRE(batch.plan.num_slots == 2);
+    REQUIRE(batch.input == NULL);
+    REQUIRE(batch.outputs.data[0]->data == batch.outputs.data[2]->data);
+    REQUIRE(batch.outputs.data[1]->size1 == 4);
+    REQUIRE(batch.outputs.data[1]->size2 == 7);
+    network_batch_free (&batch);
+
+    // GEMM passes with a short last pass, then too few rows for a GEMM
+    check_predict_batch (&network, 6, 21, NETWORK_BATCH_MIN_GEMM);
+    check_predict_batch (&network, 6, 3, 16);
+    check_predict_batch (&network, 6, 5, 1);
+
+    network_free (&network);
+}
+
+TEST_CASE( "Batched prediction with features", "[nnet]" )
+{
+    network_t network = {};
+    uint32_t nodes[] = { 0, 4, 3 };
+    layer_t features[] = {
+            { LAYER_CONV2D, 3, 1, 2 },
+            { LAYER_MAX_POOL, 2, 2 },
+            { LAYER_FLATTEN }
+    };
+
+    network.nodes.data = nodes;
+    network.nodes.size = sizeof(nodes) / sizeof(nodes[0]);
+    network.features.size = sizeof(features) / sizeof(features[0]);
+    network.features.data = features;
+    network.features.input_shape = { 1, 8, 8 };
+    network.mode = NETWORK_INFER;
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    network_batch_t batch;
+    REQUIRE(network_batch_allocate (&batch, &network, 2) == 0);
+    REQUIRE(batch.input->size2 == nodes[0]);
+    network_batch_free (&batch);
+
+    check_predict_batch (&network, 64, 11, NETWORK_BATCH_MIN_GEMM);
+
+    network_free (&network);
+}
+
+TEST_CASE( "Packed network", "[packed]" )
+{
+    uint32_t nodes[] = { 13, 5, 9, 4 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 4;
+    network.mode = NETWORK_INFER;
+
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    packed_network_t packed;
+    REQUIRE(packed_network_allocate (&packed, &network) == 0);
+    REQUIRE(packed.padded[0] == 16);
+    REQUIRE(packed.padded[2] == 16);
+    for (uint32_t l = 0; l < packed.layers; ++l) {
+        REQUIRE(((uintptr_t) packed.weights[l] % 64) == 0);
+        REQUIRE(((uintptr_t) packed.biases[l] % 64) == 0);
+    }
+
+    double input[13];
+    double output[4];
+    for (uint32_t s = 0; s < 3; ++s) {
+        for (uint32_t i = 0; i < 13; ++i) {
+            input[i] = ((i + s * 5) % 7) / 7.0 - 0.4;
+        }
+
+        gsl_vector_view view = gsl_vector_view_array (input, 13);
+        network_set_input (&network, &view.vector);
+        network_feed_forward (&network, 0);
+        const gsl_vector * expected = network.outputs.data[2];
+
+        uint32_t best = packed_network_predict (&packed, input, output);
+        REQUIRE(best == gsl_vector_max_index (expected));
+        REQUIRE(packed_network_predict (&packed, input, NULL) == best);
+        for (uint32_t i = 0; i < 4; ++i) {
+            REQUIRE(output[i] == Approx (gsl_vector_get (expected, i)));
+        }
+    }
+
+    // New weights only show after a refresh
+    const double before = output[3];
+    gsl_vector_set_all (network.biases.data[2], 0.0);
+    gsl_vector_set (network.biases.data[2], 3, 50.0);
+    packed_network_predict (&packed, input, output);
+    REQUIRE(output[3] == before);
+    packed_network_refresh (&packed, &network);
+    REQUIRE(packed_network_predict (&packed, input, output) == 3);
+    REQUIRE(output[3] == Approx (1.0));
+
+    packed_network_free (&packed);
+    network_free (&network);
+
+    // Only whole dense networks are packed
+    layer_t features[] = { { LAYER_FLATTEN } };
+    network.features.size = 1;
+    network.features.data = features;
+    REQUIRE(packed_network_allocate (&packed, &network) == GSL_EINVAL);
+}
+
+TEST_CASE( "Fixed network", "[fixed]" )
+{
+    uint32_t nodes[] = { 13, 5, 9, 4 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 4;
+    network.mini_batch_size = 3;
+    network.eta = 0.5;
+
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    nnet::fixed_network<13, 5, 9, 4> fixed;
+    REQUIRE(fixed.load (network) == 0);
+
+    const uint32_t items = 3;
+    gsl_vector * images[items];
+    uint8_t labels[items];
+    uint32_t order[items];
+    for (uint32_t s = 0; s < items; ++s) {
+        images[s] = gsl_vector_alloc (13);
+        for (uint32_t i = 0; i < 13; ++i) {
+            gsl_vector_set (images[s], i, ((i + s * 5) % 7) / 7.0 - 0.4);
+        }
+        labels[s] = s;
+        order[s] = s;
+
+        network_set_input (&network, images[s]);
+        network_feed_forward (&network, 0);
+        const gsl_vector * expected = network.outputs.data[2];
+
+        const double * output = fixed.forward (images[s]->data);
+        for (uint32_t i = 0; i < 4; ++i) {
+            REQUIRE(output[i] == Approx (gsl_vector_get (expected, i)));
+        }
+        REQUIRE(fixed.predict (images[s]->data)
+                == gsl_vector_max_index (expected));
+    }
+
+    // The same step of SGD on both, then compare the weights
+    data_t data = {};
+    data.images.images = images;
+    data.labels.labels = labels;
+    data.items = items;
+    uint32_array_t slice = { items, order };
+
+    network_update_mini_batch (&network, &data, &slice);
+    fixed.update_mini_batch (data, slice, network.eta);
+
+    // Stored along with the transposed copy
+    network_t stored = {};
+    stored.nodes = network.nodes;
+    stored.transpose_weights = 1;
+    REQUIRE(network_allocate (&stored) == 0);
+    REQUIRE(fixed.store (stored) == 0);
+    for (uint32_t l = 0; l < 3; ++l) {
+        const gsl_matrix * w = network.weights.data[l];
+        for (size_t i = 0; i < w->size1; ++i) {
+            REQUIRE(gsl_vector_get (stored.biases.data[l], i)
+                    == Approx (gsl_vector_get (network.biases.data[l], i)));
+            for (size_t j = 0; j < w->size2; ++j) {
+                REQUIRE(gsl_matrix_get (stored.weights.data[l], i, j)
+                        == Approx (gsl_matrix_get (w, i, j)));
+                REQUIRE(gsl_matrix_get (stored.weights_t.data[l], j, i)
+                        == gsl_matrix_get (stored.weights.data[l], i, j));
+            }
+        }
+    }
+
+    // Only a network of the same shape loads or is stored to
+    nnet::fixed_network<13, 5, 4> shallow;
+    nnet::fixed_network<13, 6, 9, 4> wider;
+    const double before = gsl_matrix_get (network.weights.data[0], 0, 0);
+    REQUIRE(shallow.load (network) == GSL_EBADLEN);
+    REQUIRE(wider.load (network) == GSL_EBADLEN);
+    REQUIRE(shallow.store (network) == GSL_EBADLEN);
+    REQUIRE(wider.store (network) == GSL_EBADLEN);
+    REQUIRE(gsl_matrix_get (network.weights.data[0], 0, 0) == before);
+
+    for (uint32_t s = 0; s < items; ++s) {
+        gsl_vector_free (images[s]);
+    }
+    network_free (&stored);
+    network_free (&network);
+}
+
+TEST_CASE( "Checkpoint", "[checkpoint]" )
+{
+    const char * path = "test_checkpoint.nnet";
+    uint32_t nodes[] = { 13, 5, 4 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 3;
+    network.mode = NETWORK_INFER;
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+    REQUIRE(checkpoint_save (&network, path) == 0);
+
+    uint32_array_t saved;
+    REQUIRE(checkpoint_read_nodes (&saved, path) == 0);
+    REQUIRE(saved.size == 3);
+    REQUIRE(saved.data[0] == 13);
+    REQUIRE(saved.data[2] == 4);
+
+    network_t loaded = {};
+    loaded.nodes = saved;
+    loaded.mode = NETWORK_INFER;
+    REQUIRE(network_allocate (&loaded) == 0);
+    REQUIRE(checkpoint_load (&loaded, path) == 0);
+    for (uint32_t l = 0; l < 2; ++l) {
+        REQUIRE(gsl_matrix_equal (loaded.weights.data[l],
+                                  network.weights.data[l]));
+        REQUIRE(gsl_vector_equal (loaded.biases.data[l],
+                                  network.biases.data[l]));
+    }
+
+    // Only into the same shape
+    uint32_t other[] = { 13, 6, 4 };
+    network_t wider = {};
+    wider.nodes.data = other;
+    wider.nodes.size = 3;
+    wider.mode = NETWORK_INFER;
+    REQUIRE(network_allocate (&wider) == 0);
+    REQUIRE(checkpoint_load (&wider, path) == GSL_EBADLEN);
+    REQUIRE(checkpoint_load (&wider, "no_such_file") == GSL_EFAILED);
+
+    // Nor from anything else
+    FILE * fp = fopen (path, "wb");
+    fputs ("MNIST", fp);
+    fclose (fp);
+    REQUIRE(checkpoint_load (&network, path) == GSL_EFAILED);
+    fp = fopen (path, "wb");
+    fputs ("IDX3 and more than a header", fp);
+    fclose (fp);
+    REQUIRE(checkpoint_load (&network, path) == GSL_EINVAL);
+
+    // Nor node counts that are corrupt or don't match the length
+    const uint32_t headers[][5] = {
+            { CHECKPOINT_VERSION, 3, 13, 0, 4 },
+            { CHECKPOINT_VERSION, 3, 13, UINT32_MAX, 4 },
+            { CHECKPOINT_VERSION, UINT32_MAX, 13, 5, 4 },
+            { CHECKPOINT_VERSION, 3, 13, 5, 4 }
+    };
+    for (uint32_t h = 0; h < 4; ++h) {
+        fp = fopen (path, "wb");
+        fwrite (CHECKPOINT_MAGIC, 1, 4, fp);
+        fwrite (headers[h], sizeof(uint32_t), 5, fp);
+        fclose (fp);
+        uint32_array_t corrupt;
+        REQUIRE(checkpoint_read_nodes (&corrupt, path) == GSL_EINVAL);
+        REQUIRE(corrupt.data == NULL);
+    }
+    REQUIRE(checkpoint_save (&network, path) == 0);
+    REQUIRE(truncate (path, 100) == 0);
+    REQUIRE(checkpoint_load (&network, path) == GSL_EINVAL);
+
+    remove (path);
+    network_free (&wider);
+    network_free (&loaded);
+    free (saved.data);
+    network_free (&network);
+}
+
+TEST_CASE( "Emit C", "[codegen]" )
+{
+    uint32_t nodes[] = { 3, 5, 2 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 3;
+    network.mode = NETWORK_INFER;
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    FILE * fp = tmpfile ();
+    REQUIRE(codegen_emit (&network, "tiny", fp) == 0);
+    std::string code;
+    rewind (fp);
+    for (int c = fgetc (fp); c != EOF; c = fgetc (fp)) {
+        code += (char) c;
+    }
+    fclose (fp);
+
+    REQUIRE(code.find ("#define TINY_INPUTS 3") != std::string::npos);
+    REQUIRE(code.find ("#define TINY_OUTPUTS 2") != std::string::npos);
+    REQUIRE(code.find ("uint32_t\ntiny_predict (const double * const input")
+            != std::string::npos);
+    REQUIRE(code.find ("gsl") == std::string::npos);
+
+    // Each row of the first weights is an input to the 5 outputs, padded
+    size_t row = code.find ("tiny_w0[3][8]");
+    REQUIRE(row != std::string::npos);
+    for (uint32_t j = 0; j < 3; ++j) {
+        row = code.find ("{ ", row + 1);
+        const char * c = code.c_str () + row + 1;
+        for (uint32_t i = 0; i < 8; ++i) {
+            char * end;
+            double w = strtod (c, &end);
+            double expected = i < 5
+                    ? gsl_matrix_get (network.weights.data[0], i, j) : 0.0;
+            REQUIRE(w == expected);
+            c = end + 1;
+        }
+    }
+
+    fp = tmpfile ();
+    REQUIRE(codegen_emit (&network, "2fast", fp) == GSL_EINVAL);
+    REQUIRE(codegen_emit (&network, "not-c", fp) == GSL_EINVAL);
+    fclose (fp);
+
+    network_free (&network);
+}
+
+TEST_CASE( "Histogram", "[histogram]" )
+{
+    histogram_t h;
+    histogram_reset (&h);
+    REQUIRE(histogram_percentile (&h, 50.0) == 0);
+
+    // Exact while small
+    for (uint64_t v = 0; v < 8; ++v) {
+        histogram_record (&h, v);
+    }
+    REQUIRE(histogram_percentile (&h, 50.0) == 3);
+    REQUIRE(histogram_percentile (&h, 100.0) == 7);
+
+    // Then within an eighth
+    histogram_reset (&h);
+    for (uint64_t v = 1; v <= 100000; ++v) {
+        histogram_record (&h, v * 1000);
+    }
+    REQUIRE(h.count == 100000);
+    REQUIRE(h.max == 100000000);
+    REQUIRE(histogram_mean (&h) == Approx (50000500.0));
+    const double ps[] = { 1.0, 50.0, 99.0, 99.9 };
+    for (uint32_t i = 0; i < 4; ++i) {
+        double exact = ps[i] * 1000000.0;
+        double p = histogram_percentile (&h, ps[i]);
+        REQUIRE(p >= exact);
+        REQUIRE(p <= (exact * 1.125));
+    }
+    REQUIRE(histogram_percentile (&h, 100.0) == h.max);
+
+    histogram_t other;
+    histogram_reset (&other);
+    histogram_record (&other, UINT64_MAX);
+    histogram_merge (&h, &other);
+    REQUIRE(h.count == 100001);
+    REQUIRE(histogram_percentile (&h, 100.0) == UINT64_MAX);
+}
+
+TEST_CASE( "SPSC queue", "[queue]" )
+{
+    spsc_queue_t q;
+    REQUIRE(spsc_queue_allocate (&q, 6) == GSL_EINVAL);
+    REQUIRE(spsc_queue_allocate (&q, 4) == 0);
+
+    uint32_t items[6];
+    REQUIRE(spsc_queue_pop (&q) == NULL);
+    for (uint32_t round = 0; round < 3; ++round) {
+        for (uint32_t i = 0; i < 4; ++i) {
+            REQUIRE(spsc_queue_push (&q, &items[i]) == 0);
+        }
+        REQUIRE(spsc_queue_push (&q, &items[4]) != 0);
+        for (uint32_t i = 0; i < 4; ++i) {
+            REQUIRE(spsc_queue_pop (&q) == &items[i]);
+        }
+        REQUIRE(spsc_queue_pop (&q) == NULL);
+    }
+
+    spsc_queue_free (&q);
+}
+
+typedef struct
+{
+    mpsc_queue_t * queue;
+    uintptr_t producer;
+} mpsc_producer_t;
+
+static void *
+mpsc_producer (void * arg)
+{
+    mpsc_producer_t * p = (mpsc_producer_t *) arg;
+
+    // Tagged with the producer in the top bits, and 1 based so not NULL
+    for (uintptr_t i = 1; i <= 10000; ++i) {
+        while (mpsc_queue_push (p->queue, (void *) ((p->producer << 24) | i)))
+            sched_yield ();
+    }
+
+    return NULL;
+}
+
+TEST_CASE( "MPSC queue", "[queue]" )
+{
+    mpsc_queue_t q;
+    REQUIRE(mpsc_queue_allocate (&q, 64) == 0);
+    REQUIRE(mpsc_queue_pop (&q) == NULL);
+
+    const uint32_t producers = 4;
+    mpsc_producer_t args[producers];
+    pthread_t tids[producers];
+    for (uint32_t p = 0; p < producers; ++p) {
+        args[p].queue = &q;
+        args[p].producer = p;
+        REQUIRE(pthread_create (&tids[p], NULL, &mpsc_producer, &args[p])
+                == 0);
+    }
+
+    // Each producer's items arrive once each and in order
+    uintptr_t last[producers] = {};
+    uint32_t popped = 0;
+    while (popped < producers * 10000) {
+        uintptr_t item = (uintptr_t) mpsc_queue_pop (&q);
+        if (!item)
+            continue;
+        uintptr_t p = item >> 24;
+        REQUIRE(p < producers);
+        REQUIRE((item & 0xffffff) == last[p] + 1);
+        last[p]++;
+        popped++;
+    }
+    REQUIRE(mpsc_queue_pop (&q) == NULL);
+    REQUIRE(mpsc_queue_size (&q) == 0);
+
+    for (uint32_t p = 0; p < producers; ++p) {
+        pthread_join (tids[p], NULL);
+    }
+    mpsc_queue_free (&q);
+}
+
+TEST_CASE( "Address", "[address]" )
+{
+    address_t a;
+    REQUIRE(address_parse (&a, "unix:/tmp/nnet.sock") == 0);
+    REQUIRE(a.family == AF_UNIX);
+    REQUIRE(address_parse (&a, "tcp:5000") == 0);
+    REQUIRE(a.family == AF_INET);
+    REQUIRE(address_parse (&a, "tcp:0") == GSL_EINVAL);
+    REQUIRE(address_parse (&a, "tcp:5000x") == GSL_EINVAL);
+    REQUIRE(address_parse (&a, "unix:") == GSL_EINVAL);
+    REQUIRE(address_parse (&a, "udp:5000") == GSL_EINVAL);
+}
+
+typedef struct
+{
+    batcher_t * batcher;
+    const uint8_t * pixels;
+    uint32_t images;
+    uint32_t offset;
+    uint32_t labels[64];
+} batcher_client_t;
+
+static void *
+batcher_client (void * arg)
+{
+    batcher_client_t * client = (batcher_client_t *) arg;
+
+    batcher_attach (client->batcher);
+    for (uint32_t i = 0; i < 64; ++i) {
+        uint32_t image = (client->offset + i) % client->images;
+        client->labels[i] = batcher_classify (client->batcher,
+                                              client->pixels + image * 13);
+    }
+    batcher_detach (client->batcher);
+
+    return NULL;
+}
+
+TEST_CASE( "Batcher", "[batcher]" )
+{
+    const uint32_t images = 16;
+    uint32_t nodes[] = { 13, 5, 4 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 3;
+    network.mode = NETWORK_INFER;
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    uint8_t pixels[images * 13];
+    double inputs[images * 13];
+    uint32_t expected[images];
+    for (uint32_t i = 0; i < images * 13; ++i) {
+        pixels[i] = (i * 97) % 256;
+        inputs[i] = pixels[i] / 255.0;
+    }
+
+    network_batch_t batch;
+    REQUIRE(network_batch_allocate (&batch, &network, images) == 0);
+    REQUIRE(network_predict_batch (&network, &batch, inputs, images,
+                                   expected, NULL) == 0);
+    network_batch_free (&batch);
+
+    // A generous budget, which a lone request shouldn't wait out
+    batcher_t batcher;
+    REQUIRE(batcher_start (&batcher, &network, 4, 1000000000) == 0);
+    uint64_t start = batcher_now ();
+    REQUIRE(batcher_classify (&batcher, pixels + 13) == expected[1]);
+    REQUIRE((batcher_now () - start) < 500000000);
+
+    const uint32_t threads = 4;
+    batcher_client_t clients[threads];
+    pthread_t tids[threads];
+    for (uint32_t t = 0; t < threads; ++t) {
+        clients[t].batcher = &batcher;
+        clients[t].pixels = pixels;
+        clients[t].images = images;
+        clients[t].offset = t * 5;
+        REQUIRE(pthread_create (&tids[t], NULL, &batcher_client,
+                                &clients[t]) == 0);
+    }
+    for (uint32_t t = 0; t < threads; ++t) {
+        pthread_join (tids[t], NULL);
+    }
+
+    for (uint32_t t = 0; t < threads; ++t) {
+        for (uint32_t i = 0; i < 64; ++i) {
+            REQUIRE(clients[t].labels[i]
+                    == expected[(clients[t].offset + i) % images]);
+        }
+    }
+
+    batcher_stats_t stats;
+    batcher_take_stats (&batcher, &stats);
+    REQUIRE(stats.latency.count == (1 + threads * 64));
+    REQUIRE(stats.depth.count == stats.latency.count);
+    REQUIRE(stats.batch.sum == stats.latency.count);
+    REQUIRE(stats.batch.max <= 4);
+    REQUIRE(stats.depth.max < threads);
+
+    batcher_take_stats (&batcher, &stats);
+    REQUIRE(stats.latency.count == 0);
+
+    batcher_stop (&batcher);
+    network_free (&network);
+}
+
+typedef struct
+{
+    batcher_t * batcher;
+    const uint8_t * pixels;
+    const uint32_t * expected[2];
+    uint32_t stop;
+    uint32_t wrong;
+} swap_client_t;
+
+static void *
+swap_client (void * arg)
+{
+    swap_client_t * client = (swap_client_t *) arg;
+
+    batcher_attach (client->batcher);
+    for (uint32_t i = 0; !__atomic_load_n (&client->stop, __ATOMIC_RELAXED);
+            ++i) {
+        uint32_t image = i % 16;
+        uint32_t label = batcher_classify (client->batcher,
+                                           client->pixels + image * 13);
+        if (label != client->expected[0][image]
+                && label != client->expected[1][image])
+            client->wrong++;
+    }
+    batcher_detach (client->batcher);
+
+    return NULL;
+}
+
+static network_t *
+swap_network (const char * path)
+{
+    uint32_t * nodes = (uint32_t *) malloc (3 * sizeof(uint32_t));
+    network_t * network = new network_t ();
+    nodes[0] = 13;
+    nodes[1] = 5;
+    nodes[2] = 4;
+    network->nodes.data = nodes;
+    network->nodes.size = 3;
+    network->mode = NETWORK_INFER;
+    REQUIRE(network_allocate (network) == 0);
+    if (path)
+        REQUIRE(checkpoint_load (network, path) == 0);
+
+    return network;
+}
+
+static void
+swap_free (network_t * network)
+{
+    free (network->nodes.data);
+    network_free (network);
+    delete network;
+}
+
+TEST_CASE( "Batcher swap", "[batcher]" )
+{
+    const char * paths[] = { "batcher_swap_a.nnet", "batcher_swap_b.nnet" };
+    uint8_t pixels[16 * 13];
+    double inputs[16 * 13];
+    uint32_t expected[2][16];
+    for (uint32_t i = 0; i < 16 * 13; ++i) {
+        pixels[i] = (i * 61) % 256;
+        inputs[i] = pixels[i] / 255.0;
+    }
+
+    // Two models of the same shape that disagree on some images
+    for (uint32_t m = 0; m < 2; ++m) {
+        network_t * network = swap_network (NULL);
+        network_random_init (network, 1.0);
+        REQUIRE(checkpoint_save (network, paths[m]) == 0);
+
+        network_batch_t batch;
+        REQUIRE(network_batch_allocate (&batch, network, 16) == 0);
+        REQUIRE(network_predict_batch (network, &batch, inputs, 16,
+                                       expected[m], NULL) == 0);
+        network_batch_free (&batch);
+        swap_free (network);
+    }
+
+    batcher_t batcher;
+    network_t * a = swap_network (paths[0]);
+    REQUIRE(batcher_start (&batcher, a, 4, 100000) == 0);
+
+    network_t * b = swap_network (paths[1]);
+    network_t * old;
+    REQUIRE(batcher_swap (&batcher, b, &old) == 0);
+    REQUIRE(old == a);
+    swap_free (old);
+    for (uint32_t i = 0; i < 16; ++i) {
+        REQUIRE(batcher_classify (&batcher, pixels + i * 13)
+                == expected[1][i]);
+    }
+
+    uint32_t nodes[] = { 13, 6, 4 };
+    network_t other = {};
+    other.nodes.data = nodes;
+    other.nodes.size = 3;
+    REQUIRE(batcher_swap (&batcher, &other, &old) == GSL_EBADLEN);
+
+    // Old networks are freed as soon as they are swapped out
+    const uint32_t threads = 3;
+    swap_client_t clients[threads];
+    pthread_t tids[threads];
+    for (uint32_t t = 0; t < threads; ++t) {
+        clients[t].batcher = &batcher;
+        clients[t].pixels = pixels;
+        clients[t].expected[0] = expected[0];
+        clients[t].expected[1] = expected[1];
+        clients[t].stop = 0;
+        clients[t].wrong = 0;
+        REQUIRE(pthread_create (&tids[t], NULL, &swap_client, &clients[t])
+                == 0);
+    }
+    for (uint32_t i = 0; i < 40; ++i) {
+        REQUIRE(batcher_swap (&batcher, swap_network (paths[i % 2]), &old)
+                == 0);
+        swap_free (old);
+    }
+    for (uint32_t t = 0; t < threads; ++t) {
+        __atomic_store_n (&clients[t].stop, 1, __ATOMIC_RELAXED);
+        pthread_join (tids[t], NULL);
+        REQUIRE(clients[t].wrong == 0);
+    }
+
+    // The last swap was to the second model
+    for (uint32_t i = 0; i < 16; ++i) {
+        REQUIRE(batcher_classify (&batcher, pixels + i * 13)
+                == expected[1][i]);
+    }
+
+    batcher_stop (&batcher);
+    swap_free (batcher.network);
+    remove (paths[0]);
+    remove (paths[1]);
+}
+
+typedef struct
+{
+    shm_ring_t * ring;
+    network_t * network;
+    network_batch_t * batch;
+    uint32_t requests;
+} shm_server_t;
+
+// Classifies the requests by the network, a few at a time
+static void *
+shm_server (void * arg)
+{
+    shm_server_t * server = (shm_server_t *) arg;
+    const uint32_t inputs = server->network->nodes.data[0];
+    const uint8_t * pixels[8];
+    uint32_t labels[8];
+    double x[8 * 13];
+    uint32_t served = 0;
+
+    while (served < server->requests) {
+        uint32_t n = shm_ring_wait (server->ring, 8, pixels, 100000000);
+        for (uint32_t i = 0; i < n; ++i) {
+            for (uint32_t j = 0; j < inputs; ++j) {
+                x[i * inputs + j] = pixels[i][j] / 255.0;
+            }
+        }
+        if (n)
+            network_predict_batch (server->network, server->batch, x, n,
+                                   labels, NULL);
+        shm_ring_complete (server->ring, n, labels);
+        served += n;
+    }
+
+    return NULL;
+}
+
+typedef struct
+{
+    shm_ring_t * ring;
+    const uint8_t * pixels;
+    uint32_t offset;
+    uint32_t labels[100];
+} shm_client_t;
+
+static void *
+shm_client (void * arg)
+{
+    shm_client_t * client = (shm_client_t *) arg;
+
+    for (uint32_t i = 0; i < 100; ++i) {
+        uint32_t image = (client->offset + i) % 16;
+        client->labels[i] = shm_ring_classify (client->ring,
+                                               client->pixels + image * 13);
+    }
+
+    return NULL;
+}
+
+TEST_CASE( "Shared memory ring", "[shm]" )
+{
+    uint32_t nodes[] = { 13, 5, 4 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 3;
+    network.mode = NETWORK_INFER;
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    uint8_t pixels[16 * 13];
+    double inputs[16 * 13];
+    uint32_t expected[16];
+    for (uint32_t i = 0; i < 16 * 13; ++i) {
+        pixels[i] = (i * 89) % 256;
+        inputs[i] = pixels[i] / 255.0;
+    }
+    network_batch_t batch;
+    REQUIRE(network_batch_allocate (&batch, &network, 16) == 0);
+    REQUIRE(network_predict_batch (&network, &batch, inputs, 16, expected,
+                                   NULL) == 0);
+
+    std::string name = "nnet-test-" + std::to_string (getpid ());
+    shm_ring_t server_ring, client_ring;
+    REQUIRE(shm_ring_create (&server_ring, name.c_str (), 13, 6)
+            == GSL_EINVAL);
+    REQUIRE(shm_ring_create (&server_ring, "a/b", 13, 8) == GSL_EINVAL);
+    REQUIRE(shm_ring_open (&client_ring, name.c_str ()) == GSL_EFAILED);
+
+    // Fewer slots than clients' requests, so tickets lap the ring
+    REQUIRE(shm_ring_create (&server_ring, name.c_str (), 13, 8) == 0);
+    REQUIRE(shm_ring_open (&client_ring, name.c_str ()) == 0);
+    REQUIRE(client_ring.header->inputs == 13);
+
+    const uint32_t clients = 4;
+    shm_server_t server = { &server_ring, &network, &batch, clients * 100 };
+    shm_client_t args[clients];
+    pthread_t server_thread, tids[clients];
+    REQUIRE(pthread_create (&server_thread, NULL, &shm_server, &server) == 0);
+    for (uint32_t c = 0; c < clients; ++c) {
+        args[c].ring = &client_ring;
+        args[c].pixels = pixels;
+        args[c].offset = c * 3;
+        REQUIRE(pthread_create (&tids[c], NULL, &shm_client, &args[c]) == 0);
+    }
+    for (uint32_t c = 0; c < clients; ++c) {
+        pthread_join (tids[c], NULL);
+    }
+    pthread_join (server_thread, NULL);
+
+    for (uint32_t c = 0; c < clients; ++c) {
+        for (uint32_t i = 0; i < 100; ++i) {
+            REQUIRE(args[c].labels[i] == expected[(args[c].offset + i) % 16]);
+        }
+    }
+
+    // Nothing left, so the server times out
+    const uint8_t * none[1];
+    REQUIRE(shm_ring_wait (&server_ring, 1, none, 1000000) == 0);
+
+    shm_ring_close (&client_ring);
+    shm_ring_close (&server_ring);
+    REQUIRE(shm_ring_open (&client_ring, name.c_str ()) == GSL_EFAILED);
+    network_batch_free (&batch);
+    network_free (&network);
+}
+
+TEST_CASE( "Quantised dot product", "[quant]" )
+{
+    const size_t n = 800;
+    uint8_t codes[n];
+    int8_t weights[n];
+
+    // The extremes would saturate pairs summed in 16 bits
+    for (size_t j = 0; j < n; ++j) {
+        codes[j] = j % 3 ? 255 : (uint8_t) (j * 7);
+        weights[j] = j % 5 ? -127 : (int8_t) (j * 11 % 255 - 127);
+    }
+
+    for (size_t len = QUANT_ALIGN; len <= n; len += 3 * QUANT_ALIGN) {
+        int64_t expected = 0;
+        for (size_t j = 0; j < len; ++j) {
+            expected += (int32_t) codes[j] * weights[j];
+        }
+        REQUIRE(quant_dot (codes, weights, len) == expected);
+    }
+}
+
+TEST_CASE( "Quantised network", "[quant]" )
+{
+    uint32_t nodes[] = { 784, 30, 10 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 3;
+    network.mode = NETWORK_INFER;
+
+    REQUIRE(network_allocate (&network) == 0);
+    network_random_init (&network, 1.0);
+
+    // Sparse images, like the digits
+    const uint32_t items = 50;
+    uint8_t * pixels = new uint8_t[items * 784];
+    gsl_vector * images[items];
+    uint8_t labels[items];
+    for (uint32_t i = 0; i < items; ++i) {
+        images[i] = gsl_vector_alloc (784);
+        for (uint32_t j = 0; j < 784; ++j) {
+            uint32_t h = (i * 7919 + j * 104729) % 1013;
+            pixels[i * 784 + j] = h < 200 ? (uint8_t) h : 0;
+            gsl_vector_set (images[i], j, pixels[i * 784 + j] / 255.0);
+        }
+    }
+
+    data_t data = {};
+    data.images.rows = 28;
+    data.images.cols = 28;
+    data.images.images = images;
+    data.images.pixels = pixels;
+    data.labels.labels = labels;
+    data.items = items;
+
+    quant_network_t quant;
+    REQUIRE(quant_network_allocate (&quant, &network) == 0);
+    REQUIRE(quant.layer[0].stride == 800);
+    REQUIRE(quant.layer[1].input_scale == Approx (1.0 / 255.0));
+
+    // An eighth of the size, less the scales and biases
+    const size_t double_bytes = (784 * 30 + 30 * 10 + 40) * sizeof(double);
+    REQUIRE((quant_network_bytes (&quant) * 7) < double_bytes);
+
+    quant_network_calibrate (&quant, &network, &data, items);
+    double max_hidden = 0.0;
+    for (uint32_t i = 0; i < items; ++i) {
+        network_set_input (&network, images[i]);
+        network_feed_forward (&network, 0);
+        double m = gsl_vector_max (network.outputs.data[0]);
+        max_hidden = m > max_hidden ? m : max_hidden;
+        labels[i] = gsl_vector_max_index (network.outputs.data[1]);
+    }
+    REQUIRE(quant.layer[1].input_scale == Approx (max_hidden / 255.0));
+
+    double output[10];
+    double worst = 0.0;
+    for (uint32_t i = 0; i < items; ++i) {
+        network_set_input (&network, images[i]);
+        network_feed_forward (&network, 0);
+        quant_network_predict (&quant, pixels + i * 784, output);
+        for (uint32_t k = 0; k < 10; ++k) {
+            double d = fabs (output[k]
+                             - gsl_vector_get (network.outputs.data[1], k));
+            worst = d > worst ? d : worst;
+        }
+    }
+    REQUIRE(worst < 0.02);
+
+    // The labels are the double network's answers
+    uint32_t correct;
+    quant_network_evaluate (&quant, &data, &correct);
+    REQUIRE(correct >= items - 2);
+
+    quant_network_free (&quant);
+    for (uint32_t i = 0; i < items; ++i) {
+        gsl_vector_free (images[i]);
+    }
+    delete[] pixels;
+    network_free (&network);
+}
+
+TEST_CASE( "Half precision conversions", "[half]" )
+{
+    REQUIRE(half_from_double (1.0, PRECISION_BF16) == 0x3f80);
+    REQUIRE(half_from_double (-2.0, PRECISION_BF16) == 0xc000);
+    REQUIRE(half_from_double (1.0, PRECISION_FP16) == 0x3c00);
+    REQUIRE(half_from_double (-2.0, PRECISION_FP16) == 0xc000);
+
+    // The largest half, overflow, and the smallest subnormal
+    REQUIRE(half_from_double (65504.0, PRECISION_FP16) == 0x7bff);
+    REQUIRE(half_from_double (1e6, PRECISION_FP16) == 0x7c00);
+    REQUIRE(half_from_double (ldexp (1.0, -24), PRECISION_FP16) == 0x0001);
+    REQUIRE(half_from_double (ldexp (1.0, -26), PRECISION_FP16) == 0x0000);
+    REQUIRE(half_to_double (0x0001, PRECISION_FP16) == ldexp (1.0, -24));
+
+    // Halfway cases go to even
+    REQUIRE(half_from_double (1.0 + ldexp (1.0, -11), PRECISION_FP16)
+            == 0x3c00);
+    REQUIRE(half_from_double (1.0 + 3 * ldexp (1.0, -11), PRECISION_FP16)
+            == 0x3c02);
+    REQUIRE(half_from_double (1.0 + ldexp (1.0, -8), PRECISION_BF16)
+            == 0x3f80);
+
+    for (double x = -3.0; x < 3.0; x += 0.173) {
+        double bf16 = half_to_double (half_from_double (x, PRECISION_BF16),
+                                      PRECISION_BF16);
+        double fp16 = half_to_double (half_from_double (x, PRECISION_FP16),
+                                      PRECISION_FP16);
+        REQUIRE(fabs (bf16 - x) <= fabs (x) * ldexp (1.0, -8));
+        REQUIRE(fabs (fp16 - x) <= fabs (x) * ldexp (1.0, -11));
+    }
+}
+
+TEST_CASE( "Half precision kernels", "[half]" )
+{
+    uint32_t nodes[] = { 37, 19 };
+    uint32_array_t dimensions = { 2, nodes };
+    matrix_array_t weights;
+    REQUIRE(matrix_array_allocate (&weights, &dimensions) == 0);
+    gsl_rng * rng = gsl_rng_alloc (gsl_rng_mt19937);
+    matrix_array_set_rand (&weights, rng, 1.0);
+
+    gsl_vector * x = gsl_vector_alloc (37);
+    gsl_vector * b = gsl_vector_alloc (19);
+    gsl_vector * delta = gsl_vector_alloc (19);
+    vector_set_rand (x, rng, 1.0);
+    vector_set_rand (b, rng, 1.0);
+    vector_set_rand (delta, rng, 1.0);
+
+    for (uint32_t p = PRECISION_BF16; p <= PRECISION_FP16; ++p) {
+        const double tol = p == PRECISION_BF16 ? 0.1 : 0.02;
+        half_matrix_array_t half;
+        REQUIRE(half_matrix_array_allocate (&half, &dimensions,
+                                            (precision_t) p) == 0);
+        half_matrix_array_memcpy (&half, &weights);
+
+        gsl_vector * expected = gsl_vector_alloc (19);
+        gsl_vector * zs = gsl_vector_alloc (19);
+        gsl_vector * a = gsl_vector_alloc (19);
+        kernel_dense_forward (weights.data[0], x, b, NULL, expected,
+                              ACTIVATION_EXACT);
+        half_dense_forward (&half, 0, x, b, zs, a, ACTIVATION_EXACT);
+        for (uint32_t i = 0; i < 19; ++i) {
+            REQUIRE(gsl_vector_get (a, i)
+                    == Approx (gsl_vector_get (expected, i)).epsilon (tol));
+            REQUIRE(gsl_vector_get (a, i)
+                    == Approx (sigmoid (gsl_vector_get (zs, i))));
+        }
+
+        gsl_vector * y = gsl_vector_alloc (37);
+        gsl_vector * y_expected = gsl_vector_alloc (37);
+        gsl_blas_dgemv (CblasTrans, 1.0, weights.data[0], delta, 0.0,
+                        y_expected);
+        half_gemv_t (&half, 0, delta, y);
+        for (uint32_t j = 0; j < 37; ++j) {
+            REQUIRE(fabs (gsl_vector_get (y, j)
+                          - gsl_vector_get (y_expected, j)) < 10 * tol);
+        }
+
+        // The update lands in both copies
+        gsl_matrix * w = gsl_matrix_alloc (19, 37);
+        gsl_matrix_memcpy (w, weights.data[0]);
+        half_matrix_update (w, weights.data[0], 0.5, &half, 0);
+        REQUIRE(gsl_matrix_get (w, 3, 4)
+                == Approx (0.5 * gsl_matrix_get (weights.data[0], 3, 4)));
+        REQUIRE(half_to_double (half.data[0].data[3 * 37 + 4],
+                                (precision_t) p)
+                == Approx (gsl_matrix_get (w, 3, 4)).epsilon (tol / 10));
+
+        gsl_matrix_free (w);
+        gsl_vector_free (y);
+        gsl_vector_free (y_expected);
+        gsl_vector_free (expected);
+        gsl_vector_free (zs);
+        gsl_vector_free (a);
+        half_matrix_array_free (&half);
+    }
+
+    gsl_vector_free (x);
+    gsl_vector_free (b);
+    gsl_vector_free (delta);
+    gsl_rng_free (rng);
+    matrix_array_free (&weights);
+}
+
+/*
+ * Train a small network to tell which of its two inputs is larger, and
+ * return how many of the samples it then gets right
+ */
+static uint32_t
+train_larger_input (const precision_t precision)
+{
+    const uint32_t items = 64;
+    uint32_t nodes[] = { 2, 8, 2 };
+    network_t network = {};
+    network.nodes.data = nodes;
+    network.nodes.size = 3;
+    network.mini_batch_size = 8;
+    network.eta = 3.0;
+    network.precision = precision;
+    REQUIRE(network_allocate (&network) == 0);
+    REQUIRE((network.layers.data[0].half.size != 0)
+            == (precision != PRECISION_DOUBLE));
+    network_random_init (&network, 1.0);
+
+    gsl_vector * images[items];
+    uint8_t labels[items];
+    uint32_t order[items];
+    for (uint32_t i = 0; i < items; ++i) {
+        images[i] = gsl_vector_alloc (2);
+        gsl_vector_set (images[i], 0, ((i * 37) % 64) / 64.0);
+        gsl_vector_set (images[i], 1, ((i * 23 + 5) % 64) / 64.0);
+        labels[i] = gsl_vector_get (images[i], 1)
+                > gsl_vector_get (images[i], 0);
+        order[i] = i;
+    }
+
+    data_t data = {};
+    data.images.images = images;
+    data.labels.labels = labels;
+    data.items = items;
+
+    for (uint32_t epoch = 0; epoch < 300; ++epoch) {
+        network_process_mini_batches (&network, &data, order,
+                                      &network_update_mini_batch);
+    }
+
+    uint32_t correct;
+    network_evaluate_test_data (&network, &data, &correct);
+
+    for (uint32_t i = 0; i < items; ++i) {
+        gsl_vector_free (images[i]);
+    }
     network_free (&network);
+
+    return correct;
+}
+
+TEST_CASE( "Mixed precision training", "[half]" )
+{
+    uint32_t baseline = train_larger_input (PRECISION_DOUBLE);
+    REQUIRE(baseline >= 60);
+    REQUIRE(train_larger_input (PRECISION_BF16) >= baseline - 2);
+    REQUIRE(train_larger_input (PRECISION_FP16) >= baseline - 2);
+}
+
+TEST_CASE( "Transposed weights", "[nnet]" )
+{
+    uint32_t nodes[] = { 5, 9, 3 };
+    network_t plain = {};
+    network_t transposed = {};
+    plain.nodes.data = transposed.nodes.data = nodes;
+    plain.nodes.size = transposed.nodes.size = 3;
+    transposed.transpose_weights = 1;
+
+    REQUIRE(network_allocate (&plain) == 0);
+    REQUIRE(network_allocate (&transposed) == 0);
+    REQUIRE(plain.weights_t.size == 0);
+    REQUIRE(transposed.weights_t.size == 2);
+    REQUIRE(transposed.weights_t.data[0]->size1 == 5);
+    REQUIRE(transposed.weights_t.data[0]->size2 == 9);
+
+    network_random_init (&plain, 1.0);
+    network_random_init (&transposed, 1.0);
+
+    gsl_vector * input = gsl_vector_alloc (5);
+    for (uint32_t i = 0; i < 5; ++i) {
+        gsl_vector_set (input, i, 0.1 * i);
+    }
+    network_set_input (&plain, input);
+    network_set_input (&transposed, input);
+
+    matrix_array_set_zero (&plain.nabla_w);
+    matrix_array_set_zero (&transposed.nabla_w);
+    network_backpropagate_error (&plain, 2);
+    network_backpropagate_error (&transposed, 2);
+    require_matrices_equal (plain.nabla_w.data[0],
+                            transposed.nabla_w.data[0]);
+
+    // The update keeps the copy in step
+    matrix_update_transposed (transposed.weights.data[0],
+                              transposed.nabla_w.data[0], 0.5,
+                              transposed.weights_t.data[0]);
+    for (uint32_t i = 0; i < 9; ++i) {
+        for (uint32_t j = 0; j < 5; ++j) {
+            double w = gsl_matrix_get (plain.weights.data[0], i, j)
+                    - 0.5 * gsl_matrix_get (plain.nabla_w.data[0], i, j);
+            REQUIRE(gsl_matrix_get (transposed.weights.data[0], i, j)
+                    == Approx (w));
+            REQUIRE(gsl_matrix_get (transposed.weights_t.data[0], j, i)
+                    == Approx (w));
+        }
+    }
+
+    gsl_vector_free (input);
+    network_free (&plain);
+    network_free (&transposed);
+}
+
+static err_t
+negate_allocate (layer_t * const layer, const layer_stack_mode_t mode)
+{
+    layer->out = layer->in;
+    return GSL_SUCCESS;
+}
+
+static void
+negate_forward (layer_t * const layer,
+                const gsl_vector * const input,
+                const uint8_t train)
+{
+    gsl_vector_memcpy (layer->output, input);
+    gsl_vector_scale (layer->output, -1.0);
+}
+
+static void
+negate_backward (layer_t * const layer,
+                 const gsl_vector * const input,
+                 gsl_vector * const input_delta)
+{
+    if (input_delta) {
+        gsl_vector_memcpy (input_delta, layer->output_delta);
+        gsl_vector_scale (input_delta, -1.0);
+    }
 }
 
+TEST_CASE( "Layer stack", "[layer]" )
+{
+    // Same network as the feed forward test, plus a custom layer
+    const layer_ops_t negate_ops = {
+            &negate_allocate, NULL, &negate_forward, &negate_backward, 0
+    };
+
+    layer_t layers[] = {
+            { LAYER_CUSTOM, 0, 0, 0, &negate_ops },
+            { LAYER_DENSE, 3 },
+            { LAYER_DENSE, 2 }
+    };
+    layer_stack_t stack = { 3, { 1, 1, 2 }, NULL, layers };
+
+    REQUIRE(layer_stack_allocate (&stack, LAYER_STACK_TRAIN) == 0);
+    REQUIRE(layer_stack_output_size (&stack) == 2);
+    REQUIRE(layers[1].num_params == 2);
+    REQUIRE(layers[1].params[0].size == 6);
+
+    // Every output is kept for the backward pass, the deltas alternate
+    REQUIRE(stack.plan.num_slots == 5);
+    REQUIRE(layers[0].output->data != layers[2].output->data);
+    REQUIRE(layers[0].output_delta->data == layers[2].output_delta->data);
+    REQUIRE(layers[1].output_delta->data != layers[2].output_delta->data);
+
+    gsl_vector * input = gsl_vector_alloc (2);
+    gsl_vector_set_all (input, -1.0);
+    stack.input = input;
+
+    gsl_matrix_set_all (layers[1].weights, 1.0);
+    gsl_matrix_set_all (layers[2].weights, 1.0);
+    gsl_vector_set_all (layers[1].biases, -2.0);
+    gsl_vector_set_all (layers[2].biases, -1.5);
+
+    layer_stack_feed_forward (&stack, 1);
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        REQUIRE(gsl_vector_get (layers[1].output, i) == Approx (0.5));
+    }
+    REQUIRE(gsl_vector_get (layer_stack_output (&stack), 0) == Approx (0.5));
+    REQUIRE(gsl_vector_get (layer_stack_output (&stack), 1) == Approx (0.5));
+
+    // The gradients reach the parameters through the custom layer
+    layer_stack_zero_gradients (&stack);
+    gsl_vector_set_all (layer_stack_output_delta (&stack), 1.0);
+    layer_stack_backpropagate (&stack);
+
+    REQUIRE(gsl_vector_get (layers[2].nabla_b, 0) == Approx (0.25));
+    REQUIRE(gsl_matrix_get (layers[2].nabla_w, 1, 2) == Approx (0.125));
+    REQUIRE(gsl_vector_get (layers[1].nabla_b, 0) == Approx (0.125));
+    REQUIRE(gsl_matrix_get (layers[1].nabla_w, 0, 0) == Approx (0.125));
+
+    layer_stack_update (&stack, 2.0);
+    REQUIRE(gsl_vector_get (layers[2].biases, 0) == Approx (-2.0));
+
+    layer_stack_free (&stack);
+
+    // Inference alternates between two buffers
+    REQUIRE(layer_stack_allocate (&stack, LAYER_STACK_INFER) == 0);
+    REQUIRE(stack.plan.num_slots == 2);
+    REQUIRE(layers[0].output->data == layers[2].output->data);
+    REQUIRE(layers[0].output->data != layers[1].output->data);
+    REQUIRE(layers[2].output_delta == NULL);
+
+    gsl_vector_free (input);
+    layer_stack_free (&stack);
+}
+
+TEST_CASE( "Sigmoid layer in place", "[layer]" )
+{
+    layer_t layers[] = {
+            { LAYER_DENSE, 3 },
+            { LAYER_SIGMOID },
+            { LAYER_DENSE, 2 }
+    };
+    layer_stack_t stack = { 3, { 1, 1, 2 }, NULL, layers };
+
+    REQUIRE(layer_stack_allocate (&stack, LAYER_STACK_INFER) == 0);
+
+    // The activation overwrites its input
+    REQUIRE(layers[1].output->data == layers[0].output->data);
+    layer_stack_free (&stack);
+
+    REQUIRE(layer_stack_allocate (&stack, LAYER_STACK_TRAIN) == 0);
+
+    // Unless the dense layer needs its output for sigma', the delta is
+    // shared regardless
+    REQUIRE(layers[1].output->data != layers[0].output->data);
+    REQUIRE(layers[1].output_delta->data == layers[0].output_delta->data);
+    REQUIRE(memory_plan_bytes (&stack.plan)
+            < memory_plan_unplanned_bytes (&stack.plan));
+
+    gsl_vector * input = gsl_vector_alloc (2);
+    gsl_vector_set_all (input, 1.0);
+    stack.input = input;
+
+    // Dense layers apply a sigmoid too, so a = sigma(sigma(0))
+    double a = sigmoid (0.5);
+    gsl_matrix_set_all (layers[0].weights, 1.0);
+    gsl_matrix_set_all (layers[2].weights, 1.0);
+    gsl_vector_set_all (layers[0].biases, -2.0);
+    gsl_vector_set_all (layers[2].biases, -3.0 * a);
+
+    layer_stack_feed_forward (&stack, 1);
+    REQUIRE(gsl_vector_get (layers[1].output, 0) == Approx (a));
+    REQUIRE(gsl_vector_get (layer_stack_output (&stack), 0) == Approx (0.5));
+
+    layer_stack_zero_gradients (&stack);
+    gsl_vector_set_all (layer_stack_output_delta (&stack), 1.0);
+    layer_stack_backpropagate (&stack);
+
+    REQUIRE(gsl_vector_get (layers[2].nabla_b, 0) == Approx (0.25));
+    REQUIRE(gsl_matrix_get (layers[2].nabla_w, 0, 0) == Approx (0.25 * a));
+    REQUIRE(gsl_vector_get (layers[0].nabla_b, 0)
+            == Approx (0.5 * a * (1.0 - a) * 0.25));
+
+    gsl_vector_free (input);
+    layer_stack_free (&stack);
+}
+
+TEST_CASE( "Memory plan", "[planner]" )
+{
+    memory_plan_t plan;
+    REQUIRE(memory_plan_allocate (&plan, 4) == 0);
+
+    int32_t a = memory_plan_add (&plan, 4, 0, 1);
+    int32_t b = memory_plan_add (&plan, 2, 1, 2);
+    int32_t c = memory_plan_add (&plan, 3, 2, 3);
+    int32_t d = memory_plan_add (&plan, 4, 3, 3);
+    memory_plan_alias (&plan, d, c);
+
+    REQUIRE(memory_plan_last_use (&plan, b) == 2);
+    REQUIRE(memory_plan_build (&plan) == 0);
+
+    // c reuses a once it is dead, and d writes over c
+    REQUIRE(plan.num_slots == 2);
+    REQUIRE(memory_plan_data (&plan, a) == memory_plan_data (&plan, c));
+    REQUIRE(memory_plan_data (&plan, c) == memory_plan_data (&plan, d));
+    REQUIRE(memory_plan_data (&plan, a) != memory_plan_data (&plan, b));
+
+    REQUIRE(memory_plan_unplanned_bytes (&plan) == 13 * sizeof(double));
+    REQUIRE(memory_plan_bytes (&plan) == 6 * sizeof(double));
+    REQUIRE(memory_plan_peak_bytes (&plan) == 6 * sizeof(double));
+
+    memory_plan_free (&plan);
+}
+
+TEST_CASE( "Convolution im2col matches direct", "[conv]" )
+{
+    layer_t layer = { LAYER_CONV2D, 2, 1, 2 };
+    layer.in.channels = 2;
+    layer.in.rows = 3;
+    layer.in.cols = 3;
+    layer.out.channels = 2;
+    layer.out.rows = 2;
+    layer.out.cols = 2;
+
+    gsl_vector * input = gsl_vector_alloc (18);
+    for (uint32_t i = 0; i < input->size; ++i) {
+        gsl_vector_set (input, i, i);
+    }
+
+    // Each column holds one 2x2 receptive field across both channels
+    gsl_matrix * cols = gsl_matrix_alloc (8, 4);
+    im2col (input, &layer, cols);
+
+    REQUIRE(gsl_matrix_get (cols, 0, 0) == Approx (0.0));
+    REQUIRE(gsl_matrix_get (cols, 3, 0) == Approx (4.0));
+    REQUIRE(gsl_matrix_get (cols, 0, 3) == Approx (4.0));
+    REQUIRE(gsl_matrix_get (cols, 4, 1) == Approx (10.0));
+    REQUIRE(gsl_matrix_get (cols, 7, 3) == Approx (17.0));
+
+    // col2im sums each input over the windows it appears in
+    gsl_matrix_set_all (cols, 1.0);
+    col2im (cols, &layer, input);
+
+    REQUIRE(gsl_vector_get (input, 0) == Approx (1.0));
+    REQUIRE(gsl_vector_get (input, 1) == Approx (2.0));
+    REQUIRE(gsl_vector_get (input, 4) == Approx (4.0));
+    REQUIRE(gsl_vector_get (input, 17) == Approx (1.0));
+
+    gsl_matrix_free (cols);
+    gsl_vector_free (input);
+
+    // Same convolution through both kernels
+    layer_t direct[] = { { LAYER_CONV2D, 3, 2, 3 } };
+    layer_t gemm[] = { { LAYER_CONV2D, 5, 2, 3 } };
+    layer_stack_t direct_stack = { 1, { 2, 11, 11 }, NULL, direct };
+    layer_stack_t gemm_stack = { 1, { 2, 11, 11 }, NULL, gemm };
+
+    REQUIRE(layer_stack_allocate (&direct_stack, LAYER_STACK_TRAIN) == 0);
+    REQUIRE(layer_stack_allocate (&gemm_stack, LAYER_STACK_TRAIN) == 0);
+    REQUIRE(direct[0].cols == NULL);
+    REQUIRE(gemm[0].cols != NULL);
+    REQUIRE(direct[0].out.rows == 5);
+    REQUIRE(gemm[0].out.rows == 4);
+
+    // Embed the 3x3 kernel in the top left of the 5x5 one
+    gsl_rng * rng = gsl_rng_alloc (gsl_rng_mt19937);
+    layer_stack_set_rand (&direct_stack, rng, 1.0);
+    gsl_matrix_set_zero (gemm[0].weights);
+    gsl_vector_memcpy (gemm[0].biases, direct[0].biases);
+    for (uint32_t f = 0; f < 3; ++f) {
+        for (uint32_t c = 0; c < 2; ++c) {
+            for (uint32_t ky = 0; ky < 3; ++ky) {
+                for (uint32_t kx = 0; kx < 3; ++kx) {
+                    gsl_matrix_set (gemm[0].weights, f,
+                                    (c * 5 + ky) * 5 + kx,
+                                    gsl_matrix_get (direct[0].weights, f,
+                                                    (c * 3 + ky) * 3 + kx));
+                }
+            }
+        }
+    }
+
+    gsl_vector * image = gsl_vector_alloc (242);
+    vector_set_rand (image, rng, 1.0);
+    direct_stack.input = image;
+    gemm_stack.input = image;
+
+    layer_stack_feed_forward (&direct_stack, 1);
+    layer_stack_feed_forward (&gemm_stack, 1);
+
+    for (uint32_t f = 0; f < 3; ++f) {
+        for (uint32_t y = 0; y < 4; ++y) {
+            for (uint32_t x = 0; x < 4; ++x) {
+                REQUIRE(gsl_vector_get (gemm[0].output, (f * 4 + y) * 4 + x)
+                        == Approx (gsl_vector_get (direct[0].output,
+                                                   (f * 5 + y) * 5 + x)));
+            }
+        }
+    }
+
+    gsl_vector_free (image);
+    gsl_rng_free (rng);
+    layer_stack_free (&direct_stack);
+    layer_stack_free (&gemm_stack);
+}
+
+TEST_CASE( "Max pool", "[conv]" )
+{
+    layer_t layers[] = {
+            { LAYER_MAX_POOL, 2, 2 },
+            { LAYER_FLATTEN }
+    };
+    layer_stack_t stack = { 2, { 1, 4, 4 }, NULL, layers };
+    REQUIRE(layer_stack_allocate (&stack, LAYER_STACK_TRAIN) == 0);
+    REQUIRE(layer_stack_output_size (&stack) == 4);
+
+    double pixels[] = {
+            1, 2, 0, 0,
+            3, 4, 0, 9,
+            0, 0, 5, 0,
+            8, 0, 0, 0
+    };
+    gsl_vector_view input = gsl_vector_view_array (pixels, 16);
+    stack.input = &input.vector;
+
+    layer_stack_feed_forward (&stack, 0);
+
+    gsl_vector * output = layer_stack_output (&stack);
+    REQUIRE(output->data == layers[0].output->data);
+    REQUIRE(gsl_vector_get (output, 0) == Approx (4.0));
+    REQUIRE(gsl_vector_get (output, 1) == Approx (9.0));
+    REQUIRE(gsl_vector_get (output, 2) == Approx (8.0));
+    REQUIRE(gsl_vector_get (output, 3) == Approx (5.0));
+
+    // Flatten shares the pool delta, which only flows back to the maxima
+    gsl_vector_set_all (layer_stack_output_delta (&stack), 1.0);
+    REQUIRE(layers[0].output_delta->data == layers[1].output_delta->data);
+
+    gsl_vector * input_delta = gsl_vector_alloc (16);
+    max_pool_backpropagate (&layers[0], &input.vector, input_delta);
+
+    double sum = 0.0;
+    for (uint32_t i = 0; i < 16; ++i) {
+        sum += gsl_vector_get (input_delta, i);
+    }
+    REQUIRE(sum == Approx (4.0));
+    REQUIRE(gsl_vector_get (input_delta, 5) == Approx (1.0));
+    REQUIRE(gsl_vector_get (input_delta, 7) == Approx (1.0));
+    REQUIRE(gsl_vector_get (input_delta, 12) == Approx (1.0));
+    REQUIRE(gsl_vector_get (input_delta, 10) == Approx (1.0));
+
+    gsl_vector_free (input_delta);
+    layer_stack_free (&stack);
+}
+
+static double
+quadratic_cost (network_t * const network, const uint8_t label)
+{
+    network_feed_forward (network, 0);
+
+    gsl_vector * output = network->outputs.data[network->outputs.size - 1];
+    double cost = 0.0;
+    for (uint32_t i = 0; i < output->size; ++i) {
+        double diff = gsl_vector_get (output, i) - (i == label);
+        cost += 0.5 * diff * diff;
+    }
+
+    return cost;
+}
+
+static void
+check_conv_gradients (const uint32_t kernel)
+{
+    network_t network = {};
+    uint32_t nodes[] = { 0, 4, 3 };
+    layer_t features[] = {
+            { LAYER_CONV2D, kernel, 1, 2 },
+            { LAYER_MAX_POOL, 2, 2 },
+            { LAYER_FLATTEN }
+    };
+
+    network.nodes.data = nodes;
+    network.nodes.size = sizeof(nodes) / sizeof(nodes[0]);
+    network.features.size = sizeof(features) / sizeof(features[0]);
+    network.features.data = features;
+    network.features.input_shape = { 1, 8, 8 };
+    REQUIRE(network_allocate (&network) == 0);
+    REQUIRE(nodes[0] == layer_stack_output_size (&network.features));
+
+    network_random_init (&network, 1.0);
+
+    gsl_vector * image = gsl_vector_alloc (64);
+    for (uint32_t i = 0; i < image->size; ++i) {
+        gsl_vector_set (image, i, (i * 37 % 64) / 64.0);
+    }
+    network_set_input (&network, image);
+
+    const uint8_t label = 1;
+    matrix_array_set_zero (&network.nabla_w);
+    vector_array_zero (&network.nabla_b);
+    layer_stack_zero_gradients (&network.features);
+    network_backpropagate_error (&network, label);
+
+    // Compare against central differences of the cost
+    const double h = 1e-6;
+    gsl_matrix * weights = features[0].weights;
+    for (uint32_t f = 0; f < weights->size1; ++f) {
+        for (uint32_t j = 0; j < weights->size2; ++j) {
+            double w = gsl_matrix_get (weights, f, j);
+            gsl_matrix_set (weights, f, j, w + h);
+            double up = quadratic_cost (&network, label);
+            gsl_matrix_set (weights, f, j, w - h);
+            double down = quadratic_cost (&network, label);
+            gsl_matrix_set (weights, f, j, w);
+
+            REQUIRE(gsl_matrix_get (features[0].nabla_w, f, j)
+                    == Approx ((up - down) / (2 * h)));
+        }
+
+        double b = gsl_vector_get (features[0].biases, f);
+        gsl_vector_set (features[0].biases, f, b + h);
+        double up = quadratic_cost (&network, label);
+        gsl_vector_set (features[0].biases, f, b - h);
+        double down = quadratic_cost (&network, label);
+        gsl_vector_set (features[0].biases, f, b);
+
+        REQUIRE(gsl_vector_get (features[0].nabla_b, f)
+                == Approx ((up - down) / (2 * h)));
+    }
+
+    gsl_vector_free (image);
+    network_free (&network);
+}
+
+TEST_CASE( "Convolution gradients", "[conv]" )
+{
+    check_conv_gradients (3);
+    check_conv_gradients (4);
+}
+
+static gsl_matrix *
+random_matrix (gsl_rng * const rng, const size_t rows, const size_t cols)
+{
+    gsl_matrix * m = gsl_matrix_alloc (rows, cols);
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < cols; ++j) {
+            gsl_matrix_set (m, i, j, gsl_ran_gaussian (rng, 1.0));
+        }
+    }
+    return m;
+}
+
+static void
+require_matrices_equal (const gsl_matrix * const a, const gsl_matrix * const b)
+{
+    for (size_t i = 0; i < a->size1; ++i) {
+        for (size_t j = 0; j < a->size2; ++j) {
+            REQUIRE(gsl_matrix_get (a, i, j)
+                    == Approx (gsl_matrix_get (b, i, j)).epsilon (1e-12));
+        }
+    }
+}
+
+TEST_CASE( "Native GEMV matches BLAS", "[kernels]" )
+{
+    gsl_rng * rng = gsl_rng_alloc (gsl_rng_mt19937);
+
+    // Odd sizes exercise the tails of the four row and four column loops
+    const size_t shapes[][2] = { { 30, 784 }, { 10, 30 }, { 7, 13 }, { 1, 1 } };
+    for (size_t s = 0; s < 4; ++s) {
+        size_t m = shapes[s][0];
+        size_t n = shapes[s][1];
+        gsl_matrix * a = random_matrix (rng, m, n);
+        gsl_matrix * xs = random_matrix (rng, 2, m > n ? m : n);
+        gsl_matrix * ys = random_matrix (rng, 2, m > n ? m : n);
+        gsl_vector_view x = gsl_matrix_row (xs, 0);
+        gsl_vector_view y = gsl_matrix_row (ys, 0);
+        gsl_vector_view y_ref = gsl_matrix_row (ys, 1);
+
+        for (int trans = 0; trans < 2; ++trans) {
+            CBLAS_TRANSPOSE_t t = trans ? CblasTrans : CblasNoTrans;
+            gsl_vector_view xv = gsl_vector_subvector (&x.vector, 0,
+                                                       trans ? m : n);
+            gsl_vector_view yv = gsl_vector_subvector (&y.vector, 0,
+                                                       trans ? n : m);
+            gsl_vector_view rv = gsl_vector_subvector (&y_ref.vector, 0,
+                                                       trans ? n : m);
+            gsl_vector_memcpy (&rv.vector, &yv.vector);
+
+            REQUIRE(kernel_dgemv (t, 0.5, a, &xv.vector, 2.0, &yv.vector)
+                    == 0);
+            gsl_blas_dgemv (t, 0.5, a, &xv.vector, 2.0, &rv.vector);
+
+            for (size_t i = 0; i < yv.vector.size; ++i) {
+                REQUIRE(gsl_vector_get (&yv.vector, i) == Approx (
+                        gsl_vector_get (&rv.vector, i)).epsilon (1e-12));
+            }
+        }
+
+        gsl_matrix_free (a);
+        gsl_matrix_free (xs);
+        gsl_matrix_free (ys);
+    }
+
+    gsl_rng_free (rng);
+}
+
+TEST_CASE( "Native GEMM matches BLAS", "[kernels]" )
+{
+    gsl_rng * rng = gsl_rng_alloc (gsl_rng_mt19937);
+    kernel_gemm_buffers_t buffers;
+    REQUIRE(kernel_gemm_buffers_allocate (&buffers) == 0);
+
+    // Past each cache block and off the register tile in every dimension
+    const size_t shapes[][3] = {
+            { 30, 784, 64 }, { 8, 25, 576 }, { 67, 300, 1030 }, { 3, 5, 7 }
+    };
+    for (size_t s = 0; s < 4; ++s) {
+        size_t m = shapes[s][0];
+        size_t k = shapes[s][1];
+        size_t n = shapes[s][2];
+
+        for (int trans = 0; trans < 4; ++trans) {
+            uint8_t ta = trans & 1;
+            uint8_t tb = trans >> 1;
+            gsl_matrix * a = ta ? random_matrix (rng, k, m) :
+                    random_matrix (rng, m, k);
+            gsl_matrix * b = tb ? random_matrix (rng, n, k) :
+                    random_matrix (rng, k, n);
+
+            // Write into a view so the row stride differs from the width
+            gsl_matrix * c = random_matrix (rng, m, n + 3);
+            gsl_matrix_view cv = gsl_matrix_submatrix (c, 0, 1, m, n);
+            gsl_matrix * expected = gsl_matrix_alloc (m, n);
+            gsl_matrix_memcpy (expected, &cv.matrix);
+
+            CBLAS_TRANSPOSE_t t_a = ta ? CblasTrans : CblasNoTrans;
+            CBLAS_TRANSPOSE_t t_b = tb ? CblasTrans : CblasNoTrans;
+            REQUIRE(kernel_dgemm (t_a, t_b, 1.5, a, b, -1.0, &cv.matrix,
+                                  &buffers) == 0);
+            gsl_blas_dgemm (t_a, t_b, 1.5, a, b, -1.0, expected);
+
+            require_matrices_equal (&cv.matrix, expected);
+
+            gsl_matrix_free (a);
+            gsl_matrix_free (b);
+            gsl_matrix_free (c);
+            gsl_matrix_free (expected);
+        }
+    }
+
+    kernel_gemm_buffers_free (&buffers);
+    gsl_rng_free (rng);
+}
+
+TEST_CASE( "Fused dense forward", "[kernels]" )
+{
+    gsl_rng * rng = gsl_rng_alloc (gsl_rng_mt19937);
+    gsl_matrix * w = random_matrix (rng, 7, 13);
+    gsl_matrix * xs = random_matrix (rng, 2, 13);
+    gsl_vector_view x = gsl_matrix_row (xs, 0);
+    gsl_vector_view b = gsl_matrix_row (xs, 1);
+    gsl_vector_view bias = gsl_vector_subvector (&b.vector, 0, 7);
+    gsl_vector * zs = gsl_vector_alloc (7);
+    gsl_vector * a = gsl_vector_alloc (7);
+    gsl_vector * expected = gsl_vector_alloc (7);
+
+    gsl_blas_dgemv (CblasNoTrans, 1.0, w, &x.vector, 0.0, expected);
+    gsl_blas_daxpy (1.0, &bias.vector, expected);
+
+    REQUIRE(kernel_dense_forward (w, &x.vector, &bias.vector, zs, a,
+                                  ACTIVATION_EXACT) == 0);
+    for (size_t i = 0; i < 7; ++i) {
+        double z = gsl_vector_get (expected, i);
+        REQUIRE(gsl_vector_get (zs, i) == Approx (z).epsilon (1e-12));
+        REQUIRE(gsl_vector_get (a, i) == Approx (sigmoid (z)));
+    }
+
+    // Inference skips the z stash
+    gsl_vector_set_zero (a);
+    REQUIRE(kernel_dense_forward (w, &x.vector, &bias.vector, NULL, a,
+                                  ACTIVATION_FAST) == 0);
+    for (size_t i = 0; i < 7; ++i) {
+        REQUIRE(fabs (gsl_vector_get (a, i) - sigmoid (gsl_vector_get (zs, i)))
+                < 5e-8);
+    }
+
+    REQUIRE(kernel_dense_forward (w, &bias.vector, &bias.vector, NULL, a,
+                                  ACTIVATION_EXACT) == GSL_EBADLEN);
+
+    gsl_matrix_free (w);
+    gsl_matrix_free (xs);
+    gsl_vector_free (zs);
+    gsl_vector_free (a);
+    gsl_vector_free (expected);
+    gsl_rng_free (rng);
+}
+
+TEST_CASE( "BLAS backend query", "[kernels]" )
+{
+    blas_backend_t backend;
+    blas_backend_query (&backend);
+
+    REQUIRE(backend.threads >= 1);
+    REQUIRE(std::string (backend.isa) == kernel_isa ());
+#ifdef NNET_NATIVE_KERNELS
+    REQUIRE(std::string (backend.gemm) == "native");
+#else
+    REQUIRE(std::string (backend.gemm) == backend.cblas);
+#endif
+}
 
 TEST_CASE("gsl_blas_sger", "[GSL]")
 {